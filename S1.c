@@ -3,7 +3,9 @@
 // Build: gcc S1.c -o S1
 // Run:   ./S1
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -12,15 +14,39 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <elf.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define BUFSZ   4096
+#ifndef BACKLOG
 #define BACKLOG 16
+#endif
 
 #define S1_PORT 6201
 #define S2_PORT 6202
@@ -31,9 +57,14 @@
 static const char *S1_ROOT = "/home/azeem7/S1";
 
 /* ---------- small I/O helpers ---------- */
+static void qos_charge(int fd, long long n);   // client QoS, below
+static long long nwrites;                       // write syscalls issued (STATS write_calls=)
+
 static ssize_t write_n(int fd, const void *buf, size_t n){
     size_t off=0; const char *p=(const char*)buf;
+    qos_charge(fd, (long long)n);
     while(off<n){
+        nwrites++;
         ssize_t w=write(fd, p+off, n-off);
         if(w<0){ if(errno==EINTR) continue; return -1; }
         if(w==0) return (ssize_t)off;
@@ -41,6 +72,65 @@ static ssize_t write_n(int fd, const void *buf, size_t n){
     }
     return (ssize_t)off;
 }
+// write_n for several pieces (reply header + payload) in one writev.
+static int writev_n(int fd, struct iovec *v, int cnt){
+    long long tot=0; for(int i=0;i<cnt;i++) tot += (long long)v[i].iov_len;
+    qos_charge(fd, tot);
+    while(cnt>0){
+        if(!v->iov_len){ v++; cnt--; continue; }
+        nwrites++;
+        ssize_t w=writev(fd, v, cnt);
+        if(w<0){ if(errno==EINTR) continue; return -1; }
+        if(w==0) return -1;
+        while(cnt>0 && (size_t)w>=v->iov_len){ w -= (ssize_t)v->iov_len; v++; cnt--; }
+        if(cnt>0){ v->iov_base = (char*)v->iov_base + w; v->iov_len -= (size_t)w; }
+    }
+    return 0;
+}
+// Reply header whose payload follows at once (more!=0): MSG_MORE holds it
+// back so both leave in the same segment instead of a lone header packet.
+static void head_printf(int fd, int more, const char *fmt, ...){
+    char sb[512], *b = sb; va_list ap, aq; va_start(ap, fmt); va_copy(aq, ap);
+    int n = vsnprintf(sb, sizeof(sb), fmt, ap);
+    va_end(ap);
+    if(n>=(int)sizeof(sb) && (b = malloc((size_t)n+1))) vsnprintf(b, (size_t)n+1, fmt, aq);   // a long path: the line is never cut
+    va_end(aq);
+    if(n<0 || !b) return;
+    size_t off = 0;
+    while(off<(size_t)n){
+        nwrites++;
+        ssize_t w = send(fd, b+off, (size_t)n-off, more ? MSG_MORE : 0);
+        if(w<0 && errno==EINTR) continue;
+        if(w<0 && errno==ENOTSOCK){ write_n(fd, b+off, (size_t)n-off); break; }
+        if(w<=0) break;
+        off += (size_t)w;
+    }
+    if(b!=sb) free(b);
+}
+// Is this an AF_UNIX connection (S1 and an aux server on the same host)?
+static int sock_is_unix(int sd){
+    struct sockaddr_storage a; socklen_t l=sizeof(a);
+    return getsockname(sd,(struct sockaddr*)&a,&l)==0 && a.ss_family==AF_UNIX;
+}
+// read_line() that also takes a descriptor sent along with the line (SCM_RIGHTS);
+// *fd is -1 when none came.
+static ssize_t read_line_fd(int sd, char *buf, size_t len, int *fd){
+    size_t i=0; *fd=-1;
+    while(i+1<len){
+        char c; struct iovec v={ &c, 1 };
+        union { struct cmsghdr h; char b[CMSG_SPACE(sizeof(int))]; } cm;
+        struct msghdr m={0}; m.msg_iov=&v; m.msg_iovlen=1; m.msg_control=cm.b; m.msg_controllen=sizeof(cm.b);
+        ssize_t r=recvmsg(sd,&m,MSG_CMSG_CLOEXEC);
+        if(r<0){ if(errno==EINTR) continue; return -1; }
+        if(r==0) break;
+        struct cmsghdr *h=CMSG_FIRSTHDR(&m);
+        if(h && h->cmsg_level==SOL_SOCKET && h->cmsg_type==SCM_RIGHTS && *fd<0) memcpy(fd,CMSG_DATA(h),sizeof(int));
+        buf[i++]=c;
+        if(c=='\n') break;
+    }
+    buf[i]='\0';
+    return (ssize_t)i;
+}
 static ssize_t read_line(int fd, char *buf, size_t len){
     size_t i=0;
     while(i+1<len){
@@ -77,385 +167,5285 @@ static const char* file_ext(const char *name){
     return (!dot || dot==name) ? "" : dot;
 }
 
-/* ---------- sockets to S2/S3/S4 ---------- */
-static int connect_local_port(int port){
-    int sd = socket(AF_INET, SOCK_STREAM, 0);
-    if(sd<0) return -1;
-    struct sockaddr_in a={0};
-    a.sin_family = AF_INET;
-    a.sin_port   = htons(port);
-    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // 127.0.0.1
-    if(connect(sd,(struct sockaddr*)&a,sizeof(a))<0){ close(sd); return -1; }
-    return sd;
+/* ---------- request memory: arena, I/O buffers, tokenizer ----------
+   Request-scoped data (listing names, their arrays) comes from a session
+   arena: bump allocation out of ARENA_CHUNK chunks, all of it released at
+   once when the next command starts, chunks kept for the next command.
+   Copy loops take their buffers from a pool of IOB_SIZE blocks aligned to
+   4 KB (usable for O_DIRECT; at 2 MB and up also aligned and advised for
+   transparent huge pages) that are recycled, not freed. Both belong to the
+   session's main thread. Command lines are split in place by tok_next().
+   A -DALLOC_STATS=1 build (glibc; a debugging aid, it interposes the
+   process-wide allocator) counts every malloc/calloc/realloc, so STATS can
+   show what a command still allocates; otherwise heap_allocs stays 0. */
+#ifndef ARENA_CHUNK
+#define ARENA_CHUNK (64<<10)
+#endif
+#ifndef IOB_SIZE
+#define IOB_SIZE (128<<10)
+#endif
+#ifndef ALLOC_STATS
+#define ALLOC_STATS 0
+#endif
+#define IOB_POOL 8
+
+static struct { unsigned long long heap, arena, arena_bytes, iob, iob_new; } astat;
+
+#if ALLOC_STATS && defined(__GLIBC__)
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+void *malloc(size_t n){ __atomic_add_fetch(&astat.heap, 1, __ATOMIC_RELAXED); return __libc_malloc(n); }
+void *calloc(size_t k, size_t n){ __atomic_add_fetch(&astat.heap, 1, __ATOMIC_RELAXED); return __libc_calloc(k, n); }
+void *realloc(void *p, size_t n){ __atomic_add_fetch(&astat.heap, 1, __ATOMIC_RELAXED); return __libc_realloc(p, n); }
+#endif
+
+struct achunk { struct achunk *next; size_t cap, used; char d[]; };
+static struct { struct achunk *cur, *spare; } arena;
+
+static void *arena_alloc(size_t n){
+    n = (n+15) & ~(size_t)15;
+    struct achunk *c = arena.cur;
+    if(!c || c->cap-c->used < n){
+        if(arena.spare && arena.spare->cap >= n){ c = arena.spare; arena.spare = c->next; }
+        else{
+            size_t cap = n > ARENA_CHUNK-sizeof(*c) ? n : ARENA_CHUNK-sizeof(*c);
+            if(!(c = malloc(sizeof(*c)+cap))) return NULL;
+            c->cap = cap;
+        }
+        c->used = 0; c->next = arena.cur; arena.cur = c;
+    }
+    astat.arena++; astat.arena_bytes += n;
+    void *p = c->d + c->used;
+    c->used += n;
+    return p;
+}
+static char *arena_strdup(const char *s){
+    size_t n = strlen(s)+1;
+    char *p = arena_alloc(n);
+    if(p) memcpy(p, s, n);
+    return p;
+}
+// Append s to the arena array *v (n used, *cap slots), growing it in the arena.
+static int arena_push(char ***v, int *n, int *cap, const char *s){
+    if(*n == *cap){
+        int nc = *cap ? *cap*2 : 32;
+        char **nv = arena_alloc((size_t)nc*sizeof(char*));
+        if(!nv) return -1;
+        if(*n) memcpy(nv, *v, (size_t)*n*sizeof(char*));
+        *v = nv; *cap = nc;
+    }
+    if(!((*v)[*n] = arena_strdup(s))) return -1;
+    (*n)++;
+    return 0;
+}
+// Command boundary: everything handed out so far is dead.
+static void arena_reset(void){
+    while(arena.cur){
+        struct achunk *c = arena.cur; arena.cur = c->next;
+        if(c->cap > ARENA_CHUNK-sizeof(*c)){ free(c); continue; }   // one-off big block
+        c->next = arena.spare; arena.spare = c;
+    }
 }
 
-/* ---------- upload forwarding (.pdf/.txt/.zip) ---------- */
-static int forward_store_file(int port, const char *dest, const char *fname,
-                              const char *local_fullpath, long long size){
-    int in_fd = open(local_fullpath, O_RDONLY);
-    if(in_fd < 0) return -1;
+static struct { char *b[IOB_POOL]; int n; } iobp;
 
-    int sd = connect_local_port(port);
-    if(sd < 0){ close(in_fd); return -2; }
+static char *iob_get(void){
+    astat.iob++;
+    if(iobp.n) return iobp.b[--iobp.n];
+    size_t align = IOB_SIZE >= (2<<20) ? (2<<20) : 4096;
+    void *p = NULL;
+    if(posix_memalign(&p, align, IOB_SIZE)!=0) return NULL;
+#ifdef MADV_HUGEPAGE
+    if(align > 4096) madvise(p, IOB_SIZE, MADV_HUGEPAGE);
+#endif
+    astat.iob_new++;
+    return p;
+}
+static void iob_put(char *b){
+    if(!b) return;
+    if(iobp.n < IOB_POOL) iobp.b[iobp.n++] = b;
+    else free(b);
+}
+
+// Next blank-separated token of *p, terminated in place; NULL when none is left.
+static char *tok_next(char **p){
+    char *s = *p;
+    while(*s==' ' || *s=='\t') s++;
+    if(!*s || *s=='\r' || *s=='\n'){ *p = s; return NULL; }
+    char *e = s;
+    while(*e && *e!=' ' && *e!='\t' && *e!='\r' && *e!='\n') e++;
+    if(*e){ *e = '\0'; *p = e+1; } else *p = e;
+    return s;
+}
+// Whole token as a decimal number in [lo,hi].
+static int tok_num(const char *t, long long lo, long long hi, long long *v){
+    if(!t || !*t) return -1;
+    char *e; errno = 0;
+    long long x = strtoll(t, &e, 10);
+    if(*e || errno || x<lo || x>hi) return -1;
+    *v = x;
+    return 0;
+}
 
-    dprintf(sd, "STORE %s %s %lld\n", dest, fname, size);
+/* ---------- wire compression ----------
+   COMP <codec,...> picks the first codec both ends support for the session.
+   A transfer whose header line carries "z=<codec>" is then sent as frames:
+   raw length and wire length (4 bytes each, big-endian) followed by the
+   payload; wire==raw means stored, raw==0 ends the stream. raw==0 with
+   wire==0xffffffff ends it with an error: the sender gave up and what came
+   before is incomplete. "lz4" is the
+   LZ4 block format (built-in coder, or liblz4 with -DHAVE_LZ4 -llz4);
+   "zstd" needs -DHAVE_ZSTD -lzstd. */
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#define ZCHUNK  (64*1024)
+#define ZBOUND  (ZCHUNK + ZCHUNK/255 + 64)
+enum { Z_NONE=0, Z_LZ4=1, Z_ZSTD=2, Z_RAW=3 };   // raw: framed, never compressed
+static const char *z_names[] = { "none", "lz4", "zstd", "raw" };
+static struct { long long raw, wire, cpu_ns; } zstat;   // this process
 
-    char buf[BUFSZ]; long long left = size;
-    while(left > 0){
-        ssize_t r = read(in_fd, buf, (left > BUFSZ ? BUFSZ : (size_t)left));
-        if(r <= 0){ close(in_fd); close(sd); return -3; }
-        if(write_n(sd, buf, (size_t)r) != r){ close(in_fd); close(sd); return -4; }
-        left -= r;
+static int z_parse(const char *name){
+    for(int i=0;i<4;i++) if(strcmp(name,z_names[i])==0) return i;
+    return -1;
+}
+static int z_supported(int c){
+#ifdef HAVE_ZSTD
+    if(c==Z_ZSTD) return 1;
+#endif
+    return c==Z_NONE || c==Z_LZ4 || c==Z_RAW;
+}
+// First codec in a comma-separated offer that we support.
+static int z_choose(const char *offer){
+    char tmp[128]; snprintf(tmp,sizeof(tmp),"%s",offer);
+    for(char *t=strtok(tmp,","); t; t=strtok(NULL,",")){
+        int c=z_parse(t); if(c>0 && c!=Z_RAW && z_supported(c)) return c;
     }
-    close(in_fd);
+    return Z_NONE;
+}
+// Already-compressed formats are sent as-is.
+static int z_skip_ext(const char *name){
+    static const char *exts[] = { ".zip",".pdf",".gz",".tgz",".zst",".xz",".bz2",".7z",".png",".jpg",".jpeg",NULL };
+    const char *dot=strrchr(name,'.');
+    if(!dot) return 0;
+    for(int i=0;exts[i];i++) if(strcasecmp(dot,exts[i])==0) return 1;
+    return 0;
+}
+// Value of a " key=value" token in a header line; returns 1 if present.
+static int opt_get(const char *line, const char *key, char *val, size_t vsz){
+    size_t kl=strlen(key);
+    for(const char *p=line; (p=strchr(p,' '))!=NULL; ){
+        p++;
+        if(strncmp(p,key,kl)==0 && p[kl]=='='){
+            p+=kl+1; size_t n=strcspn(p," \r\n");
+            if(n>=vsz) n=vsz-1;
+            memcpy(val,p,n); val[n]='\0';
+            return 1;
+        }
+    }
+    return 0;
+}
+static const char *z_opt(int c){ static const char *o[]={""," z=lz4"," z=zstd"," z=raw"}; return o[c]; }
+static long long z_now_ns(void){
+    struct timespec ts; clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&ts);
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
 
-    char line[256]; ssize_t rn = read_line(sd, line, sizeof(line));
-    close(sd);
-    if(rn <= 0 || strncmp(line,"OK",2)!=0) return -5;
+#ifndef HAVE_LZ4
+static uint32_t lz_read32(const unsigned char *p){ uint32_t v; memcpy(&v,p,4); return v; }
+static int lz_putlen(unsigned char *dst, int op, int cap, int len){
+    for(; len>=255; len-=255){ if(op>=cap) return -1; dst[op++]=255; }
+    if(op>=cap) return -1;
+    dst[op++]=(unsigned char)len;
+    return op;
+}
+static int lz_emit(unsigned char *dst, int op, int cap, const unsigned char *lit, int nlit, int off, int mlen){
+    if(op>=cap) return -1;
+    int tok=op++;
+    dst[tok] = (unsigned char)((nlit>=15 ? 15 : nlit) << 4);
+    if(nlit>=15 && (op=lz_putlen(dst,op,cap,nlit-15))<0) return -1;
+    if(op+nlit>cap) return -1;
+    memcpy(dst+op,lit,(size_t)nlit); op+=nlit;
+    if(!off) return op;                          // final literals-only sequence
+    if(op+2>cap) return -1;
+    dst[op++]=(unsigned char)(off&255); dst[op++]=(unsigned char)(off>>8);
+    int m=mlen-4;
+    dst[tok] |= (unsigned char)(m>=15 ? 15 : m);
+    if(m>=15 && (op=lz_putlen(dst,op,cap,m-15))<0) return -1;
+    return op;
+}
+#endif
+// Returns compressed length, or -1 if it does not fit in 'cap'.
+static int lz4_compress(const unsigned char *src, int n, unsigned char *dst, int cap){
+#ifdef HAVE_LZ4
+    int r=LZ4_compress_default((const char*)src,(char*)dst,n,cap);
+    return r>0 ? r : -1;
+#else
+    enum { HLOG=12 };
+    int tab[1<<HLOG]; memset(tab,-1,sizeof(tab));
+    int ip=0, anchor=0, op=0;
+    const int mflimit=n-12, matchlimit=n-5;     // LZ4 end-of-block rules
+    while(ip<mflimit){
+        uint32_t seq=lz_read32(src+ip);
+        uint32_t h=(seq*2654435761u)>>(32-HLOG);
+        int ref=tab[h]; tab[h]=ip;
+        if(ref<0 || ip-ref>65535 || lz_read32(src+ref)!=seq){ ip += 1 + ((ip-anchor)>>6); continue; }
+        while(ip>anchor && ref>0 && src[ip-1]==src[ref-1]){ ip--; ref--; }
+        int len=4; while(ip+len<matchlimit && src[ip+len]==src[ref+len]) len++;
+        if((op=lz_emit(dst,op,cap,src+anchor,ip-anchor,ip-ref,len))<0) return -1;
+        ip+=len; anchor=ip;
+    }
+    return lz_emit(dst,op,cap,src+anchor,n-anchor,0,0);
+#endif
+}
+// Returns decompressed length, or -1 on corrupt input.
+static int lz4_decompress(const unsigned char *src, int n, unsigned char *dst, int cap){
+#ifdef HAVE_LZ4
+    int r=LZ4_decompress_safe((const char*)src,(char*)dst,n,cap);
+    return r>=0 ? r : -1;
+#else
+    int ip=0, op=0;
+    while(ip<n){
+        int tok=src[ip++], lit=tok>>4, b;
+        if(lit==15) do{ if(ip>=n) return -1; b=src[ip++]; lit+=b; }while(b==255);
+        if(ip+lit>n || op+lit>cap) return -1;
+        memcpy(dst+op,src+ip,(size_t)lit); ip+=lit; op+=lit;
+        if(ip>=n) break;
+        if(ip+2>n) return -1;
+        int off=src[ip] | (src[ip+1]<<8); ip+=2;
+        if(off==0 || off>op) return -1;
+        int ml=(tok&15)+4;
+        if((tok&15)==15) do{ if(ip>=n) return -1; b=src[ip++]; ml+=b; }while(b==255);
+        if(op+ml>cap) return -1;
+        for(int i=0;i<ml;i++,op++) dst[op]=dst[op-off];   // may overlap
+    }
+    return op;
+#endif
+}
+static int z_compress(int codec, const char *src, int n, char *dst, int cap){
+    int r=-1; long long t0=z_now_ns();
+    if(codec==Z_LZ4) r=lz4_compress((const unsigned char*)src,n,(unsigned char*)dst,cap);
+#ifdef HAVE_ZSTD
+    else if(codec==Z_ZSTD){ size_t z=ZSTD_compress(dst,(size_t)cap,src,(size_t)n,1); r=ZSTD_isError(z)?-1:(int)z; }
+#endif
+    zstat.cpu_ns += z_now_ns()-t0;
+    return r;
+}
+static int z_decompress(int codec, const char *src, int n, char *dst, int cap){
+    int r=-1; long long t0=z_now_ns();
+    if(codec==Z_LZ4) r=lz4_decompress((const unsigned char*)src,n,(unsigned char*)dst,cap);
+#ifdef HAVE_ZSTD
+    else if(codec==Z_ZSTD){ size_t z=ZSTD_decompress(dst,(size_t)cap,src,(size_t)n); r=ZSTD_isError(z)?-1:(int)z; }
+#endif
+    zstat.cpu_ns += z_now_ns()-t0;
+    return r;
+}
 
-    // success: remove from S1 (client is unaware)
-    unlink(local_fullpath);
+static void be32put(unsigned char *p, uint32_t v){ p[0]=(unsigned char)(v>>24); p[1]=(unsigned char)(v>>16); p[2]=(unsigned char)(v>>8); p[3]=(unsigned char)v; }
+static uint32_t be32get(const unsigned char *p){ return ((uint32_t)p[0]<<24)|((uint32_t)p[1]<<16)|((uint32_t)p[2]<<8)|p[3]; }
+
+// Frame writer. Output is batched: the reply header set with zw_head() goes
+// out in the same writev as the first payload bytes, Z_NONE data is collected
+// up to ZCHUNK, and the last frame carries the end marker. Nothing is sent
+// before zw_end() unless the buffer fills.
+#define ZHEAD 1536   // a header line: verb, dest (1023), fname (255) and options
+struct zw { int fd, codec; size_t n, hn; char head[ZHEAD]; char buf[ZCHUNK]; char out[8+ZBOUND+8]; };
+static void zw_init(struct zw *z, int fd, int codec){ z->fd=fd; z->codec=codec; z->n=0; z->hn=0; }
+static void zw_head(struct zw *z, const char *fmt, ...){
+    va_list ap, aq; va_start(ap, fmt); va_copy(aq, ap);
+    int k = vsnprintf(z->head, sizeof(z->head), fmt, ap);
+    va_end(ap);
+    if(k>=(int)sizeof(z->head)){   // longer still: it goes out ahead of the payload, whole
+        char *b = malloc((size_t)k+1);
+        if(b){ vsnprintf(b, (size_t)k+1, fmt, aq); write_n(z->fd, b, (size_t)k); free(b); }
+        k = 0;
+    }
+    va_end(aq);
+    z->hn = k<0 ? 0 : (size_t)k;
+}
+// Pending header plus up to two pieces, one syscall in the common case.
+static int zw_send(struct zw *z, const void *a, size_t an, const void *b, size_t bn){
+    struct iovec v[3] = { { z->head, z->hn }, { (void*)a, an }, { (void*)b, bn } };
+    z->hn = 0;
+    return writev_n(z->fd, v, 3);
+}
+static int zw_frame(struct zw *z, int last){
+    size_t len = 0;
+    if(z->n>0){
+        int c = z_compress(z->codec, z->buf, (int)z->n, z->out+8, ZBOUND);
+        uint32_t wire = (c>0 && (size_t)c<z->n) ? (uint32_t)c : (uint32_t)z->n;
+        if(wire==z->n) memcpy(z->out+8, z->buf, z->n);
+        be32put((unsigned char*)z->out, (uint32_t)z->n); be32put((unsigned char*)z->out+4, wire);
+        zstat.raw += (long long)z->n; zstat.wire += 8+(long long)wire;
+        z->n=0; len = 8+wire;
+    }
+    if(last){ memset(z->out+len, 0, 8); len += 8; zstat.wire += 8; }
+    return (len || z->hn) ? zw_send(z, z->out, len, NULL, 0) : 0;
+}
+static int zw_write(struct zw *z, const void *p, size_t n){
+    const char *s=(const char*)p;
+    if(z->codec==Z_NONE){
+        if(z->n+n > ZCHUNK){                     // what is buffered, then this piece
+            size_t k = z->n; z->n = 0;
+            return zw_send(z, z->buf, k, s, n);
+        }
+        memcpy(z->buf+z->n, s, n); z->n += n;
+        return 0;
+    }
+    while(n>0){
+        size_t k = ZCHUNK - z->n; if(k>n) k=n;
+        memcpy(z->buf+z->n, s, k); z->n+=k; s+=k; n-=k;
+        if(z->n==ZCHUNK && zw_frame(z,0)<0) return -1;
+    }
     return 0;
 }
+static int zw_end(struct zw *z){
+    if(z->codec!=Z_NONE) return zw_frame(z, 1);
+    size_t k = z->n; z->n = 0;
+    return (k || z->hn) ? zw_send(z, z->buf, k, NULL, 0) : 0;
+}
+// End a framed stream with the error frame instead of the end marker; what
+// is still buffered is dropped. Z_NONE has no frames: -1, the caller must cut.
+static int zw_abort(struct zw *z){
+    z->n = 0;
+    if(z->codec==Z_NONE) return -1;
+    unsigned char e[8]; be32put(e, 0); be32put(e+4, 0xffffffffu);
+    zstat.wire += 8;
+    return zw_send(z, e, 8, NULL, 0);
+}
 
-/* ---------- download helpers ---------- */
-static int stream_local_file(int out, const char *absdir, const char *fname){
-    char full[3072]; snprintf(full,sizeof(full), "%s/%s", absdir, fname);
-    int fd = open(full, O_RDONLY);
-    if(fd < 0) return -1;
+// Frame reader; with Z_NONE it reads straight through (no read-ahead).
+struct zr { int fd, codec, eof; size_t off, len; char buf[ZCHUNK]; char in[ZBOUND]; };
+static void zr_init(struct zr *z, int fd, int codec){ z->fd=fd; z->codec=codec; z->eof=0; z->off=z->len=0; }
+static int read_full(int fd, void *buf, size_t n){
+    size_t off=0;
+    qos_charge(fd, (long long)n);
+    while(off<n){
+        ssize_t r=read(fd,(char*)buf+off,n-off);
+        if(r<0){ if(errno==EINTR) continue; return -1; }
+        if(r==0) return -1;
+        off+=(size_t)r;
+    }
+    return 0;
+}
+static int zr_fill(struct zr *z){
+    unsigned char h[8];
+    if(read_full(z->fd,h,8)<0) return -1;
+    uint32_t raw=be32get(h), wire=be32get(h+4);
+    if(raw==0){ if(wire) return -1; z->eof=1; zstat.wire+=8; return 0; }   // wire!=0: error frame
+    if(raw>ZCHUNK || wire>raw || read_full(z->fd,z->in,wire)<0) return -1;
+    if(wire==raw) memcpy(z->buf,z->in,raw);
+    else if(z_decompress(z->codec,z->in,(int)wire,z->buf,ZCHUNK)!=(int)raw) return -1;
+    zstat.raw += raw; zstat.wire += 8+(long long)wire;
+    z->off=0; z->len=raw;
+    return 0;
+}
+static ssize_t zr_read(struct zr *z, void *p, size_t n){
+    if(z->codec==Z_NONE){
+        for(;;){
+            ssize_t r=read(z->fd,p,n);
+            if(r<0 && errno==EINTR) continue;
+            qos_charge(z->fd, r);
+            return r;
+        }
+    }
+    if(z->off==z->len){
+        if(z->eof) return 0;
+        if(zr_fill(z)<0) return -1;
+        if(z->eof) return 0;
+    }
+    size_t k = z->len - z->off; if(k>n) k=n;
+    memcpy(p, z->buf+z->off, k); z->off+=k;
+    return (ssize_t)k;
+}
+static ssize_t zr_line(struct zr *z, char *buf, size_t len){
+    if(z->codec==Z_NONE) return read_line(z->fd,buf,len);
+    size_t i=0;
+    while(i+1<len){
+        char c; ssize_t r=zr_read(z,&c,1);
+        if(r<0) return -1;
+        if(r==0) break;
+        buf[i++]=c;
+        if(c=='\n') break;
+    }
+    buf[i]='\0';
+    return (ssize_t)i;
+}
+// Consume the rest of a framed stream up to its end marker.
+static int zr_finish(struct zr *z){
+    char tmp[512];
+    if(z->codec==Z_NONE) return 0;
+    while(!z->eof){ ssize_t r=zr_read(z,tmp,sizeof(tmp)); if(r<0) return -1; if(r==0) break; }
+    return 0;
+}
 
-    struct stat st; fstat(fd, &st);
-    dprintf(out, "FILE %s %lld\n", fname, (long long)st.st_size);
+/* ---------- request tracing ----------
+   Every client command gets a request id (the client's own "rid=" if it sent
+   one); S1 passes it on as " rid=<trace>-<parent span>" with STORE, FETCH,
+   DELETE, LIST and TARALL, and S2-S4 adopt it. Spans go into a per-thread
+   ring (TRACE_RING entries, no locks, no allocation) and at the end of each
+   command are appended in one O_APPEND write to TRACE_FILE, which all four
+   servers share: Chrome trace events (chrome://tracing, Perfetto; pid = S<n>,
+   tid = session) or, with -DTRACE_OTLP=1, OpenTelemetry JSON lines (one
+   ExportTraceServiceRequest per command). Off unless built with -DTRACE=1.
+   The file lives in RUN_DIR, a 0700 directory of the server's user that is
+   refused if it is a link or someone else's; it is opened O_NOFOLLOW, and
+   past TRACE_MAX bytes it is renamed to TRACE_FILE.1 and started afresh
+   (processes still holding the old one notice the new inode and reopen). */
+#ifndef TRACE
+#define TRACE 0
+#endif
+#ifndef SLOW_MS
+#define SLOW_MS 1000                     // see slow_end()
+#endif
+#define TR_SPANS (TRACE || SLOW_MS>0)    // the ring also times phases for the slow log
+#ifndef RUN_DIR
+#define RUN_DIR "/tmp/dfs-run-%u"        // %u: the effective uid
+#endif
+#ifndef TRACE_FILE
+#define TRACE_FILE "trace.json"
+#endif
+#ifndef TRACE_MAX
+#define TRACE_MAX (64LL<<20)
+#endif
+#ifndef TRACE_OTLP
+#define TRACE_OTLP 0
+#endif
+#define TRACE_RING 256
+#define TRACE_SRV  1
+
+struct tspan { uint64_t id, parent; const char *name; long long t0, t1; };
+static __thread struct {
+    struct tspan r[TRACE_RING];
+    unsigned n, start;               // spans from 'start' on belong to the current command
+    uint64_t cur, seed;              // innermost open span, id generator
+} tr;
+static struct { uint64_t hi, lo, parent; int root; char cmd[16]; } tctx = { .root = -1 };
+static int tr_fd = -1;
+static char tr_path[128];
+
+static long long tr_now(void){
+    struct timespec ts; clock_gettime(CLOCK_REALTIME,&ts);
+    return (long long)ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+static uint64_t tr_rand(void){
+    if(!tr.seed) tr.seed = (uint64_t)tr_now() ^ ((uint64_t)getpid()<<32) ^ (uint64_t)(uintptr_t)&tr;
+    tr.seed ^= tr.seed<<13; tr.seed ^= tr.seed>>7; tr.seed ^= tr.seed<<17;
+    return tr.seed ? tr.seed : 1;
+}
+// Open a span below the innermost open one; the handle goes to tr_end().
+static int tr_begin(const char *name){
+    if(!TR_SPANS) return -1;
+    unsigned i = tr.n++;
+    struct tspan *s = &tr.r[i % TRACE_RING];
+    s->id = tr_rand(); s->parent = tr.cur ? tr.cur : tctx.parent;
+    s->name = name; s->t0 = tr_now(); s->t1 = 0;
+    tr.cur = s->id;
+    return (int)(i & 0x7fffffff);
+}
+static void tr_end(int h){
+    if(h<0 || tr.n-(unsigned)h > TRACE_RING) return;   // overwritten by a long command
+    struct tspan *s = &tr.r[(unsigned)h % TRACE_RING];
+    s->t1 = tr_now();
+    tr.cur = s->parent==tctx.parent ? 0 : s->parent;
+}
+static const char *rq_opt(void);
+// " rid=<trace>-<current span>" for a command sent to S2-S4 ("" without
+// tracing), followed by the command's deadline if it has one.
+static const char *tr_opt(void){
+    static __thread char o[96];
+    if(!TRACE) return rq_opt();
+    snprintf(o, sizeof(o), " rid=%016llx%016llx-%016llx%s", (unsigned long long)tctx.hi,
+             (unsigned long long)tctx.lo, (unsigned long long)(tr.cur ? tr.cur : tctx.parent), rq_opt());
+    return o;
+}
+// RUN_DIR/name, once RUN_DIR is known to be a private directory of ours.
+static int run_path(char *out, size_t n, const char *name){
+    char d[64]; struct stat st;
+    snprintf(d, sizeof(d), RUN_DIR, (unsigned)geteuid());
+    if(mkdir(d, 0700)<0 && errno!=EEXIST) return -1;
+    if(lstat(d,&st)<0 || !S_ISDIR(st.st_mode) || st.st_uid!=geteuid() || (st.st_mode & 022)) return -1;
+    snprintf(out, n, "%s/%s", d, name);
+    return 0;
+}
+// Name this server's track; the first server to touch a file opens the array.
+static void tr_announce(void){
+    if(!TRACE || TRACE_OTLP || tr_fd<0) return;
+    char b[160]; struct stat st;
+    flock(tr_fd, LOCK_EX);
+    if(fstat(tr_fd,&st)==0 && st.st_size==0) (void)!write(tr_fd, "[\n", 2);
+    int k = snprintf(b, sizeof(b), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"S%d\"}},\n", TRACE_SRV, TRACE_SRV);
+    (void)!write(tr_fd, b, (size_t)k);
+    flock(tr_fd, LOCK_UN);
+}
+// The fd of the current trace file: reopened after another process rotated it.
+static int tr_open_file(void){
+    struct stat a, b;
+    if(tr_fd>=0){
+        if(fstat(tr_fd,&a)==0 && stat(tr_path,&b)==0 && a.st_ino==b.st_ino && a.st_dev==b.st_dev) return tr_fd;
+        close(tr_fd); tr_fd = -1;
+    }
+    if(!*tr_path && run_path(tr_path, sizeof(tr_path), TRACE_FILE)<0){ tr_path[0] = '\0'; return -1; }
+    tr_fd = open(tr_path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC|O_NOFOLLOW, 0600);
+    tr_announce();
+    return tr_fd;
+}
+// Caller holds the flock: move a full file aside, start the next one.
+static void tr_rotate(void){
+    char old[sizeof(tr_path)+2]; snprintf(old, sizeof(old), "%s.1", tr_path);
+    rename(tr_path, old);
+    flock(tr_fd, LOCK_UN);
+    close(tr_fd); tr_fd = -1;
+    tr_open_file();
+    if(tr_fd>=0) flock(tr_fd, LOCK_EX);
+}
+static void tr_flush(void){
+    unsigned from = tr.n-tr.start > TRACE_RING ? tr.n-TRACE_RING : tr.start;
+    if(from==tr.n || tr_open_file()<0) return;
+    static char *buf; const size_t cap = (size_t)TRACE_RING*400+512;
+    if(!buf && !(buf = malloc(cap))) return;
+    char trace[40]; snprintf(trace, sizeof(trace), "%016llx%016llx", (unsigned long long)tctx.hi, (unsigned long long)tctx.lo);
+    long long now = tr_now();
+    size_t k = 0;
+    if(TRACE_OTLP) k += (size_t)snprintf(buf+k, cap-k,
+        "{\"resourceSpans\":[{\"resource\":{\"attributes\":[{\"key\":\"service.name\",\"value\":{\"stringValue\":\"S%d\"}}]},"
+        "\"scopeSpans\":[{\"scope\":{\"name\":\"dfs\"},\"spans\":[", TRACE_SRV);
+    for(unsigned i=from; i!=tr.n; i++){
+        struct tspan *s = &tr.r[i % TRACE_RING];
+        long long t1 = s->t1 ? s->t1 : now;
+        char par[24] = ""; if(s->parent) snprintf(par, sizeof(par), "%016llx", (unsigned long long)s->parent);
+        if(TRACE_OTLP)
+            k += (size_t)snprintf(buf+k, cap-k, "%s{\"traceId\":\"%s\",\"spanId\":\"%016llx\",\"parentSpanId\":\"%s\",\"name\":\"%s\","
+                "\"kind\":%d,\"startTimeUnixNano\":\"%lld000\",\"endTimeUnixNano\":\"%lld000\","
+                "\"attributes\":[{\"key\":\"process.pid\",\"value\":{\"intValue\":\"%d\"}}]}",
+                i==from ? "" : ",", trace, (unsigned long long)s->id, par, s->name,
+                (int)i==tctx.root ? 2 : 1, s->t0, t1, (int)getpid());
+        else
+            k += (size_t)snprintf(buf+k, cap-k, "{\"name\":\"%s\",\"cat\":\"S%d\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"rid\":\"%s\",\"span\":\"%016llx\",\"parent\":\"%s\"}},\n",
+                s->name, TRACE_SRV, s->t0, t1-s->t0, TRACE_SRV, (int)getpid(), trace, (unsigned long long)s->id, par);
+        if(k>=cap-400) break;
+    }
+    if(TRACE_OTLP) k += (size_t)snprintf(buf+k, cap-k, "]}]}]}\n");
+    struct stat st;
+    flock(tr_fd, LOCK_EX);
+    if(fstat(tr_fd,&st)==0 && st.st_size+(long long)k > TRACE_MAX) tr_rotate();
+    if(tr_fd>=0){ (void)!write(tr_fd, buf, k); flock(tr_fd, LOCK_UN); }
+}
+// A command line arrived: adopt its "rid=<trace>[-<parent span>]" or start a
+// new trace, and open the command's root span.
+static void tr_request(const char *line){
+    if(!TR_SPANS) return;
+    tr.start = tr.n; tr.cur = 0;
+    if(!TRACE){ tctx.parent = 0; tctx.root = -1; return; }   // phases only, nothing is written
+    tctx.hi = tctx.lo = tctx.parent = 0;
+    char v[64];
+    if(opt_get(line, "rid", v, sizeof(v))){
+        char *dash = strchr(v, '-');
+        if(dash){ *dash = '\0'; tctx.parent = strtoull(dash+1, NULL, 16); }
+        size_t l = strlen(v);
+        if(l>16){ tctx.lo = strtoull(v+l-16, NULL, 16); v[l-16] = '\0'; tctx.hi = strtoull(v, NULL, 16); }
+        else tctx.lo = strtoull(v, NULL, 16);
+    }
+    if(!tctx.hi && !tctx.lo){ tctx.hi = tr_rand(); tctx.lo = tr_rand(); }
+    snprintf(tctx.cmd, sizeof(tctx.cmd), "%.*s", (int)strcspn(line, " \r\n"), line);
+    tctx.root = tr_begin(tctx.cmd);
+}
+// The command is done (or a forked helper exits): close the root, write the spans.
+static void tr_finish(void){
+    if(!TR_SPANS) return;
+    if(tctx.root>=0) tr_end(tctx.root);
+    if(TRACE) tr_flush();
+    tr.start = tr.n; tctx.root = -1;
+}
+// In a freshly forked helper: only its own spans are its to write, and its
+// span ids must not repeat the parent's sequence.
+static void tr_child(void){ tr.start = tr.n; tctx.root = -1; tr.seed = 0; }
+
+/* ---------- client QoS: admission, bulk lanes, shaping ----------
+   State shared by all acceptors and sessions (MAP_SHARED, robust mutex):
+   - admission: at most CLIENT_MAX_SESSIONS live sessions per client address
+     (refused with "ERR busy" before fork), and at most CLIENT_MAX_FORWARDS
+     background upload forwarders per client; past that a session forwards
+     in-line, which slows that client down instead of forking more.
+   - scheduling: every command starts interactive. One that is about to move
+     BULK_MIN bytes or more over the client socket (an UPLOAD by its SIZE
+     lines, a DOWNLF by the file it is sending, any DOWNLTAR) becomes bulk
+     and needs one of BULK_SLOTS lanes; waiting sessions get lanes
+     round-robin by client (fewest lanes held first, FIFO within a client).
+     The lane is taken at that point, by qos_size(), before the command
+     opens or locks anything, never from inside the I/O helpers. Interactive
+     commands never queue.
+   - shaping: token buckets per client (CLIENT_RATE) and for everything
+     (QOS_RATE), bytes/s, 0 = off. Interactive traffic draws tokens without
+     waiting, so bulk transfers of the same client and on the same box yield
+     to it; bulk traffic sleeps off its debt.
+   Entries of sessions that died are reclaimed by pid (kill(pid,0)). */
+#ifndef CLIENT_MAX_SESSIONS
+#define CLIENT_MAX_SESSIONS 16   // 0 = unlimited
+#endif
+#ifndef CLIENT_MAX_FORWARDS
+#define CLIENT_MAX_FORWARDS 4
+#endif
+#ifndef BULK_SLOTS
+#define BULK_SLOTS 4             // 0 = bulk commands never queue
+#endif
+#ifndef BULK_MIN
+#define BULK_MIN (256<<10)
+#endif
+#ifndef CLIENT_RATE
+#define CLIENT_RATE 0
+#endif
+#ifndef QOS_RATE
+#define QOS_RATE 0
+#endif
+#ifndef QOS_BURST
+#define QOS_BURST (1<<20)
+#endif
+#define QOS_SESS    1024
+#define QOS_CLIENTS 256
+#define QOS_STEP    (1<<20)      // shaped xfer_copy chunk
+
+struct qbucket { uint32_t addr; int used; double tokens; long long last; };
+static struct qos_shm {
+    pthread_mutex_t mu; pthread_cond_t cv;
+    unsigned long long ticket, refused;
+    struct { uint32_t addr; pid_t pid; int fwd; } sess[QOS_SESS];
+    struct { uint32_t addr; pid_t pid; } lane[BULK_SLOTS>0 ? BULK_SLOTS : 1];
+    struct { uint32_t addr; pid_t pid; unsigned long long ticket; } wait[QOS_SESS];
+    struct qbucket bkt[QOS_CLIENTS], all;
+} *qs;
+// this session: its client socket and what the current command has moved
+static struct { int fd; uint32_t addr; long long op_bytes, wait_us; int bulk, lane; } qsess = { -1, 0, 0, 0, 0, -1 };
+
+static void qos_lock(void){
+    if(pthread_mutex_lock(&qs->mu)==EOWNERDEAD) pthread_mutex_consistent(&qs->mu);
+}
+static long long mono_us(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+static int pid_dead(pid_t pid){ return pid<=0 || (kill(pid,0)<0 && errno==ESRCH); }
+
+static void qos_init(void){
+    struct qos_shm *m = mmap(NULL, sizeof(*qs), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if(m==MAP_FAILED) return;
+    pthread_mutexattr_t ma; pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&m->mu, &ma); pthread_mutexattr_destroy(&ma);
+    pthread_condattr_t ca; pthread_condattr_init(&ca);
+    pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&m->cv, &ca); pthread_condattr_destroy(&ca);
+    qs = m;
+}
+// Live sessions (fwd=0) or forwarders (fwd=1) of 'addr'; drops dead entries.
+static int qos_count(uint32_t addr, int fwd){
+    int n=0;
+    for(int i=0;i<QOS_SESS;i++){
+        if(!qs->sess[i].pid) continue;
+        if(pid_dead(qs->sess[i].pid)){ qs->sess[i].pid = 0; continue; }
+        if(qs->sess[i].addr==addr && qs->sess[i].fwd==fwd) n++;
+    }
+    return n;
+}
+// May 'addr' start another session (fwd=0) or forwarder (fwd=1)?
+static int qos_admit(uint32_t addr, int fwd){
+    if(!qs) return 1;
+    int max = fwd ? CLIENT_MAX_FORWARDS : CLIENT_MAX_SESSIONS;
+    if(max<=0) return 1;
+    qos_lock();
+    int ok = qos_count(addr, fwd) < max;
+    if(!ok && !fwd) qs->refused++;
+    pthread_mutex_unlock(&qs->mu);
+    return ok;
+}
+static void qos_register(uint32_t addr, pid_t pid, int fwd){
+    if(!qs || pid<=0) return;
+    qos_lock();
+    for(int i=0;i<QOS_SESS;i++) if(!qs->sess[i].pid || pid_dead(qs->sess[i].pid)){
+        qs->sess[i].addr = addr; qs->sess[i].pid = pid; qs->sess[i].fwd = fwd; break;
+    }
+    pthread_mutex_unlock(&qs->mu);
+}
+static void qos_leave(void){
+    if(!qs) return;
+    pid_t me = getpid();
+    qos_lock();
+    for(int i=0;i<QOS_SESS;i++) if(qs->sess[i].pid==me) qs->sess[i].pid = 0;
+    pthread_mutex_unlock(&qs->mu);
+}
+
+static int lane_held(uint32_t addr){
+    int n=0;
+    for(int i=0;i<BULK_SLOTS;i++) if(qs->lane[i].pid && qs->lane[i].addr==addr) n++;
+    return n;
+}
+// Block until this session holds a bulk lane (its turn among the waiters).
+static void lane_acquire(void){
+    if(!qs || BULK_SLOTS<=0) return;
+    pid_t me = getpid();
+    long long t0 = mono_us();
+    int th = tr_begin("qos.lane");
+    qos_lock();
+    int w = -1;
+    for(int i=0;i<QOS_SESS;i++) if(!qs->wait[i].pid || pid_dead(qs->wait[i].pid)){ w = i; break; }
+    if(w>=0){ qs->wait[w].addr = qsess.addr; qs->wait[w].pid = me; qs->wait[w].ticket = ++qs->ticket; }
+    for(;;){
+        int free_lane = -1;
+        for(int i=0;i<BULK_SLOTS;i++){
+            if(qs->lane[i].pid && pid_dead(qs->lane[i].pid)) qs->lane[i].pid = 0;
+            if(!qs->lane[i].pid && free_lane<0) free_lane = i;
+        }
+        if(free_lane>=0){
+            // the waiter whose client holds the fewest lanes, oldest ticket first
+            int best = -1, bh = 0;
+            for(int i=0;i<QOS_SESS;i++){
+                if(!qs->wait[i].pid) continue;
+                if(pid_dead(qs->wait[i].pid)){ qs->wait[i].pid = 0; continue; }
+                int h = lane_held(qs->wait[i].addr);
+                if(best<0 || h<bh || (h==bh && qs->wait[i].ticket<qs->wait[best].ticket)){ best = i; bh = h; }
+            }
+            if(best<0 || best==w || w<0){
+                qs->lane[free_lane].addr = qsess.addr; qs->lane[free_lane].pid = me;
+                qsess.lane = free_lane;
+                break;
+            }
+        }
+        struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_nsec += 50*1000000L; if(ts.tv_nsec>=1000000000L){ ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+        if(pthread_cond_timedwait(&qs->cv, &qs->mu, &ts)==EOWNERDEAD) pthread_mutex_consistent(&qs->mu);
+    }
+    if(w>=0) qs->wait[w].pid = 0;
+    pthread_mutex_unlock(&qs->mu);
+    tr_end(th);
+    qsess.wait_us += mono_us()-t0;
+}
+// The command is over: back to interactive, hand the lane on.
+static void qos_idle(void){
+    qsess.op_bytes = 0; qsess.bulk = 0;
+    if(!qs || qsess.lane<0) return;
+    qos_lock();
+    if(qs->lane[qsess.lane].pid==getpid()) qs->lane[qsess.lane].pid = 0;
+    pthread_cond_broadcast(&qs->cv);
+    pthread_mutex_unlock(&qs->mu);
+    qsess.lane = -1;
+}
+
+static double bucket_take(struct qbucket *b, double rate, long long now, long long n){
+    if(!b->used){ b->used = 1; b->tokens = QOS_BURST; b->last = now; }
+    b->tokens += (double)(now-b->last)*rate/1e6; b->last = now;
+    if(b->tokens>QOS_BURST) b->tokens = QOS_BURST;
+    b->tokens -= (double)n;
+    return b->tokens<0 ? -b->tokens/rate : 0;            // seconds of debt
+}
+// The command is going to move n more bytes over 'fd': if that makes it bulk
+// it waits for a lane here (no-op for other fds).
+static void qos_size(int fd, long long n){
+    if(fd!=qsess.fd || qsess.bulk || qsess.op_bytes+n < BULK_MIN) return;
+    qsess.bulk = 1;
+    lane_acquire();
+}
+// n bytes are about to cross the client socket (no-op for other fds).
+static void qos_charge(int fd, long long n){
+    if(fd!=qsess.fd || n<=0) return;
+    qsess.op_bytes += n;
+    if(!qs || (CLIENT_RATE<=0 && QOS_RATE<=0)) return;
+    long long now = mono_us(); double debt = 0, d;
+    qos_lock();
+    if(CLIENT_RATE>0){
+        struct qbucket *b = NULL, *lru = &qs->bkt[0];
+        for(int i=0;i<QOS_CLIENTS && !b;i++){
+            if(qs->bkt[i].used && qs->bkt[i].addr==qsess.addr) b = &qs->bkt[i];
+            else if(!qs->bkt[i].used || (lru->used && qs->bkt[i].last<lru->last)) lru = &qs->bkt[i];
+        }
+        if(!b){ b = lru; b->used = 0; b->addr = qsess.addr; }
+        if((d = bucket_take(b, CLIENT_RATE, now, n))>debt) debt = d;
+    }
+    if(QOS_RATE>0 && (d = bucket_take(&qs->all, QOS_RATE, now, n))>debt) debt = d;
+    pthread_mutex_unlock(&qs->mu);
+    if(qsess.bulk && debt>0){
+        struct timespec ts = { (time_t)debt, (long)((debt-(double)(time_t)debt)*1e9) };
+        int th = tr_begin("qos.shape");
+        while(nanosleep(&ts,&ts)<0 && errno==EINTR);
+        tr_end(th);
+        qsess.wait_us += (long long)(debt*1e6);
+    }
+}
+
+/* ---------- slow requests, on-demand profiling ----------
+   A command that takes SLOW_MS or longer (0 = off) is logged to stderr with
+   its line, the bytes it moved over the client socket and the time spent in
+   each of its phases (recv, forward, aux.fetch, relay, qos.lane ...): the
+   span ring records them whether or not TRACE writes them out.
+
+   "PROFILE <seconds> [hz=<n>]" is taken from a unix socket or loopback peer,
+   or from anyone with " exp=<unix time> sig=<hex>" appended, the
+   HMAC-SHA256 of "PROFILE <seconds> <hz> <exp>" under $DFS_KEY (see
+   prof_allowed()); others get "ERR denied". It opens a sampling window for the whole server
+   ("PROFILE 0" closes it): the window lives in shared memory, and every
+   session that runs a command inside it arms ITIMER_PROF in its own process
+   and records a backtrace per tick. At the end of each command the samples
+   are symbolized from the binary's own symbol table (static functions
+   included) and appended to PROF_FILE in RUN_DIR as folded stacks
+   ("a;b;c <count>", flamegraph.pl / speedscope input); /tmp/perf-<pid>.map
+   (where perf looks) gets the symbol map in perf's format for tools that
+   read raw addresses. Neither open follows a link, and the map is only
+   written if the process creates it. */
+#ifndef PROF_ENABLE
+#define PROF_ENABLE 1             // 0 = no PROFILE at all
+#endif
+#ifndef PROF_FILE
+#define PROF_FILE "prof.folded"
+#endif
+#define PROF_HZ      997          // default rate, off the 1 kHz beat of timers
+#define PROF_SAMPLES 8192         // per process and command
+#define PROF_DEPTH   48
+
+static struct { char line[256]; long long t0; } slow;
 
-    char buf[BUFSZ]; ssize_t r;
-    while((r = read(fd, buf, sizeof(buf))) > 0){
-        if(write_n(out, buf, (size_t)r) != r){ close(fd); return -2; }
+static void slow_begin(const char *line){
+    if(SLOW_MS<=0) return;
+    snprintf(slow.line, sizeof(slow.line), "%.*s", (int)strcspn(line, "\r\n"), line);
+    slow.t0 = mono_us();
+}
+// File names and paths that follow on their own lines (NAME, PATH).
+static void slow_arg(const char *a){
+    if(SLOW_MS<=0) return;
+    size_t l = strlen(slow.line), k = strlen(a);
+    if(l+1+k >= sizeof(slow.line)) return;      // keep the line as it is
+    slow.line[l] = ' '; memcpy(slow.line+l+1, a, k+1);
+}
+// Called before tr_finish(): the command's spans are still in the ring.
+static void slow_end(void){
+    if(SLOW_MS<=0 || !slow.t0) return;
+    long long us = mono_us()-slow.t0;
+    slow.t0 = 0;
+    if(us < (long long)SLOW_MS*1000) return;
+    const char *name[16]; long long sum[16]; int np = 0;
+    unsigned from = tr.n-tr.start > TRACE_RING ? tr.n-TRACE_RING : tr.start;
+    long long now = tr_now();
+    for(unsigned i=from; i!=tr.n; i++){
+        if((int)(i & 0x7fffffff)==tctx.root) continue;
+        struct tspan *s = &tr.r[i % TRACE_RING];
+        int k = 0; while(k<np && strcmp(name[k], s->name)) k++;
+        if(k==np){ if(np==16) continue; name[np] = s->name; sum[np++] = 0; }
+        sum[k] += (s->t1 ? s->t1 : now) - s->t0;
     }
+    char ph[512]; size_t pl = 0; ph[0] = '\0';
+    for(int k=0;k<np && pl<sizeof(ph)-40;k++)
+        pl += (size_t)snprintf(ph+pl, sizeof(ph)-pl, " %s=%.1fms", name[k], sum[k]/1000.0);
+    fprintf(stderr, "S1: slow %.1fms pid=%d bytes=%lld qos_wait=%.1fms [%s]%s\n",
+            us/1000.0, (int)getpid(), qsess.op_bytes, qsess.wait_us/1000.0, slow.line, ph);
+}
+
+struct psym { uintptr_t addr; size_t size; const char *name; };
+static struct { struct psym *s; int n; char *str; } psyms;   // loaded once, shared by the forks
+static struct { long long until_us; int hz; } *pwin;
+static struct { void *(*pc)[PROF_DEPTH]; unsigned char *depth; volatile int n; int armed; } prof;
+int main(void);
+
+static int psym_cmp(const void *a, const void *b){
+    uintptr_t x = ((const struct psym*)a)->addr, y = ((const struct psym*)b)->addr;
+    return x<y ? -1 : x>y;
+}
+// Function symbols of our own executable, relocated by where main() landed.
+static void prof_load_syms(void){
+    int fd = open("/proc/self/exe", O_RDONLY|O_CLOEXEC); if(fd<0) return;
+    struct stat st; unsigned char *m = MAP_FAILED;
+    if(fstat(fd,&st)==0) m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     close(fd);
-    return 0;
+    if(m==MAP_FAILED) return;
+    Elf64_Ehdr *eh = (Elf64_Ehdr*)m;
+    if(memcmp(eh->e_ident, ELFMAG, SELFMAG) || eh->e_ident[EI_CLASS]!=ELFCLASS64 ||
+       eh->e_shoff + (size_t)eh->e_shnum*sizeof(Elf64_Shdr) > (size_t)st.st_size) goto out;
+    Elf64_Shdr *sh = (Elf64_Shdr*)(m+eh->e_shoff);
+    for(int i=0;i<eh->e_shnum;i++){
+        if(sh[i].sh_type!=SHT_SYMTAB || sh[i].sh_link>=eh->e_shnum) continue;
+        Elf64_Sym *sy = (Elf64_Sym*)(m+sh[i].sh_offset);
+        size_t ns = sh[i].sh_size/sizeof(Elf64_Sym);
+        const char *strs = (const char*)(m+sh[sh[i].sh_link].sh_offset);
+        size_t strsz = sh[sh[i].sh_link].sh_size;
+        psyms.s = malloc(ns*sizeof(struct psym)); psyms.str = malloc(strsz);
+        if(!psyms.s || !psyms.str) goto out;
+        memcpy(psyms.str, strs, strsz);
+        uintptr_t base = 0;
+        for(size_t k=0;k<ns;k++)
+            if(sy[k].st_name<strsz && !strcmp(strs+sy[k].st_name,"main")) base = (uintptr_t)main - sy[k].st_value;
+        for(size_t k=0;k<ns;k++){
+            if(ELF64_ST_TYPE(sy[k].st_info)!=STT_FUNC || !sy[k].st_value || sy[k].st_name>=strsz) continue;
+            psyms.s[psyms.n++] = (struct psym){ base+sy[k].st_value, sy[k].st_size, psyms.str+sy[k].st_name };
+        }
+        qsort(psyms.s, (size_t)psyms.n, sizeof(struct psym), psym_cmp);
+        break;
+    }
+out:
+    munmap(m, (size_t)st.st_size);
+}
+static const char *prof_sym(void *pc){
+    uintptr_t a = (uintptr_t)pc-1;                 // return address -> inside the call
+    int lo = 0, hi = psyms.n-1;
+    while(lo<=hi){
+        int mid = (lo+hi)/2;
+        if(psyms.s[mid].addr > a) hi = mid-1; else lo = mid+1;
+    }
+    if(hi>=0 && a < psyms.s[hi].addr + (psyms.s[hi].size ? psyms.s[hi].size : 1)) return psyms.s[hi].name;
+    Dl_info di;
+    if(dladdr(pc,&di) && di.dli_sname) return di.dli_sname;
+    return "[unknown]";
 }
-static int relay_from_aux(int out, int port, const char *dest, const char *fname){
-    int sd = connect_local_port(port);
-    if(sd < 0) return -1;
-    dprintf(sd, "FETCH %s %s\n", dest, fname);
 
-    char hdr[256]; ssize_t rn = read_line(sd, hdr, sizeof(hdr));
-    if(rn <= 0 || strncmp(hdr, "OK ", 3) != 0){ close(sd); return -2; }
-    long long size=0; if(sscanf(hdr+3, "%lld", &size)!=1 || size<0){ close(sd); return -3; }
+static void prof_tick(int sig){
+    (void)sig;
+    int i = prof.n, e = errno;
+    if(i<PROF_SAMPLES){ prof.depth[i] = (unsigned char)backtrace(prof.pc[i], PROF_DEPTH); prof.n = i+1; }
+    errno = e;
+}
+static void prof_init(void){
+    if(!PROF_ENABLE) return;
+    void *m = mmap(NULL, sizeof(*pwin), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if(m==MAP_FAILED) return;
+    pwin = m;
+    prof_load_syms();
+}
+static void prof_arm(int on){
+    struct itimerval it = {{0,0},{0,0}};
+    if(on){
+        if(!prof.pc){
+            prof.pc = malloc(sizeof(*prof.pc)*PROF_SAMPLES); prof.depth = malloc(PROF_SAMPLES);
+            if(!prof.pc || !prof.depth) return;
+            void *warm[2]; backtrace(warm, 2);    // loads the unwinder outside the handler
+        }
+        signal(SIGPROF, prof_tick);
+        int hz = pwin->hz>0 ? pwin->hz : PROF_HZ;
+        it.it_interval.tv_usec = it.it_value.tv_usec = 1000000/hz;
+    }
+    setitimer(ITIMER_PROF, &it, NULL);
+    prof.armed = on;
+}
+static int prof_cmp(const void *a, const void *b){ return strcmp(*(char*const*)a, *(char*const*)b); }
+// Append this process's samples as folded stacks (root first) and reset.
+static void prof_dump(void){
+    int n = prof.n;
+    if(n<=0) return;
+    char **st = malloc(sizeof(char*)*(size_t)n); int ns = 0;
+    for(int i=0;i<n && st;i++){
+        char b[2048]; size_t k = 0;
+        for(int d=prof.depth[i]-1; d>=2 && k<sizeof(b)-130; d--)   // 0,1: handler and signal frame
+            k += (size_t)snprintf(b+k, sizeof(b)-k, "%s%.120s", k ? ";" : "", prof_sym(prof.pc[i][d]));
+        if(k) st[ns++] = strdup(b);
+    }
+    prof.n = 0;
+    if(!st) return;
+    qsort(st, (size_t)ns, sizeof(char*), prof_cmp);
+    char path[160]; int fd = -1;
+    if(run_path(path, sizeof(path), PROF_FILE)==0)
+        fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600);
+    FILE *f = fd>=0 ? fdopen(fd, "a") : NULL;
+    if(!f && fd>=0) close(fd);
+    if(f){
+        flock(fileno(f), LOCK_EX);
+        for(int i=0;i<ns;){
+            int j = i; while(j<ns && !strcmp(st[i],st[j])) j++;
+            fprintf(f, "%s %d\n", st[i], j-i);
+            i = j;
+        }
+        fflush(f); flock(fileno(f), LOCK_UN);
+        fclose(f);
+    }
+    for(int i=0;i<ns;i++) free(st[i]);
+    free(st);
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);   // exists: written already, or not ours
+    if(fd>=0 && (f = fdopen(fd, "w"))){
+        for(int i=0;i<psyms.n;i++)
+            fprintf(f, "%lx %zx %s\n", (unsigned long)psyms.s[i].addr, psyms.s[i].size ? psyms.s[i].size : 1, psyms.s[i].name);
+        fclose(f);
+    }
+    else if(fd>=0) close(fd);
+}
+// A command starts: sample it if a window is open.
+static void prof_begin(void){
+    if(pwin && mono_us() < pwin->until_us) prof_arm(1);
+}
+// The command is over (or the session): stop the timer, write the samples.
+static void prof_end(void){
+    if(!prof.armed) return;
+    prof_arm(0);
+    prof_dump();
+}
+// PROFILE <seconds> [hz=<n>]
+static void prof_cmd(int csd, const char *args){
+    if(!pwin){ dprintf(csd, PROF_ENABLE ? "ERR profiling unavailable\n" : "ERR profiling disabled\n"); return; }
+    char v[16]; int secs = atoi(args), hz = opt_get(args, "hz", v, sizeof(v)) ? atoi(v) : PROF_HZ;
+    if(secs<0 || hz<1 || hz>10000){ dprintf(csd, "ERR bad PROFILE\n"); return; }
+    pwin->hz = hz;
+    pwin->until_us = secs ? mono_us() + secs*1000000LL : 0;
+    char path[160]; if(run_path(path, sizeof(path), PROF_FILE)<0) snprintf(path, sizeof(path), "(no RUN_DIR)");
+    if(secs) dprintf(csd, "OK profiling %ds at %d Hz -> %s\n", secs, hz, path);
+    else     dprintf(csd, "OK profiling off\n");
+}
 
-    dprintf(out, "FILE %s %lld\n", fname, size);
+/* ---------- bulk copy engine ----------
+   xfer_copy() moves the raw payload of an uncompressed UPLOAD or DOWNLF
+   between the client socket and a file. With io_uring (raw syscalls, no liburing) the read of
+   the next chunk overlaps the write of the previous one, through IO_NBUF
+   registered buffers and the two fds installed as fixed files; each
+   io_uring_enter both submits and reaps. If the kernel refuses a ring (old
+   kernel, seccomp) or with -DIO_URING=0 it is a plain read/write loop in
+   IO_BUF steps. File-to-socket copies go through sendfile() first (no user
+   copy at all; -DSENDFILE=0 turns it off). Framed (compressed) transfers keep going through zr/zw. */
+#ifndef IO_URING
+#define IO_URING 1
+#endif
+#ifndef SENDFILE
+#define SENDFILE 1
+#endif
+#define IO_BUF  (128*1024)
+#define IO_NBUF 4
+static struct { long long calls, bytes; int mode, sf; } iostat;   // mode: 0 untried, 1 io_uring, -1 read/write; sf likewise for sendfile
 
-    char buf[BUFSZ]; long long left = size;
-    while(left > 0){
-        ssize_t r = read(sd, buf, (left > BUFSZ ? BUFSZ : (size_t)left));
-        if(r <= 0){ close(sd); return -4; }
-        if(write_n(out, buf, (size_t)r) != r){ close(sd); return -5; }
-        left -= r;
+#if IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+static struct {
+    int fd; pid_t pid;
+    unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes; struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map; size_t sq_sz, cq_sz, sqe_sz;
+    char *buf; unsigned queued;
+} ur = { .fd = -1 };
+
+static void ur_teardown(void){
+    if(ur.fd<0) return;
+    if(ur.cq_map && ur.cq_map!=ur.sq_map) munmap(ur.cq_map, ur.cq_sz);
+    if(ur.sq_map) munmap(ur.sq_map, ur.sq_sz);
+    if(ur.sqes) munmap(ur.sqes, ur.sqe_sz);
+    close(ur.fd);
+    free(ur.buf);
+    memset(&ur, 0, sizeof(ur)); ur.fd = -1;
+}
+// One ring per process: a ring inherited across fork() belongs to the parent.
+static int ur_setup(void){
+    if(ur.fd>=0 && ur.pid==getpid()) return 0;
+    ur_teardown();
+    struct io_uring_params p; memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, 8, &p);
+    if(fd<0) return -1;
+    ur.fd = fd; ur.pid = getpid();
+    ur.sq_sz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    ur.cq_sz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(single){ if(ur.cq_sz>ur.sq_sz) ur.sq_sz = ur.cq_sz; ur.cq_sz = ur.sq_sz; }
+    ur.sq_map = mmap(NULL, ur.sq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(ur.sq_map==MAP_FAILED){ ur.sq_map = NULL; ur_teardown(); return -1; }
+    ur.cq_map = single ? ur.sq_map : mmap(NULL, ur.cq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if(ur.cq_map==MAP_FAILED){ ur.cq_map = NULL; ur_teardown(); return -1; }
+    ur.sqe_sz = p.sq_entries*sizeof(struct io_uring_sqe);
+    ur.sqes = mmap(NULL, ur.sqe_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(ur.sqes==MAP_FAILED){ ur.sqes = NULL; ur_teardown(); return -1; }
+    char *sq = ur.sq_map, *cq = ur.cq_map;
+    ur.sq_tail = (unsigned*)(sq+p.sq_off.tail); ur.sq_mask = (unsigned*)(sq+p.sq_off.ring_mask);
+    ur.sq_array = (unsigned*)(sq+p.sq_off.array);
+    ur.cq_head = (unsigned*)(cq+p.cq_off.head); ur.cq_tail = (unsigned*)(cq+p.cq_off.tail);
+    ur.cq_mask = (unsigned*)(cq+p.cq_off.ring_mask);
+    ur.cqes = (struct io_uring_cqe*)(cq+p.cq_off.cqes);
+
+    // registered buffers and a sparse two-slot fixed file table (0 = in, 1 = out)
+    ur.buf = aligned_alloc(4096, (size_t)IO_NBUF*IO_BUF);
+    struct iovec iov[IO_NBUF];
+    for(int i=0;i<IO_NBUF && ur.buf;i++){ iov[i].iov_base = ur.buf+(size_t)i*IO_BUF; iov[i].iov_len = IO_BUF; }
+    int sparse[2] = { -1, -1 };
+    if(!ur.buf || syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, IO_NBUF)<0
+               || syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, sparse, 2)<0){
+        ur_teardown(); return -1;
     }
-    close(sd);
     return 0;
 }
+static void ur_prep(int op, int slot, int bi, unsigned boff, unsigned len, long long foff){
+    unsigned tail = *ur.sq_tail, idx = tail & *ur.sq_mask;
+    struct io_uring_sqe *e = &ur.sqes[idx];
+    memset(e, 0, sizeof(*e));
+    e->opcode = (uint8_t)op; e->fd = slot; e->flags = IOSQE_FIXED_FILE;
+    e->addr = (uint64_t)(uintptr_t)(ur.buf+(size_t)bi*IO_BUF+boff); e->len = len;
+    e->off = (uint64_t)foff;          // -1 on a socket: no offset
+    e->buf_index = (uint16_t)bi;
+    e->user_data = (uint64_t)(op==IORING_OP_WRITE_FIXED)<<8 | (uint64_t)bi;
+    ur.sq_array[idx] = idx;
+    __atomic_store_n(ur.sq_tail, tail+1, __ATOMIC_RELEASE);
+    ur.queued++;
+}
+static long long xfer_uring(int in, int out, long long n, long long in_off, long long out_off){
+    int fds[2] = { in, out };
+    struct io_uring_files_update up; memset(&up, 0, sizeof(up));
+    up.offset = 0; up.fds = (uint64_t)(uintptr_t)fds;
+    iostat.calls++;
+    if(syscall(__NR_io_uring_register, ur.fd, IORING_REGISTER_FILES_UPDATE, &up, 2)<0) return -1;
 
-/* ---------- remove helpers ---------- */
-static int delete_local(const char *dest, const char *fname){
-    char dir[2048]; join_path(dir,sizeof(dir),S1_ROOT,dest);
-    char full[3072]; snprintf(full,sizeof(full), "%s/%s", dir, fname);
-    return unlink(full); // 0 on success
+    struct { unsigned len, wpos; } b[IO_NBUF];
+    int fifo[IO_NBUF], fh=0, fn=0;            // filled buffers, in stream order
+    int freeb[IO_NBUF], nfree=0;
+    for(int i=IO_NBUF-1;i>=0;i--) freeb[nfree++] = i;
+    int rd=-1, wr=-1, eof=0, err=0;           // buffer with a read / write in flight
+    long long left=n, done=0;
+    while(!err){
+        if(rd<0 && !eof && left>0 && nfree>0){
+            rd = freeb[--nfree];
+            ur_prep(IORING_OP_READ_FIXED, 0, rd, 0, (unsigned)(left>IO_BUF ? IO_BUF : left), in_off);
+        }
+        if(wr<0 && fn>0){
+            wr = fifo[fh];
+            ur_prep(IORING_OP_WRITE_FIXED, 1, wr, b[wr].wpos, b[wr].len-b[wr].wpos, out_off);
+        }
+        if(rd<0 && wr<0) break;
+        iostat.calls++;
+        if(syscall(__NR_io_uring_enter, ur.fd, ur.queued, 1, IORING_ENTER_GETEVENTS, NULL, 0)<0){
+            if(errno==EINTR) continue;
+            err = 1; break;
+        }
+        ur.queued = 0;
+        unsigned head = *ur.cq_head;
+        while(head != __atomic_load_n(ur.cq_tail, __ATOMIC_ACQUIRE)){
+            struct io_uring_cqe *c = &ur.cqes[head & *ur.cq_mask]; head++;
+            int bi = (int)(c->user_data & 0xff), res = c->res;
+            if(!(c->user_data>>8)){
+                rd = -1;
+                if(res==-EINTR || res==-EAGAIN){ freeb[nfree++] = bi; }
+                else if(res<0) err = 1;
+                else if(res==0){ eof = 1; freeb[nfree++] = bi; }
+                else{
+                    b[bi].len = (unsigned)res; b[bi].wpos = 0;
+                    fifo[(fh+fn)%IO_NBUF] = bi; fn++;
+                    left -= res; if(in_off>=0) in_off += res;
+                }
+            }else{
+                wr = -1;
+                if(res==-EINTR || res==-EAGAIN) continue;
+                if(res<=0){ err = 1; continue; }
+                b[bi].wpos += (unsigned)res; done += res; if(out_off>=0) out_off += res;
+                if(b[bi].wpos==b[bi].len){ fh = (fh+1)%IO_NBUF; fn--; freeb[nfree++] = bi; }
+            }
+        }
+        __atomic_store_n(ur.cq_head, head, __ATOMIC_RELEASE);
+    }
+    // an op may still be in flight on a dead peer; dropping the ring cancels it
+    if(err) ur_teardown();
+    return (err || done!=n) ? -1 : done;
 }
-static int delete_remote(int port, const char *dest, const char *fname){
-    int sd = connect_local_port(port);
-    if(sd < 0) return -1;
-    dprintf(sd, "DELETE %s %s\n", dest, fname);
-    char line[128]; ssize_t rn = read_line(sd, line, sizeof(line));
-    close(sd);
-    if(rn <= 0) return -2;
-    return (strncmp(line,"OK",2)==0) ? 0 : -3;
+#endif
+
+static long long xfer_loop(int in, int out, long long n){
+    static char *buf;
+    if(!buf && !(buf = malloc(IO_BUF))) return -1;
+    long long left=n;
+    while(left>0){
+        iostat.calls++;
+        ssize_t r = read(in, buf, (size_t)(left>IO_BUF ? IO_BUF : left));
+        if(r<0 && errno==EINTR) continue;
+        if(r<=0){ iostat.bytes += n-left; return -1; }
+        for(ssize_t w=0; w<r; ){
+            iostat.calls++;
+            ssize_t k = write(out, buf+w, (size_t)(r-w));
+            if(k<0 && errno==EINTR) continue;
+            if(k<=0){ iostat.bytes += n-left; return -1; }
+            w += k;
+        }
+        left -= r;
+    }
+    return n;
+}
+// File (at in_off) to socket inside the kernel; -2 if sendfile can't do this pair.
+static long long xfer_sendfile(int in, int out, long long n, long long in_off){
+    off_t off = (off_t)in_off; long long done = 0;
+    while(done<n){
+        size_t k = n-done > (1<<30) ? (size_t)1<<30 : (size_t)(n-done);
+        iostat.calls++;
+        ssize_t w = sendfile(out, in, &off, k);
+        if(w<0 && errno==EINTR) continue;
+        if(w<0 && done==0 && (errno==EINVAL || errno==ENOSYS)) return -2;
+        if(w<=0){ iostat.bytes += done; return -1; }   // what got out still counts
+        done += w;
+    }
+    return n;
+}
+static long long xfer_step(int in, int out, long long n, long long in_off, long long out_off){
+    long long r = -2;
+    if(SENDFILE && iostat.sf>=0 && in_off>=0 && out_off<0){
+        r = xfer_sendfile(in, out, n, in_off);
+        if(r!=-2){ iostat.sf = 1; if(r>0) iostat.bytes += r; return r; }
+        iostat.sf = -1;
+    }
+#if IO_URING
+    if(iostat.mode>=0 && ur_setup()==0){ iostat.mode = 1; r = xfer_uring(in, out, n, in_off, out_off); }
+    else iostat.mode = -1;
+#else
+    (void)in_off; (void)out_off;
+    iostat.mode = -1;
+#endif
+    if(r==-2) r = xfer_loop(in, out, n);
+    if(r>0) iostat.bytes += r;
+    return r;
+}
+// Copy n bytes from 'in' to 'out'; a file side gives its offset, a socket -1.
+// With shaping on, the client socket side goes in QOS_STEP pieces.
+static long long xfer_copy(int in, int out, long long n, long long in_off, long long out_off){
+    int client = qsess.fd>=0 && (in==qsess.fd || out==qsess.fd);
+    long long step = client && (CLIENT_RATE>0 || QOS_RATE>0) ? QOS_STEP : n, done = 0;
+    do{
+        long long k = n-done<step ? n-done : step;
+        if(client) qos_charge(qsess.fd, k);
+        long long r = xfer_step(in, out, k, in_off<0 ? -1 : in_off+done, out_off<0 ? -1 : out_off+done);
+        if(r!=k) return r;
+        done += k;
+    }while(done<n);
+    return n;
 }
 
-/* ---------- tar helpers (downltar) — robust `.c` path ---------- */
-static int ends_with_ext(const char *name, const char *ext){
-    size_t ln=strlen(name), le=strlen(ext);
-    if(le==0 || ln<le) return 0;
-    return strcasecmp(name+ln-le, ext)==0;
+/* ---------- packed small-file store (PACKSTORE=1) ----------
+   Small files are appended as records to ROOT/.pack/seg-NNNNNN instead of
+   getting an inode each. Every process keeps an in-memory index
+   (key "dest/fname" -> segment, offset, size) and catches up by replaying
+   the log tail, so forked children see what their siblings appended.
+   Appends and compaction take LOCK_EX on .pack/LOCK, readers LOCK_SH;
+   compaction bumps .pack/GEN, which makes other processes reload. A put or
+   delete is fdatasync'd (with the directory for a new segment) before it
+   returns, so it is as durable as a plain file when the client gets OK. */
+#ifndef PACKSTORE
+#define PACKSTORE 0                     // build with -DPACKSTORE=1 to enable
+#endif
+#ifndef PACK_MAX
+#define PACK_MAX     (64*1024)          // files up to this size are packed
+#endif
+#ifndef PACK_SEGMAX
+#define PACK_SEGMAX  (64LL*1024*1024)   // roll to a new segment past this
+#endif
+#define PACK_MAGIC   0x314b4150u        // "PAK1"
+#define PACK_PUT     1
+#define PACK_DEL     2
+#define PACK_KEYMAX  2048
+
+struct pack_hdr { uint32_t magic; uint16_t op; uint16_t klen; uint32_t size; uint32_t pad; int64_t mtime; };
+struct pack_ent { char *key; uint32_t seg; uint32_t size; int64_t off; int64_t mtime; int live; };
+
+static struct {
+    char dir[2048];
+    struct pack_ent *tab; size_t cap, used;
+    uint32_t first, last, seg; int64_t pos;   // oldest/newest at load, replay position
+    long long *total, *live; size_t nstat;
+    unsigned long long gen;
+    pid_t pid; int lockfd, held;              // held: the flock mode this process has
+} pk = { .lockfd = -1 };
+
+static uint64_t fnv1a(const char *s){
+    uint64_t h=1469598103934665603ULL;
+    while(*s){ h ^= (unsigned char)*s++; h *= 1099511628211ULL; }
+    return h;
+}
+static void pack_key(char *out, size_t outsz, const char *dest, const char *fname){
+    while(dest && *dest=='/') dest++;
+    if(!dest || !*dest){ snprintf(out,outsz,"%s",fname); return; }
+    size_t dl=strlen(dest); while(dl>0 && dest[dl-1]=='/') dl--;
+    snprintf(out,outsz,"%.*s/%s",(int)dl,dest,fname);
+}
+static void seg_path(char *out, size_t outsz, uint32_t seg){
+    snprintf(out,outsz,"%s/seg-%06u",pk.dir,seg);
+}
+
+static void pack_grow(void){
+    size_t ncap = pk.cap ? pk.cap*2 : 1024;
+    struct pack_ent *nt = calloc(ncap, sizeof(*nt));
+    for(size_t i=0;i<pk.cap;i++){
+        if(!pk.tab[i].key) continue;
+        size_t j = fnv1a(pk.tab[i].key) & (ncap-1);
+        while(nt[j].key) j = (j+1) & (ncap-1);
+        nt[j] = pk.tab[i];
+    }
+    free(pk.tab); pk.tab=nt; pk.cap=ncap;
+}
+static struct pack_ent *pack_slot(const char *key, int create){
+    if(pk.cap){
+        size_t i = fnv1a(key) & (pk.cap-1);
+        while(pk.tab[i].key){
+            if(strcmp(pk.tab[i].key,key)==0) return &pk.tab[i];
+            i = (i+1) & (pk.cap-1);
+        }
+    }
+    if(!create) return NULL;
+    if((pk.used+1)*2 > pk.cap) pack_grow();
+    size_t i = fnv1a(key) & (pk.cap-1);
+    while(pk.tab[i].key) i = (i+1) & (pk.cap-1);
+    pk.tab[i].key = strdup(key); pk.used++;
+    return &pk.tab[i];
+}
+static long long pack_reclen(uint32_t klen, uint32_t size){ return (long long)sizeof(struct pack_hdr)+klen+size; }
+static void pack_stat(uint32_t seg, long long total, long long live){
+    if(seg >= pk.nstat){
+        size_t n = pk.nstat ? pk.nstat : 64; while(n <= seg) n*=2;
+        pk.total = realloc(pk.total, n*sizeof(long long));
+        pk.live  = realloc(pk.live,  n*sizeof(long long));
+        memset(pk.total+pk.nstat, 0, (n-pk.nstat)*sizeof(long long));
+        memset(pk.live+pk.nstat,  0, (n-pk.nstat)*sizeof(long long));
+        pk.nstat = n;
+    }
+    pk.total[seg] += total; pk.live[seg] += live;
+}
+static void pack_apply(uint32_t seg, int64_t off, const struct pack_hdr *h, const char *key){
+    long long rec = pack_reclen(h->klen, h->size);
+    pack_stat(seg, rec, h->op==PACK_PUT ? rec : 0);
+    struct pack_ent *e = pack_slot(key, h->op==PACK_PUT);
+    if(!e) return;
+    if(e->live) pack_stat(e->seg, 0, -pack_reclen(h->klen, e->size));
+    if(h->op==PACK_PUT){
+        e->seg=seg; e->off=off+(int64_t)sizeof(*h)+h->klen; e->size=h->size; e->mtime=h->mtime; e->live=1;
+    }else e->live=0;
+}
+
+// Replay complete records from the current position to the end of the log.
+static void pack_replay(void){
+    char p[2200];
+    for(;;){
+        seg_path(p,sizeof(p),pk.seg);
+        int fd=open(p,O_RDONLY);
+        if(fd>=0){
+            struct stat st; fstat(fd,&st);
+            struct pack_hdr h; char key[PACK_KEYMAX];
+            while(pk.pos+(int64_t)sizeof(h) <= st.st_size){
+                if(pread(fd,&h,sizeof(h),pk.pos)!=(ssize_t)sizeof(h) || h.magic!=PACK_MAGIC || h.klen>=sizeof(key)) break;
+                if(pk.pos+pack_reclen(h.klen,h.size) > st.st_size) break;   // torn or in-flight tail
+                if(pread(fd,key,h.klen,pk.pos+(off_t)sizeof(h))!=(ssize_t)h.klen) break;
+                key[h.klen]='\0';
+                pack_apply(pk.seg, pk.pos, &h, key);
+                pk.pos += pack_reclen(h.klen,h.size);
+            }
+            close(fd);
+        }
+        seg_path(p,sizeof(p),pk.seg+1);
+        if(access(p,F_OK)!=0 && pk.seg>=pk.last) return;   // compaction leaves holes below 'last'
+        pk.seg++; pk.pos=0;
+    }
+}
+static unsigned long long pack_read_gen(void){
+    char p[2200]; snprintf(p,sizeof(p),"%s/GEN",pk.dir);
+    char b[32]={0}; int fd=open(p,O_RDONLY); if(fd<0) return 0;
+    ssize_t r=read(fd,b,sizeof(b)-1); close(fd);
+    return r>0 ? strtoull(b,NULL,10) : 0;
+}
+static void pack_reload(void){
+    for(size_t i=0;i<pk.cap;i++) free(pk.tab[i].key);
+    free(pk.tab); pk.tab=NULL; pk.cap=pk.used=0;
+    if(pk.nstat){ memset(pk.total,0,pk.nstat*sizeof(long long)); memset(pk.live,0,pk.nstat*sizeof(long long)); }
+    pk.gen = pack_read_gen();
+
+    uint32_t lo=0, hi=0;
+    DIR *dp=opendir(pk.dir);
+    if(dp){
+        struct dirent *de;
+        while((de=readdir(dp))){
+            unsigned s; if(sscanf(de->d_name,"seg-%u",&s)!=1) continue;
+            if(lo==0 || s<lo) lo=s;
+            if(s>hi) hi=s;
+        }
+        closedir(dp);
+    }
+    pk.first = pk.seg = lo ? lo : 1; pk.last = hi; pk.pos = 0;
+    pack_replay();
+}
+static int pack_lock(int op){
+    if(pk.pid != getpid()){   // flock is per open file; each process needs its own
+        if(pk.lockfd>=0) close(pk.lockfd);
+        char p[2200]; snprintf(p,sizeof(p),"%s/LOCK",pk.dir);
+        pk.lockfd = open(p,O_RDWR|O_CREAT,0664);
+        pk.pid = getpid(); pk.held = 0;
+    }
+    if(pk.lockfd<0) return -1;
+    while(flock(pk.lockfd,op)<0) if(errno!=EINTR) return -1;
+    pk.held = op==LOCK_UN ? 0 : op;
+    return 0;
+}
+// Catch the index up with the log; takes LOCK_SH unless the caller holds the lock.
+static void pack_sync(void){
+    int own = pk.pid!=getpid() || !pk.held;
+    if(own && pack_lock(LOCK_SH)<0) return;
+    if(pack_read_gen()!=pk.gen) pack_reload();
+    else pack_replay();
+    if(own) pack_lock(LOCK_UN);
+}
+// fdatasync segments from..to, and the directory (new segments, unlinks).
+static int pack_flush(uint32_t from, uint32_t to){
+    char p[2200]; int rc=0;
+    for(uint32_t s=from; s<=to; s++){
+        seg_path(p,sizeof(p),s);
+        int fd=open(p,O_RDONLY); if(fd<0) continue;
+        if(fdatasync(fd)<0) rc=-1;
+        close(fd);
+    }
+    int dfd=open(pk.dir,O_RDONLY|O_DIRECTORY);
+    if(dfd>=0){ if(fsync(dfd)<0) rc=-1; close(dfd); }
+    return rc;
+}
+static int pack_init(const char *root){
+    join_path(pk.dir,sizeof(pk.dir),root,".pack");
+    if(ensure_dir(pk.dir)<0) return -1;
+    if(pack_lock(LOCK_SH)<0) return -1;
+    pack_reload();
+    pack_lock(LOCK_UN);
+    return 0;
+}
+
+// Append one record; caller holds LOCK_EX and has synced.
+// With 'durable' the record (and a new segment's name) is on disk on return.
+static int pack_append_locked(uint16_t op, const char *key, const char *data, uint32_t n, int64_t mtime, int durable){
+    char p[2200];
+    if(pk.pos >= PACK_SEGMAX){ pk.seg++; pk.pos=0; }
+    seg_path(p,sizeof(p),pk.seg);
+    int fd=open(p,O_RDWR|O_CREAT,0664); if(fd<0) return -1;
+    struct stat st;
+    if(fstat(fd,&st)==0 && st.st_size>pk.pos && ftruncate(fd,pk.pos)<0){ close(fd); return -1; } // crash leftovers
+    struct pack_hdr h = { PACK_MAGIC, op, (uint16_t)strlen(key), n, 0, mtime };
+    struct iovec iov[3] = { {&h,sizeof(h)}, {(void*)key,h.klen}, {(void*)data,n} };
+    ssize_t want = (ssize_t)pack_reclen(h.klen,n);
+    ssize_t w = pwritev(fd, iov, data ? 3 : 2, pk.pos);
+    if(w==want && durable && fdatasync(fd)<0) w = -1;
+    close(fd);
+    if(w!=want) return -1;
+    if(durable && pk.pos==0 && pack_flush(pk.seg+1, pk.seg)<0) return -1;   // directory only
+    pack_apply(pk.seg, pk.pos, &h, key);
+    pk.pos += want;
+    return 0;
+}
+static int pack_put(const char *key, const char *data, uint32_t n){
+    if(strlen(key)>=PACK_KEYMAX || pack_lock(LOCK_EX)<0) return -1;
+    pack_sync();
+    int rc = pack_append_locked(PACK_PUT, key, data, n, (int64_t)time(NULL), 1);
+    pack_lock(LOCK_UN);
+    return rc;
+}
+// Returns 0 if the key was live and is now deleted.
+static int pack_del(const char *key){
+    if(pack_lock(LOCK_EX)<0) return -1;
+    pack_sync();
+    struct pack_ent *e = pack_slot(key,0);
+    int rc = (e && e->live) ? pack_append_locked(PACK_DEL, key, NULL, 0, (int64_t)time(NULL), 1) : -1;
+    pack_lock(LOCK_UN);
+    return rc;
+}
+// Read a packed file into a malloc'd buffer; returns size or -1.
+// *ver (optional) identifies the record itself: every rewrite appends a new one.
+static long long pack_get(const char *key, char **out, int64_t *mtime, uint64_t *ver){
+    if(pack_lock(LOCK_SH)<0) return -1;
+    pack_sync();
+    long long rc=-1;
+    struct pack_ent *e = pack_slot(key,0);
+    if(e && e->live){
+        char p[2200]; seg_path(p,sizeof(p),e->seg);
+        int fd=open(p,O_RDONLY);
+        char *buf = malloc(e->size ? e->size : 1);
+        if(fd>=0 && buf && pread(fd,buf,e->size,e->off)==(ssize_t)e->size){
+            *out=buf; if(mtime) *mtime=e->mtime; if(ver) *ver=((uint64_t)e->seg<<40)^(uint64_t)e->off; rc=e->size; buf=NULL;
+        }
+        free(buf); if(fd>=0) close(fd);
+    }
+    pack_lock(LOCK_UN);
+    return rc;
+}
+// Append live packed names directly under 'dest' that end with 'ext'.
+static int pack_list(const char *dest, const char *ext, char ***names, int n, int *cap){
+    char dir[PACK_KEYMAX]; pack_key(dir,sizeof(dir),dest,"");
+    size_t dl=strlen(dir);
+    pack_sync();
+    for(size_t i=0;i<pk.cap;i++){
+        struct pack_ent *e=&pk.tab[i];
+        if(!e->key || !e->live || strncmp(e->key,dir,dl)!=0) continue;
+        const char *nm=e->key+dl;
+        const char *dot=strrchr(nm,'.');
+        if(strchr(nm,'/') || !dot || strcasecmp(dot,ext)!=0) continue;
+        if(arena_push(names, &n, cap, nm)!=0) break;
+    }
+    return n;
+}
+// A sealed segment that is mostly dead is rewritten: its live records are
+// re-appended at the tail, and so are its tombstones unless it is the
+// oldest segment (then nothing older can hold what they delete).
+static int pack_dead_seg(uint32_t s){
+    return s < pk.nstat && pk.total[s] > 0 && pk.live[s]*2 < pk.total[s];
+}
+static int pack_need_compact(void){
+    pack_sync();
+    for(uint32_t s=pk.first; s<pk.seg; s++) if(pack_dead_seg(s)) return 1;
+    return 0;
+}
+static int pack_compact_seg(uint32_t old){
+    char p[2200]; seg_path(p,sizeof(p),old);
+    int fd=open(p,O_RDONLY); if(fd<0) return -1;
+    struct stat st; fstat(fd,&st);
+    struct pack_hdr h; char key[PACK_KEYMAX];
+    int64_t pos=0; int ok=1; uint32_t s0=pk.seg;
+    while(ok && pos+(int64_t)sizeof(h) <= st.st_size){
+        if(pread(fd,&h,sizeof(h),pos)!=(ssize_t)sizeof(h) || h.magic!=PACK_MAGIC || h.klen>=sizeof(key)) break;
+        if(pread(fd,key,h.klen,pos+(off_t)sizeof(h))!=(ssize_t)h.klen) break;
+        key[h.klen]='\0';
+        struct pack_ent *e = pack_slot(key,0);
+        int64_t doff = pos+(int64_t)sizeof(h)+h.klen;
+        if(h.op==PACK_PUT && e && e->live && e->seg==old && e->off==doff){
+            char *buf=malloc(h.size ? h.size : 1);
+            ok = buf && pread(fd,buf,h.size,doff)==(ssize_t)h.size
+                 && pack_append_locked(PACK_PUT,key,buf,h.size,h.mtime,0)==0;
+            free(buf);
+        }else if(h.op==PACK_DEL && old!=pk.first && e && !e->live){
+            ok = pack_append_locked(PACK_DEL,key,NULL,0,h.mtime,0)==0;
+        }
+        pos += pack_reclen(h.klen,h.size);
+    }
+    close(fd);
+    if(!ok || pack_flush(s0, pk.seg)<0) return -1;   // the copies are on disk before the original goes
+    return unlink(p);
+}
+static void pack_compact(void){
+    if(pack_lock(LOCK_EX)<0) return;
+    pack_sync();
+    int changed=0;
+    uint32_t active=pk.seg;
+    for(uint32_t s=pk.first; s<active; s++)
+        if(pack_dead_seg(s) && pack_compact_seg(s)==0) changed=1;
+    if(changed){
+        char p[2200], tmp[2200]; snprintf(p,sizeof(p),"%s/GEN",pk.dir); snprintf(tmp,sizeof(tmp),"%s/GEN.tmp",pk.dir);
+        FILE *f=fopen(tmp,"w");
+        if(f){ fprintf(f,"%llu\n",pk.gen+1); fflush(f); fdatasync(fileno(f)); fclose(f); rename(tmp,p); }
+        pack_flush(1, 0);
+        pack_reload();
+    }
+    pack_lock(LOCK_UN);
+}
+
+
+/* ---------- directory listing cache (DISPFNAMES .c listing) ----------
+   Sorted listings of recently used directories live in a MAP_SHARED region
+   set up before the accept loop, so every forked session sees them. Caching
+   a directory puts an inotify watch on it (sessions inherit the inotify fd,
+   so any of them can add watches); a thread in the listening process reads
+   the events and drops the slots of changed directories. This server's own
+   .c UPLOAD/REMOVEF drop the slot synchronously via jnl_add(), which also
+   covers packed files that inotify cannot see. S2-S4 cache their LIST. A fill is only kept if no
+   invalidation raced it (slot generation). */
+#ifndef DCACHE_SLOTS
+#define DCACHE_SLOTS 64          // 0 disables the cache
+#endif
+#define DCACHE_BYTES (64*1024)   // names of one listing, NUL-separated; larger ones are not cached
+#define DC_EVENTS (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR)
+
+struct dslot {
+    char key[1024], ext[8];          // directory relative to the root ("" or "a/b/")
+    int wd, valid, n, len;
+    unsigned gen; unsigned long long used;
+    char names[DCACHE_BYTES];
+};
+static struct dcache {
+    pthread_mutex_t mu; int ifd;
+    unsigned long long tick, hits, misses;
+    struct dslot s[DCACHE_SLOTS>0 ? DCACHE_SLOTS : 1];
+} *dc;
+static char dc_root[1024];
+
+static void dc_lock(void){
+    if(pthread_mutex_lock(&dc->mu)==EOWNERDEAD){      // a session died mid-update
+        for(int i=0;i<DCACHE_SLOTS;i++) dc->s[i].valid = 0;
+        pthread_mutex_consistent(&dc->mu);
+    }
+}
+// "x//y" and "/x/y" name the same slot as the pack key "x/y/"
+static void dc_key(char *out, size_t outsz, const char *dest){
+    pack_key(out, outsz, dest, "");
+    char *w = out;
+    for(char *r=out; *r; r++) if(!(*r=='/' && w>out && w[-1]=='/')) *w++ = *r;
+    *w = '\0';
+}
+static struct dslot *dc_find(const char *key, const char *ext){
+    for(int i=0;i<DCACHE_SLOTS;i++){
+        struct dslot *s = &dc->s[i];
+        if(s->used && !strcmp(s->key,key) && !strcmp(s->ext,ext)) return s;
+    }
+    return NULL;
+}
+static void *dc_watch(void *arg){
+    (void)arg;
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for(;;){
+        ssize_t r = read(dc->ifd, buf, sizeof(buf));
+        if(r<0 && errno==EINTR) continue;
+        if(r<=0) break;
+        dc_lock();
+        for(char *p=buf; p<buf+r; ){
+            struct inotify_event *ev = (struct inotify_event*)p;
+            for(int i=0;i<DCACHE_SLOTS;i++){
+                struct dslot *s = &dc->s[i];
+                if(ev->wd>=0 && s->wd!=ev->wd) continue;   // wd -1: queue overflow, drop all
+                s->valid = 0; s->gen++;
+                if(ev->mask & IN_IGNORED) s->wd = -1;
+            }
+            p += sizeof(*ev) + ev->len;
+        }
+        pthread_mutex_unlock(&dc->mu);
+    }
+    return NULL;
+}
+static void dc_init(const char *root){
+    if(DCACHE_SLOTS<=0) return;
+    struct dcache *m = mmap(NULL, sizeof(*dc), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if(m==MAP_FAILED) return;
+    pthread_mutexattr_t at; pthread_mutexattr_init(&at);
+    pthread_mutexattr_setpshared(&at, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&at, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&m->mu, &at);
+    pthread_mutexattr_destroy(&at);
+    for(int i=0;i<DCACHE_SLOTS;i++) m->s[i].wd = -1;
+    pthread_t th;
+    if((m->ifd = inotify_init1(IN_CLOEXEC))<0){ munmap(m, sizeof(*dc)); return; }
+    dc = m;
+    snprintf(dc_root, sizeof(dc_root), "%s", root);
+    if(pthread_create(&th, NULL, dc_watch, NULL)!=0){ close(m->ifd); munmap(m, sizeof(*dc)); dc = NULL; return; }
+    pthread_detach(th);
+}
+// Cached listing of 'dest': names in *out (request arena) and the count, or
+// -1 on a miss with *gen set for dc_put() (the directory is watched from here on).
+static int dc_get(const char *dest, const char *ext, char ***out, unsigned *gen){
+    *out = NULL;
+    if(!dc) return -1;
+    char key[1024]; dc_key(key, sizeof(key), dest);
+    int n = -1;
+    dc_lock();
+    struct dslot *s = dc_find(key, ext);
+    if(s && s->valid && (*out = arena_alloc((size_t)(s->n ? s->n : 1)*sizeof(char*)))){
+        const char *p = s->names;
+        for(n=0; n<s->n; n++){ (*out)[n] = arena_strdup(p); p += strlen(p)+1; }
+        s->used = ++dc->tick; dc->hits++;
+    }else{
+        dc->misses++;
+        if(!s){                                          // take the least recently used slot
+            s = &dc->s[0];
+            for(int i=1;i<DCACHE_SLOTS;i++) if(dc->s[i].used < s->used) s = &dc->s[i];
+            if(s->wd>=0){
+                int shared = 0;
+                for(int i=0;i<DCACHE_SLOTS;i++) if(&dc->s[i]!=s && dc->s[i].wd==s->wd) shared = 1;
+                if(!shared) inotify_rm_watch(dc->ifd, s->wd);
+            }
+            snprintf(s->key, sizeof(s->key), "%s", key);
+            snprintf(s->ext, sizeof(s->ext), "%s", ext);
+            s->wd = -1; s->valid = 0; s->gen++;
+        }
+        s->used = ++dc->tick;
+        if(s->wd<0){
+            char dir[2200]; snprintf(dir, sizeof(dir), "%s/%s", dc_root, key);
+            s->wd = inotify_add_watch(dc->ifd, dir, DC_EVENTS);
+        }
+        *gen = s->gen;
+    }
+    pthread_mutex_unlock(&dc->mu);
+    return n;
+}
+// Keep a freshly read listing unless the directory changed since dc_get().
+static void dc_put(const char *dest, const char *ext, unsigned gen, char **names, int n){
+    if(!dc) return;
+    size_t len = 0;
+    for(int i=0;i<n;i++) len += strlen(names[i])+1;
+    if(len>DCACHE_BYTES) return;
+    char key[1024]; dc_key(key, sizeof(key), dest);
+    dc_lock();
+    struct dslot *s = dc_find(key, ext);
+    if(s && s->gen==gen && s->wd>=0){
+        char *p = s->names;
+        for(int i=0;i<n;i++){ size_t l = strlen(names[i])+1; memcpy(p, names[i], l); p += l; }
+        s->n = n; s->len = (int)len; s->valid = 1;
+    }
+    pthread_mutex_unlock(&dc->mu);
+}
+// 'path' (relative to the root) was created or removed: drop its directory.
+static void dc_changed(const char *path){
+    if(!dc) return;
+    char key[1024]; const char *sl = strrchr(path, '/');
+    char dest[1024]; snprintf(dest, sizeof(dest), "%.*s", sl ? (int)(sl-path) : 0, path);
+    dc_key(key, sizeof(key), dest);
+    dc_lock();
+    for(int i=0;i<DCACHE_SLOTS;i++){
+        struct dslot *s = &dc->s[i];
+        if(s->used && !strcmp(s->key,key)){ s->valid = 0; s->gen++; }
+    }
+    pthread_mutex_unlock(&dc->mu);
+}
+
+/* ---------- change journal (incremental DOWNLTAR) ----------
+   Every .c UPLOAD and REMOVEF appends "<usec> P|D <path>" to
+   <root>/.journal (S2-S4 do the same for STORE/DELETE); the first line
+   "# <usec>" is how far back the history goes. DOWNLTAR since=<usec>
+   replays it instead of walking the tree. Past JOURNAL_MAX the
+   file is rewritten with only the newest line per path, which answers any
+   "since" the same way. */
+#ifndef JOURNAL_MAX
+#define JOURNAL_MAX (4<<20)
+#endif
+static char jnl_path[2200];
+
+static long long now_us(void){
+    struct timespec ts; clock_gettime(CLOCK_REALTIME,&ts);
+    return (long long)ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+static void jnl_init(const char *root){
+    ensure_dir(root);
+    snprintf(jnl_path,sizeof(jnl_path),"%s/.journal",root);
+    int fd=open(jnl_path,O_WRONLY|O_CREAT|O_EXCL,0664);
+    if(fd>=0){ dprintf(fd,"# %lld\n",now_us()); close(fd); }
+}
+// Open the journal locked with 'op', again if a compaction replaced it meanwhile.
+static int jnl_open(int op){
+    for(;;){
+        int fd=open(jnl_path,O_RDWR|O_APPEND);
+        if(fd<0) return -1;
+        while(flock(fd,op)<0) if(errno!=EINTR){ close(fd); return -1; }
+        struct stat a,b;
+        if(fstat(fd,&a)==0 && stat(jnl_path,&b)==0 && a.st_ino==b.st_ino) return fd;
+        close(fd);
+    }
+}
+
+struct jrec { char *path; long long us; char op; int seq; };
+static int jrec_cmp(const void *a, const void *b){
+    const struct jrec *x=a, *y=b;
+    int c=strcmp(x->path,y->path);
+    return c ? c : x->seq - y->seq;
+}
+// Newest record per path, sorted by path; *base = start of the history.
+static int jnl_load(int fd, struct jrec **out, long long *base){
+    FILE *f=fdopen(dup(fd),"r");
+    if(!f) return -1;
+    struct jrec *r=NULL; int n=0, cap=0;
+    char ln[PACK_KEYMAX+64];
+    *base=0;
+    while(fgets(ln,sizeof(ln),f)){
+        ln[strcspn(ln,"\n")]='\0';
+        if(ln[0]=='#'){ *base=atoll(ln+1); continue; }
+        long long us; char op; int off=0;
+        if(sscanf(ln,"%lld %c %n",&us,&op,&off)<2 || !off) continue;
+        if(n==cap){ cap=cap?cap*2:256; r=realloc(r,(size_t)cap*sizeof(*r)); if(!r){ fclose(f); return -1; } }
+        r[n].path=strdup(ln+off); r[n].us=us; r[n].op=op; r[n].seq=n; n++;
+    }
+    fclose(f);
+    if(n) qsort(r,(size_t)n,sizeof(*r),jrec_cmp);
+    int m=0;
+    for(int i=0;i<n;i++){
+        if(i+1<n && strcmp(r[i].path,r[i+1].path)==0){ free(r[i].path); continue; }
+        r[m++]=r[i];
+    }
+    *out=r;
+    return m;
+}
+static void jnl_free(struct jrec *r, int n){ for(int i=0;i<n;i++) free(r[i].path); free(r); }
+
+static void jnl_compact(int fd){   // caller holds LOCK_EX
+    struct jrec *r; long long base;
+    int n=jnl_load(fd,&r,&base);
+    if(n<0) return;
+    char tmp[2300]; snprintf(tmp,sizeof(tmp),"%s.tmp",jnl_path);
+    FILE *f=fopen(tmp,"w");
+    if(f){
+        fprintf(f,"# %lld\n",base);
+        for(int i=0;i<n;i++) fprintf(f,"%lld %c %s\n",r[i].us,r[i].op,r[i].path);
+        if(fclose(f)==0) rename(tmp,jnl_path); else unlink(tmp);
+    }
+    jnl_free(r,n);
+}
+static void jnl_add(char op, const char *path){
+    dc_changed(path);            // every journaled change also drops the cached listing
+    int fd=jnl_open(LOCK_SH);
+    if(fd<0) return;
+    char ln[PACK_KEYMAX+64];
+    int k=snprintf(ln,sizeof(ln),"%lld %c %s\n",now_us(),op,path);
+    if(k>0 && k<(int)sizeof(ln)) write_n(fd,ln,(size_t)k);
+    struct stat st;
+    int big = fstat(fd,&st)==0 && st.st_size>JOURNAL_MAX;
+    close(fd);
+    if(big && (fd=jnl_open(LOCK_EX))>=0){
+        if(fstat(fd,&st)==0 && st.st_size>JOURNAL_MAX) jnl_compact(fd);
+        close(fd);
+    }
+}
+
+/* ---------- request deadlines and cancellation ----------
+   A client command may carry "deadline=<ms>" anywhere on its line: S1 takes
+   it off, makes it an absolute time and sends it along as " dl=<usec>" (see
+   tr_opt) with every STORE, FETCH, LIST and TARALL the command issues.
+   While a command runs, the session's watchdog thread (started with the
+   first command) waits for the deadline and polls the client socket for a
+   hang-up (POLLHUP/POLLERR: the connection is gone both ways, typically
+   reset when a reply reached a client that had closed). End-of-input alone
+   (POLLRDHUP) is not one: a client may shut down its sending side after the
+   request and still read the reply; one that closed altogether is noticed
+   at the next write. Either one cancels the command at
+   once: the aux connections it opened are shut down, so whatever blocks on
+   them returns, the helpers it forked (tar, tar_source) are killed, and the
+   client socket is shut down too, since a reply cut short cannot be
+   resumed, the session ends. The aux servers notice their connection go
+   and stop their half the same way. Cancelled commands and the bytes they
+   no longer had to move are counted for the whole server (STATS
+   cancel_gone= cancel_deadline= cancel_saved=). -DRQ_WATCHDOG=0 turns the
+   watchdog off; deadlines are then still passed on. */
+#include <sys/eventfd.h>
+#ifndef RQ_WATCHDOG
+#define RQ_WATCHDOG 1
+#endif
+#ifndef RQ_GRACE
+#define RQ_GRACE 20        // ms a hang-up waits: the client may just have read the last reply
+#endif
+#define RQ_FDS     16      // aux connections tracked per command
+#define RQ_PIDS    8       // helper processes tracked per command
+#define RQ_GONE    1
+#define RQ_EXPIRED 2
+
+static struct {
+    int csd, efd, started, nfd, npid, cut;
+    volatile int active, cancel; volatile unsigned gen;
+    long long dl, saved;               // absolute deadline (now_us, 0 = none); bytes spared
+    int fd[RQ_FDS]; pid_t pid[RQ_PIDS];
+    char cmd[16];
+} rq = { .csd = -1, .efd = -1 };
+static struct { unsigned long long gone, expired, saved; } *rqs;   // all sessions
+
+static void rq_init(void){
+    void *m = mmap(NULL, sizeof(*rqs), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if(m != MAP_FAILED) rqs = m;
+}
+// Remove every " key=<value>" from a command line in place.
+static void opt_cut(char *line, const char *key){
+    size_t kl = strlen(key);
+    for(char *p = line; (p = strchr(p, ' ')); p++)
+        if(!strncmp(p+1, key, kl) && p[1+kl]=='='){
+            char *e = p+1+strcspn(p+1, " \r\n");
+            memmove(p, e, strlen(e)+1);
+            p--;                       // look at what moved into place
+        }
+}
+// The command's own aux connections and helpers: what a cancel tears down.
+// An entry may be stale (closed, the number reused) only within the same
+// command, which is being given up as a whole anyway.
+static void rq_track(int fd){
+    int i = __atomic_fetch_add(&rq.nfd, 1, __ATOMIC_RELAXED);
+    if(i < RQ_FDS) __atomic_store_n(&rq.fd[i], fd, __ATOMIC_RELEASE);
+}
+static void rq_child(pid_t pid){
+    int i = __atomic_fetch_add(&rq.npid, 1, __ATOMIC_RELAXED);
+    if(i < RQ_PIDS) __atomic_store_n(&rq.pid[i], pid, __ATOMIC_RELEASE);
+}
+// " dl=<usec>" for a command sent to S2-S4 ("" without a deadline).
+static const char *rq_opt(void){
+    static __thread char o[32];
+    if(!rq.dl) return "";
+    snprintf(o, sizeof(o), " dl=%lld", rq.dl);
+    return o;
+}
+// A transfer stopped with 'left' bytes to go (-1: a stream, unknown): spared
+// work if the command turns out to be cancelled (see rq_end).
+static void rq_saved(long long left){
+    if(!left) return;
+    rq.cut = 1;
+    if(left > 0) rq.saved += left;
+}
+static void rq_cancel(int why){
+    rq.cancel = why;   // counted first: the session can be gone as soon as csd is shut
+    if(rqs) __atomic_add_fetch(why==RQ_GONE ? &rqs->gone : &rqs->expired, 1, __ATOMIC_RELAXED);
+    shutdown(rq.csd, SHUT_RDWR);       // before the backends: no error reply slips out
+    int n = __atomic_load_n(&rq.nfd, __ATOMIC_ACQUIRE), np = __atomic_load_n(&rq.npid, __ATOMIC_ACQUIRE);
+    for(int i=0;i<n && i<RQ_FDS;i++){
+        int fd = __atomic_load_n(&rq.fd[i], __ATOMIC_ACQUIRE);
+        if(fd >= 0) shutdown(fd, SHUT_RDWR);
+    }
+    for(int i=0;i<np && i<RQ_PIDS;i++){
+        pid_t p = __atomic_load_n(&rq.pid[i], __ATOMIC_ACQUIRE);
+        if(p > 0) kill(p, SIGKILL);    // 0: slot taken, pid not stored yet
+    }
+}
+static void *rq_watch(void *arg){
+    (void)arg;
+    for(;;){
+        struct pollfd pf[2] = { { rq.efd, POLLIN, 0 }, { rq.csd, 0, 0 } };   // POLLHUP/POLLERR come anyway
+        int on = rq.active && !rq.cancel, ms = -1;
+        if(on && rq.dl){
+            long long left = rq.dl - now_us();
+            ms = left <= 0 ? 0 : left > 3600000000LL ? 3600000 : (int)((left+999)/1000);
+        }
+        int n = poll(pf, on ? 2 : 1, ms);
+        if(n < 0){ if(errno==EINTR) continue; return NULL; }
+        if(pf[0].revents & POLLIN){ uint64_t v; (void)!read(rq.efd, &v, sizeof(v)); continue; }
+        if(!on || !rq.active) continue;
+        if(n > 0 && (pf[1].revents & (POLLHUP|POLLERR))){
+            unsigned g = rq.gen;
+            struct pollfd e = { rq.efd, POLLIN, 0 };
+            poll(&e, 1, RQ_GRACE);
+            if(rq.active && rq.gen==g && !rq.cancel) rq_cancel(RQ_GONE);
+        }
+        else if(n == 0 && rq.dl && now_us() >= rq.dl) rq_cancel(RQ_EXPIRED);
+    }
+}
+// A command line arrived: take its deadline off and arm the watchdog.
+static void rq_begin(int csd, char *line){
+    char v[24];
+    for(int i=0;i<rq.nfd && i<RQ_FDS;i++) rq.fd[i] = -1;
+    for(int i=0;i<rq.npid && i<RQ_PIDS;i++) rq.pid[i] = 0;
+    rq.nfd = rq.npid = 0; rq.cancel = 0; rq.cut = 0; rq.saved = 0; rq.dl = 0;
+    if(opt_get(line, "deadline", v, sizeof(v))){
+        long long ms = atoll(v);
+        if(ms > 0) rq.dl = now_us() + ms*1000;
+        opt_cut(line, "deadline");
+    }
+    if(!RQ_WATCHDOG) return;
+    if(!rq.started){
+        pthread_t t; pthread_attr_t at; pthread_attr_init(&at);
+        pthread_attr_setdetachstate(&at, PTHREAD_CREATE_DETACHED);
+        pthread_attr_setstacksize(&at, 64<<10);
+        rq.csd = csd;
+        rq.efd = eventfd(0, EFD_CLOEXEC);
+        rq.started = rq.efd >= 0 && pthread_create(&t, &at, rq_watch, NULL)==0 ? 1 : -1;
+        pthread_attr_destroy(&at);
+        // a cancelled command unwinds through EPIPE instead of dying in a write,
+        // so its cleanup and the counters still run
+        if(rq.started > 0) signal(SIGPIPE, SIG_IGN);
+    }
+    if(rq.started < 0) return;
+    snprintf(rq.cmd, sizeof(rq.cmd), "%.*s", (int)strcspn(line, " \r\n"), line);
+    rq.gen++; rq.active = 1;
+    uint64_t one = 1; (void)!write(rq.efd, &one, sizeof(one));
+}
+// The command is over: disarm, and count what a cancel spared. A transfer
+// can also run into the hang-up itself (EPIPE, a reset) before the
+// watchdog's grace is up; that is the same cancel.
+static void rq_end(void){
+    rq.dl = 0;
+    if(!rq.active) return;
+    rq.active = 0;
+    struct pollfd pf = { rq.csd, 0, 0 };
+    if(!rq.cancel && rq.cut && poll(&pf, 1, 0) > 0 && (pf.revents & (POLLHUP|POLLERR))){
+        rq.cancel = RQ_GONE;
+        if(rqs) __atomic_add_fetch(&rqs->gone, 1, __ATOMIC_RELAXED);
+    }
+    if(!rq.cancel) return;
+    if(rqs) __atomic_add_fetch(&rqs->saved, (unsigned long long)rq.saved, __ATOMIC_RELAXED);
+    fprintf(stderr, "S1: cancelled %s pid=%d (%s), %lld bytes not moved\n", rq.cmd, (int)getpid(),
+            rq.cancel==RQ_GONE ? "client gone" : "deadline passed", rq.saved);
+}
+
+/* ---------- sockets to S2/S3/S4 ----------
+   The aux servers run on this host, so S1 first tries their AF_UNIX socket
+   (AUX_SOCK, -DAUX_UNIX=0 to skip it) and falls back to TCP on 127.0.0.1.
+   Over the Unix socket nothing is compressed, and FETCH asks for "fd=1":
+   a large file then comes back as its open descriptor, which S1 sends to the
+   client itself (sendfile), so those bytes never cross the S1<->aux link. */
+#ifndef AUX_UNIX
+#define AUX_UNIX 1
+#endif
+#ifndef AUX_SOCK
+#define AUX_SOCK "/tmp/dfs-%d.sock"   // %d = the aux server's TCP port
+#endif
+
+static int connect_local_port(int port){
+    int th = tr_begin("connect");
+    if(AUX_UNIX){
+        struct sockaddr_un u={0}; u.sun_family = AF_UNIX;
+        snprintf(u.sun_path, sizeof(u.sun_path), AUX_SOCK, port);
+        int sd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if(sd>=0 && connect(sd,(struct sockaddr*)&u,sizeof(u))==0){ tr_end(th); rq_track(sd); return sd; }
+        if(sd>=0) close(sd);
+    }
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sd<0){ tr_end(th); return -1; }
+    struct sockaddr_in a={0};
+    a.sin_family = AF_INET;
+    a.sin_port   = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // 127.0.0.1
+    int rc = connect(sd,(struct sockaddr*)&a,sizeof(a));
+    tr_end(th);
+    if(rc<0){ close(sd); return -1; }
+    int one = 1; setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    rq_track(sd);
+    return sd;
+}
+
+#ifndef AUX_COMP
+#define AUX_COMP 1   // 0 = never compress S1<->aux transfers
+#endif
+static int client_codec = Z_NONE;   // negotiated with COMP for this session
+
+// Codec for sending 'name' to the client.
+static int z_for(const char *name){ return z_skip_ext(name) ? Z_NONE : client_codec; }
+// Codec to offer an aux server: match the client so frames can pass through.
+static int aux_codec(void){ return !AUX_COMP ? Z_NONE : client_codec ? client_codec : Z_LZ4; }
+
+// Connect to an aux server and agree on 'codec' for the connection;
+// *got is what the server accepted (Z_NONE from servers without COMP).
+static int connect_aux(int port, int codec, int *got){
+    *got = Z_NONE;
+    int sd = connect_local_port(port);
+    if(sd<0 || codec==Z_NONE || sock_is_unix(sd)) return sd;   // no point compressing a local copy
+    int th = tr_begin("comp");
+    dprintf(sd, "COMP %s\n", z_names[codec]);
+    char ln[64];
+    ssize_t rn = read_line(sd, ln, sizeof(ln));
+    tr_end(th);
+    if(rn <= 0){ close(sd); return -1; }
+    if(strncmp(ln,"OK ",3)==0){
+        ln[strcspn(ln,"\r\n")] = '\0';
+        int c = z_parse(ln+3); if(c>0) *got = c;
+    }
+    return sd;
+}
+// Forward a framed stream unchanged (both sides use the same codec).
+static int zcopy_frames(int in, int out){
+    static char buf[8+ZBOUND]; unsigned char *h=(unsigned char*)buf;
+    for(;;){
+        if(read_full(in,h,8)<0) return -1;
+        uint32_t raw=be32get(h), wire=be32get(h+4);
+        if(raw>ZCHUNK || wire>raw) return -1;
+        zstat.wire += 8+(long long)wire; zstat.raw += raw;
+        if(raw && read_full(in,buf+8,wire)<0) return -1;
+        if(write_n(out,buf,8+wire)!=(ssize_t)(8+wire)) return -1;   // frame in one write
+        if(raw==0) return 0;
+    }
+}
+
+/* ---------- upload forwarding (.pdf/.txt/.zip) ---------- */
+static int forward_store_file(int port, const char *dest, const char *fname,
+                              const char *local_fullpath, long long size){
+    int in_fd = open(local_fullpath, O_RDONLY);
+    if(in_fd < 0) return -1;
+
+    int zc = Z_NONE;
+    int sd = z_skip_ext(fname) ? connect_local_port(port) : connect_aux(port, aux_codec(), &zc);
+    if(sd < 0){ close(in_fd); return -2; }
+
+    struct zw zw; zw_init(&zw, sd, zc);
+    zw_head(&zw, "STORE %s %s %lld%s%s\n", dest, fname, size, z_opt(zc), tr_opt());
+    char *buf = iob_get(); long long left = size;
+    int rc = buf ? 0 : -3;
+    while(rc == 0 && left > 0){
+        ssize_t r = read(in_fd, buf, (left > IOB_SIZE ? IOB_SIZE : (size_t)left));
+        if(r <= 0) rc = -3;
+        else if(zw_write(&zw, buf, (size_t)r) != 0) rc = -4;
+        else left -= r;
+    }
+    iob_put(buf);
+    close(in_fd);
+    if(rc != 0){ close(sd); return rc; }
+    if(zw_end(&zw) != 0){ close(sd); return -4; }
+
+    char line[256]; ssize_t rn = read_line(sd, line, sizeof(line));
+    close(sd);
+    if(rn <= 0 || strncmp(line,"OK",2)!=0) return -5;
+
+    // success: remove from S1 (client is unaware)
+    unlink(local_fullpath);
+    return 0;
+}
+
+/* Cut-through (default): a routed upload is passed on to the aux server's
+   STORE while it is still arriving, and the client's OK waits for the aux
+   OK, so the bytes never touch S1's disk. The aux STORE answers OK only once
+   the file is fsynced and renamed into place, and keeps the old version if
+   the stream breaks. Only when the aux server can't be
+   reached is the file spooled to S1 and forwarded in the background as
+   before (-DUPLOAD_SPOOL=0 refuses it instead); -DCUT_THROUGH=0 always
+   spools. */
+#ifndef CUT_THROUGH
+#define CUT_THROUGH 1
+#endif
+#ifndef UPLOAD_SPOOL
+#define UPLOAD_SPOOL 1
+#endif
+
+// Returns 0 once the aux server has the file, -1 if it can't be reached
+// and spooling is on (nothing read yet), -2 if the client stream broke,
+// -3 if the aux server failed (the client's bytes were read and dropped).
+static int cut_through_store(int csd, struct zr *zr, int port, const char *dest, const char *fname, long long size){
+    int zc = Z_NONE;
+    int sd = z_skip_ext(fname) ? connect_local_port(port) : connect_aux(port, aux_codec(), &zc);
+    if(sd < 0 && UPLOAD_SPOOL) return -1;
+    int aux_ok = sd >= 0;
+
+    struct zw zw; zw_init(&zw, sd, zc);
+    zw_head(&zw, "STORE %s %s %lld%s%s\n", dest, fname, size, z_opt(zc), tr_opt());
+    char *buf = iob_get(); long long left = size;
+    int rc = buf ? 0 : -2;
+    while(rc == 0 && left > 0){
+        ssize_t r = zr_read(zr, buf, (left > IOB_SIZE ? IOB_SIZE : (size_t)left));
+        if(r <= 0){ rc = -2; break; }
+        if(zr->codec == Z_NONE) qos_charge(csd, r);
+        left -= r;
+        if(aux_ok && zw_write(&zw, buf, (size_t)r) != 0) aux_ok = 0;   // keep reading the client
+    }
+    iob_put(buf);
+    if(rc == 0){
+        zr_finish(zr);
+        char line[256];
+        if(aux_ok && (zw_end(&zw) != 0 || read_line(sd, line, sizeof(line)) <= 0 || strncmp(line, "OK", 2) != 0)) aux_ok = 0;
+    }
+    if(sd >= 0) close(sd);
+    return rc ? rc : aux_ok ? 0 : -3;
+}
+
+/* ---------- direct data path: signed redirects ----------
+   A client that adds "direct=1" to a DOWNLF PATH line or to an UPLOAD SIZE
+   line may be sent to the aux server that holds the file, instead of S1
+   relaying the bytes:
+     REDIRECT <host> <port> <dest> <fname> exp=<unix time> sig=<hex>
+   It then sends "GET <dest> <fname> exp=.. sig=.. [if-none=<tag>]" (or
+   "PUT <dest> <fname> <size> exp=.. sig=.." and the bytes) to that server.
+   The server checks the HMAC-SHA256 of the grant with the key it shares with
+   S1 ($DFS_KEY at start-up) and answers as for FETCH/STORE. There is no
+   built-in key: without $DFS_KEY nothing is redirected. Grants expire after
+   REDIR_TTL seconds. .c and erasure-coded files always
+   go through S1, and so does an upload that replaces an erasure-coded file
+   or a copy S1 keeps itself. An upload that isn't redirected is answered "SEND" and
+   streamed to S1 as before, and clients that never ask keep the proxied
+   path. */
+#ifndef REDIRECT
+#define REDIRECT 1               // 0 = always proxy
+#endif
+#ifndef REDIR_TTL
+#define REDIR_TTL 30
+#endif
+#ifndef AUX_HOST
+#define AUX_HOST "127.0.0.1"     // S2-S4 as clients reach them
+#endif
+
+/* SHA-256 (FIPS 180-4) and HMAC-SHA256 (RFC 2104) */
+static const uint32_t sha_k[64] = {
+    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+    0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+    0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+    0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+    0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+    0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+    0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+    0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2 };
+struct sha256 { uint32_t h[8]; uint64_t len; unsigned char b[64]; size_t n; };
+
+#define SHA_ROR(x,r) (((x)>>(r))|((x)<<(32-(r))))
+static void sha256_block(uint32_t *h, const unsigned char *p){
+    uint32_t w[64], s[8];
+    for(int i=0;i<16;i++) w[i] = be32get(p+4*i);
+    for(int i=16;i<64;i++){
+        uint32_t s0 = SHA_ROR(w[i-15],7)^SHA_ROR(w[i-15],18)^(w[i-15]>>3), s1 = SHA_ROR(w[i-2],17)^SHA_ROR(w[i-2],19)^(w[i-2]>>10);
+        w[i] = w[i-16]+s0+w[i-7]+s1;
+    }
+    memcpy(s, h, sizeof(s));
+    for(int i=0;i<64;i++){
+        uint32_t t1 = s[7]+(SHA_ROR(s[4],6)^SHA_ROR(s[4],11)^SHA_ROR(s[4],25))+((s[4]&s[5])^(~s[4]&s[6]))+sha_k[i]+w[i];
+        uint32_t t2 = (SHA_ROR(s[0],2)^SHA_ROR(s[0],13)^SHA_ROR(s[0],22))+((s[0]&s[1])^(s[0]&s[2])^(s[1]&s[2]));
+        memmove(s+1, s, 7*sizeof(uint32_t));
+        s[4] += t1; s[0] = t1+t2;
+    }
+    for(int i=0;i<8;i++) h[i] += s[i];
+}
+static void sha256_init(struct sha256 *c){
+    static const uint32_t iv[8] = { 0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19 };
+    memcpy(c->h, iv, sizeof(iv)); c->len = 0; c->n = 0;
+}
+static void sha256_update(struct sha256 *c, const void *data, size_t n){
+    const unsigned char *p = data;
+    c->len += n;
+    while(n > 0){
+        size_t k = 64-c->n < n ? 64-c->n : n;
+        memcpy(c->b+c->n, p, k); c->n += k; p += k; n -= k;
+        if(c->n == 64){ sha256_block(c->h, c->b); c->n = 0; }
+    }
+}
+static void sha256_final(struct sha256 *c, unsigned char out[32]){
+    uint64_t bits = c->len*8;
+    unsigned char pad = 0x80, z = 0, lb[8];
+    sha256_update(c, &pad, 1);
+    while(c->n != 56) sha256_update(c, &z, 1);
+    for(int i=0;i<8;i++) lb[i] = (unsigned char)(bits>>(56-8*i));
+    sha256_update(c, lb, 8);
+    for(int i=0;i<8;i++) be32put(out+4*i, c->h[i]);
+}
+static void hmac_sha256(const char *key, const char *msg, unsigned char out[32]){
+    unsigned char k[64] = {0}, ip[64], op[64], ih[32];
+    size_t kl = strlen(key);
+    if(kl > 64){ struct sha256 c; sha256_init(&c); sha256_update(&c, key, kl); sha256_final(&c, k); }
+    else memcpy(k, key, kl);
+    for(int i=0;i<64;i++){ ip[i] = k[i]^0x36; op[i] = k[i]^0x5c; }
+    struct sha256 c;
+    sha256_init(&c); sha256_update(&c, ip, 64); sha256_update(&c, msg, strlen(msg)); sha256_final(&c, ih);
+    sha256_init(&c); sha256_update(&c, op, 64); sha256_update(&c, ih, 32); sha256_final(&c, out);
+}
+
+static const char *redir_key;
+static int redir_on;             // REDIRECT and a key to sign with
+static long long nredirects;     // this session (STATS redirects=)
+
+static void redir_init(void){
+    const char *k = getenv("DFS_KEY");
+    if(k && *k) redir_key = k;
+    redir_on = REDIRECT && redir_key;
+    if(REDIRECT && !redir_key) fprintf(stderr, "S1: $DFS_KEY not set, direct transfers off\n");
+}
+static void redir_sign(char hex[65], const char *msg){
+    unsigned char mac[32]; hmac_sha256(redir_key, msg, mac);
+    for(int i=0;i<32;i++) snprintf(hex+2*i, 3, "%02x", mac[i]);
+}
+static int peer_local(int sd){
+    struct sockaddr_storage a; socklen_t l = sizeof(a);
+    if(getpeername(sd, (struct sockaddr*)&a, &l)<0) return 0;
+    if(a.ss_family==AF_UNIX) return 1;
+    if(a.ss_family==AF_INET) return (ntohl(((struct sockaddr_in*)&a)->sin_addr.s_addr)>>24)==127;
+    if(a.ss_family==AF_INET6){
+        const struct in6_addr *x = &((struct sockaddr_in6*)&a)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(x) || (IN6_IS_ADDR_V4MAPPED(x) && x->s6_addr[12]==127);
+    }
+    return 0;
+}
+// PROFILE from a local peer, or signed with $DFS_KEY: "PROFILE <seconds> <hz> <exp>".
+static int prof_allowed(int csd, const char *args){
+    if(peer_local(csd)) return 1;
+    char ev[24], sig[80], hz[16], msg[96], want[65]; unsigned char d = 0;
+    if(!redir_key || !opt_get(args, "exp", ev, sizeof(ev)) || !opt_get(args, "sig", sig, sizeof(sig)) || strlen(sig)!=64) return 0;
+    long long exp = atoll(ev);
+    if(exp < (long long)time(NULL)) return 0;
+    if(!opt_get(args, "hz", hz, sizeof(hz))) snprintf(hz, sizeof(hz), "%d", PROF_HZ);
+    snprintf(msg, sizeof(msg), "PROFILE %d %d %lld", atoi(args), atoi(hz), exp);
+    redir_sign(want, msg);
+    for(int i=0;i<64;i++) d |= (unsigned char)(want[i]^sig[i]);   // no early exit
+    return !d;
+}
+// Grant a GET (size < 0) or a PUT of size bytes of dest/fname on port.
+static void redir_reply(int csd, int port, const char *dest, const char *fname, long long size){
+    long long exp = (long long)time(NULL) + REDIR_TTL;
+    char msg[1500], sig[65];
+    if(size < 0) snprintf(msg, sizeof(msg), "GET %s %s %lld", dest, fname, exp);
+    else         snprintf(msg, sizeof(msg), "PUT %s %s %lld %lld", dest, fname, size, exp);
+    redir_sign(sig, msg);
+    dprintf(csd, "REDIRECT %s %d %s %s exp=%lld sig=%s\n", AUX_HOST, port, dest, fname, exp, sig);
+    nredirects++;
+}
+
+/* ---------- download helpers ----------
+   Every FILE reply carries the file's version tag ("tag=<size>-<mtime ns>",
+   or "<size>-p<record>" for a packed file, hex; S2-S4 send theirs with
+   FETCH's OK). A DOWNLF PATH line may add
+   "if-none=<tag>": if the file still has that tag the answer is just
+   "SAME <name> tag=<tag>" and no data moves. */
+static void file_tag(char *t, size_t n, long long size, long long mtime_ns){
+    snprintf(t, n, "%llx-%llx", (unsigned long long)size, (unsigned long long)mtime_ns);
+}
+static const char *tag_opt(const char *tag){
+    static char o[64];
+    if(!tag || !*tag) return "";
+    snprintf(o, sizeof(o), " tag=%s", tag);
+    return o;
+}
+// Send an open file as a FILE reply: raw through the copy engine, else framed.
+static int stream_fd(int out, int fd, const char *fname, long long size, const char *tag){
+    int zc = z_for(fname);
+    qos_size(out, size);
+    if(zc == Z_NONE){
+        head_printf(out, size>0, "FILE %s %lld%s\n", fname, size, tag_opt(tag));
+        long long b0 = iostat.bytes;
+        if(xfer_copy(fd, out, size, 0, -1) == size) return 0;
+        rq_saved(size - (iostat.bytes - b0));
+        return -2;
+    }
+    struct zw zw; zw_init(&zw, out, zc);
+    zw_head(&zw, "FILE %s %lld%s%s\n", fname, size, z_opt(zc), tag_opt(tag));
+    char *buf = iob_get(); ssize_t r; long long left = size;
+    int rc = buf ? 0 : -2;
+    while(rc == 0 && (r = read(fd, buf, IOB_SIZE)) > 0){
+        if(zw_write(&zw, buf, (size_t)r) != 0) rc = -2;
+        else left -= r;
+    }
+    iob_put(buf);
+    if(rc != 0){ rq_saved(left); return rc; }
+    return zw_end(&zw)==0 ? 0 : -2;
+}
+static int stream_local_file(int out, const char *absdir, const char *fname, const char *inm){
+    char full[3072]; snprintf(full,sizeof(full), "%s/%s", absdir, fname);
+    int fd = open(full, O_RDONLY);
+    if(fd < 0) return -1;
+    struct stat st; fstat(fd, &st);
+    char tag[48]; file_tag(tag, sizeof(tag), (long long)st.st_size, (long long)st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec);
+    int rc = 0;
+    if(inm && !strcmp(inm, tag)) dprintf(out, "SAME %s tag=%s\n", fname, tag);
+    else rc = stream_fd(out, fd, fname, (long long)st.st_size, tag);
+    close(fd);
+    return rc;
+}
+static int stream_packed_file(int out, const char *dest, const char *fname, const char *inm){
+    char key[PACK_KEYMAX]; pack_key(key,sizeof(key),dest,fname);
+    char *data=NULL; uint64_t ver=0;
+    long long size = pack_get(key, &data, NULL, &ver);
+    if(size < 0) return -1;
+    char tag[48]; snprintf(tag, sizeof(tag), "%llx-p%llx", (unsigned long long)size, (unsigned long long)ver);
+    if(inm && !strcmp(inm, tag)){ free(data); dprintf(out, "SAME %s tag=%s\n", fname, tag); return 0; }
+    qos_size(out, size);   // pack_get() has let go of the pack lock
+    int zc = z_for(fname);
+    struct zw zw; zw_init(&zw, out, zc);
+    zw_head(&zw, "FILE %s %lld%s%s\n", fname, size, z_opt(zc), tag_opt(tag));
+    int rc = zw_write(&zw, data, (size_t)size);
+    free(data);
+    return (rc==0 && zw_end(&zw)==0) ? 0 : -2;
+}
+static int relay_from_aux(int out, int port, const char *dest, const char *fname, const char *inm){
+    int want = z_for(fname), zc = Z_NONE;
+    int sd = want ? connect_aux(port, want, &zc) : connect_local_port(port);
+    if(sd < 0) return -1;
+    int th = tr_begin("aux.fetch");   // until the aux server has the file open
+    int pass = AUX_UNIX && sock_is_unix(sd), ffd = -1;
+    dprintf(sd, "FETCH %s %s%s%s%s%s\n", dest, fname, pass ? " fd=1" : "", inm ? " if-none=" : "", inm ? inm : "", tr_opt());
+
+    char hdr[256]; ssize_t rn = pass ? read_line_fd(sd, hdr, sizeof(hdr), &ffd) : read_line(sd, hdr, sizeof(hdr));
+    tr_end(th);
+    char tag[48] = ""; if(rn > 0) opt_get(hdr, "tag", tag, sizeof(tag));
+    if(rn > 0 && strncmp(hdr, "SAME", 4) == 0){
+        close(sd);
+        dprintf(out, "SAME %s tag=%s\n", fname, tag);
+        return 0;
+    }
+    if(rn <= 0 || strncmp(hdr, "OK ", 3) != 0){ if(ffd>=0) close(ffd); close(sd); return -2; }
+    long long size=0; if(sscanf(hdr+3, "%lld", &size)!=1 || size<0){ if(ffd>=0) close(ffd); close(sd); return -3; }
+    if(ffd >= 0){                     // the aux server handed us its open file
+        close(sd);
+        th = tr_begin("relay.fd");
+        int rc = stream_fd(out, ffd, fname, size, tag);
+        close(ffd);
+        tr_end(th);
+        return rc;
+    }
+    char zv[16]; int in_c = opt_get(hdr, "z", zv, sizeof(zv)) ? z_parse(zv) : Z_NONE;
+    if(in_c < 0){ close(sd); return -3; }
+    qos_size(out, size);
+
+    th = tr_begin("relay");
+    int rc = 0;
+    // same codec on both links: pass the aux server's frames straight through
+    if(want != Z_NONE && in_c == want){
+        head_printf(out, 1, "FILE %s %lld%s%s\n", fname, size, z_opt(want), tag_opt(tag));
+        rc = zcopy_frames(sd, out)==0 ? 0 : -4;
+    }else{
+        struct zr zr; zr_init(&zr, sd, in_c);
+        struct zw zw; zw_init(&zw, out, want);
+        zw_head(&zw, "FILE %s %lld%s%s\n", fname, size, z_opt(want), tag_opt(tag));
+        char *buf = iob_get(); long long left = size;
+        if(!buf) rc = -5;
+        while(left > 0 && rc == 0){
+            ssize_t r = zr_read(&zr, buf, (left > IOB_SIZE ? IOB_SIZE : (size_t)left));
+            if(r <= 0) rc = -4;
+            else if(zw_write(&zw, buf, (size_t)r) != 0) rc = -5;
+            else left -= r;
+        }
+        iob_put(buf);
+        rq_saved(left);
+        if(rc == 0){ zr_finish(&zr); if(zw_end(&zw) != 0) rc = -5; }
+    }
+    close(sd);
+    tr_end(th);
+    return rc;
+}
+
+/* ---------- remove helpers ---------- */
+static int delete_local(const char *dest, const char *fname){
+    char dir[2048]; join_path(dir,sizeof(dir),S1_ROOT,dest);
+    char full[3072]; snprintf(full,sizeof(full), "%s/%s", dir, fname);
+    int rc = unlink(full); // 0 on success
+    char key[PACK_KEYMAX]; pack_key(key,sizeof(key),dest,fname);
+    if(PACKSTORE && pack_del(key)==0) rc = 0;
+    if(rc==0) jnl_add('D', key);
+    return rc;
+}
+static int delete_remote(int port, const char *dest, const char *fname){
+    int sd = connect_local_port(port);
+    if(sd < 0) return -1;
+    int th = tr_begin("aux.delete");
+    dprintf(sd, "DELETE %s %s%s\n", dest, fname, tr_opt());
+    char line[128]; ssize_t rn = read_line(sd, line, sizeof(line));
+    tr_end(th);
+    close(sd);
+    if(rn <= 0) return -2;
+    return (strncmp(line,"OK",2)==0) ? 0 : -3;
+}
+
+/* ---------- erasure-coded large objects ----------
+   With -DEC_K=k (0 = off) a .pdf/.txt/.zip upload of EC_MIN bytes or more
+   is cut into stripes of k EC_BLOCK-byte data blocks plus EC_M Reed-Solomon
+   parity blocks over GF(2^8), and block i of every stripe goes to chunk i,
+   stored as "<dir>/.ec/<name>.<gen>.<i>" on S2, S3 or S4: the file's own
+   server first, one chunk per server, so k+m is at most 3 here. S1 keeps the
+   manifest (<S1 root>/<dir>/.ec/<name>). Every upload writes chunks of a new
+   generation and renames the manifest over the old one only once they are
+   all stored, so a failed upload leaves the previous version readable. DOWNLF fetches the data chunks,
+   takes a parity chunk for each one it can't get and rebuilds the missing
+   blocks; any k chunks will do. The parity rows form a Cauchy matrix, so
+   every k rows of the systematic generator are invertible. Multiply-adds
+   over a region use split-nibble tables with PSHUFB (AVX2 or SSSE3, picked
+   at start-up; -DEC_SIMD=0 for the plain product table). DISPFNAMES lists
+   and REMOVEF removes erasure-coded files, and DOWNLTAR rebuilds them into
+   the archive like DOWNLF. A stored, copied or moved one is journaled
+   ("P"/"D" <dir>/<name> in S1's journal, like a .c file), as is one that
+   REMOVEF takes away, so WATCH and DOWNLTAR since= see them; one replaced by
+   a plain copy is not, its aux server journals that. */
+#ifndef EC_K
+#define EC_K 0
+#endif
+#ifndef EC_M
+#define EC_M 1
+#endif
+#ifndef EC_MIN
+#define EC_MIN (1<<20)
+#endif
+#ifndef EC_BLOCK
+#define EC_BLOCK (64<<10)
+#endif
+#ifndef EC_SIMD
+#define EC_SIMD 1
+#endif
+#define EC_MAXN 3
+#if EC_K && (EC_M < 1 || EC_K+EC_M > EC_MAXN)
+#error "EC_K data + EC_M parity chunks must fit on S2-S4 (EC_M >= 1)"
+#endif
+
+struct ec_man { int k, m, home; long long size, block, gen, mtime; };
+static const int ec_ports[EC_MAXN] = { S2_PORT, S3_PORT, S4_PORT };
+static uint8_t gf_exp[512], gf_log[256], gf_tab[256][256];
+static struct { long long enc, dec, degraded; const char *kern; } ecstat = { 0, 0, 0, "table" };
+
+static int tar_header(int out, const char *name, long long size, long long mtime);
+static int tar_pad(int out, long long size);
+
+static uint8_t gf_inv(uint8_t a){ return gf_exp[255-gf_log[a]]; }
+// dst ^= c*src over n bytes
+static void gf_madd_table(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n){
+    const uint8_t *t = gf_tab[c];
+    for(size_t i=0;i<n;i++) dst[i] ^= t[src[i]];
+}
+static void (*gf_madd)(uint8_t *, const uint8_t *, uint8_t, size_t) = gf_madd_table;
+
+#if EC_SIMD && (defined(__x86_64__) || defined(__i386__))
+// c*x = c*(x & 15) ^ c*(x >> 4 << 4): two 16-entry lookups per byte
+__attribute__((target("ssse3")))
+static void gf_madd_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n){
+    uint8_t lo[16], hi[16];
+    for(int i=0;i<16;i++){ lo[i] = gf_tab[c][i]; hi[i] = gf_tab[c][i<<4]; }
+    __m128i tl = _mm_loadu_si128((const __m128i*)lo), th = _mm_loadu_si128((const __m128i*)hi), mk = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for(; i+16<=n; i+=16){
+        __m128i s = _mm_loadu_si128((const __m128i*)(src+i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tl, _mm_and_si128(s, mk)),
+                                  _mm_shuffle_epi8(th, _mm_and_si128(_mm_srli_epi64(s, 4), mk)));
+        _mm_storeu_si128((__m128i*)(dst+i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(dst+i)), p));
+    }
+    gf_madd_table(dst+i, src+i, c, n-i);
+}
+__attribute__((target("avx2")))
+static void gf_madd_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n){
+    uint8_t lo[16], hi[16];
+    for(int i=0;i<16;i++){ lo[i] = gf_tab[c][i]; hi[i] = gf_tab[c][i<<4]; }
+    __m256i tl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lo));
+    __m256i th = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)hi));
+    __m256i mk = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for(; i+32<=n; i+=32){
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src+i));
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(tl, _mm256_and_si256(s, mk)),
+                                     _mm256_shuffle_epi8(th, _mm256_and_si256(_mm256_srli_epi64(s, 4), mk)));
+        _mm256_storeu_si256((__m256i*)(dst+i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(dst+i)), p));
+    }
+    gf_madd_table(dst+i, src+i, c, n-i);
+}
+#endif
+
+static void ec_init(void){
+    int x = 1;
+    for(int i=0;i<255;i++){
+        gf_exp[i] = gf_exp[i+255] = (uint8_t)x; gf_log[x] = (uint8_t)i;
+        x <<= 1; if(x & 0x100) x ^= 0x11d;
+    }
+    for(int a=1;a<256;a++) for(int b=1;b<256;b++) gf_tab[a][b] = gf_exp[gf_log[a]+gf_log[b]];
+#if EC_SIMD && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))       { gf_madd = gf_madd_avx2;  ecstat.kern = "avx2"; }
+    else if(__builtin_cpu_supports("ssse3")) { gf_madd = gf_madd_ssse3; ecstat.kern = "ssse3"; }
+#endif
+}
+// Generator entry: identity for data rows, Cauchy 1/(row ^ col) for parity rows.
+static uint8_t ec_coef(int k, int row, int col){
+    return row < k ? row == col : gf_inv((uint8_t)(row ^ col));
+}
+// Gauss-Jordan over GF(2^8); -1 if a is singular.
+static int gf_invert(int k, uint8_t a[EC_MAXN][EC_MAXN], uint8_t inv[EC_MAXN][EC_MAXN]){
+    for(int r=0;r<k;r++) for(int c=0;c<k;c++) inv[r][c] = r==c;
+    for(int c=0;c<k;c++){
+        int p = c; while(p<k && !a[p][c]) p++;
+        if(p==k) return -1;
+        for(int j=0;j<k;j++){
+            uint8_t t = a[c][j]; a[c][j] = a[p][j]; a[p][j] = t;
+            t = inv[c][j]; inv[c][j] = inv[p][j]; inv[p][j] = t;
+        }
+        uint8_t s = gf_inv(a[c][c]);
+        for(int j=0;j<k;j++){ a[c][j] = gf_tab[s][a[c][j]]; inv[c][j] = gf_tab[s][inv[c][j]]; }
+        for(int r=0;r<k;r++){
+            uint8_t f = a[r][c];
+            if(r==c || !f) continue;
+            for(int j=0;j<k;j++){ a[r][j] ^= gf_tab[f][a[c][j]]; inv[r][j] ^= gf_tab[f][inv[c][j]]; }
+        }
+    }
+    return 0;
+}
+
+// "<dest>/.ec": where the chunks (aux servers) and manifests (S1) of dest live.
+static void ec_dir(char *d, size_t n, const char *dest){
+    size_t l = strlen(dest);
+    snprintf(d, n, "%s%s.ec", dest, l && dest[l-1]=='/' ? "" : "/");
+}
+static void ec_man_path(char *p, size_t n, const char *dest, const char *fname){
+    char ed[1100], dir[2048]; ec_dir(ed, sizeof(ed), dest);
+    join_path(dir, sizeof(dir), S1_ROOT, ed);
+    snprintf(p, n, "%s/%s", dir, fname);
+}
+// Manifest of dest/fname and its version tag; -1 if the file isn't erasure-coded.
+static int ec_read_man(const char *dest, const char *fname, struct ec_man *mf, char *tag, size_t tsz){
+    char mp[3200]; ec_man_path(mp, sizeof(mp), dest, fname);
+    FILE *f = fopen(mp, "r");
+    if(!f) return -1;
+    struct stat st; fstat(fileno(f), &st);
+    mf->gen = 0;   // no generation: chunks written before there were any
+    int ok = fscanf(f, "EC %d %d %lld %lld %d %llx", &mf->k, &mf->m, &mf->size, &mf->block, &mf->home, (unsigned long long *)&mf->gen) >= 5;
+    fclose(f);
+    mf->mtime = (long long)st.st_mtime;
+    if(!ok || mf->k<1 || mf->m<0 || mf->k+mf->m>EC_MAXN || mf->home<0 || mf->home>=EC_MAXN ||
+       mf->size<0 || mf->block<1 || mf->block>(64<<20)) return -1;
+    if(tag) file_tag(tag, tsz, mf->size, (long long)st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec);
+    return 0;
+}
+// Name of chunk j of generation gen of fname.
+static void ec_chunk(char *cn, size_t n, const char *fname, long long gen, int j){
+    if(gen) snprintf(cn, n, "%s.%llx.%d", fname, (unsigned long long)gen, j);
+    else    snprintf(cn, n, "%s.%d", fname, j);
+}
+static void ec_unstore(const char *ed, const char *fname, int home, int n, long long gen){
+    char cn[300];
+    for(int j=0;j<n;j++){
+        ec_chunk(cn, sizeof(cn), fname, gen, j);
+        (void)delete_remote(ec_ports[(home+j)%EC_MAXN], ed, cn);
+    }
+}
+// Forget dest/fname as an erasure-coded file: manifest first, then its chunks.
+// 'gone': the file is removed, not replaced, so its deletion is journaled.
+// 0 if it was one.
+static int ec_drop(const char *dest, const char *fname, int gone){
+    struct ec_man mf;
+    if(ec_read_man(dest, fname, &mf, NULL, 0) != 0) return -1;
+    char mp[3200], ed[1100]; ec_man_path(mp, sizeof(mp), dest, fname); ec_dir(ed, sizeof(ed), dest);
+    if(unlink(mp) != 0) return -1;
+    if(gone){ char key[PACK_KEYMAX]; pack_key(key, sizeof(key), dest, fname); jnl_add('D', key); }
+    ec_unstore(ed, fname, mf.home, mf.k+mf.m, mf.gen);
+    return 0;
+}
+
+// UPLOAD of a large routed file. Returns like cut_through_store(): 0 stored,
+// -1 a chunk server can't be reached (nothing read yet), -2 the client stream
+// broke, -3 a chunk server failed (the client's bytes were read and dropped).
+// On any failure an older version of the file is left as it was.
+static int ec_store(int csd, struct zr *zr, int port, const char *dest, const char *fname, long long size){
+    int k = EC_K, n = EC_K+EC_M, home = 0, sd[EC_MAXN];
+    while(home<EC_MAXN-1 && ec_ports[home]!=port) home++;
+    char ed[1100], cn[300]; ec_dir(ed, sizeof(ed), dest);
+    long long stripes = (size + (long long)k*EC_BLOCK - 1) / ((long long)k*EC_BLOCK), gen = now_us();
+    for(int j=0;j<n;j++){
+        if((sd[j] = connect_local_port(ec_ports[(home+j)%EC_MAXN])) < 0){
+            while(j--) close(sd[j]);
+            return -1;
+        }
+        ec_chunk(cn, sizeof(cn), fname, gen, j);
+        head_printf(sd[j], 1, "STORE %s %s %lld%s\n", ed, cn, stripes*EC_BLOCK, tr_opt());
+    }
+    uint8_t *st = NULL;
+    int rc = posix_memalign((void**)&st, 64, (size_t)n*EC_BLOCK) ? -2 : 0, aux_ok = 1;
+    long long left = size;
+    for(long long s=0; s<stripes && rc==0; s++){
+        size_t want = left < (long long)k*EC_BLOCK ? (size_t)left : (size_t)k*EC_BLOCK, got = 0;
+        while(got < want){
+            ssize_t r = zr_read(zr, st+got, want-got);
+            if(r <= 0){ rc = -2; break; }
+            if(zr->codec == Z_NONE) qos_charge(csd, r);
+            got += (size_t)r;
+        }
+        if(rc) break;
+        left -= (long long)want;
+        memset(st+want, 0, (size_t)n*EC_BLOCK - want);   // padding of the last stripe, parity accumulators
+        if(aux_ok){
+            for(int i=k;i<n;i++)
+                for(int j=0;j<k;j++) gf_madd(st+(size_t)i*EC_BLOCK, st+(size_t)j*EC_BLOCK, ec_coef(k, i, j), EC_BLOCK);
+            ecstat.enc += (long long)k*EC_BLOCK;
+        }
+        for(int j=0;j<n && aux_ok;j++)
+            if(write_n(sd[j], st+(size_t)j*EC_BLOCK, EC_BLOCK) != EC_BLOCK) aux_ok = 0;   // keep reading the client
+    }
+    free(st);
+    if(rc == 0){
+        zr_finish(zr);
+        char line[256];
+        for(int j=0;j<n && aux_ok;j++)
+            if(read_line(sd[j], line, sizeof(line)) <= 0 || strncmp(line, "OK", 2) != 0) aux_ok = 0;
+    }
+    for(int j=0;j<n;j++) close(sd[j]);
+    if(rc) return rc;   // no chunk server got all its bytes, so none kept them
+
+    char mp[3200], tmp[3300], md[2048];
+    ec_man_path(mp, sizeof(mp), dest, fname);
+    join_path(md, sizeof(md), S1_ROOT, ed);
+    snprintf(tmp, sizeof(tmp), "%s/.%s.%d", md, fname, (int)getpid());
+    struct ec_man old; int had = ec_read_man(dest, fname, &old, NULL, 0) == 0;
+    FILE *f = aux_ok && ensure_dir(md) == 0 ? fopen(tmp, "w") : NULL;
+    if(f){
+        int w = fprintf(f, "EC %d %d %lld %d %d %llx\n", k, EC_M, size, EC_BLOCK, home, (unsigned long long)gen) > 0;
+        if(fflush(f) != 0 || fsync(fileno(f)) != 0) w = 0;
+        if(fclose(f) != 0 || !w || rename(tmp, mp) != 0){ unlink(tmp); f = NULL; }
+    }
+    if(!f){
+        ec_unstore(ed, fname, home, n, gen);   // some servers may have kept theirs
+        return -3;
+    }
+    int dd = open(md, O_RDONLY|O_DIRECTORY);
+    if(dd >= 0){ fsync(dd); close(dd); }
+    if(had && old.gen != gen) ec_unstore(ed, fname, old.home, old.k+old.m, old.gen);
+    (void)delete_remote(port, dest, fname);   // a plain copy from before is stale now
+    char key[PACK_KEYMAX]; pack_key(key, sizeof(key), dest, fname);
+    jnl_add('P', key);                        // after that DELETE, which its server journals
+    return 0;
+}
+
+// Rebuild erasure-coded dest/fname (manifest mf) onto out: as a DOWNLF
+// reply with version tag, or as the tar entry tarname if that isn't NULL.
+// Nothing is written if k chunks can't be had. 0 sent, -2 failed.
+static int ec_send(int out, const char *dest, const char *fname, const struct ec_man *m, const char *tag, const char *tarname){
+    struct ec_man mf = *m;
+    char ed[1100], cn[300]; ec_dir(ed, sizeof(ed), dest);
+    int k = mf.k, n = mf.k+mf.m, sd[EC_MAXN], idx[EC_MAXN], have = 0;
+    long long B = mf.block, stripes = (mf.size + k*B - 1) / (k*B);
+
+    // the first k chunks that answer: all the data chunks unless one is missing
+    int th = tr_begin("aux.fetch");
+    for(int j=0;j<n && have<k;j++){
+        int s = connect_local_port(ec_ports[(mf.home+j)%EC_MAXN]);
+        if(s < 0) continue;
+        ec_chunk(cn, sizeof(cn), fname, mf.gen, j);
+        dprintf(s, "FETCH %s %s%s\n", ed, cn, tr_opt());
+        char hdr[256]; long long sz = -1;
+        if(read_line(s, hdr, sizeof(hdr)) <= 0 || strncmp(hdr, "OK ", 3) != 0 ||
+           sscanf(hdr+3, "%lld", &sz) != 1 || sz != stripes*B){ close(s); continue; }
+        sd[have] = s; idx[have++] = j;
+    }
+    tr_end(th);
+    uint8_t a[EC_MAXN][EC_MAXN], inv[EC_MAXN][EC_MAXN], *in = NULL;
+    int degraded = have == k && idx[k-1] != k-1, pos[EC_MAXN];
+    for(int r=0;r<have;r++) for(int c=0;c<k;c++) a[r][c] = ec_coef(k, idx[r], c);
+    if(have < k || (degraded && gf_invert(k, a, inv) != 0) || posix_memalign((void**)&in, 64, (size_t)(k+1)*B)){
+        while(have--) close(sd[have]);
+        return -2;
+    }
+    for(int j=0;j<k;j++){ pos[j] = -1; for(int r=0;r<k;r++) if(idx[r]==j) pos[j] = r; }
+    if(degraded) ecstat.degraded++;
+
+    th = tr_begin(degraded ? "ec.rebuild" : "relay");
+    int zc = tarname ? Z_NONE : z_for(fname), rc = 0;
+    qos_size(out, mf.size);
+    struct zw zw; zw_init(&zw, out, zc);
+    if(!tarname) zw_head(&zw, "FILE %s %lld%s%s\n", fname, mf.size, z_opt(zc), tag_opt(tag));
+    else if(tar_header(out, tarname, mf.size, mf.mtime) != 0) rc = -2;
+    uint8_t *rb = in + (size_t)k*B;
+    long long left = mf.size;
+    for(long long s=0; s<stripes && rc==0; s++){
+        for(int r=0;r<k && rc==0;r++) if(read_full(sd[r], in+(size_t)r*B, (size_t)B) < 0) rc = -2;
+        for(int j=0;j<k && rc==0 && left>0;j++){
+            const uint8_t *blk = pos[j] >= 0 ? in + (size_t)pos[j]*B : rb;
+            if(pos[j] < 0){
+                memset(rb, 0, (size_t)B);
+                for(int r=0;r<k;r++) if(inv[j][r]) gf_madd(rb, in+(size_t)r*B, inv[j][r], (size_t)B);
+                ecstat.dec += B;
+            }
+            size_t w = left < B ? (size_t)left : (size_t)B;
+            if(zw_write(&zw, blk, w) != 0) rc = -2;
+            left -= (long long)w;
+        }
+    }
+    free(in);
+    for(int r=0;r<k;r++) close(sd[r]);
+    if(rc == 0 && zw_end(&zw) != 0) rc = -2;
+    if(rc == 0 && tarname && tar_pad(out, mf.size) != 0) rc = -2;
+    tr_end(th);
+    return rc;
+}
+// DOWNLF of an erasure-coded file: -1 if dest/fname isn't one, 0 sent, -2 failed.
+static int ec_fetch(int out, const char *dest, const char *fname, const char *inm){
+    struct ec_man mf; char tag[48];
+    if(ec_read_man(dest, fname, &mf, tag, sizeof(tag)) != 0) return -1;
+    if(inm && !strcmp(inm, tag)){ dprintf(out, "SAME %s tag=%s\n", fname, tag); return 0; }
+    return ec_send(out, dest, fname, &mf, tag, NULL);
+}
+
+static int ec_cmp(const void *a, const void *b){ return strcmp(*(char *const*)a, *(char *const*)b); }
+// Add dest's erasure-coded files with extension ext to a sorted listing of n names.
+static int ec_list(const char *dest, const char *ext, char ***names, int n){
+    char ed[1100], dir[2048]; ec_dir(ed, sizeof(ed), dest);
+    join_path(dir, sizeof(dir), S1_ROOT, ed);
+    DIR *dp = opendir(dir);
+    if(!dp) return n;
+    char **v = *names; int cnt = n, cap = n;
+    struct dirent *de;
+    while((de = readdir(dp))){
+        if(de->d_name[0]=='.') continue;
+        const char *dot = strrchr(de->d_name, '.'), *nm = de->d_name;
+        if(!dot || strcasecmp(dot, ext) || (n && bsearch(&nm, v, (size_t)n, sizeof(char*), ec_cmp))) continue;
+        if(arena_push(&v, &cnt, &cap, nm) != 0) break;
+    }
+    closedir(dp);
+    if(cnt > n) qsort(v, (size_t)cnt, sizeof(char*), ec_cmp);
+    *names = v;
+    return cnt;
+}
+
+/* ---------- hot/cold tiering of routed files ----------
+   S2-S4 stay the home of .pdf/.txt/.zip files, but S1 keeps local copies
+   of the ones read most (<S1 root>/.hot, TIER_BYTES in all) and answers
+   DOWNLF for those from its own disk. Reads are counted in a count-min
+   sketch in shared memory (TIER_DEPTH rows of TIER_WIDTH saturating 16-bit
+   counters, conservative update), halved every TIER_DECAY reads so that
+   old popularity fades. Once a file's estimate reaches TIER_HOT a
+   background child copies it in; with the budget full it replaces the
+   coldest resident copy, and only one estimated colder than itself. At
+   each halving, copies estimated below TIER_COLD are dropped (demoted: the
+   aux server still has the file). UPLOAD and REMOVEF drop a name's copy
+   first and again once the change is done, and a copy-in that overlapped a
+   drop is discarded. A redirected PUT never passes through S1, so while
+   redirects are on a copy is only served after the aux server confirmed
+   its version tag (FETCH if-none=). Erasure-coded files are not tiered. */
+#ifndef TIER_BYTES
+#define TIER_BYTES (256LL<<20)   // 0 = off
+#endif
+#ifndef TIER_MAX_FILE
+#define TIER_MAX_FILE (64LL<<20)
+#endif
+#ifndef TIER_HOT
+#define TIER_HOT 8
+#endif
+#ifndef TIER_COLD
+#define TIER_COLD 2
+#endif
+#ifndef TIER_DECAY
+#define TIER_DECAY 4096
+#endif
+#define TIER_WIDTH 4096
+#define TIER_DEPTH 4
+#define TIER_SLOTS 256
+
+struct tslot { uint64_t h; long long size, used; int state; char tag[48], key[512]; };   // state: 0 free, 1 copying in, 2 resident
+static struct tier {
+    pthread_mutex_t mu;
+    uint16_t cms[TIER_DEPTH][TIER_WIDTH];
+    unsigned reads;
+    unsigned long long drops, tick, hits, promoted, demoted;   // drops: every tier_drop(), for copy-ins in flight
+    long long bytes;
+    struct tslot s[TIER_SLOTS];
+} *tier;
+
+static void tier_lock(void){
+    if(pthread_mutex_lock(&tier->mu)==EOWNERDEAD) pthread_mutex_consistent(&tier->mu);
+}
+static void tier_init(void){
+    if(TIER_BYTES<=0) return;
+    struct tier *m = mmap(NULL, sizeof(*tier), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if(m==MAP_FAILED) return;
+    pthread_mutexattr_t at; pthread_mutexattr_init(&at);
+    pthread_mutexattr_setpshared(&at, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&at, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&m->mu, &at);
+    pthread_mutexattr_destroy(&at);
+    tier = m;
+    char d[1100]; snprintf(d, sizeof(d), "%s/.hot", S1_ROOT);
+    ensure_dir(d);
+    DIR *dp = opendir(d);   // copies from an earlier run aren't in the table
+    struct dirent *de;
+    while(dp && (de = readdir(dp))) if(de->d_name[0]!='.') unlinkat(dirfd(dp), de->d_name, 0);
+    if(dp) closedir(dp);
+}
+static void tier_path(char *p, size_t n, uint64_t h){
+    snprintf(p, n, "%s/.hot/%016llx", S1_ROOT, (unsigned long long)h);
+}
+static unsigned tier_col(uint64_t h, int d){ return (unsigned)((uint32_t)h + (uint32_t)d*(uint32_t)(h>>32)) % TIER_WIDTH; }
+static unsigned tier_est(uint64_t h){
+    unsigned e = 0xffff;
+    for(int d=0;d<TIER_DEPTH;d++) if(tier->cms[d][tier_col(h,d)] < e) e = tier->cms[d][tier_col(h,d)];
+    return e;
+}
+static struct tslot *tier_find(uint64_t h, const char *key){
+    for(int i=0;i<TIER_SLOTS;i++)
+        if(tier->s[i].state && tier->s[i].h==h && !strcmp(tier->s[i].key, key)) return &tier->s[i];
+    return NULL;
+}
+// Free a resident slot (lock held).
+static void tier_evict(struct tslot *s){
+    char p[1200]; tier_path(p, sizeof(p), s->h);
+    unlink(p);
+    tier->bytes -= s->size; tier->demoted++;
+    s->state = 0;
+}
+// Count one read of key; returns the new estimate.
+static unsigned tier_count(uint64_t h){
+    unsigned e = tier_est(h);
+    for(int d=0;d<TIER_DEPTH;d++){
+        uint16_t *c = &tier->cms[d][tier_col(h,d)];
+        if(*c==e && e<0xffff) (*c)++;
+    }
+    if(++tier->reads >= TIER_DECAY){
+        tier->reads = 0;
+        for(int d=0;d<TIER_DEPTH;d++) for(int i=0;i<TIER_WIDTH;i++) tier->cms[d][i] >>= 1;
+        for(int i=0;i<TIER_SLOTS;i++)
+            if(tier->s[i].state==2 && tier_est(tier->s[i].h) < TIER_COLD) tier_evict(&tier->s[i]);
+    }
+    return e < 0xffff ? e+1 : e;
+}
+
+// Forget S1's copy of key, if any (the file is about to change or just did).
+static void tier_drop(const char *key){
+    if(!tier) return;
+    uint64_t h = fnv1a(key);
+    tier_lock();
+    tier->drops++;
+    struct tslot *s = tier_find(h, key);
+    if(s && s->state==2) tier_evict(s);
+    else if(s) s->state = 0;               // its copy-in will see drops move and give up
+    pthread_mutex_unlock(&tier->mu);
+}
+// 0 if the aux server on port still has version tag of dest/fname.
+static int tier_check(int port, const char *dest, const char *fname, const char *tag){
+    int sd = connect_local_port(port);
+    if(sd < 0) return -1;
+    dprintf(sd, "FETCH %s %s if-none=%s%s\n", dest, fname, tag, tr_opt());
+    char hdr[256];
+    int rc = read_line(sd, hdr, sizeof(hdr)) > 0 && strncmp(hdr, "SAME", 4) == 0 ? 0 : -1;
+    close(sd);   // a changed file: its bytes are not read
+    return rc;
+}
+// DOWNLF of a routed file: serve S1's copy if it has one (0, or -2 when the
+// client stream broke); -1 if not, with *promote set when it is hot enough.
+static int tier_serve(int out, int port, const char *dest, const char *key, const char *fname, const char *inm, int *promote){
+    *promote = 0;
+    if(!tier || strlen(key) >= sizeof(tier->s[0].key)) return -1;
+    uint64_t h = fnv1a(key);
+    char tag[48]; long long size = -1;
+    tier_lock();
+    unsigned est = tier_count(h);
+    struct tslot *s = tier_find(h, key);
+    if(s && s->state==2){
+        snprintf(tag, sizeof(tag), "%s", s->tag); size = s->size;
+        s->used = ++tier->tick; tier->hits++;
+    }
+    else if(!s && est >= TIER_HOT) *promote = 1;
+    pthread_mutex_unlock(&tier->mu);
+    if(size < 0) return -1;
+    if(redir_on && tier_check(port, dest, fname, tag) != 0){ tier_drop(key); return -1; }
+    if(inm && !strcmp(inm, tag)){ dprintf(out, "SAME %s tag=%s\n", fname, tag); return 0; }
+    char p[1200]; tier_path(p, sizeof(p), h);
+    int fd = open(p, O_RDONLY);
+    if(fd < 0) return -1;                  // dropped meanwhile: go to the aux server
+    int th = tr_begin("send.hot");
+    int rc = stream_fd(out, fd, fname, size, tag);
+    tr_end(th);
+    close(fd);
+    return rc ? -2 : 0;
+}
+// Copy dest/fname in from its aux server in a background child.
+static void tier_promote(int port, const char *dest, const char *fname, const char *key){
+    uint64_t h = fnv1a(key);
+    struct tslot *s = NULL;
+    tier_lock();
+    if(!tier_find(h, key))
+        for(int i=0;i<TIER_SLOTS && !s;i++) if(!tier->s[i].state) s = &tier->s[i];
+    if(s){ s->state = 1; s->h = h; s->size = 0; s->tag[0] = '\0'; snprintf(s->key, sizeof(s->key), "%s", key); }
+    unsigned long long drops = tier->drops;
+    pthread_mutex_unlock(&tier->mu);
+    if(!s) return;
+    pid_t pid = fork();
+    if(pid < 0){ tier_lock(); s->state = 0; pthread_mutex_unlock(&tier->mu); }
+    if(pid != 0) return;
+
+    tr_child();
+    close(qsess.fd); qsess.fd = -1;   // don't hold the client's connection open
+    int th = tr_begin("tier.promote");
+    char p[1200], tmp[1300]; tier_path(p, sizeof(p), h);
+    snprintf(tmp, sizeof(tmp), "%s.%d", p, (int)getpid());
+    char hdr[256], tag[48] = ""; long long size = -1; int ffd = -1, ok = 0;
+    int sd = connect_local_port(port);
+    if(sd >= 0){
+        int pass = AUX_UNIX && sock_is_unix(sd);
+        dprintf(sd, "FETCH %s %s%s%s\n", dest, fname, pass ? " fd=1" : "", tr_opt());
+        if((pass ? read_line_fd(sd, hdr, sizeof(hdr), &ffd) : read_line(sd, hdr, sizeof(hdr))) > 0 &&
+           strncmp(hdr, "OK ", 3)==0 && sscanf(hdr+3, "%lld", &size)==1 && size>=0 && size<=TIER_MAX_FILE &&
+           size<=TIER_BYTES && !strstr(hdr, " z=")){
+            opt_get(hdr, "tag", tag, sizeof(tag));
+            int fd = open(tmp, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+            if(fd >= 0){
+                ok = (ffd>=0 ? xfer_copy(ffd, fd, size, 0, 0) : xfer_copy(sd, fd, size, -1, 0)) == size;
+                if(close(fd) != 0) ok = 0;
+            }
+        }
+        if(ffd >= 0) close(ffd);
+        close(sd);
+    }
+    tier_lock();
+    if(ok && s->state==1 && tier->drops==drops && !strcmp(s->key, key)){
+        unsigned est = tier_est(h);
+        while(tier->bytes + size > TIER_BYTES){   // make room: coldest resident copy, if colder than this one
+            struct tslot *v = NULL; unsigned ve = 0;
+            for(int i=0;i<TIER_SLOTS;i++){
+                struct tslot *c = &tier->s[i];
+                if(c->state!=2) continue;
+                unsigned e = tier_est(c->h);
+                if(!v || e<ve || (e==ve && c->used<v->used)){ v = c; ve = e; }
+            }
+            if(!v || ve >= est){ ok = 0; break; }
+            tier_evict(v);
+        }
+    }else ok = 0;
+    if(ok && rename(tmp, p)==0){
+        s->size = size; snprintf(s->tag, sizeof(s->tag), "%s", tag);
+        s->used = ++tier->tick; s->state = 2;
+        tier->bytes += size; tier->promoted++;
+    }else{
+        unlink(tmp);
+        if(s->state==1 && !strcmp(s->key, key)) s->state = 0;
+    }
+    pthread_mutex_unlock(&tier->mu);
+    tr_end(th);
+    tr_finish();
+    _exit(0);
+}
+
+/* ---------- tar helpers (downltar) — robust `.c` path ---------- */
+static int ends_with_ext(const char *name, const char *ext){
+    size_t ln=strlen(name), le=strlen(ext);
+    if(le==0 || ln<le) return 0;
+    return strcasecmp(name+ln-le, ext)==0;
+}
+
+/* ---------- minimal ustar writer ---------- */
+static int tar_header(int out, const char *name, long long size, long long mtime){
+    char h[512]; memset(h,0,sizeof(h));
+    size_t ln=strlen(name);
+    const char *base=name; size_t plen=0;
+    if(ln>99){   // split into prefix/name at a '/'
+        const char *s=name+ln-100;
+        while(*s && *s!='/') s++;
+        if(!*s || (size_t)(s-name)>155) return -1;
+        plen=(size_t)(s-name); base=s+1;
+    }
+    memcpy(h, base, strlen(base));
+    snprintf(h+100, 8,  "%07o", 0664);
+    snprintf(h+108, 8,  "%07o", 0);
+    snprintf(h+116, 8,  "%07o", 0);
+    snprintf(h+124, 12, "%011llo", size);
+    snprintf(h+136, 12, "%011llo", mtime);
+    memset(h+148, ' ', 8);
+    h[156]='0';
+    memcpy(h+257, "ustar", 6); memcpy(h+263, "00", 2);
+    if(plen) memcpy(h+345, name, plen);
+    unsigned sum=0; for(int i=0;i<512;i++) sum += (unsigned char)h[i];
+    snprintf(h+148, 8, "%06o", sum); h[155]=' ';
+    return write_n(out,h,512)==512 ? 0 : -1;
+}
+static int tar_pad(int out, long long size){
+    static const char z[1024];
+    size_t pad = (size_t)((512 - size%512) % 512);
+    return (pad==0 || write_n(out,z,pad)==(ssize_t)pad) ? 0 : -1;
+}
+static int tar_finish(int out){
+    static const char z[1024];
+    return write_n(out,z,sizeof(z))==(ssize_t)sizeof(z) ? 0 : -1;
+}
+// Copy exactly 'size' bytes of 'fd' as an entry body (zero-filled if the file shrank).
+static int tar_copy_fd(int out, int fd, long long size){
+    char *buf = iob_get(); if(!buf) return -1;
+    long long left=size; int rc=0;
+    while(left>0 && rc==0){
+        size_t want = left>IOB_SIZE ? IOB_SIZE : (size_t)left;
+        ssize_t r = read(fd,buf,want);
+        if(r<=0){ memset(buf,0,want); r=(ssize_t)want; }
+        if(write_n(out,buf,(size_t)r)!=r) rc=-1;
+        left -= r;
+    }
+    iob_put(buf);
+    return rc ? rc : tar_pad(out,size);
+}
+// 'sub' limits an archive to one subtree ("" = everything).
+static int in_subtree(const char *path, const char *sub){
+    size_t n=strlen(sub);
+    return n==0 || (strncmp(path,sub,n)==0 && path[n]=='/');
+}
+// Emit every live packed file under 'sub' ending with 'ext' as a tar entry.
+static int tar_pack_entries(int out, const char *ext, const char *sub){
+    if(!PACKSTORE) return 0;
+    if(pack_lock(LOCK_SH)<0) return -1;
+    pack_sync();
+    int rc=0; uint32_t openseg=0; int fd=-1;
+    for(size_t i=0;i<pk.cap && rc==0;i++){
+        struct pack_ent *e=&pk.tab[i];
+        if(!e->key || !e->live || !ends_with_ext(e->key,ext) || !in_subtree(e->key,sub)) continue;
+        if(fd<0 || openseg!=e->seg){
+            if(fd>=0) close(fd);
+            char p[2200]; seg_path(p,sizeof(p),e->seg);
+            fd=open(p,O_RDONLY); openseg=e->seg;
+            if(fd<0) continue;
+        }
+        if(tar_header(out,e->key,e->size,e->mtime)<0) continue;
+        if(lseek(fd,e->off,SEEK_SET)<0 || tar_copy_fd(out,fd,e->size)<0) rc=-1;
+    }
+    if(fd>=0) close(fd);
+    pack_lock(LOCK_UN);
+    return rc;
+}
+
+/* ---------- parallel tree walker (tar file lists) ----------
+   walk_tree() lists the regular files under root/sub ending in 'ext'. Each
+   directory is a task read through a fd opened relative to its parent
+   (openat + fdopendir); d_type is trusted, so fstatat only runs for
+   DT_UNKNOWN and no absolute paths are built. Tasks sit in per-thread
+   deques: the owner works depth-first from the tail, idle threads steal from
+   the head, and a thread that finds nothing to steal sleeps until a task is
+   queued or the walk is over. The result is sorted, so the tar order does not depend on
+   scheduling. Dot entries (.pack, .journal, ...) are skipped. While a
+   metadata snapshot is current the answer comes from it instead. */
+#ifndef WALK_THREADS
+#define WALK_THREADS 0     // 0 = one per online CPU, at most 16
+#endif
+#define WALK_FDMAX 256     // queued directories kept open; beyond that reopened by path
+
+struct wtask { int fd; char *rel; };
+struct wdeque { pthread_mutex_t mu; struct wtask *t; int head, tail, cap; };
+struct wlist { char **v; int n, cap; };
+static struct {
+    int rootfd, nthreads; const char *ext;
+    struct wdeque *dq; struct wlist *out;
+    int pending, openfds;            // atomics: tasks queued or running / queued fds
+    int queued, sleepers;            // atomics: tasks in the deques / threads waiting on cv
+    pthread_mutex_t mu; pthread_cond_t cv;
+} wk;
+
+static void wlist_add(struct wlist *l, char *s){
+    if(l->n==l->cap){
+        int nc = l->cap ? l->cap*2 : 256;
+        char **nv = realloc(l->v, (size_t)nc*sizeof(*nv));
+        if(!nv){ free(s); return; }
+        l->v = nv; l->cap = nc;
+    }
+    l->v[l->n++] = s;
+}
+static int wq_push(int self, struct wtask t){
+    struct wdeque *q = &wk.dq[self];
+    pthread_mutex_lock(&q->mu);
+    if(q->tail==q->cap){
+        if(q->head>0){ memmove(q->t, q->t+q->head, (size_t)(q->tail-q->head)*sizeof(*q->t)); q->tail -= q->head; q->head = 0; }
+        if(q->tail==q->cap){
+            int nc = q->cap ? q->cap*2 : 64;
+            struct wtask *nt = realloc(q->t, (size_t)nc*sizeof(*nt));
+            if(!nt){ pthread_mutex_unlock(&q->mu); return -1; }
+            q->t = nt; q->cap = nc;
+        }
+    }
+    q->t[q->tail++] = t;
+    pthread_mutex_unlock(&q->mu);
+    __atomic_add_fetch(&wk.queued, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&wk.sleepers, __ATOMIC_SEQ_CST)){
+        pthread_mutex_lock(&wk.mu); pthread_cond_signal(&wk.cv); pthread_mutex_unlock(&wk.mu);
+    }
+    return 0;
+}
+static int wq_take(int who, int own, struct wtask *t){
+    struct wdeque *q = &wk.dq[who];
+    int got = 0;
+    pthread_mutex_lock(&q->mu);
+    if(q->tail>q->head){ *t = own ? q->t[--q->tail] : q->t[q->head++]; got = 1; }
+    pthread_mutex_unlock(&q->mu);
+    if(got) __atomic_sub_fetch(&wk.queued, 1, __ATOMIC_SEQ_CST);
+    return got;
+}
+static void walk_dir(int self, struct wtask t){
+    int fd = t.fd>=0 ? t.fd : openat(wk.rootfd, *t.rel ? t.rel : ".", O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if(t.fd>=0) __atomic_sub_fetch(&wk.openfds, 1, __ATOMIC_RELAXED);
+    DIR *dp = fd>=0 ? fdopendir(fd) : NULL;
+    if(!dp){ if(fd>=0) close(fd); free(t.rel); return; }
+    size_t rl = strlen(t.rel), el = strlen(wk.ext);
+    struct dirent *de;
+    while((de=readdir(dp))){
+        if(de->d_name[0]=='.') continue;
+        int type = de->d_type;
+        if(type==DT_UNKNOWN){
+            struct stat st;
+            if(fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)<0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+        }
+        if(type!=DT_DIR && type!=DT_REG) continue;
+        size_t nl = strlen(de->d_name);
+        if(type==DT_REG && (nl<el || strcasecmp(de->d_name+nl-el, wk.ext)!=0)) continue;
+        char *rel = malloc(rl+nl+2);
+        if(!rel) continue;
+        if(rl){ memcpy(rel, t.rel, rl); rel[rl] = '/'; memcpy(rel+rl+1, de->d_name, nl+1); }
+        else memcpy(rel, de->d_name, nl+1);
+        if(type==DT_REG){ wlist_add(&wk.out[self], rel); continue; }
+        struct wtask c = { -1, rel };
+        if(__atomic_add_fetch(&wk.openfds, 1, __ATOMIC_RELAXED) <= WALK_FDMAX)
+            c.fd = openat(fd, de->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        if(c.fd<0) __atomic_sub_fetch(&wk.openfds, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&wk.pending, 1, __ATOMIC_SEQ_CST);
+        if(wq_push(self, c)<0){
+            if(c.fd>=0){ close(c.fd); __atomic_sub_fetch(&wk.openfds, 1, __ATOMIC_RELAXED); }
+            free(rel);
+            __atomic_sub_fetch(&wk.pending, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+    closedir(dp);
+    free(t.rel);
+}
+static void *walk_worker(void *arg){
+    int self = (int)(intptr_t)arg;
+    for(;;){
+        struct wtask t; int got = wq_take(self, 1, &t);
+        for(int k=1; !got && k<wk.nthreads; k++) got = wq_take((self+k)%wk.nthreads, 0, &t);
+        if(got){
+            walk_dir(self, t);
+            if(__atomic_sub_fetch(&wk.pending, 1, __ATOMIC_SEQ_CST)==0){   // last task: release the sleepers
+                pthread_mutex_lock(&wk.mu); pthread_cond_broadcast(&wk.cv); pthread_mutex_unlock(&wk.mu);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&wk.mu);
+        __atomic_add_fetch(&wk.sleepers, 1, __ATOMIC_SEQ_CST);
+        while(!__atomic_load_n(&wk.queued, __ATOMIC_SEQ_CST) && __atomic_load_n(&wk.pending, __ATOMIC_SEQ_CST))
+            pthread_cond_wait(&wk.cv, &wk.mu);
+        __atomic_sub_fetch(&wk.sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&wk.mu);
+        if(!__atomic_load_n(&wk.pending, __ATOMIC_SEQ_CST)) break;
+    }
+    return NULL;
+}
+static int cmp_path(const void *a, const void *b){ return strcmp(*(char *const *)a, *(char *const *)b); }
+
+static int meta_walk(const char *root, const char *sub, const char *ext, char ***out);
+
+// Sorted malloc'd relative paths of the matching files; returns the count.
+static int walk_tree(const char *root, const char *sub, const char *ext, char ***out){
+    *out = NULL;
+    int mn = meta_walk(root, sub, ext, out);
+    if(mn >= 0) return mn;
+    memset(&wk, 0, sizeof(wk));
+    wk.rootfd = open(root, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(wk.rootfd<0) return 0;
+    wk.ext = ext;
+    wk.nthreads = WALK_THREADS>0 ? WALK_THREADS : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(wk.nthreads<1) wk.nthreads = 1;
+    if(wk.nthreads>16) wk.nthreads = 16;
+    wk.dq = calloc((size_t)wk.nthreads, sizeof(*wk.dq));
+    wk.out = calloc((size_t)wk.nthreads, sizeof(*wk.out));
+    char *top = strdup(sub);
+    if(!wk.dq || !wk.out || !top){ free(wk.dq); free(wk.out); free(top); close(wk.rootfd); return 0; }
+    for(int i=0;i<wk.nthreads;i++) pthread_mutex_init(&wk.dq[i].mu, NULL);
+    pthread_mutex_init(&wk.mu, NULL); pthread_cond_init(&wk.cv, NULL);
+    wk.pending = 1;
+    wq_push(0, (struct wtask){ -1, top });
+
+    pthread_t th[16]; int started = 1;
+    for(int i=1;i<wk.nthreads;i++) if(pthread_create(&th[i], NULL, walk_worker, (void*)(intptr_t)i)==0) started++; else break;
+    walk_worker((void*)0);
+    for(int i=1;i<started;i++) pthread_join(th[i], NULL);
+
+    int n = 0;
+    for(int i=0;i<wk.nthreads;i++) n += wk.out[i].n;
+    char **v = malloc((size_t)(n ? n : 1)*sizeof(*v));
+    int k = 0;
+    for(int i=0;i<wk.nthreads;i++){
+        for(int j=0;j<wk.out[i].n;j++){ if(v) v[k++] = wk.out[i].v[j]; else free(wk.out[i].v[j]); }
+        free(wk.out[i].v); free(wk.dq[i].t);
+        pthread_mutex_destroy(&wk.dq[i].mu);
+    }
+    free(wk.out); free(wk.dq);
+    pthread_mutex_destroy(&wk.mu); pthread_cond_destroy(&wk.cv);
+    close(wk.rootfd);
+    if(!v) return 0;
+    qsort(v, (size_t)k, sizeof(*v), cmp_path);
+    *out = v;
+    return k;
+}
+static void walk_free(char **v, int n){ for(int i=0;i<n;i++) free(v[i]); free(v); }
+
+/* ---------- metadata snapshot (warm restart) ----------
+   <root>/.meta lists every regular file under the root (dot entries skipped,
+   as walk_tree() does), sorted: a header, a table of offsets and the
+   NUL-terminated root-relative paths. Sessions map it read-only and bring it
+   current from the journal, which is the change log: every path journaled
+   since the snapshot was taken (from the recorded offset while the journal is
+   the same file, by time after a compaction) is looked at again with one
+   stat. walk_tree() and listings that miss the listing cache answer from
+   that view, so the first DOWNLTAR or listing after a restart walks nothing.
+   A keeper process rewrites the snapshot from a real walk at start-up, in
+   the background, and then every META_INTERVAL seconds when the journal has
+   moved (write to .meta.tmp, fsync, rename); that walk is also what picks up
+   files changed behind the server's back. META_INTERVAL 0 turns it off. */
+#include <sys/prctl.h>
+#ifndef META_INTERVAL
+#define META_INTERVAL 300
+#endif
+#define META_MAGIC 0x3141544du              // "MTA1"
+
+struct meta_hdr { uint32_t magic, count; uint64_t blob; int64_t base_us; uint64_t jnl_ino, jnl_off; };
+struct mchg { char *path; int seq; char live; };
+static struct {
+    char root[1024], path[2200]; int off;     // off: this process walks for real (the keeper)
+    const struct meta_hdr *h; size_t len; ino_t ino;
+    const uint32_t *idx; const char *blob;
+    struct mchg *chg; int nchg, cchg, seq;    // replayed journal tail, sorted by path
+    ino_t jino; long long joff;               // how far the journal has been replayed
+    unsigned long long hits;
+} meta;
+
+static const char *meta_at(uint32_t i){ return meta.blob + meta.idx[i]; }
+// First snapshot entry >= key.
+static uint32_t meta_lower(const char *key){
+    uint32_t lo = 0, hi = meta.h->count;
+    while(lo < hi){
+        uint32_t mid = lo + (hi-lo)/2;
+        if(strcmp(meta_at(mid), key) < 0) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+static int mchg_cmp(const void *a, const void *b){
+    const struct mchg *x = a, *y = b;
+    int c = strcmp(x->path, y->path);
+    return c ? c : x->seq - y->seq;
+}
+static int mchg_key(const void *k, const void *e){ return strcmp(k, ((const struct mchg*)e)->path); }
+// The replayed change for 'path', if the journal mentioned it since the snapshot.
+static struct mchg *meta_changed(const char *path){
+    return meta.nchg ? bsearch(path, meta.chg, (size_t)meta.nchg, sizeof(*meta.chg), mchg_key) : NULL;
+}
+static void meta_drop_chg(void){
+    for(int i=0;i<meta.nchg;i++) free(meta.chg[i].path);
+    meta.nchg = 0;
+}
+// Map the current snapshot (again, if the keeper replaced it).
+static void meta_map(void){
+    struct stat st;
+    if(stat(meta.path, &st)==0 && meta.h && st.st_ino==meta.ino) return;
+    if(meta.h){ munmap((void*)meta.h, meta.len); meta.h = NULL; meta.ino = 0; }
+    meta_drop_chg();
+    int fd = open(meta.path, O_RDONLY|O_CLOEXEC);
+    if(fd<0) return;
+    void *m = MAP_FAILED;
+    if(fstat(fd,&st)==0 && (size_t)st.st_size > sizeof(struct meta_hdr))
+        m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(m==MAP_FAILED) return;
+    const struct meta_hdr *h = m;
+    const uint32_t *idx = (const uint32_t*)(h+1);
+    const char *blob = (const char*)(idx + h->count);
+    int ok = h->magic==META_MAGIC && h->blob &&
+             sizeof(*h) + (uint64_t)h->count*sizeof(*idx) + h->blob == (uint64_t)st.st_size &&
+             blob[h->blob-1]=='\0';
+    for(uint32_t i=0; ok && i<h->count; i++) ok = idx[i] < h->blob;
+    if(!ok){ munmap(m, (size_t)st.st_size); return; }
+    meta.h = h; meta.len = (size_t)st.st_size; meta.ino = st.st_ino;
+    meta.idx = idx; meta.blob = blob;
+    meta.jino = (ino_t)h->jnl_ino; meta.joff = (long long)h->jnl_off;
+}
+// Paths under a dot directory are not part of the tree (.ec, .hot, ...).
+static int meta_hidden(const char *p){
+    for(const char *s = p; s; s = strchr(s, '/')){
+        if(*s=='/') s++;
+        if(*s=='.') return 1;
+    }
+    return 0;
+}
+// Replay what the journal gained since the last look.
+static void meta_replay(void){
+    int fd = jnl_open(LOCK_SH);
+    if(fd<0) return;
+    struct stat st;
+    if(fstat(fd,&st)<0){ close(fd); return; }
+    long long from = meta.joff, since = 0;
+    if(st.st_ino != meta.jino){                       // compacted since: go by time
+        meta_drop_chg();
+        from = 0; since = meta.h->base_us - 1000000;  // writers stamp before they append
+        meta.jino = st.st_ino; meta.joff = 0;
+    }
+    size_t n = st.st_size > from ? (size_t)(st.st_size-from) : 0;
+    char *buf = n ? malloc(n+1) : NULL;
+    ssize_t got = buf ? pread(fd, buf, n, from) : 0;
+    close(fd);
+    if(got<=0){ free(buf); return; }
+    buf[got] = '\0';
+    char *end = strrchr(buf, '\n');                   // whole lines only
+    if(!end){ free(buf); return; }
+    meta.joff = from + (end-buf) + 1;
+    end[1] = '\0';
+    int added = 0;
+    for(char *ln = buf, *nl; *ln; ln = nl+1){
+        nl = strchr(ln, '\n'); *nl = '\0';
+        long long us; char op; int off = 0;
+        if(ln[0]=='#' || sscanf(ln, "%lld %c %n", &us, &op, &off)!=2 || !off || us < since) continue;
+        const char *p = ln+off;
+        if(!*p || meta_hidden(p)) continue;
+        if(meta.nchg==meta.cchg){
+            int nc = meta.cchg ? meta.cchg*2 : 64;
+            struct mchg *v = realloc(meta.chg, (size_t)nc*sizeof(*v));
+            if(!v) break;
+            meta.chg = v; meta.cchg = nc;
+        }
+        char full[3300]; struct stat fs;
+        snprintf(full, sizeof(full), "%s/%s", meta.root, p);
+        char *dup = strdup(p);
+        if(!dup) break;
+        meta.chg[meta.nchg++] = (struct mchg){ dup, meta.seq++, lstat(full,&fs)==0 && S_ISREG(fs.st_mode) };
+        added++;
+    }
+    free(buf);
+    if(!added) return;
+    qsort(meta.chg, (size_t)meta.nchg, sizeof(*meta.chg), mchg_cmp);
+    int k = 0;                                        // newest look per path wins
+    for(int i=0;i<meta.nchg;i++){
+        if(i+1<meta.nchg && !strcmp(meta.chg[i].path, meta.chg[i+1].path)){ free(meta.chg[i].path); continue; }
+        meta.chg[k++] = meta.chg[i];
+    }
+    meta.nchg = k;
+}
+// Is there a current view of 'root'? Maps and replays as needed.
+static int meta_ready(const char *root){
+    if(META_INTERVAL<=0 || meta.off || !meta.root[0] || strcmp(root, meta.root)) return 0;
+    meta_map();
+    if(!meta.h) return 0;
+    meta_replay();
+    return 1;
+}
+static int meta_push(char ***v, int *n, int *cap, const char *s){
+    if(*n==*cap){
+        int nc = *cap ? *cap*2 : 64;
+        char **nv = realloc(*v, (size_t)nc*sizeof(char*));
+        if(!nv) return -1;
+        *v = nv; *cap = nc;
+    }
+    return ((*v)[*n] = strdup(s)) ? (++*n, 0) : -1;
+}
+static int meta_ext(const char *p, const char *ext){
+    size_t l = strlen(p), el = strlen(ext);
+    return l>=el && strcasecmp(p+l-el, ext)==0;
+}
+// walk_tree() from the view: -1 when there is none and the tree must be walked.
+static int meta_walk(const char *root, const char *sub, const char *ext, char ***out){
+    if(!meta_ready(root)) return -1;
+    while(*sub=='/') sub++;
+    size_t sl = strlen(sub);
+    while(sl && sub[sl-1]=='/') sl--;
+    char pre[1100];
+    if(sl >= sizeof(pre)-1) return -1;
+    size_t pl = (size_t)snprintf(pre, sizeof(pre), "%.*s%s", (int)sl, sub, sl ? "/" : "");
+    char **v = NULL; int n = 0, cap = 0, bad = 0;
+    for(uint32_t i = meta_lower(pre); i<meta.h->count && !bad; i++){
+        const char *p = meta_at(i);
+        if(strncmp(p, pre, pl)) break;
+        if(!meta_changed(p) && meta_ext(p, ext)) bad = meta_push(&v, &n, &cap, p);
+    }
+    for(int i=0;i<meta.nchg && !bad;i++){
+        const struct mchg *c = &meta.chg[i];
+        if(c->live && !strncmp(c->path, pre, pl) && meta_ext(c->path, ext)) bad = meta_push(&v, &n, &cap, c->path);
+    }
+    if(bad){ walk_free(v, n); return -1; }
+    if(n) qsort(v, (size_t)n, sizeof(*v), cmp_path);
+    meta.hits++;
+    *out = v;
+    return n;
+}
+// Names of the files directly in 'dest' whose extension is 'ext', from the view.
+static int meta_dir_each(const char *dest, const char *ext, int (*add)(const char *name, void *arg), void *arg){
+    if(!meta_ready(meta.root)) return -1;
+    while(*dest=='/') dest++;
+    size_t dl = strlen(dest);
+    while(dl && dest[dl-1]=='/') dl--;
+    char pre[1100];
+    if(dl >= sizeof(pre)-1) return -1;
+    size_t pl = (size_t)snprintf(pre, sizeof(pre), "%.*s%s", (int)dl, dest, dl ? "/" : "");
+    int n = 0;
+    for(uint32_t i = meta_lower(pre); i<meta.h->count; ){
+        const char *p = meta_at(i);
+        if(strncmp(p, pre, pl)) break;
+        const char *name = p+pl, *sl = strchr(name, '/');
+        if(sl){                                       // a subdirectory: jump past all of it
+            char skip[2200];
+            snprintf(skip, sizeof(skip), "%.*s0", (int)(sl-p), p);
+            i = meta_lower(skip);
+            continue;
+        }
+        i++;
+        const char *dot = strrchr(name, '.');
+        if(meta_changed(p) || !dot || strcasecmp(dot, ext)) continue;
+        if(add(name, arg)) return n;
+        n++;
+    }
+    for(int i=0;i<meta.nchg;i++){
+        const struct mchg *c = &meta.chg[i];
+        const char *name = c->path+pl, *dot;
+        if(!c->live || strncmp(c->path, pre, pl) || strchr(name, '/')) continue;
+        if(!(dot = strrchr(name, '.')) || strcasecmp(dot, ext)) continue;
+        if(add(name, arg)) return n;
+        n++;
+    }
+    meta.hits++;
+    return n;
+}
+// Keeper: walk the whole tree and replace the snapshot.
+static void meta_write(void){
+    struct stat js;
+    int fd = jnl_open(LOCK_SH);
+    if(fd<0) return;
+    int ok = fstat(fd,&js)==0;
+    close(fd);
+    if(!ok) return;
+    struct meta_hdr h = { META_MAGIC, 0, 0, now_us(), (uint64_t)js.st_ino, (uint64_t)js.st_size };
+    char **v; int n = walk_tree(meta.root, "", "", &v);
+    uint32_t *idx = malloc((size_t)(n ? n : 1)*sizeof(*idx));
+    for(int i=0;i<n && idx;i++){
+        size_t l = strlen(v[i])+1;
+        if(h.blob+l > UINT32_MAX){ n = i; break; }
+        idx[i] = (uint32_t)h.blob; h.blob += l;
+    }
+    h.count = (uint32_t)n;
+    char tmp[2300]; snprintf(tmp, sizeof(tmp), "%s.tmp", meta.path);
+    FILE *f = idx && h.blob ? fopen(tmp, "w") : NULL;
+    if(f){
+        int bad = fwrite(&h, sizeof(h), 1, f)!=1 || fwrite(idx, sizeof(*idx), (size_t)n, f)!=(size_t)n;
+        for(int i=0;i<n && !bad;i++) bad = fwrite(v[i], strlen(v[i])+1, 1, f)!=1;
+        bad |= fflush(f)!=0 || fsync(fileno(f))!=0;
+        bad |= fclose(f)!=0;
+        if(bad || rename(tmp, meta.path)<0) unlink(tmp);
+    }
+    else if(idx && !h.blob) unlink(meta.path);               // empty tree: nothing to map
+    free(idx);
+    walk_free(v, n);
+}
+static void meta_init(const char *root){
+    snprintf(meta.root, sizeof(meta.root), "%s", root);
+    snprintf(meta.path, sizeof(meta.path), "%s/.meta", root);
+    if(META_INTERVAL<=0) return;
+    meta_map();                                       // the sessions inherit the mapping
+    pid_t pid = fork();
+    if(pid<0){ perror("fork meta"); return; }
+    if(pid) return;
+    meta.off = 1;
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if(nice(19) < 0) perror("nice");                 // stays out of the sessions' way:
+    syscall(SYS_ioprio_set, 1, 0, 3<<13);             // lowest CPU priority, idle I/O class
+    struct stat last = {0}, js;
+    for(int first = 1;; first = 0){
+        int moved = stat(jnl_path,&js)==0 && (js.st_ino!=last.st_ino || js.st_size!=last.st_size);
+        if(first || moved){ meta_write(); last = js; }
+        sleep(META_INTERVAL);
+    }
+}
+
+struct mdir { char ***v; int *n, *cap; };
+static int meta_dir_add(const char *name, void *arg){ struct mdir *d = arg; return arena_push(d->v, d->n, d->cap, name); }
+
+/* ---------- change subscriptions (WATCH) ----------
+   A subscription follows the journal: it keeps its own offset into
+   <root>/.journal and wakes on inotify (IN_MODIFY on the file, IN_MOVED_TO
+   on the root for the rename a compaction does). Records for paths under
+   the watched directory (its direct entries, or the whole subtree with
+   r=1) become events. The paths seen put and not yet deleted tell a create
+   from a modify. Records up to 'since' (default: now) only fill that set, so
+   "since=<token>" resumes an earlier stream. A compacted journal is read
+   again from the start, skipping records not newer than the last one seen:
+   intermediate states of a path can be lost then, its final state is not. */
+#ifndef WATCH_BUCKETS
+#define WATCH_BUCKETS 4096
+#endif
+
+struct wpath { struct wpath *next; char p[]; };
+struct watch {
+    int fd, ino_fd, rec, refeed; ino_t ino; long long pos, since, last;
+    char sub[1024]; const char *ext;
+    struct wpath **live;
+};
+typedef void (*watch_fn)(void *arg, long long us, char kind, const char *path);
+
+static unsigned watch_hash(const char *s){
+    unsigned h = 2166136261u;
+    while(*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h % WATCH_BUCKETS;
+}
+// Record 'path' as existing or not; returns whether it existed before.
+static int watch_mark(struct watch *w, const char *path, int live){
+    struct wpath **pp = &w->live[watch_hash(path)];
+    while(*pp && strcmp((*pp)->p, path)) pp = &(*pp)->next;
+    int was = *pp != NULL;
+    if(was && !live){ struct wpath *d = *pp; *pp = d->next; free(d); }
+    else if(!was && live){
+        size_t n = strlen(path)+1;
+        struct wpath *e = malloc(sizeof(*e)+n);
+        if(e){ memcpy(e->p, path, n); e->next = NULL; *pp = e; }
+    }
+    return was;
+}
+static int watch_scope(const struct watch *w, const char *path){
+    size_t n = strlen(w->sub), l = strlen(path);
+    if(n && (strncmp(path, w->sub, n) || path[n]!='/')) return 0;
+    if(!w->rec && strchr(path + (n ? n+1 : 0), '/')) return 0;
+    if(meta_hidden(path)) return 0;
+    for(const char *e = w->ext; *e; ){               // ".c" or a list, ".c,.pdf"
+        size_t el = strcspn(e, ",");
+        if(l>=el && strncasecmp(path+l-el, e, el)==0) return 1;
+        e += el; if(*e) e++;
+    }
+    return 0;
+}
+static void watch_line(struct watch *w, char *ln, watch_fn fn, void *arg){
+    long long us; char op; int off = 0;
+    if(ln[0]=='#' || sscanf(ln, "%lld %c %n", &us, &op, &off)!=2 || !off) return;
+    if(w->refeed && us <= w->last) return;
+    if(us > w->last) w->last = us;
+    const char *p = ln+off;
+    if((op!='P' && op!='D') || !watch_scope(w, p)) return;
+    int was = watch_mark(w, p, op=='P');
+    if(us > w->since) fn(arg, us, op=='D' ? 'd' : was ? 'm' : 'c', p);
+}
+// Turn what the journal gained since the last call into events.
+static void watch_pump(struct watch *w, watch_fn fn, void *arg){
+    struct stat st;
+    if(stat(jnl_path, &st)==0 && st.st_ino != w->ino){   // first call, or compacted
+        int fd = open(jnl_path, O_RDONLY|O_CLOEXEC);
+        if(fd>=0 && fstat(fd, &st)==0){
+            if(w->fd>=0) close(w->fd);
+            w->fd = fd; w->ino = st.st_ino; w->pos = 0; w->refeed = w->last > 0;
+            inotify_add_watch(w->ino_fd, jnl_path, IN_MODIFY);
+        }
+        else if(fd>=0) close(fd);
+    }
+    if(w->fd<0) return;
+    char buf[64<<10];
+    for(;;){
+        ssize_t r = pread(w->fd, buf, sizeof(buf)-1, w->pos);
+        if(r<=0) break;
+        buf[r] = '\0';
+        char *ln = buf, *nl;
+        while((nl = strchr(ln, '\n'))){ *nl = '\0'; watch_line(w, ln, fn, arg); ln = nl+1; }
+        if(ln==buf) break;                            // half a line: the writer is not done
+        w->pos += ln-buf;
+    }
+    w->refeed = 0;
+}
+// Empty the inotify queue; the events only say "look again".
+static void watch_drain(struct watch *w){
+    char ev[4096];
+    while(read(w->ino_fd, ev, sizeof(ev)) > 0) ;
+}
+static void watch_close(struct watch *w){
+    for(int i=0; w->live && i<WATCH_BUCKETS; i++)
+        for(struct wpath *e = w->live[i], *nx; e; e = nx){ nx = e->next; free(e); }
+    free(w->live);
+    if(w->fd>=0) close(w->fd);
+    if(w->ino_fd>=0) close(w->ino_fd);
+}
+static int watch_open(struct watch *w, const char *root, const char *dest, int rec, const char *ext, long long since){
+    memset(w, 0, sizeof(*w));
+    w->fd = -1; w->rec = rec; w->ext = ext; w->since = since;
+    while(*dest=='/') dest++;
+    snprintf(w->sub, sizeof(w->sub), "%s", dest);
+    size_t n = strlen(w->sub);
+    while(n && w->sub[n-1]=='/') w->sub[--n] = '\0';
+    w->live = calloc(WATCH_BUCKETS, sizeof(*w->live));
+    w->ino_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if(!w->live || w->ino_fd<0 || inotify_add_watch(w->ino_fd, root, IN_MOVED_TO)<0){ watch_close(w); return -1; }
+    return 0;
+}
+
+// Write the matching relative paths to 'f', one per line; returns the count.
+static int walk_list(const char *root, const char *sub, const char *ext, FILE *f){
+    char **v; int n = walk_tree(root, sub, ext, &v);
+    for(int i=0;i<n;i++) fprintf(f, "%s\n", v[i]);
+    walk_free(v, n);
+    return n;
+}
+
+// Write the files named (relative to root) in 'listpath' plus matching packed
+// files to 'out' without exec'ing tar.
+static int write_native_tar(const char *root, const char *ext, const char *sub, const char *listpath, int out){
+    FILE *lf = fopen(listpath, "r");
+    int rc = 0;
+    char rel[4096];
+    while(rc==0 && lf && fgets(rel,sizeof(rel),lf)){
+        if(rq.cancel){ rc = -1; break; }
+        rel[strcspn(rel,"\n")] = '\0';
+        char abs[8192]; snprintf(abs,sizeof(abs), "%s/%s", root, rel);
+        int fd = open(abs, O_RDONLY);
+        if(fd<0) continue;
+        struct stat st; fstat(fd,&st);
+        if(tar_header(out, rel, (long long)st.st_size, (long long)st.st_mtime)==0)
+            rc = tar_copy_fd(out, fd, (long long)st.st_size);
+        close(fd);
+    }
+    if(lf) fclose(lf);
+    if(rc==0) rc = tar_pack_entries(out, ext, sub);
+    if(rc==0) rc = tar_finish(out);
+    return rc;
+}
+
+// Create a tar with all files under 'root' that end with 'ext'.
+// On success, writes the tmp tar path into outpath and returns 0.
+static int make_tar_for_root(const char *root, const char *ext, char *outpath, size_t outsz){
+    char listtmp[] = "/tmp/s1listXXXXXX";
+    char tartmp[]  = "/tmp/s1tarXXXXXX";
+    int lfd = mkstemp(listtmp);
+    int tfd = mkstemp(tartmp);
+    if(lfd<0 || tfd<0){
+        if(lfd>=0) { close(lfd); unlink(listtmp); }
+        if(tfd>=0) { close(tfd); unlink(tartmp); }
+        return -1;
+    }
+    close(tfd); // tar will recreate it
+    FILE *lfp = fdopen(lfd, "w");
+    if(!lfp){ close(lfd); unlink(listtmp); unlink(tartmp); return -1; }
+
+    int count = walk_list(root, "", ext, lfp);
+    fflush(lfp); fsync(lfd); fclose(lfp);
+
+    if(PACKSTORE){
+        // packed files have no path tar could read, so write the archive here
+        int out = open(tartmp, O_WRONLY|O_TRUNC);
+        int rc = out<0 ? -1 : write_native_tar(root, ext, "", listtmp, out);
+        if(out>=0) close(out);
+        unlink(listtmp);
+        if(rc!=0){ unlink(tartmp); return -2; }
+        snprintf(outpath, outsz, "%s", tartmp);
+        return 0;
+    }
+
+    pid_t pid = fork();
+    if(pid<0){
+        unlink(listtmp); unlink(tartmp);
+        return -1;
+    }
+    if(pid==0){
+        if(count==0){
+            // empty archive is valid
+            execlp("tar", "tar", "-cf", tartmp, "--files-from", "/dev/null", (char*)NULL);
+        }else{
+            execlp("tar", "tar", "-C", root, "-cf", tartmp, "-T", listtmp, (char*)NULL);
+        }
+        _exit(127);
+    }
+    rq_child(pid);
+    int status=0; waitpid(pid, &status, 0);
+    unlink(listtmp);
+    if(!WIFEXITED(status) || WEXITSTATUS(status)!=0){
+        unlink(tartmp);
+        return -2;
+    }
+    snprintf(outpath, outsz, "%s", tartmp);
+    return 0;
+}
+
+// Like make_tar_for_root, limited to 'sub', but writes the archive to 'out'
+// (a pipe) as it is built.
+// The list is unlinked at once and read back through /dev/fd: this runs in
+// a tar_source helper, which a cancelled DOWNLTAR kills outright.
+static int write_tar_stream(const char *root, const char *ext, const char *sub, int out){
+    char listtmp[] = "/tmp/s1listXXXXXX", lpath[32];
+    int lfd = mkstemp(listtmp);
+    if(lfd<0) return -1;
+    unlink(listtmp);
+    snprintf(lpath, sizeof(lpath), "/dev/fd/%d", lfd);
+    FILE *lfp = fdopen(dup(lfd), "w");
+    if(!lfp){ close(lfd); return -1; }
+    int count = walk_list(root, sub, ext, lfp);
+    fclose(lfp);
+
+    int rc = 0;
+    if(PACKSTORE){
+        rc = write_native_tar(root, ext, sub, lpath, out);
+    }else{
+        pid_t pid = fork();
+        if(pid<0){ close(lfd); return -1; }
+        if(pid==0){
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            dup2(out, 1);
+            if(count==0) execlp("tar", "tar", "-cf", "-", "--files-from", "/dev/null", (char*)NULL);
+            else         execlp("tar", "tar", "-C", root, "-cf", "-", "-T", lpath, (char*)NULL);
+            _exit(127);
+        }
+        int status=0; waitpid(pid, &status, 0);
+        if(!WIFEXITED(status) || WEXITSTATUS(status)!=0) rc = -2;
+    }
+    close(lfd);
+    return rc;
+}
+
+// Add one file (packed or on disk) as an entry; gone files are skipped.
+static int tar_add_path(int out, const char *root, const char *key){
+    if(PACKSTORE){
+        char *data=NULL; int64_t mt=0;
+        long long sz=pack_get(key,&data,&mt,NULL);
+        if(sz>=0){
+            int rc=0;
+            if(tar_header(out,key,sz,(long long)mt)==0)
+                rc = (write_n(out,data,(size_t)sz)==sz && tar_pad(out,sz)==0) ? 0 : -1;
+            free(data);
+            return rc;
+        }
+    }
+    char abs[8192]; snprintf(abs,sizeof(abs),"%s/%s",root,key);
+    int fd=open(abs,O_RDONLY);
+    if(fd<0) return 0;
+    struct stat st; fstat(fd,&st);
+    int rc=0;
+    if(S_ISREG(st.st_mode) && tar_header(out,key,(long long)st.st_size,(long long)st.st_mtime)==0)
+        rc = tar_copy_fd(out,fd,(long long)st.st_size);
+    close(fd);
+    return rc;
+}
+// Incremental tar: a ".deleted/S1" entry listing paths deleted at or
+// after 'since', then the files changed since then. A journal younger than
+// 'since' gives a full archive, flagged "full" in the manifest.
+static int write_incr_tar(const char *root, const char *ext, const char *sub, long long since, int out){
+    struct jrec *r=NULL; long long base=0;
+    int fd=jnl_open(LOCK_SH);
+    int n = fd<0 ? -1 : jnl_load(fd,&r,&base);
+    if(fd>=0) close(fd);
+    if(n<0) return -1;
+    int full = since<base;
+    char *man=NULL; size_t msz=0;
+    FILE *m=open_memstream(&man,&msz);
+    if(!m){ jnl_free(r,n); return -1; }
+    fprintf(m,"# since %lld%s\n",since,full?" full":"");
+    for(int i=0;i<n && !full;i++){
+        const char *dot=strrchr(r[i].path,'.');
+        if(r[i].op=='D' && r[i].us>=since && dot && strcasecmp(dot,ext)==0 && in_subtree(r[i].path,sub))
+            fprintf(m,"%s\n",r[i].path);
+    }
+    fclose(m);
+    int rc = tar_header(out,".deleted/S1",(long long)msz,now_us()/1000000)==0 &&
+             write_n(out,man,msz)==(ssize_t)msz && tar_pad(out,(long long)msz)==0 ? 0 : -1;
+    free(man);
+    if(rc==0 && full) rc = write_tar_stream(root,ext,sub,out);   // concatenates: its entries follow the manifest
+    else if(rc==0){
+        for(int i=0;i<n && rc==0;i++){
+            const char *dot=strrchr(r[i].path,'.');
+            if(r[i].op=='P' && r[i].us>=since && dot && strcasecmp(dot,ext)==0 && in_subtree(r[i].path,sub))
+                rc = tar_add_path(out,root,r[i].path);
+        }
+        if(rc==0) rc = tar_finish(out);
+    }
+    jnl_free(r,n);
+    return rc;
+}
+
+// fetch tar stream (of subtree 'sub', "" = all; incremental when since >= 0)
+// from S2/S3/S4 into 'out_fd' and return size, or <0 on error
+static long long fetch_tar_from_aux(int port, const char *ext, const char *sub, long long since, int out_fd){
+    int zc = Z_NONE;
+    int sd = z_skip_ext(ext) ? connect_local_port(port) : connect_aux(port, aux_codec(), &zc);
+    if(sd < 0) return -1;
+    char opt[48]=""; if(since>=0) snprintf(opt,sizeof(opt)," since=%lld",since);
+    if(*sub) dprintf(sd, "TARALL %s %s%s%s\n", ext, sub, opt, tr_opt());
+    else     dprintf(sd, "TARALL %s%s%s\n", ext, opt, tr_opt());   // ext = ".pdf", ".txt" or ".zip"
+
+    char hdr[256]; ssize_t rn = read_line(sd, hdr, sizeof(hdr));
+    if(rn <= 0 || strncmp(hdr, "OK ", 3) != 0){ close(sd); return -2; }
+    long long size=0; if(sscanf(hdr+3,"%lld",&size)!=1 || size<0){ close(sd); return -3; }
+    char zv[16]; int in_c = opt_get(hdr, "z", zv, sizeof(zv)) ? z_parse(zv) : Z_NONE;
+    if(in_c < 0){ close(sd); return -3; }
+
+    struct zr zr; zr_init(&zr, sd, in_c);
+    char *buf = iob_get(); long long left=size, rc=size;
+    if(!buf) rc = -4;
+    while(left>0 && rc>=0){
+        ssize_t r = zr_read(&zr, buf, (left > IOB_SIZE ? IOB_SIZE : (size_t)left));
+        if(r <= 0) rc = -4;
+        else if(write_n(out_fd, buf, (size_t)r) != r) rc = -5;
+        else left -= r;
+    }
+    iob_put(buf);
+    rq_saved(left);
+    if(rc>=0) zr_finish(&zr);
+    close(sd);
+    return rc;
+}
+
+/* ---------- compressed tar output (DOWNLTAR <ext> gz|zst) ----------
+   The tar stream is cut into TARZ_BLOCK pieces that are compressed in
+   parallel, each into an independent gzip member / zstd frame. Both formats
+   allow concatenation, so the client gets an ordinary .tar.gz / .tar.zst.
+   In-process with -DHAVE_ZLIB -lz / -DHAVE_ZSTD -lzstd, otherwise pigz
+   (falling back to gzip) or zstd -T0 run as a filter. The final size is not
+   known up front, so the reply is "TAR <name> -1 z=raw" plus frames. */
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifndef TARZ_THREADS
+#define TARZ_THREADS 0          // 0 = one per online CPU
+#endif
+#define TARZ_BLOCK (1<<20)
+enum { TARZ_NONE=0, TARZ_GZ=1, TARZ_ZST=2 };
+
+static int tarz_parse(const char *s){
+    if(strcmp(s,"gz")==0) return TARZ_GZ;
+    if(strcmp(s,"zst")==0 || strcmp(s,"zstd")==0) return TARZ_ZST;
+    return -1;
+}
+static int tarz_inproc(int kind){
+#ifdef HAVE_ZLIB
+    if(kind==TARZ_GZ) return 1;
+#endif
+#ifdef HAVE_ZSTD
+    if(kind==TARZ_ZST) return 1;
+#endif
+    (void)kind; return 0;
+}
+
+// Compress one block into a malloc'd gzip member / zstd frame; returns its size or -1.
+static long tarz_block(int kind, const char *in, size_t n, char **out){
+    *out = NULL;
+#ifdef HAVE_ZLIB
+    if(kind==TARZ_GZ){
+        z_stream zs; memset(&zs,0,sizeof(zs));
+        if(deflateInit2(&zs, 6, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY)!=Z_OK) return -1;
+        uLong cap = deflateBound(&zs, (uLong)n);
+        if(!(*out = malloc(cap))){ deflateEnd(&zs); return -1; }
+        zs.next_in=(Bytef*)in; zs.avail_in=(uInt)n; zs.next_out=(Bytef*)*out; zs.avail_out=(uInt)cap;
+        int r = deflate(&zs, Z_FINISH);
+        long len = (long)zs.total_out;
+        deflateEnd(&zs);
+        return r==Z_STREAM_END ? len : -1;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if(kind==TARZ_ZST){
+        size_t cap = ZSTD_compressBound(n);
+        if(!(*out = malloc(cap))) return -1;
+        size_t r = ZSTD_compress(*out, cap, in, n, 3);
+        return ZSTD_isError(r) ? -1 : (long)r;
+    }
+#endif
+    (void)kind; (void)in; (void)n;
+    return -1;
+}
+
+struct tz_slot { char *in; size_t n; char *out; long outn; int state; };   // state: 0 free, 1 queued, 2 done
+static struct {
+    pthread_mutex_t mu; pthread_cond_t cv;
+    struct tz_slot *slot; int ns, kind, stop;
+    long long next, filled;      // next block to hand to a worker / blocks read so far
+} tz = { .mu = PTHREAD_MUTEX_INITIALIZER, .cv = PTHREAD_COND_INITIALIZER };
+
+static void *tz_worker(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&tz.mu);
+    for(;;){
+        while(!tz.stop && tz.next==tz.filled) pthread_cond_wait(&tz.cv, &tz.mu);
+        if(tz.next==tz.filled) break;
+        struct tz_slot *s = &tz.slot[tz.next++ % tz.ns];
+        pthread_mutex_unlock(&tz.mu);
+        s->outn = tarz_block(tz.kind, s->in, s->n, &s->out);
+        pthread_mutex_lock(&tz.mu);
+        s->state = 2;
+        pthread_cond_broadcast(&tz.cv);
+    }
+    pthread_mutex_unlock(&tz.mu);
+    return NULL;
+}
+
+// Sends the TAR header before the first payload byte, so an empty or failed
+// source can still be answered with ERR.
+struct tz_out { int csd; const char *tname; int codec; long long token; int sent; struct zw zw; };
+static int tz_emit(struct tz_out *o, const char *p, size_t n){
+    if(!o->sent){
+        zw_init(&o->zw, o->csd, o->codec);
+        if(o->token>=0) zw_head(&o->zw, "TAR %s -1%s since=%lld\n", o->tname, z_opt(o->codec), o->token);
+        else            zw_head(&o->zw, "TAR %s -1%s\n", o->tname, z_opt(o->codec));
+        o->sent = 1;
+    }
+    return zw_write(&o->zw, p, n);
+}
+
+static int tarz_parallel(int src, int kind, struct tz_out *o){
+    int nt = TARZ_THREADS>0 ? TARZ_THREADS : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(nt<1) nt=1;
+    if(nt>64) nt=64;
+    tz.ns = 2*nt; tz.kind = kind; tz.stop = 0; tz.next = tz.filled = 0;
+    tz.slot = calloc((size_t)tz.ns, sizeof(*tz.slot));
+    if(!tz.slot) return -1;
+    for(int i=0;i<tz.ns;i++) if(!(tz.slot[i].in = malloc(TARZ_BLOCK))){ nt=0; break; }
+    pthread_t th[64]; int started=0;
+    for(int i=0;i<nt;i++) if(pthread_create(&th[i],NULL,tz_worker,NULL)==0) started++;
+
+    int rc = started ? 0 : -1, eof = 0;
+    long long seq = 0, done = 0;
+    while(rc==0 && (!eof || done<seq)){
+        if(!eof && seq-done < tz.ns){
+            struct tz_slot *s = &tz.slot[seq % tz.ns];
+            size_t n = 0;
+            while(n<TARZ_BLOCK){
+                ssize_t r = read(src, s->in+n, TARZ_BLOCK-n);
+                if(r<0 && errno==EINTR) continue;
+                if(r<0) rc = -1;
+                if(r<=0) break;
+                n += (size_t)r;
+            }
+            if(n<TARZ_BLOCK) eof = 1;
+            if(n==0 || rc) continue;
+            pthread_mutex_lock(&tz.mu);
+            s->n = n; s->state = 1; tz.filled = ++seq;
+            pthread_cond_broadcast(&tz.cv);
+            pthread_mutex_unlock(&tz.mu);
+            continue;
+        }
+        struct tz_slot *s = &tz.slot[done % tz.ns];
+        pthread_mutex_lock(&tz.mu);
+        while(s->state!=2) pthread_cond_wait(&tz.cv, &tz.mu);
+        pthread_mutex_unlock(&tz.mu);
+        if(s->outn<0 || tz_emit(o, s->out, (size_t)s->outn)!=0) rc = -1;
+        free(s->out); s->out = NULL; s->state = 0; done++;
+    }
+
+    pthread_mutex_lock(&tz.mu);
+    tz.stop = 1; tz.filled = tz.next;     // drop anything not yet started
+    pthread_cond_broadcast(&tz.cv);
+    pthread_mutex_unlock(&tz.mu);
+    for(int i=0;i<started;i++) pthread_join(th[i],NULL);
+    for(int i=0;i<tz.ns;i++){ free(tz.slot[i].in); free(tz.slot[i].out); }
+    free(tz.slot); tz.slot = NULL;
+    return rc;
+}
+
+static int tz_pump(int fd, struct tz_out *o){
+    char *buf = iob_get(); ssize_t r;
+    int rc = buf ? 0 : -1;
+    while(rc==0 && (r=read(fd,buf,IOB_SIZE))!=0){
+        if(r<0){ if(errno==EINTR) continue; rc = -1; }
+        else if(tz_emit(o, buf, (size_t)r)!=0) rc = -1;
+    }
+    iob_put(buf);
+    return rc;
+}
+
+static int tarz_external(int src, int kind, struct tz_out *o){
+    int p[2]; if(pipe(p)<0) return -1;
+    pid_t pid = fork();
+    if(pid<0){ close(p[0]); close(p[1]); return -1; }
+    if(pid==0){
+        dup2(src, 0); dup2(p[1], 1); close(p[0]); close(p[1]);
+        if(kind==TARZ_ZST) execlp("zstd", "zstd", "-T0", "-q", "-c", (char*)NULL);
+        else{
+            execlp("pigz", "pigz", "-c", (char*)NULL);
+            execlp("gzip", "gzip", "-c", (char*)NULL);
+        }
+        _exit(127);
+    }
+    close(p[1]);
+    int rc = tz_pump(p[0], o), status = 0;
+    close(p[0]);
+    if(waitpid(pid, &status, 0)!=pid || !WIFEXITED(status) || WEXITSTATUS(status)!=0) rc = -1;
+    return rc;
 }
 
-// Recursively collect relative file paths ending with 'ext' into 'outf'.
-// root = absolute root; rel = current relative path from root ("" for top)
-static int collect_rec(const char *root, const char *rel, const char *ext, FILE *outf, int *count){
-    char abspath[4096];
-    if(rel && *rel) snprintf(abspath,sizeof(abspath), "%s/%s", root, rel);
-    else            snprintf(abspath,sizeof(abspath), "%s", root);
+/* ---------- multi-type / subtree DOWNLTAR ----------
+   DOWNLTAR .c,.pdf,.zip [gz|zst] [~S1/dir] (or "all") asks every backend at
+   once; each answers through its own pipe and tar_merge() copies whole
+   entries from whichever pipe is readable, so the backends run in parallel
+   and the result is one archive with a single end marker. */
+static const struct { const char *ext; int port; const char *tname; } tar_types[] = {
+    { ".c", 0, "cfiles" }, { ".pdf", S2_PORT, "pdf" }, { ".txt", S3_PORT, "text" }, { ".zip", S4_PORT, "zip" },
+};
+#define TAR_NTYPES 4
 
-    DIR *dp = opendir(abspath);
-    if(!dp) return 0; // not fatal
+// ".c,.txt" / "all" -> bit mask of tar_types, 0 if any entry is unknown.
+static int tar_type_mask(const char *list){
+    if(strcmp(list,"all")==0) return (1<<TAR_NTYPES)-1;
+    int mask=0; char tmp[64]; snprintf(tmp,sizeof(tmp),"%s",list);
+    for(char *sv=NULL, *t=strtok_r(tmp,",",&sv); t; t=strtok_r(NULL,",",&sv)){
+        int i=0; while(i<TAR_NTYPES && strcmp(t,tar_types[i].ext)) i++;
+        if(i==TAR_NTYPES) return 0;
+        mask |= 1<<i;
+    }
+    return mask;
+}
 
-    struct dirent *de;
-    while((de=readdir(dp))){
-        if(de->d_name[0]=='.') continue;
-        char next_rel[4096];
-        if(rel && *rel) snprintf(next_rel,sizeof(next_rel), "%s/%s", rel, de->d_name);
-        else            snprintf(next_rel,sizeof(next_rel), "%s", de->d_name);
+static long long tar_octal(const unsigned char *p, int n){
+    if(p[0]&0x80){   // GNU base-256
+        long long v=p[0]&0x7f; for(int i=1;i<n;i++) v=(v<<8)|p[i];
+        return v;
+    }
+    long long v=0;
+    for(int i=0;i<n && p[i];i++){ if(p[i]>='0' && p[i]<='7') v=v*8+(p[i]-'0'); else if(v) break; }
+    return v;
+}
 
-        char next_abs[4096]; snprintf(next_abs,sizeof(next_abs), "%s/%s", root, next_rel);
+// Copy one entry (plus any GNU/pax prefix headers) from 'in' to 'out'.
+// Returns 1 if copied, 0 at the source's end marker, -1 if the source ends
+// before it (a truncated backend stream) or a write fails.
+static int tar_copy_entry(int in, int out){
+    for(;;){
+        unsigned char h[512];
+        if(read_full(in,h,512)!=0) return -1;
+        int zero=1; for(int i=0;i<512 && zero;i++) if(h[i]) zero=0;
+        if(zero) return 0;
+        if(write_n(out,h,512)!=512) return -1;
+        long long left=(tar_octal(h+124,12)+511)/512*512;
+        char buf[BUFSZ];
+        while(left>0){
+            size_t want = left>BUFSZ ? BUFSZ : (size_t)left;
+            if(read_full(in,buf,want)!=0) return -1;
+            if(write_n(out,buf,want)!=(ssize_t)want) return -1;
+            left -= (long long)want;
+        }
+        if(h[156]!='L' && h[156]!='K' && h[156]!='x' && h[156]!='g') return 1;
+    }
+}
 
-        struct stat st;
-        if(lstat(next_abs, &st)==0){
-            if(S_ISDIR(st.st_mode)){
-                collect_rec(root, next_rel, ext, outf, count);
-            }else if(S_ISREG(st.st_mode)){
-                if(ends_with_ext(de->d_name, ext)){
-                    fprintf(outf, "%s\n", next_rel); // relative path only
-                    (*count)++;
-                }
+#define TAR_EC    (1<<TAR_NTYPES)       // tar_source(): only the erasure-coded files of the types in mask
+#define TAR_PLAIN (1<<(TAR_NTYPES+1))   // tar_source(): without them
+
+// Tar entries for the erasure-coded files of the types in mask under rel
+// ("/dir"), rebuilt from their chunks.
+static int tar_ec_tree(int out, const char *rel, int mask){
+    char dir[2048]; join_path(dir, sizeof(dir), S1_ROOT, rel);
+    DIR *dp = opendir(dir);
+    if(!dp) return 0;
+    struct dirent *de; int rc = 0;
+    while(rc == 0 && (de = readdir(dp))){
+        if(rq.cancel){ rc = -1; break; }
+        if(de->d_type != DT_DIR || !strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        if(!strcmp(de->d_name, ".ec")){
+            char ed[2100]; snprintf(ed, sizeof(ed), "%s/.ec", dir);
+            DIR *ep = opendir(ed);
+            struct dirent *ee;
+            while(rc == 0 && ep && (ee = readdir(ep))){
+                int t = 1; while(t<TAR_NTYPES && !ends_with_ext(ee->d_name, tar_types[t].ext)) t++;
+                struct ec_man mf; char key[PACK_KEYMAX];
+                if(ee->d_name[0]=='.' || t==TAR_NTYPES || !(mask & (1<<t)) || ec_read_man(rel, ee->d_name, &mf, NULL, 0) != 0) continue;
+                pack_key(key, sizeof(key), rel, ee->d_name);
+                rc = ec_send(out, rel, ee->d_name, &mf, NULL, key);
             }
+            if(ep) closedir(ep);
+        }else if(de->d_name[0] != '.'){
+            char sub[1400]; snprintf(sub, sizeof(sub), "%s/%s", strcmp(rel, "/") ? rel : "", de->d_name);
+            rc = tar_ec_tree(out, sub, mask);
         }
     }
     closedir(dp);
-    return 0;
+    return rc;
 }
 
-// Create a tar with all files under 'root' that end with 'ext'.
-// On success, writes the tmp tar path into outpath and returns 0.
-static int make_tar_for_root(const char *root, const char *ext, char *outpath, size_t outsz){
-    char listtmp[] = "/tmp/s1listXXXXXX";
-    char tartmp[]  = "/tmp/s1tarXXXXXX";
-    int lfd = mkstemp(listtmp);
-    int tfd = mkstemp(tartmp);
-    if(lfd<0 || tfd<0){
-        if(lfd>=0) { close(lfd); unlink(listtmp); }
-        if(tfd>=0) { close(tfd); unlink(tartmp); }
-        return -1;
+// DOWNLTAR since= for the erasure-coded files: a ".deleted/EC" entry listing
+// those removed at or after 'since' from S1's journal, then the ones stored
+// since then. A journal younger than 'since' gives all of them ("full").
+static int tar_ec_incr(int out, const char *sub, int mask, long long since){
+    struct jrec *r = NULL; long long base = 0;
+    int fd = jnl_open(LOCK_SH);
+    int n = fd<0 ? -1 : jnl_load(fd, &r, &base);
+    if(fd>=0) close(fd);
+    if(n<0) return -1;
+    int full = since<base, rc;
+    char *man = NULL; size_t msz = 0;
+    FILE *m = open_memstream(&man, &msz);
+    if(!m){ jnl_free(r, n); return -1; }
+    fprintf(m, "# since %lld%s\n", since, full ? " full" : "");
+    for(int i=0;i<n && !full;i++){
+        int t = 1; while(t<TAR_NTYPES && !ends_with_ext(r[i].path, tar_types[t].ext)) t++;
+        if(r[i].op=='D' && r[i].us>=since && t<TAR_NTYPES && (mask & (1<<t)) && in_subtree(r[i].path, sub))
+            fprintf(m, "%s\n", r[i].path);
     }
-    close(tfd); // tar will recreate it
-    FILE *lfp = fdopen(lfd, "w");
-    if(!lfp){ close(lfd); unlink(listtmp); unlink(tartmp); return -1; }
+    fclose(m);
+    rc = tar_header(out, ".deleted/EC", (long long)msz, now_us()/1000000)==0 &&
+         write_n(out, man, msz)==(ssize_t)msz && tar_pad(out, (long long)msz)==0 ? 0 : -1;
+    free(man);
+    if(rc==0 && full){ char rel[1100]; snprintf(rel, sizeof(rel), "/%s", sub); rc = tar_ec_tree(out, rel, mask); }
+    for(int i=0;i<n && rc==0 && !full;i++){
+        int t = 1; while(t<TAR_NTYPES && !ends_with_ext(r[i].path, tar_types[t].ext)) t++;
+        if(r[i].op!='P' || r[i].us<since || t==TAR_NTYPES || !(mask & (1<<t)) || !in_subtree(r[i].path, sub)) continue;
+        if(rq.cancel){ rc = -1; break; }
+        const char *slash = strrchr(r[i].path, '/'), *fname = slash ? slash+1 : r[i].path;
+        char dest[1100]; struct ec_man mf;
+        snprintf(dest, sizeof(dest), "/%.*s", slash ? (int)(slash-r[i].path) : 0, r[i].path);
+        if(ec_read_man(dest, fname, &mf, NULL, 0) == 0) rc = ec_send(out, dest, fname, &mf, NULL, r[i].path);   // else gone again, or plain now
+    }
+    jnl_free(r, n);
+    return rc;
+}
 
-    int count = 0;
-    collect_rec(root, "", ext, lfp, &count);
-    fflush(lfp); fsync(lfd); fclose(lfp);
+// 0 if the helper 'pid' exited cleanly.
+static int tar_reap(pid_t pid){
+    int status = 0;
+    while(waitpid(pid, &status, 0)<0) if(errno!=EINTR) return -1;
+    return WIFEXITED(status) && WEXITSTATUS(status)==0 ? 0 : -1;
+}
 
-    pid_t pid = fork();
-    if(pid<0){
-        unlink(listtmp); unlink(tartmp);
-        return -1;
+// The end marker is only written if every source ended cleanly.
+static int tar_merge(int *src, int n, int out, const pid_t *pid){
+    struct pollfd pf[TAR_NTYPES+1];
+    for(int i=0;i<n;i++){ pf[i].fd=src[i]; pf[i].events=POLLIN; }
+    int live=n, rc=0;
+    while(live>0 && rc==0){
+        if(poll(pf,(nfds_t)n,-1)<0){ if(errno==EINTR) continue; rc=-1; break; }
+        for(int i=0;i<n && rc==0;i++){
+            if(pf[i].fd<0 || !(pf[i].revents&(POLLIN|POLLHUP|POLLERR))) continue;
+            int r = tar_copy_entry(pf[i].fd, out);
+            if(r<0) rc=-1;
+            else if(r==0){      // read the source's record padding too: it must not die of EPIPE
+                char pad[BUFSZ]; while(read(pf[i].fd,pad,sizeof(pad))>0);
+                close(pf[i].fd); pf[i].fd=-1; live--;
+            }
+        }
     }
+    for(int i=0;i<n;i++) if(pf[i].fd>=0) close(pf[i].fd);
+    for(int i=0;i<n;i++) if(tar_reap(pid[i])!=0) rc = -1;
+    return rc==0 ? tar_finish(out) : rc;
+}
+
+// Start a child that writes the plain tar for the types in 'mask' under 'sub'
+// (changes since 'since' if >= 0) into a pipe; returns the read end. The
+// child exits non-zero if the archive is incomplete: reap it with tar_reap().
+// With EC_K the erasure-coded files come from one more source (TAR_EC).
+static int tar_source(int mask, const char *sub, long long since, pid_t *pidp){
+    int p[2]; if(pipe(p)<0) return -1;
+    pid_t pid = fork();
+    if(pid<0){ close(p[0]); close(p[1]); return -1; }
     if(pid==0){
-        if(count==0){
-            // empty archive is valid
-            execlp("tar", "tar", "-cf", tartmp, "--files-from", "/dev/null", (char*)NULL);
+        close(p[0]);
+        prctl(PR_SET_PDEATHSIG, SIGKILL);   // a cancelled DOWNLTAR takes the whole tree down
+        signal(SIGPIPE, SIG_IGN);
+        tr_child();
+        int rc, src[TAR_NTYPES+1], n=0, one=-1; pid_t sp[TAR_NTYPES+1];
+        for(int i=0;i<TAR_NTYPES;i++) if(mask & (1<<i)) one = (one==-1) ? i : -2;
+        int ec = EC_K && !(mask & TAR_PLAIN) && (mask & ((1<<TAR_NTYPES)-2));
+        int th = tr_begin(mask & TAR_EC ? "ec.tar" : one>=0 && !ec ? tar_types[one].tname : "tar.merge");
+        if(mask & TAR_EC){
+            char rel[1100]; snprintf(rel, sizeof(rel), "/%s", sub);
+            rc = since>=0 ? tar_ec_incr(p[1], sub, mask, since) : tar_ec_tree(p[1], rel, mask);
+            if(rc==0) rc = tar_finish(p[1]);
+        }else if(one>=0 && !ec){
+            if(one==0) rc = since>=0 ? write_incr_tar(S1_ROOT, ".c", sub, since, p[1])
+                                     : write_tar_stream(S1_ROOT, ".c", sub, p[1]);
+            else rc = fetch_tar_from_aux(tar_types[one].port, tar_types[one].ext, sub, since, p[1]) < 0;
         }else{
-            execlp("tar", "tar", "-C", root, "-cf", tartmp, "-T", listtmp, (char*)NULL);
+            rc = 0;
+            for(int i=0;i<TAR_NTYPES;i++)
+                if(mask & (1<<i)){
+                    if((src[n]=tar_source((1<<i) | TAR_PLAIN, sub, since, &sp[n]))>=0) n++;
+                    else rc = -1;
+                }
+            if(ec){
+                if((src[n]=tar_source(TAR_EC | mask, sub, since, &sp[n]))>=0) n++;
+                else rc = -1;
+            }
+            if(rc==0) rc = tar_merge(src, n, p[1], sp);
+            else for(int i=0;i<n;i++){ close(src[i]); tar_reap(sp[i]); }
         }
-        _exit(127);
-    }
-    int status=0; waitpid(pid, &status, 0);
-    unlink(listtmp);
-    if(!WIFEXITED(status) || WEXITSTATUS(status)!=0){
-        unlink(tartmp);
-        return -2;
+        tr_end(th);
+        tr_finish();
+        _exit(rc ? 1 : 0);
     }
-    snprintf(outpath, outsz, "%s", tartmp);
-    return 0;
+    rq_child(pid);
+    close(p[1]);
+    *pidp = pid;
+    return p[0];
 }
 
-// fetch tar stream from S2/S3 into 'out_fd' and return size, or <0 on error
-static long long fetch_tar_from_aux(int port, const char *ext, int out_fd){
-    int sd = connect_local_port(port);
-    if(sd < 0) return -1;
-    dprintf(sd, "TARALL %s\n", ext);            // ext = ".pdf" or ".txt"
-
-    char hdr[256]; ssize_t rn = read_line(sd, hdr, sizeof(hdr));
-    if(rn <= 0 || strncmp(hdr, "OK ", 3) != 0){ close(sd); return -2; }
-    long long size=0; if(sscanf(hdr+3,"%lld",&size)!=1 || size<0){ close(sd); return -3; }
-
-    char buf[BUFSZ]; long long left=size;
-    while(left>0){
-        ssize_t r = read(sd, buf, (left > BUFSZ ? BUFSZ : (size_t)left));
-        if(r <= 0){ close(sd); return -4; }
-        if(write_n(out_fd, buf, (size_t)r) != r){ close(sd); return -5; }
-        left -= r;
+// Streamed DOWNLTAR (several types, a subtree, compression or since=):
+// replies "TAR <name> -1 z=... [since=<next token>]" and frames. Returns 0
+// once a TAR reply went out, -1 if nothing was sent. A source or compressor
+// that fails after that ends the frames with the error frame, not the end
+// marker, so the client does not keep a truncated archive.
+static int send_tar_stream(int csd, int mask, const char *sub, int kind, long long since){
+    char tname[64]; int one=-1;
+    for(int i=0;i<TAR_NTYPES;i++) if(mask & (1<<i)) one = (one==-1) ? i : -2;
+    snprintf(tname, sizeof(tname), "%s.tar%s", one>=0 ? tar_types[one].tname : "cluster",
+             kind==TARZ_GZ ? ".gz" : kind==TARZ_ZST ? ".zst" : "");
+    long long token = since>=0 ? now_us() : -1;   // taken first: later changes land in the next run
+    pid_t spid;
+    int src = tar_source(mask, sub, since, &spid);
+    if(src<0) return -1;
+    struct tz_out o = { .csd = csd, .tname = tname, .codec = Z_RAW, .token = token };
+    int rc;
+    if(kind==TARZ_NONE){
+        if(client_codec!=Z_NONE && !(one>0 && z_skip_ext(tar_types[one].ext))) o.codec = client_codec;
+        rc = tz_pump(src, &o);
     }
-    close(sd);
-    return size;
+    else if(tarz_inproc(kind)) rc = tarz_parallel(src, kind, &o);
+    else                       rc = tarz_external(src, kind, &o);
+    close(src);                          // a source still writing gets EPIPE and stops
+    if(tar_reap(spid)!=0) rc = -1;
+    if(rc!=0) rq_saved(-1);
+    if(!o.sent) return -1;
+    if(rc!=0) zw_abort(&o.zw);
+    else      zw_end(&o.zw);
+    return 0;
 }
 /*---------------------------------------------------------------*/
 // list local files under S1_ROOT/dest with a given extension; returns sorted array
 static int s1_list_local_by_ext(const char *dest, const char *ext, char ***out_names){
-    char dir[2048]; join_path(dir, sizeof(dir), S1_ROOT, dest);
-    DIR *dp = opendir(dir);
-    if(!dp){ *out_names=NULL; return 0; }
+    unsigned gen = 0;
+    int n = dc_get(dest, ext, out_names, &gen);
+    if(n >= 0) return n;
 
-    int n=0, cap=32;
-    char **names = malloc(cap * sizeof(char*));
-    struct dirent *de;
-    while((de=readdir(dp))){
-        if(de->d_name[0]=='.') continue;
-        const char *dot = strrchr(de->d_name,'.');
-        if(dot && strcasecmp(dot, ext)==0){
-            if(n==cap){ cap*=2; names = realloc(names, cap*sizeof(char*)); }
-            names[n++] = strdup(de->d_name);
+    int cap=0; n=0;
+    char **names = NULL;
+    struct mdir md = { &names, &n, &cap };
+    if(meta_dir_each(dest, ext, meta_dir_add, &md) < 0){
+        char dir[2048]; join_path(dir, sizeof(dir), S1_ROOT, dest);
+        DIR *dp = opendir(dir);
+        if(!dp && !PACKSTORE){ *out_names=NULL; return 0; }
+        struct dirent *de;
+        while(dp && (de=readdir(dp))){
+            if(de->d_name[0]=='.') continue;
+            const char *dot = strrchr(de->d_name,'.');
+            if(dot && strcasecmp(dot, ext)==0 && arena_push(&names, &n, &cap, de->d_name)!=0) break;
         }
+        if(dp) closedir(dp);
     }
-    closedir(dp);
+    if(PACKSTORE) n = pack_list(dest, ext, &names, n, &cap);
 
     int cmpstr(const void *a, const void *b){ return strcmp(*(char *const*)a, *(char *const*)b); }
     if(n>0) qsort(names, n, sizeof(char*), cmpstr);
+    dc_put(dest, ext, gen, names, n);
     *out_names = names;
     return n;
 }
 
-// ask an auxiliary server to LIST; returns count and malloc'd array (sorted by server)
+// ask an auxiliary server to LIST; returns count and an arena array (sorted by server)
 static int s1_request_list_from_aux(int port, const char *dest, char ***out_names){
-    int sd = connect_local_port(port);
+    int zc = Z_NONE;
+    int sd = connect_aux(port, aux_codec(), &zc);
     if(sd < 0){ *out_names=NULL; return -1; }
 
-    dprintf(sd, "LIST %s\n", dest);
+    dprintf(sd, "LIST %s%s\n", dest, tr_opt());
 
     char hdr[256];
     if(read_line(sd, hdr, sizeof(hdr)) <= 0 || strncmp(hdr,"OK ",3)!=0){ close(sd); *out_names=NULL; return -2; }
 
     int count=0; sscanf(hdr+3, "%d", &count);
     if(count <= 0){ close(sd); *out_names=NULL; return 0; }
+    char zv[16]; int in_c = opt_get(hdr, "z", zv, sizeof(zv)) ? z_parse(zv) : Z_NONE;
+    if(in_c < 0){ close(sd); *out_names=NULL; return -2; }
+    struct zr zr; zr_init(&zr, sd, in_c);
 
-    char **names = malloc((size_t)count * sizeof(char*));
+    char **names = arena_alloc((size_t)count * sizeof(char*));
     for(int i=0;i<count;i++){
-        char ln[512];
-        if(read_line(sd, ln, sizeof(ln)) <= 0 || strncmp(ln,"NAME ",5)!=0){
+        char ln[512], *p = ln+5, *nm;
+        if(!names || zr_line(&zr, ln, sizeof(ln)) <= 0 || strncmp(ln,"NAME ",5)!=0 ||
+           !(nm = tok_next(&p)) || !(names[i] = arena_strdup(nm))){
             count = i; break;
         }
-        char nm[256]; sscanf(ln+5, "%255s", nm);
-        names[i] = strdup(nm);
     }
     close(sd);
     *out_names = names;
     return count;
 }
 
+/* ---------- bulk remove (REMOVEF) ----------
+   "REMOVEF <n>" takes any number of PATH lines. Routed files are grouped by
+   aux server and removed with DELBATCH, RM_BATCH names per round trip. Each
+   server gets its own thread, so the backends work in parallel while S1
+   removes the .c files itself. The "OK <name>" / "ERR <name>" lines come
+   back in request order, in as few writes as possible; a malformed PATH
+   only fails its own line.
+   "REMOVEF ~S1/<dir> [<ext>[,<ext>...]|all]" removes every file of those
+   types under dir, with one DELTREE per aux server. dir can't be empty:
+   "REMOVEF all [types]" is the whole tree. The answer is an
+   "OK <path>" line per removed file ("ERR .<ext>" for a server that failed)
+   and then "DONE <removed> <errors>". */
+#ifndef RM_BATCH
+#define RM_BATCH 1024          // at most the aux servers' DEL_BATCH
+#endif
+#define REMOVE_MAX (1<<20)     // PATH lines per REMOVEF
+
+struct rment { char *dest, *fname; int port; char ok; };
+struct rmjob { int port, n, done, err; struct rment **e; const char *sub, *ext; char *out; size_t osz; };
+
+static void *rm_batch_worker(void *arg){
+    struct rmjob *j = arg;
+    int sd = connect_local_port(j->port);
+    char *req = malloc((size_t)RM_BATCH*1300), hdr[64];
+    for(int i=0; i<j->n && sd>=0 && req; i+=RM_BATCH){
+        int m = j->n-i < RM_BATCH ? j->n-i : RM_BATCH, got = 0;
+        size_t l = 0;
+        for(int k=0;k<m;k++) l += (size_t)snprintf(req+l, 1300, "%s %s\n", j->e[i+k]->dest, j->e[i+k]->fname);
+        head_printf(sd, 1, "DELBATCH %d %zu%s\n", m, l, tr_opt());
+        if(write_n(sd, req, l) != (ssize_t)l || read_line(sd, hdr, sizeof(hdr)) <= 0 ||
+           sscanf(hdr, "OK %d", &got) != 1 || got != m || read_full(sd, req, (size_t)m) < 0) break;
+        for(int k=0;k<m;k++) j->e[i+k]->ok = req[k]=='+';
+    }
+    free(req);
+    if(sd >= 0) close(sd);
+    return NULL;
+}
+static void *rm_tree_worker(void *arg){
+    struct rmjob *j = arg;
+    FILE *m = open_memstream(&j->out, &j->osz);
+    int sd = connect_local_port(j->port), cnt = 0;
+    char hdr[128]; long long bytes = -1;
+    if(sd >= 0){
+        dprintf(sd, "DELTREE /%s%s\n", j->sub, tr_opt());
+        if(read_line(sd, hdr, sizeof(hdr)) <= 0 || sscanf(hdr, "OK %d %lld", &cnt, &bytes) != 2 || bytes < 0) bytes = -1;
+    }
+    char *names = bytes >= 0 ? malloc((size_t)bytes+1) : NULL;
+    if(names && read_full(sd, names, (size_t)bytes) == 0){
+        names[bytes] = '\0';
+        for(char *p = names, *e; *p; p = e+1){
+            if(!(e = strchr(p, '\n'))) break;
+            *e = '\0';
+            tier_drop(p);
+            if(m) fprintf(m, "OK %s\n", p);
+            j->done++;
+        }
+    }else{
+        if(m) fprintf(m, "ERR %s\n", j->ext);
+        j->err++;
+    }
+    free(names);
+    if(sd >= 0) close(sd);
+    if(m) fclose(m);
+    return NULL;
+}
+
+// Erasure-coded files of the types in mask under rel ("/dir"): removed, and reported to m.
+static void rm_ec_tree(const char *rel, int mask, FILE *m, int *done){
+    char dir[2048]; join_path(dir, sizeof(dir), S1_ROOT, rel);
+    DIR *dp = opendir(dir);
+    if(!dp) return;
+    struct dirent *de;
+    while((de = readdir(dp))){
+        if(de->d_type != DT_DIR || !strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        if(!strcmp(de->d_name, ".ec")){
+            char ed[2100]; snprintf(ed, sizeof(ed), "%s/.ec", dir);
+            DIR *ep = opendir(ed);
+            struct dirent *ee;
+            while(ep && (ee = readdir(ep))){
+                int t = 1; while(t<TAR_NTYPES && !ends_with_ext(ee->d_name, tar_types[t].ext)) t++;
+                if(ee->d_name[0]=='.' || t==TAR_NTYPES || !(mask & (1<<t)) || ec_drop(rel, ee->d_name, 1) != 0) continue;
+                char key[PACK_KEYMAX]; pack_key(key, sizeof(key), rel, ee->d_name);
+                fprintf(m, "OK %s\n", key);
+                (*done)++;
+            }
+            if(ep) closedir(ep);
+        }else if(de->d_name[0] != '.'){
+            char sub[1400]; snprintf(sub, sizeof(sub), "%s/%s", strcmp(rel, "/") ? rel : "", de->d_name);
+            rm_ec_tree(sub, mask, m, done);
+        }
+    }
+    closedir(dp);
+}
+
+// REMOVEF ~S1/<dir> [types]
+static void remove_tree(int csd, const char *sub, int mask){
+    struct rmjob job[TAR_NTYPES]; pthread_t th[TAR_NTYPES]; int started[TAR_NTYPES] = {0};
+    for(int t=1;t<TAR_NTYPES;t++){
+        job[t] = (struct rmjob){ .port = tar_types[t].port, .sub = sub, .ext = tar_types[t].ext };
+        if((mask & (1<<t)) && pthread_create(&th[t], NULL, rm_tree_worker, &job[t]) == 0) started[t] = 1;
+        else if(mask & (1<<t)) rm_tree_worker(&job[t]);
+    }
+    char *out = NULL; size_t osz = 0; int done = 0, err = 0;
+    FILE *m = open_memstream(&out, &osz);
+    if(!m){
+        for(int t=1;t<TAR_NTYPES;t++) if(started[t]) pthread_join(th[t], NULL);
+        dprintf(csd, "ERR nomem\n");
+        return;
+    }
+    if(mask & 1){          // .c files: S1's own, on disk and packed
+        char **v; int n = walk_tree(S1_ROOT, sub, ".c", &v);
+        for(int i=0;i<n;i++){
+            char *slash = strrchr(v[i], '/'), dest[1100];
+            snprintf(dest, sizeof(dest), "/%.*s", slash ? (int)(slash-v[i]) : 0, v[i]);
+            if(delete_local(dest, slash ? slash+1 : v[i]) == 0){ fprintf(m, "OK %s\n", v[i]); done++; }
+        }
+        walk_free(v, n);
+        if(PACKSTORE && pack_lock(LOCK_SH) == 0){
+            pack_sync();
+            char **keys = NULL; int nk = 0, cap = 0;
+            for(size_t i=0;i<pk.cap;i++){
+                struct pack_ent *e = &pk.tab[i];
+                if(e->key && e->live && ends_with_ext(e->key, ".c") && in_subtree(e->key, sub) &&
+                   arena_push(&keys, &nk, &cap, e->key) != 0) break;
+            }
+            pack_lock(LOCK_UN);
+            for(int i=0;i<nk;i++){
+                char *slash = strrchr(keys[i], '/'), dest[1100];
+                snprintf(dest, sizeof(dest), "/%.*s", slash ? (int)(slash-keys[i]) : 0, keys[i]);
+                if(delete_local(dest, slash ? slash+1 : keys[i]) == 0){ fprintf(m, "OK %s\n", keys[i]); done++; }
+            }
+        }
+    }
+    char rel[1100]; snprintf(rel, sizeof(rel), "/%s", sub);
+    if(mask & ~1) rm_ec_tree(rel, mask, m, &done);
+    for(int t=1;t<TAR_NTYPES;t++){
+        if(!(mask & (1<<t))) continue;
+        if(started[t]) pthread_join(th[t], NULL);
+        if(job[t].osz) fwrite(job[t].out, 1, job[t].osz, m);
+        free(job[t].out);
+        done += job[t].done; err += job[t].err;
+    }
+    fprintf(m, "DONE %d %d\n", done, err);
+    fclose(m);
+    write_n(csd, out, osz);
+    free(out);
+}
+
+// REMOVEF <n>: all n PATH lines are read, and one that can't be a file
+// gets "ERR <what was sent>" while the rest are removed. -1 when the
+// request stream is broken and the session must end.
+static int remove_list(int csd, int n){
+    struct rment *e = arena_alloc((size_t)n*sizeof(*e)), **byport = arena_alloc((size_t)n*sizeof(*byport));
+    if(!e || !byport){ dprintf(csd, "ERR nomem\n"); return -1; }
+    for(int i=0;i<n;i++){
+        char pline[1200]; if(read_line(csd, pline, sizeof(pline)) <= 0){ dprintf(csd,"ERR path\n"); return -1; }
+        pline[strcspn(pline, "\r\n")] = '\0';
+        char *q = pline+5, *full = strncmp(pline,"PATH ",5)==0 ? tok_next(&q) : NULL;
+        if(full && i==0) slow_arg(full);
+        if(full && strncmp(full,"~S1/",4)==0) full += 3;
+        char *slash = full && !strstr(full,"..") ? strrchr(full,'/') : NULL;
+        e[i].port = 0; e[i].ok = 0; e[i].dest = NULL;
+        if(!slash || slash==full || !slash[1]){
+            if(!(e[i].fname = arena_strdup(full ? full : pline))){ dprintf(csd, "ERR nomem\n"); return -1; }
+            continue;
+        }
+
+        *slash = '\0';
+        if(!(e[i].dest = arena_strdup(full)) || !(e[i].fname = arena_strdup(slash+1))){ dprintf(csd, "ERR nomem\n"); return -1; }
+        const char *ext = file_ext(e[i].fname);
+        e[i].port = (!strcasecmp(ext,".pdf"))?S2_PORT:(!strcasecmp(ext,".txt"))?S3_PORT:(!strcasecmp(ext,".zip"))?S4_PORT:0;
+        if(e[i].port){
+            char key[PACK_KEYMAX]; pack_key(key, sizeof(key), e[i].dest, e[i].fname);
+            tier_drop(key);
+        }
+    }
+
+    struct rmjob job[TAR_NTYPES]; pthread_t th[TAR_NTYPES]; int started[TAR_NTYPES] = {0}, nb = 0;
+    for(int t=1;t<TAR_NTYPES;t++){
+        job[t] = (struct rmjob){ .port = tar_types[t].port, .e = byport+nb };
+        for(int i=0;i<n;i++) if(e[i].port == job[t].port) byport[nb++] = &e[i];
+        job[t].n = (int)(byport+nb - job[t].e);
+        if(job[t].n && pthread_create(&th[t], NULL, rm_batch_worker, &job[t]) == 0) started[t] = 1;
+        else if(job[t].n) rm_batch_worker(&job[t]);
+    }
+    for(int i=0;i<n;i++) if(!e[i].port && e[i].dest) e[i].ok = delete_local(e[i].dest, e[i].fname) == 0;
+    for(int t=1;t<TAR_NTYPES;t++) if(started[t]) pthread_join(th[t], NULL);
+    for(int i=0;i<n;i++) if(e[i].port && ec_drop(e[i].dest, e[i].fname, 1) == 0) e[i].ok = 1;
+    for(int i=0;i<n;i++)
+        if(e[i].port && e[i].ok){
+            char key[PACK_KEYMAX]; pack_key(key, sizeof(key), e[i].dest, e[i].fname);
+            tier_drop(key);   // a copy-in that started after the first drop
+        }
+
+    struct zw zw; zw_init(&zw, csd, Z_NONE);
+    char ln[320];
+    for(int i=0;i<n;i++) zw_write(&zw, ln, (size_t)snprintf(ln, sizeof(ln), "%s %s\n", e[i].ok ? "OK" : "ERR", e[i].fname));
+    zw_end(&zw);
+    return 0;
+}
+
+/* ---------- server-side copy / move (COPY, MOVE) ----------
+   "COPY <src> <dst>" and "MOVE <src> <dst>" (~S1 paths; a dst ending in '/'
+   keeps the file name) never pass file data through the client. Inside one
+   backend the backend does it itself (rename, or a clone that shares extents
+   where the filesystem can). Between two aux servers the target PULLs the
+   file from the source. When S1 is one side, S1 streams the file to or from
+   the aux server. An erasure-coded file is moved chunk by chunk on its chunk
+   servers, and only its manifest changes on S1. Either way the answer is
+   "OK", or "ERR nofile|copy|type <name>".
+   "COPY ~S1/<dir>/ ~S1/<to>/" (MOVE likewise) does every .c/.pdf/.txt/.zip
+   file under dir, with one COPYTREE/MOVETREE per aux server. It answers
+   like REMOVEF's prefix form: an "OK <new path>" line per file, then
+   "DONE <done> <errors>". */
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+static int route_port(const char *fname){
+    const char *ext = file_ext(fname);
+    return !strcasecmp(ext,".pdf") ? S2_PORT : !strcasecmp(ext,".txt") ? S3_PORT : !strcasecmp(ext,".zip") ? S4_PORT : 0;
+}
+// One command to an aux server: 0 on OK, -1 on "ERR nofile", -2 otherwise.
+static int aux_call(int port, const char *fmt, ...){
+    char cmd[3000]; va_list ap;
+    va_start(ap, fmt); vsnprintf(cmd, sizeof(cmd), fmt, ap); va_end(ap);
+    int sd = connect_local_port(port);
+    if(sd < 0) return -2;
+    dprintf(sd, "%s%s\n", cmd, tr_opt());
+    char line[128]; ssize_t rn = read_line(sd, line, sizeof(line));
+    close(sd);
+    if(rn > 0 && strncmp(line, "OK", 2) == 0) return 0;
+    return rn > 0 && strncmp(line, "ERR nofile", 10) == 0 ? -1 : -2;
+}
+// src -> dst through a temporary name; FICLONE, else copy_file_range, else read/write.
+static int clone_file(const char *src, const char *dst){
+    int in = open(src, O_RDONLY);
+    if(in < 0) return -1;
+    char tmp[3200]; snprintf(tmp, sizeof(tmp), "%s.cp%d", dst, (int)getpid());
+    int out = open(tmp, O_CREAT|O_TRUNC|O_WRONLY, 0664);
+    struct stat st; int rc = out<0 || fstat(in, &st)<0 ? -1 : 0;
+    if(rc == 0 && ioctl(out, FICLONE, in) != 0){
+        long long left = st.st_size;
+        while(left > 0){
+            ssize_t r = copy_file_range(in, NULL, out, NULL, (size_t)left, 0);
+            if(r <= 0) break;
+            left -= r;
+        }
+        char *buf = left > 0 ? iob_get() : NULL;
+        while(left > 0 && buf){
+            ssize_t r = read(in, buf, IOB_SIZE);
+            if(r <= 0 || write_n(out, buf, (size_t)r) != r) break;
+            left -= r;
+        }
+        iob_put(buf);
+        if(left > 0) rc = -1;
+    }
+    close(in);
+    if(out >= 0) close(out);
+    if(rc == 0 && rename(tmp, dst) != 0) rc = -1;
+    if(rc != 0) unlink(tmp);
+    return rc;
+}
+// COPY/MOVE of a file S1 keeps itself. 0 done, -1 no such file, -2 failed.
+static int local_copy(const char *sdest, const char *sf, const char *ddest, const char *df, int move){
+    char sdir[2048], ddir[2048], src[3072], dst[3072];
+    join_path(sdir, sizeof(sdir), S1_ROOT, sdest); join_path(ddir, sizeof(ddir), S1_ROOT, ddest);
+    snprintf(src, sizeof(src), "%s/%s", sdir, sf); snprintf(dst, sizeof(dst), "%s/%s", ddir, df);
+    char skey[PACK_KEYMAX], dkey[PACK_KEYMAX]; pack_key(skey, sizeof(skey), sdest, sf); pack_key(dkey, sizeof(dkey), ddest, df);
+    if(ensure_dir(ddir) < 0) return -2;
+    if(PACKSTORE){
+        char *data = NULL; long long n = pack_get(skey, &data, NULL, NULL);
+        if(n >= 0){
+            int rc = pack_put(dkey, data, (uint32_t)n);
+            free(data);
+            if(rc != 0) return -2;
+            unlink(dst);
+            if(move) delete_local(sdest, sf);
+            jnl_add('P', dkey);
+            return 0;
+        }
+    }
+    if(move ? rename(src, dst) != 0 : clone_file(src, dst) != 0) return errno==ENOENT ? -1 : -2;
+    if(PACKSTORE) pack_del(dkey);
+    if(move) jnl_add('D', skey);
+    jnl_add('P', dkey);
+    return 0;
+}
+// An aux server's file becomes one of S1's: FETCH it into place.
+static int aux_to_local(int port, const char *sdest, const char *sf, const char *ddest, const char *df){
+    char ddir[2048], dst[3072], tmp[3200]; join_path(ddir, sizeof(ddir), S1_ROOT, ddest);
+    snprintf(dst, sizeof(dst), "%s/%s", ddir, df); snprintf(tmp, sizeof(tmp), "%s.cp%d", dst, (int)getpid());
+    char key[PACK_KEYMAX]; pack_key(key, sizeof(key), ddest, df);
+    if(ensure_dir(ddir) < 0) return -2;
+    int sd = connect_local_port(port);
+    if(sd < 0) return -2;
+    dprintf(sd, "FETCH %s %s%s\n", sdest, sf, tr_opt());
+    char hdr[256]; long long size = -1;
+    if(read_line(sd, hdr, sizeof(hdr)) <= 0 || sscanf(hdr, "OK %lld", &size) != 1 || size < 0){ close(sd); return -1; }
+    int rc = 0;
+    if(PACKSTORE && size <= PACK_MAX && !strcasecmp(file_ext(df), ".c")){
+        char *data = malloc(size ? (size_t)size : 1);
+        rc = data && read_full(sd, data, (size_t)size) == 0 && pack_put(key, data, (uint32_t)size) == 0 ? 0 : -2;
+        free(data);
+        if(rc == 0) unlink(dst);
+    }else{
+        int fd = open(tmp, O_CREAT|O_TRUNC|O_WRONLY, 0664);
+        rc = fd >= 0 && xfer_copy(sd, fd, size, -1, 0) == size ? 0 : -2;
+        if(fd >= 0) close(fd);
+        if(rc == 0 && rename(tmp, dst) != 0) rc = -2;
+        if(rc != 0) unlink(tmp);
+        else if(PACKSTORE) pack_del(key);
+    }
+    close(sd);
+    if(rc == 0) jnl_add('P', key);
+    return rc;
+}
+// One of S1's files goes to an aux server: STORE it from the pack or the file.
+static int local_to_aux(int port, const char *sdest, const char *sf, const char *ddest, const char *df){
+    char key[PACK_KEYMAX]; pack_key(key, sizeof(key), sdest, sf);
+    char *data = NULL; long long size = PACKSTORE ? pack_get(key, &data, NULL, NULL) : -1;
+    int fd = -1;
+    if(size < 0){
+        char dir[2048], src[3072]; join_path(dir, sizeof(dir), S1_ROOT, sdest);
+        snprintf(src, sizeof(src), "%s/%s", dir, sf);
+        struct stat st;
+        if((fd = open(src, O_RDONLY)) < 0) return -1;
+        fstat(fd, &st); size = st.st_size;
+    }
+    int sd = connect_local_port(port), rc = sd < 0 ? -2 : 0;
+    if(rc == 0){
+        head_printf(sd, size>0, "STORE %s %s %lld%s\n", ddest, df, size, tr_opt());
+        if(data ? write_n(sd, data, (size_t)size) != size : xfer_copy(fd, sd, size, 0, -1) != size) rc = -2;
+        char line[128];
+        if(rc == 0 && (read_line(sd, line, sizeof(line)) <= 0 || strncmp(line, "OK", 2) != 0)) rc = -2;
+        close(sd);
+    }
+    free(data);
+    if(fd >= 0) close(fd);
+    return rc;
+}
+// Erasure-coded dest/fname: its chunks are copied or renamed where they are,
+// then the manifest; a plain file at the target on port dp goes. -1 if it
+// isn't erasure-coded, -2 if a chunk server failed (chunks already done are
+// put back).
+static int ec_copy(const char *sdest, const char *sf, const char *ddest, const char *df, int move, int dp){
+    struct ec_man mf;
+    if(ec_read_man(sdest, sf, &mf, NULL, 0) != 0) return -1;
+    char sed[1100], ded[1100], smp[3200], dmp[3200], ddir[2048], sc[300], dc[300];
+    ec_dir(sed, sizeof(sed), sdest); ec_dir(ded, sizeof(ded), ddest);
+    ec_man_path(smp, sizeof(smp), sdest, sf); ec_man_path(dmp, sizeof(dmp), ddest, df);
+    join_path(ddir, sizeof(ddir), S1_ROOT, ded);
+    if(ensure_dir(ddir) < 0) return -2;
+    (void)ec_drop(ddest, df, 0);
+    int n = mf.k+mf.m, j;
+    for(j=0;j<n;j++){
+        ec_chunk(sc, sizeof(sc), sf, mf.gen, j); ec_chunk(dc, sizeof(dc), df, mf.gen, j);
+        if(aux_call(ec_ports[(mf.home+j)%EC_MAXN], "%s %s %s %s %s", move ? "MOVE" : "COPY", sed, sc, ded, dc) != 0) break;
+    }
+    int rc = j < n ? -2 : move ? rename(smp, dmp) : clone_file(smp, dmp);
+    if(rc != 0){
+        while(j-- > 0){
+            ec_chunk(sc, sizeof(sc), sf, mf.gen, j); ec_chunk(dc, sizeof(dc), df, mf.gen, j);
+            int port = ec_ports[(mf.home+j)%EC_MAXN];
+            if(move) (void)aux_call(port, "MOVE %s %s %s %s", ded, dc, sed, sc);
+            else     (void)delete_remote(port, ded, dc);
+        }
+        return -2;
+    }
+    (void)delete_remote(dp, ddest, df);   // an older plain copy
+    char skey[PACK_KEYMAX], dkey[PACK_KEYMAX]; pack_key(skey, sizeof(skey), sdest, sf); pack_key(dkey, sizeof(dkey), ddest, df);
+    if(move) jnl_add('D', skey);
+    jnl_add('P', dkey);
+    return 0;
+}
+// COPY/MOVE of one file: 0 done, -1 no such file, -2 failed, -3 wrong type.
+static int copy_file(const char *sdest, const char *sf, const char *ddest, const char *df, int move){
+    int sp = route_port(sf), dp = route_port(df), rc;
+    char skey[PACK_KEYMAX], dkey[PACK_KEYMAX]; pack_key(skey, sizeof(skey), sdest, sf); pack_key(dkey, sizeof(dkey), ddest, df);
+    if(!strcmp(skey, dkey)) return -2;
+    tier_drop(dkey);
+    if(move) tier_drop(skey);
+    struct ec_man mf;
+    if(sp && ec_read_man(sdest, sf, &mf, NULL, 0) == 0){
+        if(!dp) return -3;     // S1 serves its own types from disk only
+        if((rc = ec_copy(sdest, sf, ddest, df, move, dp)) == 0) tier_drop(dkey);
+        return rc;
+    }
+    const char *op = move ? "MOVE" : "COPY";
+    if(sp == dp) rc = sp ? aux_call(sp, "%s %s %s %s %s", op, sdest, sf, ddest, df) : local_copy(sdest, sf, ddest, df, move);
+    else if(sp && dp) rc = aux_call(dp, "PULL %d %s %s %s %s", sp, sdest, sf, ddest, df);
+    else if(sp) rc = aux_to_local(sp, sdest, sf, ddest, df);
+    else rc = local_to_aux(dp, sdest, sf, ddest, df);
+    if(rc != 0) return rc;
+    if(move && sp != dp) (void)(sp ? delete_remote(sp, sdest, sf) : delete_local(sdest, sf));
+    if(dp) (void)ec_drop(ddest, df, 0);
+    tier_drop(dkey);   // a copy-in of the old target that started meanwhile
+    return 0;
+}
+
+// path under sub -> the same path under nsub (root-relative, no leading '/').
+static void tree_rebase(char *out, size_t n, const char *path, const char *sub, const char *nsub){
+    const char *rest = path+strlen(sub); while(*rest=='/') rest++;
+    snprintf(out, n, "%s%s%s", nsub, *nsub ? "/" : "", rest);
+}
+static void split_rel(const char *path, char *dest, size_t n, const char **fname){
+    const char *slash = strrchr(path, '/');
+    snprintf(dest, n, "/%.*s", slash ? (int)(slash-path) : 0, path);
+    *fname = slash ? slash+1 : path;
+}
+struct cpjob { int port, move, done, err; const char *sub, *nsub, *ext; char *out; size_t osz; };
+
+static void *cp_tree_worker(void *arg){
+    struct cpjob *j = arg;
+    FILE *m = open_memstream(&j->out, &j->osz);
+    int sd = connect_local_port(j->port), cnt = 0;
+    char hdr[128]; long long bytes = -1;
+    if(sd >= 0){
+        dprintf(sd, "%s /%s /%s%s\n", j->move ? "MOVETREE" : "COPYTREE", j->sub, j->nsub, tr_opt());
+        if(read_line(sd, hdr, sizeof(hdr)) <= 0 || sscanf(hdr, "OK %d %lld", &cnt, &bytes) != 2 || bytes < 0) bytes = -1;
+    }
+    char *names = bytes >= 0 ? malloc((size_t)bytes+1) : NULL;
+    if(names && read_full(sd, names, (size_t)bytes) == 0){
+        names[bytes] = '\0';
+        for(char *p = names, *e; *p; p = e+1){
+            if(!(e = strchr(p, '\n'))) break;
+            *e = '\0';
+            char np[2200], dd[2200]; const char *df;
+            tree_rebase(np, sizeof(np), p, j->sub, j->nsub);
+            if(j->move) tier_drop(p);
+            tier_drop(np);
+            split_rel(np, dd, sizeof(dd), &df);
+            (void)ec_drop(dd, df, 0);
+            if(m) fprintf(m, "OK %s\n", np);
+            j->done++;
+        }
+    }else{
+        if(m) fprintf(m, "ERR %s\n", j->ext);
+        j->err++;
+    }
+    free(names);
+    if(sd >= 0) close(sd);
+    if(m) fclose(m);
+    return NULL;
+}
+// Erasure-coded files under rel ("/dir"), copied or moved from sub to nsub.
+static void cp_ec_tree(const char *rel, const char *sub, const char *nsub, int move, FILE *m, int *done, int *err){
+    char dir[2048]; join_path(dir, sizeof(dir), S1_ROOT, rel);
+    DIR *dp = opendir(dir);
+    if(!dp) return;
+    struct dirent *de;
+    while((de = readdir(dp))){
+        if(de->d_type != DT_DIR || !strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        if(!strcmp(de->d_name, ".ec")){
+            char ed[2100]; snprintf(ed, sizeof(ed), "%s/.ec", dir);
+            DIR *ep = opendir(ed);
+            struct dirent *ee;
+            while(ep && (ee = readdir(ep))){
+                if(ee->d_name[0]=='.' || !route_port(ee->d_name)) continue;
+                char key[PACK_KEYMAX], np[2200], dd[2200]; const char *df;
+                pack_key(key, sizeof(key), rel, ee->d_name);
+                tree_rebase(np, sizeof(np), key, sub, nsub);
+                split_rel(np, dd, sizeof(dd), &df);
+                if(copy_file(rel, ee->d_name, dd, df, move) == 0){ fprintf(m, "OK %s\n", np); (*done)++; }
+                else (*err)++;
+            }
+            if(ep) closedir(ep);
+        }else if(de->d_name[0] != '.'){
+            char sd[1400]; snprintf(sd, sizeof(sd), "%s/%s", strcmp(rel, "/") ? rel : "", de->d_name);
+            cp_ec_tree(sd, sub, nsub, move, m, done, err);
+        }
+    }
+    closedir(dp);
+}
+// COPY|MOVE ~S1/<sub>/ ~S1/<nsub>/
+static void copy_tree(int csd, const char *sub, const char *nsub, int move){
+    struct cpjob job[TAR_NTYPES]; pthread_t th[TAR_NTYPES]; int started[TAR_NTYPES] = {0};
+    for(int t=1;t<TAR_NTYPES;t++){
+        job[t] = (struct cpjob){ .port = tar_types[t].port, .move = move, .sub = sub, .nsub = nsub, .ext = tar_types[t].ext };
+        if(pthread_create(&th[t], NULL, cp_tree_worker, &job[t]) == 0) started[t] = 1;
+        else cp_tree_worker(&job[t]);
+    }
+    char *out = NULL; size_t osz = 0; int done = 0, err = 0;
+    FILE *m = open_memstream(&out, &osz);
+    if(!m){
+        for(int t=1;t<TAR_NTYPES;t++) if(started[t]) pthread_join(th[t], NULL);
+        dprintf(csd, "ERR nomem\n");
+        return;
+    }
+    // .c files: S1's own, on disk and packed
+    char **v; int n = walk_tree(S1_ROOT, sub, ".c", &v), nk = 0, cap = 0;
+    char **keys = NULL;
+    for(int i=0;i<n;i++) if(arena_push(&keys, &nk, &cap, v[i]) != 0) break;
+    walk_free(v, n);
+    if(PACKSTORE && pack_lock(LOCK_SH) == 0){
+        pack_sync();
+        for(size_t i=0;i<pk.cap;i++){
+            struct pack_ent *e = &pk.tab[i];
+            if(e->key && e->live && ends_with_ext(e->key, ".c") && in_subtree(e->key, sub) &&
+               arena_push(&keys, &nk, &cap, e->key) != 0) break;
+        }
+        pack_lock(LOCK_UN);
+    }
+    for(int i=0;i<nk;i++){
+        char np[2200], sd[1100], dd[2200]; const char *sf, *df;
+        tree_rebase(np, sizeof(np), keys[i], sub, nsub);
+        split_rel(keys[i], sd, sizeof(sd), &sf); split_rel(np, dd, sizeof(dd), &df);
+        if(local_copy(sd, sf, dd, df, move) == 0){ fprintf(m, "OK %s\n", np); done++; }
+        else err++;
+    }
+    char rel[1100]; snprintf(rel, sizeof(rel), "/%s", sub);
+    cp_ec_tree(rel, sub, nsub, move, m, &done, &err);
+    for(int t=1;t<TAR_NTYPES;t++){
+        if(started[t]) pthread_join(th[t], NULL);
+        if(job[t].osz) fwrite(job[t].out, 1, job[t].osz, m);
+        free(job[t].out);
+        done += job[t].done; err += job[t].err;
+    }
+    fprintf(m, "DONE %d %d\n", done, err);
+    fclose(m);
+    write_n(csd, out, osz);
+    free(out);
+}
+
+/* WATCH ~S1/<dir> [r=1] [types=<ext>[,<ext>...]|all] [since=<token>] answers
+   "OK since=<token>" and then streams "EV <usec> create|modify|delete /<path>"
+   lines until the client sends UNWATCH (answered by "END"). .c changes, and
+   with EC_K those of erasure-coded files, come from S1's own journal; the
+   other types come from a WATCH on S2/S3/S4, which is reopened with since=
+   when it drops, so no change is missed. Lines wait
+   in a queue of WATCH_QUEUE. A client that falls that far behind gets the
+   queue replaced by one "RESYNC since=<token>" line: it should list again
+   (or DOWNLTAR since=<token>) and keep following the stream. */
+#ifndef WATCH_QUEUE
+#define WATCH_QUEUE 4096
+#endif
+#if WATCH_QUEUE < 2
+#error WATCH_QUEUE must hold at least two lines
+#endif
+
+struct evq { char *line[WATCH_QUEUE]; long long us[WATCH_QUEUE]; int head, n; size_t sent; };
+struct wsrc { int port, sd; long long last; size_t n; char buf[4096]; };
+
+static void evq_add(struct evq *q, long long us, const char *s){
+    if(q->n == WATCH_QUEUE){                          // overflow: drop the backlog, ask for a resync
+        int keep = q->sent ? 1 : 0;                   // a line half on the wire stays
+        long long from = us;
+        for(int i=keep;i<q->n;i++){
+            int k = (q->head+i) % WATCH_QUEUE;
+            if(q->us[k] < from) from = q->us[k];
+            free(q->line[k]);
+        }
+        q->n = keep;
+        char r[64]; snprintf(r, sizeof(r), "RESYNC since=%lld\n", from);
+        evq_add(q, from, r);
+    }
+    char *d = strdup(s);
+    if(!d) return;
+    int k = (q->head+q->n) % WATCH_QUEUE;
+    q->line[k] = d; q->us[k] = us; q->n++;
+}
+// Send what the socket takes without blocking; -1 when the client is gone.
+static int evq_flush(int csd, struct evq *q){
+    while(q->n){
+        struct iovec iov[64]; int k = 0;
+        for(; k<q->n && k<64; k++){
+            char *s = q->line[(q->head+k) % WATCH_QUEUE];
+            size_t skip = k ? 0 : q->sent;
+            iov[k].iov_base = s+skip; iov[k].iov_len = strlen(s)-skip;
+        }
+        struct msghdr mh = { .msg_iov = iov, .msg_iovlen = (size_t)k };
+        ssize_t w = sendmsg(csd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL);
+        if(w < 0) return errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR ? 0 : -1;
+        for(int i=0; i<k && w>0; i++){
+            if((size_t)w < iov[i].iov_len){ q->sent += (size_t)w; break; }
+            w -= (ssize_t)iov[i].iov_len;
+            free(q->line[q->head]);
+            q->head = (q->head+1) % WATCH_QUEUE; q->n--; q->sent = 0;
+        }
+    }
+    return 0;
+}
+static void watch_enqueue(void *arg, long long us, char kind, const char *path){
+    char ln[PACK_KEYMAX+64];
+    snprintf(ln, sizeof(ln), "EV %lld %s /%s\n", us, kind=='c' ? "create" : kind=='m' ? "modify" : "delete", path);
+    evq_add(arg, us, ln);
+}
+// (Re)subscribe to an aux server from the last change it delivered.
+static int wsrc_open(struct wsrc *s, const char *sub, int rec){
+    s->n = 0;
+    if((s->sd = connect_local_port(s->port)) < 0) return -1;
+    dprintf(s->sd, "WATCH /%s r=%d since=%lld\n", sub, rec, s->last);
+    char resp[64];
+    if(read_line(s->sd, resp, sizeof(resp)) <= 0 || strncmp(resp, "OK", 2)){ close(s->sd); s->sd = -1; return -1; }
+    return 0;
+}
+// Queue the aux server's "EV <usec> c|m|d <path>" lines.
+static void wsrc_read(struct wsrc *s, struct evq *q){
+    ssize_t r = read(s->sd, s->buf+s->n, sizeof(s->buf)-1-s->n);
+    if(r <= 0){ close(s->sd); s->sd = -1; return; }
+    s->n += (size_t)r; s->buf[s->n] = '\0';
+    char *ln = s->buf, *nl;
+    while((nl = strchr(ln, '\n'))){
+        *nl = '\0';
+        long long us; char k; int off = 0;
+        if(sscanf(ln, "EV %lld %c %n", &us, &k, &off)==2 && off){
+            watch_enqueue(q, us, k, ln+off);
+            if(us > s->last) s->last = us;
+        }
+        ln = nl+1;
+    }
+    s->n -= (size_t)(ln-s->buf);
+    memmove(s->buf, ln, s->n);
+    if(s->n == sizeof(s->buf)-1) s->n = 0;            // no line is that long
+}
+// Returns -1 when the client went away.
+static int watch_session(int csd, const char *sub, int rec, int mask, long long since){
+    struct evq *q = calloc(1, sizeof(*q));
+    char ext[32] = ""; size_t el = 0;                 // what S1's journal has: .c, erasure-coded files
+    for(int i=0;i<TAR_NTYPES;i++)
+        if((mask & (1<<i)) && (i==0 || EC_K)) el += (size_t)snprintf(ext+el, sizeof(ext)-el, "%s%s", el ? "," : "", tar_types[i].ext);
+    struct watch w; int local = el > 0;
+    if(!q || (local && watch_open(&w, S1_ROOT, sub, rec, ext, since) < 0)){ free(q); dprintf(csd, "ERR watch\n"); return 0; }
+    while(*sub=='/') sub++;
+    struct wsrc src[TAR_NTYPES]; int ns = 0;
+    for(int i=1;i<TAR_NTYPES;i++){
+        if(!(mask & (1<<i))) continue;
+        src[ns].port = tar_types[i].port; src[ns].last = since;
+        wsrc_open(&src[ns++], sub, rec);              // one that is down is retried every second
+    }
+    dprintf(csd, "OK since=%lld\n", since);
+    if(local) watch_pump(&w, watch_enqueue, q);
+    int rc = 0; long long retry = mono_us();
+    for(;;){
+        struct pollfd pf[2+TAR_NTYPES]; int np = 0, at[TAR_NTYPES];
+        pf[np++] = (struct pollfd){ csd, (short)(POLLIN | (q->n ? POLLOUT : 0)), 0 };
+        if(local) pf[np++] = (struct pollfd){ w.ino_fd, POLLIN, 0 };
+        for(int i=0;i<ns;i++){
+            at[i] = src[i].sd>=0 ? np : -1;
+            if(src[i].sd>=0) pf[np++] = (struct pollfd){ src[i].sd, POLLIN, 0 };
+        }
+        if(poll(pf, (nfds_t)np, 1000) < 0 && errno!=EINTR){ rc = -1; break; }
+        if(pf[0].revents & POLLIN){
+            char cmd[64];
+            if(read_line(csd, cmd, sizeof(cmd)) <= 0){ rc = -1; break; }
+            if(!strncmp(cmd, "UNWATCH", 7)) break;
+        }
+        else if(pf[0].revents & (POLLERR|POLLHUP)){ rc = -1; break; }
+        for(int i=0;i<ns;i++) if(at[i]>=0 && pf[at[i]].revents) wsrc_read(&src[i], q);
+        if(local){ watch_drain(&w); watch_pump(&w, watch_enqueue, q); }
+        if(mono_us()-retry >= 1000000){
+            retry = mono_us();
+            for(int i=0;i<ns;i++) if(src[i].sd<0) wsrc_open(&src[i], sub, rec);
+        }
+        if(evq_flush(csd, q) < 0){ rc = -1; break; }
+    }
+    while(rc==0 && q->n){                             // UNWATCH: deliver the rest, then END
+        struct pollfd p = { csd, POLLOUT, 0 };
+        if(poll(&p, 1, 5000) <= 0 || evq_flush(csd, q) < 0) rc = -1;
+    }
+    if(rc==0) dprintf(csd, "END\n");
+    for(int i=0;i<ns;i++) if(src[i].sd>=0) close(src[i].sd);
+    for(; q->n; q->n--, q->head = (q->head+1) % WATCH_QUEUE) free(q->line[q->head]);
+    free(q);
+    if(local) watch_close(&w);
+    return rc;
+}
+
 /* ---------- per-client handler (prcclient) ---------- */
 static void prcclient(int csd){
     char line[2048];
+    qsess.fd = csd;
 
     while(1){
+        slow_end();
+        prof_end();
+        qos_idle();   // previous command done: release its bulk lane
+        rq_end();
+        while(waitpid(-1, NULL, WNOHANG) > 0);   // background forwards / promotions that are done
+        tr_finish();
+        arena_reset();
         ssize_t n = read_line(csd, line, sizeof(line));
         if(n <= 0) break;
+        tr_request(line);
+        rq_begin(csd, line);
+        slow_begin(line);
+        prof_begin();
 
         /* ===== UPLOAD ===== */
         if(strncmp(line, "UPLOAD ", 7) == 0){
-            int nfiles=0; char dest[1024];
-            if(sscanf(line+7, "%d %1023s", &nfiles, dest) != 2 || nfiles <= 0 || nfiles > 3){
+            char *p = line+7, *dest;
+            long long nfiles = 0;
+            if(tok_num(tok_next(&p), 1, 3, &nfiles) != 0 || !(dest = tok_next(&p))){
                 dprintf(csd, "ERR bad UPLOAD\n"); continue;
             }
-            if(strncmp(dest, "~S1/", 4) == 0) memmove(dest, dest+3, strlen(dest+3)+1);
+            if(strncmp(dest, "~S1/", 4) == 0) dest += 3;
             if(strstr(dest, "..")){ dprintf(csd, "ERR badpath\n"); continue; }
 
             char s1_dest[2048]; join_path(s1_dest, sizeof(s1_dest), S1_ROOT, dest);
             if(ensure_dir(s1_dest) < 0){ dprintf(csd, "ERR makedir\n"); continue; }
 
+            char failed[256] = "";   // first file an aux server didn't take (cut-through)
             for(int i=0;i<nfiles;i++){
                 char nline[1024], sline[1024];
                 if(read_line(csd, nline, sizeof(nline)) <= 0){ dprintf(csd,"ERR name\n"); return; }
                 if(strncmp(nline, "NAME ", 5) != 0){ dprintf(csd,"ERR namehdr\n"); return; }
-                char fname[256]; if(sscanf(nline+5, "%255s", fname) != 1){ dprintf(csd,"ERR nameparse\n"); return; }
+                char *q = nline+5, *fname = tok_next(&q);
+                if(!fname || strlen(fname) > 255){ dprintf(csd,"ERR nameparse\n"); return; }
+                slow_arg(fname);
 
                 if(read_line(csd, sline, sizeof(sline)) <= 0){ dprintf(csd,"ERR size\n"); return; }
                 if(strncmp(sline, "SIZE ", 5) != 0){ dprintf(csd,"ERR sizehdr\n"); return; }
-                long long fbytes=0; if(sscanf(sline+5, "%lld", &fbytes) != 1 || fbytes < 0){ dprintf(csd,"ERR sizeparse\n"); return; }
+                char zv[16], dv[8]; int zc = opt_get(sline, "z", zv, sizeof(zv)) ? z_parse(zv) : Z_NONE;
+                int direct = opt_get(sline, "direct", dv, sizeof(dv));
+                long long fbytes=0; q = sline+5;
+                if(tok_num(tok_next(&q), 0, LLONG_MAX, &fbytes) != 0){ dprintf(csd,"ERR sizeparse\n"); return; }
+                if(zc < 0 || !z_supported(zc)){ dprintf(csd,"ERR sizeparse\n"); return; }
+                struct zr zr; zr_init(&zr, csd, zc);
 
                 char full_local[3072]; snprintf(full_local,sizeof(full_local), "%s/%s", s1_dest, fname);
-                int fd = open(full_local, O_CREAT|O_TRUNC|O_WRONLY, 0664);
-                if(fd < 0){ dprintf(csd, "ERR open\n"); return; }
-
-                long long left=fbytes; char buf[BUFSZ];
-                while(left > 0){
-                    ssize_t r=read(csd, buf, (left>BUFSZ?BUFSZ:(size_t)left));
-                    if(r <= 0){ close(fd); unlink(full_local); dprintf(csd,"ERR stream\n"); return; }
-                    if(write_n(fd, buf, (size_t)r) != r){ close(fd); unlink(full_local); dprintf(csd,"ERR disk\n"); return; }
-                    left -= r;
-                }
-                fsync(fd); close(fd);
-
-                // route non-.c in the background
                 const char *ext = file_ext(fname);
                 int fport = 0;
                 if(!strcasecmp(ext, ".pdf")) fport = S2_PORT;
                 else if(!strcasecmp(ext, ".txt")) fport = S3_PORT;
                 else if(!strcasecmp(ext, ".zip")) fport = S4_PORT;
 
-                if(fport){
+                char tkey[PACK_KEYMAX]; pack_key(tkey, sizeof(tkey), dest, fname);
+                if(fport) tier_drop(tkey);   // and again once the new version is in place
+                if(direct){
+                    // an older erasure-coded or local version goes only once the new one is in,
+                    // which S1 doesn't see for a redirected PUT: replacing one is proxied
+                    struct ec_man om;
+                    if(redir_on && fport && !(EC_K && fbytes >= EC_MIN) &&
+                       ec_read_man(dest, fname, &om, NULL, 0) != 0 && access(full_local, F_OK) != 0){
+                        redir_reply(csd, fport, dest, fname, fbytes);
+                        continue;
+                    }
+                    dprintf(csd, "SEND\n");
+                }
+                qos_size(csd, fbytes);
+                int th = tr_begin("recv");
+                if(EC_K && fport && fbytes >= EC_MIN){
+                    int fh = tr_begin("ec.store");
+                    int rc = ec_store(csd, &zr, fport, dest, fname, fbytes);
+                    tr_end(fh);
+                    if(rc == -2){ dprintf(csd,"ERR stream\n"); return; }
+                    if(rc != -1){
+                        if(rc == 0){ unlink(full_local); tier_drop(tkey); }
+                        else if(!failed[0]) snprintf(failed, sizeof(failed), "%s", fname);
+                        tr_end(th);
+                        continue;
+                    }
+                }
+                if(CUT_THROUGH && fport){
+                    int fh = tr_begin("forward");
+                    int rc = cut_through_store(csd, &zr, fport, dest, fname, fbytes);
+                    tr_end(fh);
+                    if(rc == -2){ dprintf(csd,"ERR stream\n"); return; }
+                    if(rc != -1){
+                        if(rc == 0){ unlink(full_local); (void)ec_drop(dest, fname, 0); tier_drop(tkey); }   // older copies are stale now
+                        else if(!failed[0]) snprintf(failed, sizeof(failed), "%s", fname);
+                        tr_end(th);
+                        continue;
+                    }
+                }
+                // small .c files go into the pack store instead of their own inode
+                if(PACKSTORE && fbytes <= PACK_MAX && !strcasecmp(ext, ".c")){
+                    char *data = malloc(fbytes ? (size_t)fbytes : 1);
+                    long long got=0;
+                    while(data && got < fbytes){
+                        ssize_t r=zr_read(&zr, data+got, (size_t)(fbytes-got));
+                        if(r <= 0){ free(data); dprintf(csd,"ERR stream\n"); return; }
+                        got += r;
+                    }
+                    zr_finish(&zr);
+                    char key[PACK_KEYMAX]; pack_key(key,sizeof(key),dest,fname);
+                    if(!data || pack_put(key, data, (uint32_t)fbytes) != 0){ free(data); dprintf(csd,"ERR disk\n"); return; }
+                    free(data);
+                    unlink(full_local); // drop an older unpacked copy
+                    jnl_add('P', key);
+                    tr_end(th);
+                    continue;
+                }
+
+                // written under a dot name and renamed over the old copy once it is all on disk
+                char tmp_local[3200]; snprintf(tmp_local, sizeof(tmp_local), "%s/.%s.st%d", s1_dest, fname, (int)getpid());
+                int fd = open(tmp_local, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0664);
+                if(fd < 0){ dprintf(csd, "ERR open\n"); return; }
+
+                if(zc == Z_NONE && xfer_copy(csd, fd, fbytes, -1, 0) != fbytes){
+                    close(fd); unlink(tmp_local); dprintf(csd,"ERR stream\n"); return;
+                }
+                long long left = zc==Z_NONE ? 0 : fbytes;
+                char *buf = left ? iob_get() : NULL;
+                const char *err = left && !buf ? "ERR disk" : NULL;
+                while(left > 0 && !err){
+                    ssize_t r=zr_read(&zr, buf, (left>IOB_SIZE?IOB_SIZE:(size_t)left));
+                    if(r <= 0) err = "ERR stream";
+                    else if(write_n(fd, buf, (size_t)r) != r) err = "ERR disk";
+                    else left -= r;
+                }
+                iob_put(buf);
+                if(err){ close(fd); unlink(tmp_local); dprintf(csd,"%s\n",err); return; }
+                zr_finish(&zr);
+                if(fsync(fd) != 0 || close(fd) != 0 || rename(tmp_local, full_local) != 0){
+                    unlink(tmp_local); dprintf(csd,"ERR disk\n"); return;
+                }
+                int dd = open(s1_dest, O_RDONLY|O_DIRECTORY);
+                if(dd >= 0){ fsync(dd); close(dd); }
+                tr_end(th);
+                if(!strcasecmp(ext, ".c")){
+                    char key[PACK_KEYMAX]; pack_key(key,sizeof(key),dest,fname);
+                    if(PACKSTORE) pack_del(key); // the unpacked copy is now the current one
+                    jnl_add('P', key);
+                }
+
+                // spooled: route non-.c in the background
+                if(fport) (void)ec_drop(dest, fname, 0);
+                if(fport && !qos_admit(qsess.addr, 1)){
+                    th = tr_begin("forward");
+                    (void)forward_store_file(fport, dest, fname, full_local, fbytes);   // over the limit: in-line
+                    tier_drop(tkey);
+                    tr_end(th);
+                }
+                else if(fport){
                     pid_t wp = fork();
                     if(wp == 0){
+                        tr_child();
+                        th = tr_begin("forward");
                         (void)forward_store_file(fport, dest, fname, full_local, fbytes);
+                        tier_drop(tkey);
+                        tr_end(th);
+                        tr_finish();
+                        qos_leave();
                         _exit(0);
                     }
+                    qos_register(qsess.addr, wp, 1);
                 }
             }
-            dprintf(csd, "OK\n");
+            if(failed[0]) dprintf(csd, "ERR store %s\n", failed);
+            else          dprintf(csd, "OK\n");
         }
 
         /* ===== DOWNLF ===== */
         else if(strncmp(line, "DOWNLF ", 7) == 0){
-            int nreq=0; if(sscanf(line+7, "%d", &nreq) != 1 || nreq<=0 || nreq>2){ dprintf(csd,"ERR bad DOWNLF\n"); continue; }
+            char *p = line+7; long long nreq = 0;
+            if(tok_num(tok_next(&p), 1, 2, &nreq) != 0){ dprintf(csd,"ERR bad DOWNLF\n"); continue; }
             for(int i=0;i<nreq;i++){
                 char pline[1200]; if(read_line(csd, pline, sizeof(pline)) <= 0){ dprintf(csd,"ERR path\n"); return; }
                 if(strncmp(pline,"PATH ",5)!=0){ dprintf(csd,"ERR pathhdr\n"); return; }
-                char full[1024]; if(sscanf(pline+5,"%1023s", full) != 1){ dprintf(csd,"ERR pathparse\n"); return; }
+                char inm[48], dv[8]; const char *ifn = opt_get(pline, "if-none", inm, sizeof(inm)) ? inm : NULL;
+                int direct = opt_get(pline, "direct", dv, sizeof(dv));
+                char *q = pline+5, *full = tok_next(&q);
+                if(!full){ dprintf(csd,"ERR pathparse\n"); return; }
+                slow_arg(full);
 
-                if(strncmp(full,"~S1/",4)==0) memmove(full, full+3, strlen(full+3)+1);
+                if(strncmp(full,"~S1/",4)==0) full += 3;
                 if(strstr(full,"..")){ dprintf(csd,"ERR badpath\n"); return; }
 
                 char *slash = strrchr(full, '/');
                 if(!slash || slash==full){ dprintf(csd,"ERR badname\n"); return; }
-                char dest[1024], fname[256];
-                size_t dlen=(size_t)(slash - full);
-                snprintf(dest,sizeof(dest), "%.*s", (int)dlen, full);
-                snprintf(fname,sizeof(fname), "%s", slash+1);
+                *slash = '\0';                      // split in place: full is the directory now
+                const char *dest = full, *fname = slash+1;
 
                 const char *ext = file_ext(fname);
                 if(!strcasecmp(ext, ".c")){
                     char absdir[2048]; join_path(absdir, sizeof(absdir), S1_ROOT, dest);
-                    if(stream_local_file(csd, absdir, fname) != 0) dprintf(csd,"ERR nofile %s\n",fname);
+                    int th = tr_begin("send.local");
+                    int rc = (PACKSTORE && stream_packed_file(csd, dest, fname, ifn) == 0) ? 0 : stream_local_file(csd, absdir, fname, ifn);
+                    tr_end(th);
+                    if(rc != 0) dprintf(csd,"ERR nofile %s\n",fname);
                 }else{
                     int port = (!strcasecmp(ext,".pdf"))?S2_PORT:(!strcasecmp(ext,".txt"))?S3_PORT:(!strcasecmp(ext,".zip"))?S4_PORT:0;
                     if(!port){ dprintf(csd,"ERR type %s\n",fname); continue; }
-                    if(relay_from_aux(csd, port, dest, fname) != 0) dprintf(csd,"ERR fetch %s\n",fname);
+                    struct ec_man mf;
+                    if(redir_on && direct && ec_read_man(dest, fname, &mf, NULL, 0) != 0){
+                        redir_reply(csd, port, dest, fname, -1);
+                        continue;
+                    }
+                    char key[PACK_KEYMAX]; pack_key(key, sizeof(key), dest, fname);
+                    int promote = 0, rc = tier_serve(csd, port, dest, key, fname, ifn, &promote);
+                    if(rc == -1) rc = ec_fetch(csd, dest, fname, ifn);
+                    else promote = 0;
+                    if(rc == -1){
+                        rc = relay_from_aux(csd, port, dest, fname, ifn);
+                        if(rc == 0 && promote) tier_promote(port, dest, fname, key);
+                    }
+                    if(rc != 0) dprintf(csd,"ERR fetch %s\n",fname);
                 }
             }
         }
 
-        /* ===== REMOVEF ===== */
+        /* ===== REMOVEF <n> (PATH lines follow) | REMOVEF ~S1/<dir> [types] | REMOVEF all [types] ===== */
         else if(strncmp(line, "REMOVEF ", 8) == 0){
-            int nreq=0; if(sscanf(line+8,"%d",&nreq)!=1 || nreq<=0 || nreq>2){ dprintf(csd,"ERR bad REMOVEF\n"); continue; }
-            for(int i=0;i<nreq;i++){
-                char pline[1200]; if(read_line(csd, pline, sizeof(pline)) <= 0){ dprintf(csd,"ERR path\n"); return; }
-                if(strncmp(pline,"PATH ",5)!=0){ dprintf(csd,"ERR pathhdr\n"); return; }
-                char full[1024]; if(sscanf(pline+5,"%1023s",full)!=1){ dprintf(csd,"ERR pathparse\n"); return; }
-
-                if(strncmp(full,"~S1/",4)==0) memmove(full, full+3, strlen(full+3)+1);
-                if(strstr(full,"..")){ dprintf(csd,"ERR badpath\n"); return; }
-
-                char *slash=strrchr(full,'/'); if(!slash||slash==full){ dprintf(csd,"ERR badname\n"); return; }
-                char dest[1024], fname[256];
-                size_t dlen=(size_t)(slash-full);
-                snprintf(dest,sizeof(dest), "%.*s", (int)dlen, full);
-                snprintf(fname,sizeof(fname), "%s", slash+1);
+            char *p = line+8, *a = tok_next(&p); long long nreq = 0;
+            int whole = a && !strcmp(a,"all");   // the whole tree has to be asked for by name
+            if(whole || (a && strncmp(a,"~S1",3)==0 && (a[3]=='\0' || a[3]=='/'))){
+                char sub[1024]; const char *s = whole ? "" : a+3; while(*s=='/') s++;
+                snprintf(sub, sizeof(sub), "%s", s);
+                size_t sl = strlen(sub); while(sl>0 && sub[sl-1]=='/') sub[--sl] = '\0';
+                if(!*sub && !whole){ dprintf(csd,"ERR prefix (REMOVEF all for everything)\n"); continue; }
+                char *ty = tok_next(&p);
+                int mask = ty && strncmp(ty,"rid=",4) ? tar_type_mask(ty) : (1<<TAR_NTYPES)-1;
+                if(!mask || strstr(sub,"..")){ dprintf(csd,"ERR bad REMOVEF\n"); continue; }
+                slow_arg(a);
+                int th = tr_begin("remove.tree");
+                remove_tree(csd, sub, mask);
+                tr_end(th);
+                continue;
+            }
+            if(tok_num(a, 1, REMOVE_MAX, &nreq) != 0){ dprintf(csd,"ERR bad REMOVEF\n"); continue; }
+            if(remove_list(csd, (int)nreq) != 0) return;
+        }
 
-                const char *ext=file_ext(fname);
-                int rc=-1;
-                if(!strcasecmp(ext,".c")) rc = delete_local(dest,fname);
-                else{
-                    int port = (!strcasecmp(ext,".pdf"))?S2_PORT:(!strcasecmp(ext,".txt"))?S3_PORT:(!strcasecmp(ext,".zip"))?S4_PORT:0;
-                    if(port==0) rc = delete_local(dest,fname);
-                    else rc = delete_remote(port, dest, fname);
-                }
-                if(rc==0) dprintf(csd,"OK %s\n",fname);
-                else      dprintf(csd,"ERR %s\n",fname);
+        /* ===== COPY|MOVE <src> <dst> | COPY|MOVE ~S1/<dir>/ ~S1/<to>/ ===== */
+        else if(strncmp(line, "COPY ", 5) == 0 || strncmp(line, "MOVE ", 5) == 0){
+            int move = line[0]=='M';
+            char *p = line+5, *src = tok_next(&p), *dst = tok_next(&p);
+            if(!src || !dst || strncmp(src,"~S1/",4) || strncmp(dst,"~S1/",4)){ dprintf(csd,"ERR bad %s\n", move ? "MOVE" : "COPY"); continue; }
+            src += 3; dst += 3;
+            if(strstr(src,"..") || strstr(dst,"..")){ dprintf(csd,"ERR badpath\n"); continue; }
+            slow_arg(src);
+            size_t sl = strlen(src), dl = strlen(dst);
+            if(src[sl-1] == '/'){
+                char sub[1024], nsub[1024]; const char *s = src, *d = dst;
+                while(*s=='/') s++;
+                while(*d=='/') d++;
+                snprintf(sub, sizeof(sub), "%s", s); snprintf(nsub, sizeof(nsub), "%s", d);
+                sl = strlen(sub); while(sl>0 && sub[sl-1]=='/') sub[--sl] = '\0';
+                dl = strlen(nsub); while(dl>0 && nsub[dl-1]=='/') nsub[--dl] = '\0';
+                // neither tree may contain the other
+                if(!strcmp(sub, nsub) || in_subtree(sub, nsub) || in_subtree(nsub, sub)){ dprintf(csd,"ERR badpath\n"); continue; }
+                int th = tr_begin(move ? "move.tree" : "copy.tree");
+                copy_tree(csd, sub, nsub, move);
+                tr_end(th);
+                continue;
             }
+            char *slash = strrchr(src, '/'), *dslash = strrchr(dst, '/');
+            if(slash == src || dslash == dst){ dprintf(csd,"ERR badname\n"); continue; }
+            *slash = '\0'; *dslash = '\0';
+            const char *sf = slash+1, *df = dslash[1] ? dslash+1 : sf;
+            if(strlen(df) > 255){ dprintf(csd,"ERR badname\n"); continue; }
+            int th = tr_begin(move ? "move" : "copy");
+            int rc = copy_file(src, sf, dst, df, move);
+            tr_end(th);
+            if(rc == 0) dprintf(csd, "OK\n");
+            else dprintf(csd, "ERR %s %s\n", rc==-1 ? "nofile" : rc==-3 ? "type" : "copy", sf);
+        }
+
+        /* ===== WATCH ~S1/<dir> [r=1] [types=<ext>[,<ext>...]|all] [since=<token>] ===== */
+        else if(strncmp(line, "WATCH ", 6) == 0){
+            char v[64]; long long since = now_us();
+            int rec = opt_get(line, "r", v, sizeof(v)) && atoi(v);
+            int mask = opt_get(line, "types", v, sizeof(v)) ? tar_type_mask(v) : (1<<TAR_NTYPES)-1;
+            if(opt_get(line, "since", v, sizeof(v)) && tok_num(v, 0, LLONG_MAX, &since) != 0) mask = 0;
+            char *p = line+6, *a = tok_next(&p);
+            if(!mask || !a || strncmp(a,"~S1",3) || (a[3] && a[3]!='/') || strstr(a,"..")){ dprintf(csd,"ERR bad WATCH\n"); continue; }
+            rq_end();   // a subscription ends when its client leaves: not a cancel
+            if(watch_session(csd, a+3, rec, mask, since) < 0) return;
         }
 
         /* ===== DOWNLTAR ===== */
         else if(strncmp(line, "DOWNLTAR ", 9) == 0){
-            char ext[16]; if(sscanf(line+9,"%15s",ext)!=1){ dprintf(csd,"ERR bad DOWNLTAR\n"); continue; }
-            if(strcmp(ext,".c") && strcmp(ext,".pdf") && strcmp(ext,".txt")){ dprintf(csd,"ERR ext\n"); continue; }
+            // DOWNLTAR <ext>[,<ext>...]|all [gz|zst] [~S1/<subtree>] [since=<token>]
+            char *p = line+9, *ext = tok_next(&p), *a[4], sub[1024]="";
+            int na = 1;
+            while(ext && na<5 && (a[na-1] = tok_next(&p))) na++;
+            if(!ext){ dprintf(csd,"ERR bad DOWNLTAR\n"); continue; }
+            int mask = tar_type_mask(ext);
+            if(!mask){ dprintf(csd,"ERR ext\n"); continue; }
+            int kind = TARZ_NONE, bad = 0;
+            long long since = -1;
+            for(int i=0;i<na-1;i++){
+                if(strncmp(a[i],"rid=",4)==0) continue;   // request id, see tr_request()
+                if(strncmp(a[i],"since=",6)==0){
+                    char *e; since = strtoll(a[i]+6,&e,10);
+                    if(*e || since<0) bad=1;
+                }
+                else if(strncmp(a[i],"~S1",3)==0 && (a[i][3]=='\0' || a[i][3]=='/')){
+                    const char *p=a[i]+3; while(*p=='/') p++;
+                    snprintf(sub,sizeof(sub),"%s",p);
+                    size_t sl=strlen(sub); while(sl>0 && sub[sl-1]=='/') sub[--sl]='\0';
+                    if(strstr(sub,"..") || strchr(sub,'\'')) bad=1;
+                }
+                else if((kind=tarz_parse(a[i]))<0) bad=1;
+            }
+            if(bad){ dprintf(csd,"ERR bad DOWNLTAR\n"); continue; }
+            qos_size(csd, BULK_MIN);   // an archive is bulk: its lane comes before any pack lock
+            // the original single-type form keeps its sized reply
+            if(kind!=TARZ_NONE || *sub || since>=0 || (mask & (mask-1)) || mask==(1<<3) || (EC_K && mask!=1)){
+                if(send_tar_stream(csd, mask, sub, kind, since)!=0) dprintf(csd,"ERR tar\n");
+                continue;
+            }
 
             if(strcmp(ext,".c")==0){
                 char tarpath[256];
@@ -463,19 +5453,30 @@ static void prcclient(int csd){
                 int fd=open(tarpath,O_RDONLY);
                 if(fd<0){ unlink(tarpath); dprintf(csd,"ERR taropen\n"); continue; }
                 struct stat st; fstat(fd,&st);
-                dprintf(csd,"TAR cfiles.tar %lld\n",(long long)st.st_size);
-                char buf[BUFSZ]; ssize_t r; while((r=read(fd,buf,sizeof(buf)))>0) if(write_n(csd,buf,(size_t)r)!=r) break;
+                struct zw zw; zw_init(&zw, csd, client_codec);
+                zw_head(&zw,"TAR cfiles.tar %lld%s\n",(long long)st.st_size,z_opt(client_codec));
+                char *buf = iob_get(); ssize_t r; long long left = st.st_size;
+                while(buf && (r=read(fd,buf,IOB_SIZE))>0){ if(zw_write(&zw,buf,(size_t)r)!=0) break; left -= r; }
+                iob_put(buf);
+                rq_saved(left);
+                zw_end(&zw);
                 close(fd); unlink(tarpath);
             }else{
                 int port = (strcmp(ext,".pdf")==0)?S2_PORT:S3_PORT;
                 char tmp[]="/tmp/s1relayXXXXXX"; int fd=mkstemp(tmp);
                 if(fd<0){ dprintf(csd,"ERR tmp\n"); continue; }
-                long long sz = fetch_tar_from_aux(port, ext, fd);
+                long long sz = fetch_tar_from_aux(port, ext, "", -1, fd);
                 if(sz < 0){ close(fd); unlink(tmp); dprintf(csd,"ERR fetch\n"); continue; }
                 fsync(fd); lseek(fd,0,SEEK_SET);
                 const char *tname = (strcmp(ext,".pdf")==0) ? "pdf.tar" : "text.tar";
-                dprintf(csd,"TAR %s %lld\n", tname, sz);
-                char buf[BUFSZ]; ssize_t r; while((r=read(fd,buf,sizeof(buf)))>0) if(write_n(csd,buf,(size_t)r)!=r) break;
+                int zc = z_for(ext);
+                struct zw zw; zw_init(&zw, csd, zc);
+                zw_head(&zw,"TAR %s %lld%s\n", tname, sz, z_opt(zc));
+                char *buf = iob_get(); ssize_t r; long long left = sz;
+                while(buf && (r=read(fd,buf,IOB_SIZE))>0){ if(zw_write(&zw,buf,(size_t)r)!=0) break; left -= r; }
+                iob_put(buf);
+                rq_saved(left);
+                zw_end(&zw);
                 close(fd); unlink(tmp);
             }
         }
@@ -484,71 +5485,196 @@ static void prcclient(int csd){
    Response: NAMES <total>\n followed by 'NAME <file>\n' lines
          */
 else if (strncmp(line, "DISPFNAMES ", 11) == 0) {
-    char path[1024];
-    if (sscanf(line+11, "%1023s", path) != 1) { dprintf(csd,"ERR bad DISPFNAMES\n"); continue; }
+    char *p = line+11;
+    const char *path = tok_next(&p);
+    if (!path) { dprintf(csd,"ERR bad DISPFNAMES\n"); continue; }
 
     // Normalize ~S1, supporting both "~S1" and "~S1/<subdir>"
     if (strncmp(path, "~S1", 3) == 0) {
-        if (path[3] == '/') {                     // "~S1/<something>"
-            memmove(path, path+3, strlen(path+3)+1);   // becomes "/<something>"
-        } else if (path[3] == '\0') {             // exactly "~S1"
-            strcpy(path, "/");                    // treat as root
-        }
+        if (path[3] == '/') path += 3;            // "~S1/<something>" becomes "/<something>"
+        else if (path[3] == '\0') path = "/";     // exactly "~S1": treat as root
     }
     if (strstr(path, "..")) { dprintf(csd,"ERR badpath\n"); continue; }
 
 
     // gather per-type (order must be: .c, .pdf, .txt, .zip)
     char **cN=NULL, **pdfN=NULL, **txtN=NULL, **zipN=NULL;
+    int th = tr_begin("list.local");
     int nC   = s1_list_local_by_ext(path, ".c",   &cN);
+    tr_end(th); th = tr_begin("aux.list");
     int nPDF = s1_request_list_from_aux(S2_PORT, path, &pdfN); if(nPDF<0) nPDF=0;
     int nTXT = s1_request_list_from_aux(S3_PORT, path, &txtN); if(nTXT<0) nTXT=0;
     int nZIP = s1_request_list_from_aux(S4_PORT, path, &zipN); if(nZIP<0) nZIP=0;
+    tr_end(th);
+    nPDF = ec_list(path, ".pdf", &pdfN, nPDF);
+    nTXT = ec_list(path, ".txt", &txtN, nTXT);
+    nZIP = ec_list(path, ".zip", &zipN, nZIP);
 
     int total = nC + nPDF + nTXT + nZIP;
-    dprintf(csd, "NAMES %d\n", total);
-
-    for(int i=0;i<nC;i++){  dprintf(csd,"NAME %s\n", cN[i]);  free(cN[i]); }   free(cN);
-    for(int i=0;i<nPDF;i++){dprintf(csd,"NAME %s\n", pdfN[i]); free(pdfN[i]); } free(pdfN);
-    for(int i=0;i<nTXT;i++){dprintf(csd,"NAME %s\n", txtN[i]); free(txtN[i]); } free(txtN);
-    for(int i=0;i<nZIP;i++){dprintf(csd,"NAME %s\n", zipN[i]); free(zipN[i]); } free(zipN);
+    int zc = total ? client_codec : Z_NONE;
+    struct zw zw; zw_init(&zw, csd, zc);
+    zw_head(&zw, "NAMES %d%s\n", total, z_opt(zc));
+    char nl[320];
+    for(int i=0;i<nC;i++)   zw_write(&zw, nl, (size_t)snprintf(nl,sizeof(nl),"NAME %s\n", cN[i]));
+    for(int i=0;i<nPDF;i++) zw_write(&zw, nl, (size_t)snprintf(nl,sizeof(nl),"NAME %s\n", pdfN[i]));
+    for(int i=0;i<nTXT;i++) zw_write(&zw, nl, (size_t)snprintf(nl,sizeof(nl),"NAME %s\n", txtN[i]));
+    for(int i=0;i<nZIP;i++) zw_write(&zw, nl, (size_t)snprintf(nl,sizeof(nl),"NAME %s\n", zipN[i]));
+    zw_end(&zw);
 }
 
+        /* ===== COMP <codec,...> : negotiate wire compression ===== */
+        else if(strncmp(line,"COMP ",5)==0){
+            char *p = line+5, *offer = tok_next(&p);
+            if(!offer){ dprintf(csd,"ERR bad COMP\n"); continue; }
+            client_codec = z_choose(offer);
+            dprintf(csd,"OK %s\n", z_names[client_codec]);
+        }
+        /* ===== IO rw|uring|sendfile : copy engine for this session (benchmarks) ===== */
+        else if(strncmp(line,"IO ",3)==0){
+            if(strncmp(line+3,"rw",2)==0) iostat.mode = iostat.sf = -1;
+            else if(strncmp(line+3,"uring",5)==0 && IO_URING){ iostat.mode = 0; iostat.sf = -1; }
+            else if(strncmp(line+3,"sendfile",8)==0 && SENDFILE) iostat.sf = 0;
+            else { dprintf(csd,"ERR bad IO\n"); continue; }
+            dprintf(csd,"OK\n");
+        }
+        /* ===== STATS : this session's compression, copy-engine, QoS, allocation and erasure-coding counters, listing cache, hot tier, redirects ===== */
+        else if(strncmp(line,"STATS",5)==0){
+            struct rusage ru; getrusage(RUSAGE_SELF, &ru);
+            long long proc_us = (long long)(ru.ru_utime.tv_sec+ru.ru_stime.tv_sec)*1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+            dprintf(csd,"STATS z=%s raw=%lld wire=%lld cpu_us=%lld io=%s%s io_calls=%lld io_bytes=%lld proc_cpu_us=%lld list_hits=%llu list_misses=%llu qos_wait_us=%lld qos_refused=%llu"
+                        " heap_allocs=%llu arena_allocs=%llu arena_bytes=%llu iob_gets=%llu iob_new=%llu write_calls=%lld"
+                        " ec=%s ec_enc_bytes=%lld ec_dec_bytes=%lld ec_degraded=%lld"
+                        " tier_bytes=%lld tier_hits=%llu tier_promoted=%llu tier_demoted=%llu redirects=%lld meta_files=%u meta_tail=%d meta_hits=%llu"
+                        " cancel_gone=%llu cancel_deadline=%llu cancel_saved=%llu\n",
+                    z_names[client_codec], zstat.raw, zstat.wire, zstat.cpu_ns/1000,
+                    iostat.mode>0 ? "uring" : iostat.mode<0 ? "rw" : "-", iostat.sf>0 ? "+sendfile" : "", iostat.calls, iostat.bytes, proc_us,
+                    dc ? dc->hits : 0ULL, dc ? dc->misses : 0ULL, qsess.wait_us, qs ? qs->refused : 0ULL,
+                    astat.heap, astat.arena, astat.arena_bytes, astat.iob, astat.iob_new, nwrites,
+                    ecstat.kern, ecstat.enc, ecstat.dec, ecstat.degraded,
+                    tier ? tier->bytes : 0LL, tier ? tier->hits : 0ULL, tier ? tier->promoted : 0ULL, tier ? tier->demoted : 0ULL, nredirects,
+                    meta.h ? meta.h->count : 0U, meta.nchg, meta.hits,
+                    rqs ? rqs->gone : 0ULL, rqs ? rqs->expired : 0ULL, rqs ? rqs->saved : 0ULL);
+        }
+
+        /* ===== PROFILE <seconds> [hz=<n>] : sample stacks server-wide for a while ===== */
+        else if(strncmp(line,"PROFILE ",8)==0){
+            if(!prof_allowed(csd, line+8)) dprintf(csd, "ERR denied\n");
+            else prof_cmd(csd, line+8);
+        }
+
         /* ===== QUIT / unknown ===== */
         else if(strncmp(line,"QUIT",4)==0){ break; }
         else dprintf(csd, "ERR unknown\n");
     }
 
+    slow_end();
+    prof_end();
+    tr_finish();
+    if(zstat.raw > 0)
+        fprintf(stderr, "S1: session z=%s raw=%lld wire=%lld (%.1f%% saved) codec_cpu=%.1fms\n",
+                z_names[client_codec], zstat.raw, zstat.wire,
+                100.0*(double)(zstat.raw-zstat.wire)/(double)zstat.raw, (double)zstat.cpu_ns/1e6);
     close(csd);
 }
 
+/* ---------- acceptors ----------
+   With -DACCEPTORS=n (0 = one per online CPU) the server listens through n
+   SO_REUSEPORT sockets on the same port, each drained by its own acceptor
+   process, so the kernel spreads incoming connections over them instead of
+   queueing everything behind one accept(). -DACCEPT_PIN=1 pins acceptor i
+   (and the sessions it forks) to CPU i. The first acceptor is the original
+   process and keeps the listing-cache watcher thread. S2-S4 take the same
+   options. */
+#ifndef ACCEPTORS
+#define ACCEPTORS 1
+#endif
+#ifndef ACCEPT_PIN
+#define ACCEPT_PIN 0
+#endif
+#define ACCEPT_MAX 64
+
+static int listen_on(int port, int reuseport){
+    int sd=socket(AF_INET,SOCK_STREAM,0); if(sd<0){ perror("socket"); return -1; }
+    int opt=1; setsockopt(sd,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt));
+    if(reuseport && setsockopt(sd,SOL_SOCKET,SO_REUSEPORT,&opt,sizeof(opt))<0){ perror("SO_REUSEPORT"); close(sd); return -1; }
+    struct sockaddr_in a={0}; a.sin_family=AF_INET; a.sin_addr.s_addr=htonl(INADDR_ANY); a.sin_port=htons(port);
+    if(bind(sd,(struct sockaddr*)&a,sizeof(a))<0){ perror("bind"); close(sd); return -1; }
+    if(listen(sd,BACKLOG)<0){ perror("listen"); close(sd); return -1; }
+    return sd;
+}
+// Open the listening sockets; returns how many (all on 'port').
+static int listen_all(int port, int *sds){
+    int n = ACCEPTORS>0 ? ACCEPTORS : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(n<1) n=1;
+    if(n>ACCEPT_MAX) n=ACCEPT_MAX;
+    for(int i=0;i<n;i++){
+        if((sds[i]=listen_on(port, n>1))<0){ while(i-->0) close(sds[i]); return -1; }
+    }
+    return n;
+}
+// Fork acceptors 1..n-1, each keeping only its own socket; returns the
+// index of the calling acceptor (0 in the original process).
+static int spawn_acceptors(int *sds, int n){
+    int me=0;
+    for(int i=1;i<n && me==0;i++){
+        pid_t pid=fork();
+        if(pid==0) me=i;
+        else if(pid<0) perror("fork acceptor");
+    }
+    for(int i=0;i<n;i++) if(i!=me) close(sds[i]);
+    if(ACCEPT_PIN){
+        long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set; CPU_ZERO(&set); CPU_SET(me % (ncpu>0 ? ncpu : 1), &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    return me;
+}
+
 /* ---------- main: accept + fork per client ---------- */
 int main(void){
     signal(SIGCHLD, SIG_IGN); // avoid zombies
 
-    int sd = socket(AF_INET, SOCK_STREAM, 0);
-    if(sd<0){ perror("socket"); return 1; }
-    int opt=1; setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-
-    struct sockaddr_in a={0};
-    a.sin_family = AF_INET;
-    a.sin_addr.s_addr = htonl(INADDR_ANY);
-    a.sin_port = htons(S1_PORT);
+    int sds[ACCEPT_MAX];
+    int nacc = listen_all(S1_PORT, sds);
+    if(nacc < 0) return 1;
 
-    if(bind(sd,(struct sockaddr*)&a,sizeof(a))<0){ perror("bind"); return 1; }
-    if(listen(sd, BACKLOG)<0){ perror("listen"); return 1; }
-
-    fprintf(stderr, "S1 listening on %d, root=%s\n", S1_PORT, S1_ROOT);
+    fprintf(stderr, "S1 listening on %d (%d acceptor%s), root=%s\n", S1_PORT, nacc, nacc>1?"s":"", S1_ROOT);
+    if(PACKSTORE && pack_init(S1_ROOT) < 0){ perror("pack"); return 1; }
+    jnl_init(S1_ROOT);
+    meta_init(S1_ROOT);
+    dc_init(S1_ROOT);
+    qos_init();
+    ec_init();
+    tier_init();
+    redir_init();
+    if(TRACE) tr_open_file();   // sessions inherit it; names this server's track
+    prof_init();
+    rq_init();
+    int sd = sds[spawn_acceptors(sds, nacc)];
 
+    time_t last_compact = 0;
     while(1){
-        int csd = accept(sd, NULL, NULL);
+        struct sockaddr_in peer; socklen_t plen = sizeof(peer);
+        int csd = accept(sd, (struct sockaddr*)&peer, &plen);
         if(csd < 0){ if(errno==EINTR) continue; perror("accept"); break; }
+        int one = 1; setsockopt(csd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));   // replies are batched already
+        uint32_t caddr = peer.sin_addr.s_addr;
+        if(!qos_admit(caddr, 0)){ dprintf(csd, "ERR busy\n"); close(csd); continue; }
+        if(PACKSTORE && time(NULL)-last_compact >= 60 && pack_need_compact()){
+            last_compact = time(NULL);
+            if(fork()==0){ close(sd); close(csd); pack_compact(); _exit(0); }
+        }
         pid_t pid = fork();
         if(pid == 0){
             close(sd);
+            signal(SIGCHLD, SIG_DFL);   // the session checks its helpers' exit status
+            qsess.addr = caddr;
             prcclient(csd);
+            rq_end();
+            qos_idle(); qos_leave();
             _exit(0);
         }
+        qos_register(caddr, pid, 0);
         close(csd);
     }
     close(sd);
@@ -1,7 +1,9 @@
 // S2.c — PDF backend for S1
 // Build: gcc S2.c -o S2
 // Run:   ./S2
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -10,14 +12,39 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <dirent.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include <sys/types.h>
 
 #define S2_PORT 6202
+#ifndef BACKLOG
 #define BACKLOG 16
+#endif
+#ifndef AUX_UNIX
+#define AUX_UNIX 1
+#endif
+#ifndef AUX_SOCK
+#define AUX_SOCK "/tmp/dfs-%d.sock"   // %d = TCP port; see acceptors
+#endif
+#ifndef FD_PASS_MIN
+#define FD_PASS_MIN (64*1024)
+#endif
 #define BUFSZ   4096
 
 
@@ -40,6 +67,55 @@ static ssize_t write_n(int fd, const void *buf, size_t n){
     }
     return (ssize_t)off;
 }
+// write_n for several pieces (reply header + payload) in one writev.
+static int writev_n(int fd, struct iovec *v, int cnt){
+    while(cnt>0){
+        if(!v->iov_len){ v++; cnt--; continue; }
+        ssize_t w=writev(fd, v, cnt);
+        if(w<0){ if(errno==EINTR) continue; return -1; }
+        if(w==0) return -1;
+        while(cnt>0 && (size_t)w>=v->iov_len){ w -= (ssize_t)v->iov_len; v++; cnt--; }
+        if(cnt>0){ v->iov_base = (char*)v->iov_base + w; v->iov_len -= (size_t)w; }
+    }
+    return 0;
+}
+// Reply header whose payload follows at once (more!=0): MSG_MORE holds it
+// back so both leave in the same segment instead of a lone header packet.
+static void head_printf(int fd, int more, const char *fmt, ...){
+    char sb[512], *b = sb; va_list ap, aq; va_start(ap, fmt); va_copy(aq, ap);
+    int n = vsnprintf(sb, sizeof(sb), fmt, ap);
+    va_end(ap);
+    if(n>=(int)sizeof(sb) && (b = malloc((size_t)n+1))) vsnprintf(b, (size_t)n+1, fmt, aq);   // a long path: the line is never cut
+    va_end(aq);
+    if(n<0 || !b) return;
+    size_t off = 0;
+    while(off<(size_t)n){
+        ssize_t w = send(fd, b+off, (size_t)n-off, more ? MSG_MORE : 0);
+        if(w<0 && errno==EINTR) continue;
+        if(w<0 && errno==ENOTSOCK){ write_n(fd, b+off, (size_t)n-off); break; }
+        if(w<=0) break;
+        off += (size_t)w;
+    }
+    if(b!=sb) free(b);
+}
+// Is this an AF_UNIX connection (S1 and an aux server on the same host)?
+static int sock_is_unix(int sd){
+    struct sockaddr_storage a; socklen_t l=sizeof(a);
+    return getsockname(sd,(struct sockaddr*)&a,&l)==0 && a.ss_family==AF_UNIX;
+}
+// Reply line with an open descriptor attached (SCM_RIGHTS, AF_UNIX only).
+static int send_fd(int sd, const char *line, int fd){
+    struct iovec v={ (void*)line, strlen(line) };
+    union { struct cmsghdr h; char b[CMSG_SPACE(sizeof(int))]; } cm;
+    memset(&cm,0,sizeof(cm));
+    struct msghdr m={0}; m.msg_iov=&v; m.msg_iovlen=1; m.msg_control=cm.b; m.msg_controllen=sizeof(cm.b);
+    struct cmsghdr *h=CMSG_FIRSTHDR(&m);
+    h->cmsg_level=SOL_SOCKET; h->cmsg_type=SCM_RIGHTS; h->cmsg_len=CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(h),&fd,sizeof(int));
+    ssize_t w;
+    do w=sendmsg(sd,&m,MSG_NOSIGNAL); while(w<0 && errno==EINTR);
+    return w==(ssize_t)v.iov_len ? 0 : -1;
+}
 static ssize_t read_line(int fd, char *buf, size_t len){
     size_t i=0;
     while(i+1<len){
@@ -64,44 +140,2491 @@ static void join_path(char *out, size_t outsz, const char *root, const char *des
     if(dest[0]=='/') snprintf(out,outsz,"%s%s",root,dest);
     else snprintf(out,outsz,"%s/%s",root,dest);
 }
+
+/* ---------- wire compression ----------
+   COMP <codec,...> picks the first codec both ends support for the session.
+   A transfer whose header line carries "z=<codec>" is then sent as frames:
+   raw length and wire length (4 bytes each, big-endian) followed by the
+   payload; wire==raw means stored, raw==0 ends the stream. raw==0 with
+   wire==0xffffffff ends it with an error: the sender gave up and what came
+   before is incomplete. "lz4" is the
+   LZ4 block format (built-in coder, or liblz4 with -DHAVE_LZ4 -llz4);
+   "zstd" needs -DHAVE_ZSTD -lzstd. */
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#define ZCHUNK  (64*1024)
+#define ZBOUND  (ZCHUNK + ZCHUNK/255 + 64)
+enum { Z_NONE=0, Z_LZ4=1, Z_ZSTD=2, Z_RAW=3 };   // raw: framed, never compressed
+static const char *z_names[] = { "none", "lz4", "zstd", "raw" };
+static struct { long long raw, wire, cpu_ns; } zstat;   // this process
+
+static int z_parse(const char *name){
+    for(int i=0;i<4;i++) if(strcmp(name,z_names[i])==0) return i;
+    return -1;
+}
+static int z_supported(int c){
+#ifdef HAVE_ZSTD
+    if(c==Z_ZSTD) return 1;
+#endif
+    return c==Z_NONE || c==Z_LZ4 || c==Z_RAW;
+}
+// First codec in a comma-separated offer that we support.
+static int z_choose(const char *offer){
+    char tmp[128]; snprintf(tmp,sizeof(tmp),"%s",offer);
+    for(char *t=strtok(tmp,","); t; t=strtok(NULL,",")){
+        int c=z_parse(t); if(c>0 && c!=Z_RAW && z_supported(c)) return c;
+    }
+    return Z_NONE;
+}
+// Already-compressed formats are sent as-is.
+static int z_skip_ext(const char *name){
+    static const char *exts[] = { ".zip",".pdf",".gz",".tgz",".zst",".xz",".bz2",".7z",".png",".jpg",".jpeg",NULL };
+    const char *dot=strrchr(name,'.');
+    if(!dot) return 0;
+    for(int i=0;exts[i];i++) if(strcasecmp(dot,exts[i])==0) return 1;
+    return 0;
+}
+// Value of a " key=value" token in a header line; returns 1 if present.
+static int opt_get(const char *line, const char *key, char *val, size_t vsz){
+    size_t kl=strlen(key);
+    for(const char *p=line; (p=strchr(p,' '))!=NULL; ){
+        p++;
+        if(strncmp(p,key,kl)==0 && p[kl]=='='){
+            p+=kl+1; size_t n=strcspn(p," \r\n");
+            if(n>=vsz) n=vsz-1;
+            memcpy(val,p,n); val[n]='\0';
+            return 1;
+        }
+    }
+    return 0;
+}
+static const char *z_opt(int c){ static const char *o[]={""," z=lz4"," z=zstd"," z=raw"}; return o[c]; }
+static long long z_now_ns(void){
+    struct timespec ts; clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&ts);
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+#ifndef HAVE_LZ4
+static uint32_t lz_read32(const unsigned char *p){ uint32_t v; memcpy(&v,p,4); return v; }
+static int lz_putlen(unsigned char *dst, int op, int cap, int len){
+    for(; len>=255; len-=255){ if(op>=cap) return -1; dst[op++]=255; }
+    if(op>=cap) return -1;
+    dst[op++]=(unsigned char)len;
+    return op;
+}
+static int lz_emit(unsigned char *dst, int op, int cap, const unsigned char *lit, int nlit, int off, int mlen){
+    if(op>=cap) return -1;
+    int tok=op++;
+    dst[tok] = (unsigned char)((nlit>=15 ? 15 : nlit) << 4);
+    if(nlit>=15 && (op=lz_putlen(dst,op,cap,nlit-15))<0) return -1;
+    if(op+nlit>cap) return -1;
+    memcpy(dst+op,lit,(size_t)nlit); op+=nlit;
+    if(!off) return op;                          // final literals-only sequence
+    if(op+2>cap) return -1;
+    dst[op++]=(unsigned char)(off&255); dst[op++]=(unsigned char)(off>>8);
+    int m=mlen-4;
+    dst[tok] |= (unsigned char)(m>=15 ? 15 : m);
+    if(m>=15 && (op=lz_putlen(dst,op,cap,m-15))<0) return -1;
+    return op;
+}
+#endif
+// Returns compressed length, or -1 if it does not fit in 'cap'.
+static int lz4_compress(const unsigned char *src, int n, unsigned char *dst, int cap){
+#ifdef HAVE_LZ4
+    int r=LZ4_compress_default((const char*)src,(char*)dst,n,cap);
+    return r>0 ? r : -1;
+#else
+    enum { HLOG=12 };
+    int tab[1<<HLOG]; memset(tab,-1,sizeof(tab));
+    int ip=0, anchor=0, op=0;
+    const int mflimit=n-12, matchlimit=n-5;     // LZ4 end-of-block rules
+    while(ip<mflimit){
+        uint32_t seq=lz_read32(src+ip);
+        uint32_t h=(seq*2654435761u)>>(32-HLOG);
+        int ref=tab[h]; tab[h]=ip;
+        if(ref<0 || ip-ref>65535 || lz_read32(src+ref)!=seq){ ip += 1 + ((ip-anchor)>>6); continue; }
+        while(ip>anchor && ref>0 && src[ip-1]==src[ref-1]){ ip--; ref--; }
+        int len=4; while(ip+len<matchlimit && src[ip+len]==src[ref+len]) len++;
+        if((op=lz_emit(dst,op,cap,src+anchor,ip-anchor,ip-ref,len))<0) return -1;
+        ip+=len; anchor=ip;
+    }
+    return lz_emit(dst,op,cap,src+anchor,n-anchor,0,0);
+#endif
+}
+// Returns decompressed length, or -1 on corrupt input.
+static int lz4_decompress(const unsigned char *src, int n, unsigned char *dst, int cap){
+#ifdef HAVE_LZ4
+    int r=LZ4_decompress_safe((const char*)src,(char*)dst,n,cap);
+    return r>=0 ? r : -1;
+#else
+    int ip=0, op=0;
+    while(ip<n){
+        int tok=src[ip++], lit=tok>>4, b;
+        if(lit==15) do{ if(ip>=n) return -1; b=src[ip++]; lit+=b; }while(b==255);
+        if(ip+lit>n || op+lit>cap) return -1;
+        memcpy(dst+op,src+ip,(size_t)lit); ip+=lit; op+=lit;
+        if(ip>=n) break;
+        if(ip+2>n) return -1;
+        int off=src[ip] | (src[ip+1]<<8); ip+=2;
+        if(off==0 || off>op) return -1;
+        int ml=(tok&15)+4;
+        if((tok&15)==15) do{ if(ip>=n) return -1; b=src[ip++]; ml+=b; }while(b==255);
+        if(op+ml>cap) return -1;
+        for(int i=0;i<ml;i++,op++) dst[op]=dst[op-off];   // may overlap
+    }
+    return op;
+#endif
+}
+static int z_compress(int codec, const char *src, int n, char *dst, int cap){
+    int r=-1; long long t0=z_now_ns();
+    if(codec==Z_LZ4) r=lz4_compress((const unsigned char*)src,n,(unsigned char*)dst,cap);
+#ifdef HAVE_ZSTD
+    else if(codec==Z_ZSTD){ size_t z=ZSTD_compress(dst,(size_t)cap,src,(size_t)n,1); r=ZSTD_isError(z)?-1:(int)z; }
+#endif
+    zstat.cpu_ns += z_now_ns()-t0;
+    return r;
+}
+static int z_decompress(int codec, const char *src, int n, char *dst, int cap){
+    int r=-1; long long t0=z_now_ns();
+    if(codec==Z_LZ4) r=lz4_decompress((const unsigned char*)src,n,(unsigned char*)dst,cap);
+#ifdef HAVE_ZSTD
+    else if(codec==Z_ZSTD){ size_t z=ZSTD_decompress(dst,(size_t)cap,src,(size_t)n); r=ZSTD_isError(z)?-1:(int)z; }
+#endif
+    zstat.cpu_ns += z_now_ns()-t0;
+    return r;
+}
+
+static void be32put(unsigned char *p, uint32_t v){ p[0]=(unsigned char)(v>>24); p[1]=(unsigned char)(v>>16); p[2]=(unsigned char)(v>>8); p[3]=(unsigned char)v; }
+static uint32_t be32get(const unsigned char *p){ return ((uint32_t)p[0]<<24)|((uint32_t)p[1]<<16)|((uint32_t)p[2]<<8)|p[3]; }
+
+// Frame writer. Output is batched: the reply header set with zw_head() goes
+// out in the same writev as the first payload bytes, Z_NONE data is collected
+// up to ZCHUNK, and the last frame carries the end marker. Nothing is sent
+// before zw_end() unless the buffer fills.
+#define ZHEAD 1536   // a header line: verb, dest (1023), fname (255) and options
+struct zw { int fd, codec; size_t n, hn; char head[ZHEAD]; char buf[ZCHUNK]; char out[8+ZBOUND+8]; };
+static void zw_init(struct zw *z, int fd, int codec){ z->fd=fd; z->codec=codec; z->n=0; z->hn=0; }
+static void zw_head(struct zw *z, const char *fmt, ...){
+    va_list ap, aq; va_start(ap, fmt); va_copy(aq, ap);
+    int k = vsnprintf(z->head, sizeof(z->head), fmt, ap);
+    va_end(ap);
+    if(k>=(int)sizeof(z->head)){   // longer still: it goes out ahead of the payload, whole
+        char *b = malloc((size_t)k+1);
+        if(b){ vsnprintf(b, (size_t)k+1, fmt, aq); write_n(z->fd, b, (size_t)k); free(b); }
+        k = 0;
+    }
+    va_end(aq);
+    z->hn = k<0 ? 0 : (size_t)k;
+}
+// Pending header plus up to two pieces, one syscall in the common case.
+static int zw_send(struct zw *z, const void *a, size_t an, const void *b, size_t bn){
+    struct iovec v[3] = { { z->head, z->hn }, { (void*)a, an }, { (void*)b, bn } };
+    z->hn = 0;
+    return writev_n(z->fd, v, 3);
+}
+static int zw_frame(struct zw *z, int last){
+    size_t len = 0;
+    if(z->n>0){
+        int c = z_compress(z->codec, z->buf, (int)z->n, z->out+8, ZBOUND);
+        uint32_t wire = (c>0 && (size_t)c<z->n) ? (uint32_t)c : (uint32_t)z->n;
+        if(wire==z->n) memcpy(z->out+8, z->buf, z->n);
+        be32put((unsigned char*)z->out, (uint32_t)z->n); be32put((unsigned char*)z->out+4, wire);
+        zstat.raw += (long long)z->n; zstat.wire += 8+(long long)wire;
+        z->n=0; len = 8+wire;
+    }
+    if(last){ memset(z->out+len, 0, 8); len += 8; zstat.wire += 8; }
+    return (len || z->hn) ? zw_send(z, z->out, len, NULL, 0) : 0;
+}
+static int zw_write(struct zw *z, const void *p, size_t n){
+    const char *s=(const char*)p;
+    if(z->codec==Z_NONE){
+        if(z->n+n > ZCHUNK){                     // what is buffered, then this piece
+            size_t k = z->n; z->n = 0;
+            return zw_send(z, z->buf, k, s, n);
+        }
+        memcpy(z->buf+z->n, s, n); z->n += n;
+        return 0;
+    }
+    while(n>0){
+        size_t k = ZCHUNK - z->n; if(k>n) k=n;
+        memcpy(z->buf+z->n, s, k); z->n+=k; s+=k; n-=k;
+        if(z->n==ZCHUNK && zw_frame(z,0)<0) return -1;
+    }
+    return 0;
+}
+static int zw_end(struct zw *z){
+    if(z->codec!=Z_NONE) return zw_frame(z, 1);
+    size_t k = z->n; z->n = 0;
+    return (k || z->hn) ? zw_send(z, z->buf, k, NULL, 0) : 0;
+}
+
+// Frame reader; with Z_NONE it reads straight through (no read-ahead).
+struct zr { int fd, codec, eof; size_t off, len; char buf[ZCHUNK]; char in[ZBOUND]; };
+static void zr_init(struct zr *z, int fd, int codec){ z->fd=fd; z->codec=codec; z->eof=0; z->off=z->len=0; }
+static int read_full(int fd, void *buf, size_t n){
+    size_t off=0;
+    while(off<n){
+        ssize_t r=read(fd,(char*)buf+off,n-off);
+        if(r<0){ if(errno==EINTR) continue; return -1; }
+        if(r==0) return -1;
+        off+=(size_t)r;
+    }
+    return 0;
+}
+static int zr_fill(struct zr *z){
+    unsigned char h[8];
+    if(read_full(z->fd,h,8)<0) return -1;
+    uint32_t raw=be32get(h), wire=be32get(h+4);
+    if(raw==0){ if(wire) return -1; z->eof=1; zstat.wire+=8; return 0; }   // wire!=0: error frame
+    if(raw>ZCHUNK || wire>raw || read_full(z->fd,z->in,wire)<0) return -1;
+    if(wire==raw) memcpy(z->buf,z->in,raw);
+    else if(z_decompress(z->codec,z->in,(int)wire,z->buf,ZCHUNK)!=(int)raw) return -1;
+    zstat.raw += raw; zstat.wire += 8+(long long)wire;
+    z->off=0; z->len=raw;
+    return 0;
+}
+static ssize_t zr_read(struct zr *z, void *p, size_t n){
+    if(z->codec==Z_NONE){
+        for(;;){ ssize_t r=read(z->fd,p,n); if(r<0 && errno==EINTR) continue; return r; }
+    }
+    if(z->off==z->len){
+        if(z->eof) return 0;
+        if(zr_fill(z)<0) return -1;
+        if(z->eof) return 0;
+    }
+    size_t k = z->len - z->off; if(k>n) k=n;
+    memcpy(p, z->buf+z->off, k); z->off+=k;
+    return (ssize_t)k;
+}
+// Consume the rest of a framed stream up to its end marker.
+static int zr_finish(struct zr *z){
+    char tmp[512];
+    if(z->codec==Z_NONE) return 0;
+    while(!z->eof){ ssize_t r=zr_read(z,tmp,sizeof(tmp)); if(r<0) return -1; if(r==0) break; }
+    return 0;
+}
+
+static int sess_codec = Z_NONE;   // negotiated with COMP on this connection
+
+/* ---------- request tracing ----------
+   Every client command gets a request id (the client's own "rid=" if it sent
+   one); S1 passes it on as " rid=<trace>-<parent span>" with STORE, FETCH,
+   DELETE, LIST and TARALL, and S2-S4 adopt it. Spans go into a per-thread
+   ring (TRACE_RING entries, no locks, no allocation) and at the end of each
+   command are appended in one O_APPEND write to TRACE_FILE, which all four
+   servers share: Chrome trace events (chrome://tracing, Perfetto; pid = S<n>,
+   tid = session) or, with -DTRACE_OTLP=1, OpenTelemetry JSON lines (one
+   ExportTraceServiceRequest per command). Off unless built with -DTRACE=1.
+   The file lives in RUN_DIR, a 0700 directory of the server's user that is
+   refused if it is a link or someone else's; it is opened O_NOFOLLOW, and
+   past TRACE_MAX bytes it is renamed to TRACE_FILE.1 and started afresh
+   (processes still holding the old one notice the new inode and reopen). */
+#ifndef TRACE
+#define TRACE 0
+#endif
+#ifndef RUN_DIR
+#define RUN_DIR "/tmp/dfs-run-%u"        // %u: the effective uid
+#endif
+#ifndef TRACE_FILE
+#define TRACE_FILE "trace.json"
+#endif
+#ifndef TRACE_MAX
+#define TRACE_MAX (64LL<<20)
+#endif
+#ifndef TRACE_OTLP
+#define TRACE_OTLP 0
+#endif
+#define TRACE_RING 256
+#define TRACE_SRV  2
+
+struct tspan { uint64_t id, parent; const char *name; long long t0, t1; };
+static __thread struct {
+    struct tspan r[TRACE_RING];
+    unsigned n, start;               // spans from 'start' on belong to the current command
+    uint64_t cur, seed;              // innermost open span, id generator
+} tr;
+static struct { uint64_t hi, lo, parent; int root; char cmd[16]; } tctx = { .root = -1 };
+static int tr_fd = -1;
+static char tr_path[128];
+
+static long long tr_now(void){
+    struct timespec ts; clock_gettime(CLOCK_REALTIME,&ts);
+    return (long long)ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+static uint64_t tr_rand(void){
+    if(!tr.seed) tr.seed = (uint64_t)tr_now() ^ ((uint64_t)getpid()<<32) ^ (uint64_t)(uintptr_t)&tr;
+    tr.seed ^= tr.seed<<13; tr.seed ^= tr.seed>>7; tr.seed ^= tr.seed<<17;
+    return tr.seed ? tr.seed : 1;
+}
+// Open a span below the innermost open one; the handle goes to tr_end().
+static int tr_begin(const char *name){
+    if(!TRACE) return -1;
+    unsigned i = tr.n++;
+    struct tspan *s = &tr.r[i % TRACE_RING];
+    s->id = tr_rand(); s->parent = tr.cur ? tr.cur : tctx.parent;
+    s->name = name; s->t0 = tr_now(); s->t1 = 0;
+    tr.cur = s->id;
+    return (int)(i & 0x7fffffff);
+}
+static void tr_end(int h){
+    if(h<0 || tr.n-(unsigned)h > TRACE_RING) return;   // overwritten by a long command
+    struct tspan *s = &tr.r[(unsigned)h % TRACE_RING];
+    s->t1 = tr_now();
+    tr.cur = s->parent==tctx.parent ? 0 : s->parent;
+}
+// RUN_DIR/name, once RUN_DIR is known to be a private directory of ours.
+static int run_path(char *out, size_t n, const char *name){
+    char d[64]; struct stat st;
+    snprintf(d, sizeof(d), RUN_DIR, (unsigned)geteuid());
+    if(mkdir(d, 0700)<0 && errno!=EEXIST) return -1;
+    if(lstat(d,&st)<0 || !S_ISDIR(st.st_mode) || st.st_uid!=geteuid() || (st.st_mode & 022)) return -1;
+    snprintf(out, n, "%s/%s", d, name);
+    return 0;
+}
+// Name this server's track; the first server to touch a file opens the array.
+static void tr_announce(void){
+    if(!TRACE || TRACE_OTLP || tr_fd<0) return;
+    char b[160]; struct stat st;
+    flock(tr_fd, LOCK_EX);
+    if(fstat(tr_fd,&st)==0 && st.st_size==0) (void)!write(tr_fd, "[\n", 2);
+    int k = snprintf(b, sizeof(b), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"S%d\"}},\n", TRACE_SRV, TRACE_SRV);
+    (void)!write(tr_fd, b, (size_t)k);
+    flock(tr_fd, LOCK_UN);
+}
+// The fd of the current trace file: reopened after another process rotated it.
+static int tr_open_file(void){
+    struct stat a, b;
+    if(tr_fd>=0){
+        if(fstat(tr_fd,&a)==0 && stat(tr_path,&b)==0 && a.st_ino==b.st_ino && a.st_dev==b.st_dev) return tr_fd;
+        close(tr_fd); tr_fd = -1;
+    }
+    if(!*tr_path && run_path(tr_path, sizeof(tr_path), TRACE_FILE)<0){ tr_path[0] = '\0'; return -1; }
+    tr_fd = open(tr_path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC|O_NOFOLLOW, 0600);
+    tr_announce();
+    return tr_fd;
+}
+// Caller holds the flock: move a full file aside, start the next one.
+static void tr_rotate(void){
+    char old[sizeof(tr_path)+2]; snprintf(old, sizeof(old), "%s.1", tr_path);
+    rename(tr_path, old);
+    flock(tr_fd, LOCK_UN);
+    close(tr_fd); tr_fd = -1;
+    tr_open_file();
+    if(tr_fd>=0) flock(tr_fd, LOCK_EX);
+}
+static void tr_flush(void){
+    unsigned from = tr.n-tr.start > TRACE_RING ? tr.n-TRACE_RING : tr.start;
+    if(from==tr.n || tr_open_file()<0) return;
+    static char *buf; const size_t cap = (size_t)TRACE_RING*400+512;
+    if(!buf && !(buf = malloc(cap))) return;
+    char trace[40]; snprintf(trace, sizeof(trace), "%016llx%016llx", (unsigned long long)tctx.hi, (unsigned long long)tctx.lo);
+    long long now = tr_now();
+    size_t k = 0;
+    if(TRACE_OTLP) k += (size_t)snprintf(buf+k, cap-k,
+        "{\"resourceSpans\":[{\"resource\":{\"attributes\":[{\"key\":\"service.name\",\"value\":{\"stringValue\":\"S%d\"}}]},"
+        "\"scopeSpans\":[{\"scope\":{\"name\":\"dfs\"},\"spans\":[", TRACE_SRV);
+    for(unsigned i=from; i!=tr.n; i++){
+        struct tspan *s = &tr.r[i % TRACE_RING];
+        long long t1 = s->t1 ? s->t1 : now;
+        char par[24] = ""; if(s->parent) snprintf(par, sizeof(par), "%016llx", (unsigned long long)s->parent);
+        if(TRACE_OTLP)
+            k += (size_t)snprintf(buf+k, cap-k, "%s{\"traceId\":\"%s\",\"spanId\":\"%016llx\",\"parentSpanId\":\"%s\",\"name\":\"%s\","
+                "\"kind\":%d,\"startTimeUnixNano\":\"%lld000\",\"endTimeUnixNano\":\"%lld000\","
+                "\"attributes\":[{\"key\":\"process.pid\",\"value\":{\"intValue\":\"%d\"}}]}",
+                i==from ? "" : ",", trace, (unsigned long long)s->id, par, s->name,
+                (int)i==tctx.root ? 2 : 1, s->t0, t1, (int)getpid());
+        else
+            k += (size_t)snprintf(buf+k, cap-k, "{\"name\":\"%s\",\"cat\":\"S%d\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"rid\":\"%s\",\"span\":\"%016llx\",\"parent\":\"%s\"}},\n",
+                s->name, TRACE_SRV, s->t0, t1-s->t0, TRACE_SRV, (int)getpid(), trace, (unsigned long long)s->id, par);
+        if(k>=cap-400) break;
+    }
+    if(TRACE_OTLP) k += (size_t)snprintf(buf+k, cap-k, "]}]}]}\n");
+    struct stat st;
+    flock(tr_fd, LOCK_EX);
+    if(fstat(tr_fd,&st)==0 && st.st_size+(long long)k > TRACE_MAX) tr_rotate();
+    if(tr_fd>=0){ (void)!write(tr_fd, buf, k); flock(tr_fd, LOCK_UN); }
+}
+// A command line arrived: adopt its "rid=<trace>[-<parent span>]" or start a
+// new trace, and open the command's root span.
+static void tr_request(const char *line){
+    if(!TRACE) return;
+    tr.start = tr.n; tr.cur = 0;
+    tctx.hi = tctx.lo = tctx.parent = 0;
+    char v[64];
+    if(opt_get(line, "rid", v, sizeof(v))){
+        char *dash = strchr(v, '-');
+        if(dash){ *dash = '\0'; tctx.parent = strtoull(dash+1, NULL, 16); }
+        size_t l = strlen(v);
+        if(l>16){ tctx.lo = strtoull(v+l-16, NULL, 16); v[l-16] = '\0'; tctx.hi = strtoull(v, NULL, 16); }
+        else tctx.lo = strtoull(v, NULL, 16);
+    }
+    if(!tctx.hi && !tctx.lo){ tctx.hi = tr_rand(); tctx.lo = tr_rand(); }
+    snprintf(tctx.cmd, sizeof(tctx.cmd), "%.*s", (int)strcspn(line, " \r\n"), line);
+    tctx.root = tr_begin(tctx.cmd);
+}
+// The command is done (or a forked helper exits): close the root, write the spans.
+static void tr_finish(void){
+    if(!TRACE) return;
+    if(tctx.root>=0) tr_end(tctx.root);
+    tr_flush();
+    tr.start = tr.n; tctx.root = -1;
+}
+
+/* ---------- bulk copy engine ----------
+   xfer_copy() moves the raw payload of an uncompressed transfer between a
+   socket and a file. With io_uring (raw syscalls, no liburing) the read of
+   the next chunk overlaps the write of the previous one, through IO_NBUF
+   registered buffers and the two fds installed as fixed files; each
+   io_uring_enter both submits and reaps. If the kernel refuses a ring (old
+   kernel, seccomp) or with -DIO_URING=0 it is a plain read/write loop in
+   IO_BUF steps. File-to-socket copies go through sendfile() first (no user
+   copy at all; -DSENDFILE=0 turns it off). Framed (compressed) transfers keep going through zr/zw. */
+#ifndef IO_URING
+#define IO_URING 1
+#endif
+#ifndef SENDFILE
+#define SENDFILE 1
+#endif
+#define IO_BUF  (128*1024)
+#define IO_NBUF 4
+static struct { long long calls, bytes; int mode, sf; } iostat;   // mode: 0 untried, 1 io_uring, -1 read/write; sf likewise for sendfile
+
+#if IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+static struct {
+    int fd; pid_t pid;
+    unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes; struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map; size_t sq_sz, cq_sz, sqe_sz;
+    char *buf; unsigned queued;
+} ur = { .fd = -1 };
+
+static void ur_teardown(void){
+    if(ur.fd<0) return;
+    if(ur.cq_map && ur.cq_map!=ur.sq_map) munmap(ur.cq_map, ur.cq_sz);
+    if(ur.sq_map) munmap(ur.sq_map, ur.sq_sz);
+    if(ur.sqes) munmap(ur.sqes, ur.sqe_sz);
+    close(ur.fd);
+    free(ur.buf);
+    memset(&ur, 0, sizeof(ur)); ur.fd = -1;
+}
+// One ring per process: a ring inherited across fork() belongs to the parent.
+static int ur_setup(void){
+    if(ur.fd>=0 && ur.pid==getpid()) return 0;
+    ur_teardown();
+    struct io_uring_params p; memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, 8, &p);
+    if(fd<0) return -1;
+    ur.fd = fd; ur.pid = getpid();
+    ur.sq_sz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    ur.cq_sz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(single){ if(ur.cq_sz>ur.sq_sz) ur.sq_sz = ur.cq_sz; ur.cq_sz = ur.sq_sz; }
+    ur.sq_map = mmap(NULL, ur.sq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(ur.sq_map==MAP_FAILED){ ur.sq_map = NULL; ur_teardown(); return -1; }
+    ur.cq_map = single ? ur.sq_map : mmap(NULL, ur.cq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if(ur.cq_map==MAP_FAILED){ ur.cq_map = NULL; ur_teardown(); return -1; }
+    ur.sqe_sz = p.sq_entries*sizeof(struct io_uring_sqe);
+    ur.sqes = mmap(NULL, ur.sqe_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(ur.sqes==MAP_FAILED){ ur.sqes = NULL; ur_teardown(); return -1; }
+    char *sq = ur.sq_map, *cq = ur.cq_map;
+    ur.sq_tail = (unsigned*)(sq+p.sq_off.tail); ur.sq_mask = (unsigned*)(sq+p.sq_off.ring_mask);
+    ur.sq_array = (unsigned*)(sq+p.sq_off.array);
+    ur.cq_head = (unsigned*)(cq+p.cq_off.head); ur.cq_tail = (unsigned*)(cq+p.cq_off.tail);
+    ur.cq_mask = (unsigned*)(cq+p.cq_off.ring_mask);
+    ur.cqes = (struct io_uring_cqe*)(cq+p.cq_off.cqes);
+
+    // registered buffers and a sparse two-slot fixed file table (0 = in, 1 = out)
+    ur.buf = aligned_alloc(4096, (size_t)IO_NBUF*IO_BUF);
+    struct iovec iov[IO_NBUF];
+    for(int i=0;i<IO_NBUF && ur.buf;i++){ iov[i].iov_base = ur.buf+(size_t)i*IO_BUF; iov[i].iov_len = IO_BUF; }
+    int sparse[2] = { -1, -1 };
+    if(!ur.buf || syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, IO_NBUF)<0
+               || syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, sparse, 2)<0){
+        ur_teardown(); return -1;
+    }
+    return 0;
+}
+static void ur_prep(int op, int slot, int bi, unsigned boff, unsigned len, long long foff){
+    unsigned tail = *ur.sq_tail, idx = tail & *ur.sq_mask;
+    struct io_uring_sqe *e = &ur.sqes[idx];
+    memset(e, 0, sizeof(*e));
+    e->opcode = (uint8_t)op; e->fd = slot; e->flags = IOSQE_FIXED_FILE;
+    e->addr = (uint64_t)(uintptr_t)(ur.buf+(size_t)bi*IO_BUF+boff); e->len = len;
+    e->off = (uint64_t)foff;          // -1 on a socket: no offset
+    e->buf_index = (uint16_t)bi;
+    e->user_data = (uint64_t)(op==IORING_OP_WRITE_FIXED)<<8 | (uint64_t)bi;
+    ur.sq_array[idx] = idx;
+    __atomic_store_n(ur.sq_tail, tail+1, __ATOMIC_RELEASE);
+    ur.queued++;
+}
+static long long xfer_uring(int in, int out, long long n, long long in_off, long long out_off){
+    int fds[2] = { in, out };
+    struct io_uring_files_update up; memset(&up, 0, sizeof(up));
+    up.offset = 0; up.fds = (uint64_t)(uintptr_t)fds;
+    iostat.calls++;
+    if(syscall(__NR_io_uring_register, ur.fd, IORING_REGISTER_FILES_UPDATE, &up, 2)<0) return -1;
+
+    struct { unsigned len, wpos; } b[IO_NBUF];
+    int fifo[IO_NBUF], fh=0, fn=0;            // filled buffers, in stream order
+    int freeb[IO_NBUF], nfree=0;
+    for(int i=IO_NBUF-1;i>=0;i--) freeb[nfree++] = i;
+    int rd=-1, wr=-1, eof=0, err=0;           // buffer with a read / write in flight
+    long long left=n, done=0;
+    while(!err){
+        if(rd<0 && !eof && left>0 && nfree>0){
+            rd = freeb[--nfree];
+            ur_prep(IORING_OP_READ_FIXED, 0, rd, 0, (unsigned)(left>IO_BUF ? IO_BUF : left), in_off);
+        }
+        if(wr<0 && fn>0){
+            wr = fifo[fh];
+            ur_prep(IORING_OP_WRITE_FIXED, 1, wr, b[wr].wpos, b[wr].len-b[wr].wpos, out_off);
+        }
+        if(rd<0 && wr<0) break;
+        iostat.calls++;
+        if(syscall(__NR_io_uring_enter, ur.fd, ur.queued, 1, IORING_ENTER_GETEVENTS, NULL, 0)<0){
+            if(errno==EINTR) continue;
+            err = 1; break;
+        }
+        ur.queued = 0;
+        unsigned head = *ur.cq_head;
+        while(head != __atomic_load_n(ur.cq_tail, __ATOMIC_ACQUIRE)){
+            struct io_uring_cqe *c = &ur.cqes[head & *ur.cq_mask]; head++;
+            int bi = (int)(c->user_data & 0xff), res = c->res;
+            if(!(c->user_data>>8)){
+                rd = -1;
+                if(res==-EINTR || res==-EAGAIN){ freeb[nfree++] = bi; }
+                else if(res<0) err = 1;
+                else if(res==0){ eof = 1; freeb[nfree++] = bi; }
+                else{
+                    b[bi].len = (unsigned)res; b[bi].wpos = 0;
+                    fifo[(fh+fn)%IO_NBUF] = bi; fn++;
+                    left -= res; if(in_off>=0) in_off += res;
+                }
+            }else{
+                wr = -1;
+                if(res==-EINTR || res==-EAGAIN) continue;
+                if(res<=0){ err = 1; continue; }
+                b[bi].wpos += (unsigned)res; done += res; if(out_off>=0) out_off += res;
+                if(b[bi].wpos==b[bi].len){ fh = (fh+1)%IO_NBUF; fn--; freeb[nfree++] = bi; }
+            }
+        }
+        __atomic_store_n(ur.cq_head, head, __ATOMIC_RELEASE);
+    }
+    // an op may still be in flight on a dead peer; dropping the ring cancels it
+    if(err) ur_teardown();
+    return (err || done!=n) ? -1 : done;
+}
+#endif
+
+static long long xfer_loop(int in, int out, long long n){
+    static char *buf;
+    if(!buf && !(buf = malloc(IO_BUF))) return -1;
+    long long left=n;
+    while(left>0){
+        iostat.calls++;
+        ssize_t r = read(in, buf, (size_t)(left>IO_BUF ? IO_BUF : left));
+        if(r<0 && errno==EINTR) continue;
+        if(r<=0){ iostat.bytes += n-left; return -1; }
+        for(ssize_t w=0; w<r; ){
+            iostat.calls++;
+            ssize_t k = write(out, buf+w, (size_t)(r-w));
+            if(k<0 && errno==EINTR) continue;
+            if(k<=0){ iostat.bytes += n-left; return -1; }
+            w += k;
+        }
+        left -= r;
+    }
+    return n;
+}
+// File (at in_off) to socket inside the kernel; -2 if sendfile can't do this pair.
+static long long xfer_sendfile(int in, int out, long long n, long long in_off){
+    off_t off = (off_t)in_off; long long done = 0;
+    while(done<n){
+        size_t k = n-done > (1<<30) ? (size_t)1<<30 : (size_t)(n-done);
+        iostat.calls++;
+        ssize_t w = sendfile(out, in, &off, k);
+        if(w<0 && errno==EINTR) continue;
+        if(w<0 && done==0 && (errno==EINVAL || errno==ENOSYS)) return -2;
+        if(w<=0){ iostat.bytes += done; return -1; }   // what got out still counts
+        done += w;
+    }
+    return n;
+}
+// Copy n bytes from 'in' to 'out'; a file side gives its offset, a socket -1.
+static long long xfer_copy(int in, int out, long long n, long long in_off, long long out_off){
+    long long r = -2;
+    if(SENDFILE && iostat.sf>=0 && in_off>=0 && out_off<0){
+        r = xfer_sendfile(in, out, n, in_off);
+        if(r!=-2){ iostat.sf = 1; if(r>0) iostat.bytes += r; return r; }
+        iostat.sf = -1;
+    }
+#if IO_URING
+    if(iostat.mode>=0 && ur_setup()==0){ iostat.mode = 1; r = xfer_uring(in, out, n, in_off, out_off); }
+    else iostat.mode = -1;
+#else
+    (void)in_off; (void)out_off;
+    iostat.mode = -1;
+#endif
+    if(r==-2) r = xfer_loop(in, out, n);
+    if(r>0) iostat.bytes += r;
+    return r;
+}
+
+/* ---------- packed small-file store (PACKSTORE=1) ----------
+   Small files are appended as records to ROOT/.pack/seg-NNNNNN instead of
+   getting an inode each. Every process keeps an in-memory index
+   (key "dest/fname" -> segment, offset, size) and catches up by replaying
+   the log tail, so forked children see what their siblings appended.
+   Appends and compaction take LOCK_EX on .pack/LOCK, readers LOCK_SH;
+   compaction bumps .pack/GEN, which makes other processes reload. A put or
+   delete is fdatasync'd (with the directory for a new segment) before it
+   returns, so it is as durable as a plain file when the client gets OK. */
+#ifndef PACKSTORE
+#define PACKSTORE 0                     // build with -DPACKSTORE=1 to enable
+#endif
+#ifndef PACK_MAX
+#define PACK_MAX     (64*1024)          // files up to this size are packed
+#endif
+#ifndef PACK_SEGMAX
+#define PACK_SEGMAX  (64LL*1024*1024)   // roll to a new segment past this
+#endif
+#define PACK_MAGIC   0x314b4150u        // "PAK1"
+#define PACK_PUT     1
+#define PACK_DEL     2
+#define PACK_KEYMAX  2048
+
+struct pack_hdr { uint32_t magic; uint16_t op; uint16_t klen; uint32_t size; uint32_t pad; int64_t mtime; };
+struct pack_ent { char *key; uint32_t seg; uint32_t size; int64_t off; int64_t mtime; int live; };
+
+static struct {
+    char dir[2048];
+    struct pack_ent *tab; size_t cap, used;
+    uint32_t first, last, seg; int64_t pos;   // oldest/newest at load, replay position
+    long long *total, *live; size_t nstat;
+    unsigned long long gen;
+    pid_t pid; int lockfd, held;              // held: the flock mode this process has
+} pk = { .lockfd = -1 };
+
+static uint64_t fnv1a(const char *s){
+    uint64_t h=1469598103934665603ULL;
+    while(*s){ h ^= (unsigned char)*s++; h *= 1099511628211ULL; }
+    return h;
+}
+static void pack_key(char *out, size_t outsz, const char *dest, const char *fname){
+    while(dest && *dest=='/') dest++;
+    if(!dest || !*dest){ snprintf(out,outsz,"%s",fname); return; }
+    size_t dl=strlen(dest); while(dl>0 && dest[dl-1]=='/') dl--;
+    snprintf(out,outsz,"%.*s/%s",(int)dl,dest,fname);
+}
+static void seg_path(char *out, size_t outsz, uint32_t seg){
+    snprintf(out,outsz,"%s/seg-%06u",pk.dir,seg);
+}
+
+static void pack_grow(void){
+    size_t ncap = pk.cap ? pk.cap*2 : 1024;
+    struct pack_ent *nt = calloc(ncap, sizeof(*nt));
+    for(size_t i=0;i<pk.cap;i++){
+        if(!pk.tab[i].key) continue;
+        size_t j = fnv1a(pk.tab[i].key) & (ncap-1);
+        while(nt[j].key) j = (j+1) & (ncap-1);
+        nt[j] = pk.tab[i];
+    }
+    free(pk.tab); pk.tab=nt; pk.cap=ncap;
+}
+static struct pack_ent *pack_slot(const char *key, int create){
+    if(pk.cap){
+        size_t i = fnv1a(key) & (pk.cap-1);
+        while(pk.tab[i].key){
+            if(strcmp(pk.tab[i].key,key)==0) return &pk.tab[i];
+            i = (i+1) & (pk.cap-1);
+        }
+    }
+    if(!create) return NULL;
+    if((pk.used+1)*2 > pk.cap) pack_grow();
+    size_t i = fnv1a(key) & (pk.cap-1);
+    while(pk.tab[i].key) i = (i+1) & (pk.cap-1);
+    pk.tab[i].key = strdup(key); pk.used++;
+    return &pk.tab[i];
+}
+static long long pack_reclen(uint32_t klen, uint32_t size){ return (long long)sizeof(struct pack_hdr)+klen+size; }
+static void pack_stat(uint32_t seg, long long total, long long live){
+    if(seg >= pk.nstat){
+        size_t n = pk.nstat ? pk.nstat : 64; while(n <= seg) n*=2;
+        pk.total = realloc(pk.total, n*sizeof(long long));
+        pk.live  = realloc(pk.live,  n*sizeof(long long));
+        memset(pk.total+pk.nstat, 0, (n-pk.nstat)*sizeof(long long));
+        memset(pk.live+pk.nstat,  0, (n-pk.nstat)*sizeof(long long));
+        pk.nstat = n;
+    }
+    pk.total[seg] += total; pk.live[seg] += live;
+}
+static void pack_apply(uint32_t seg, int64_t off, const struct pack_hdr *h, const char *key){
+    long long rec = pack_reclen(h->klen, h->size);
+    pack_stat(seg, rec, h->op==PACK_PUT ? rec : 0);
+    struct pack_ent *e = pack_slot(key, h->op==PACK_PUT);
+    if(!e) return;
+    if(e->live) pack_stat(e->seg, 0, -pack_reclen(h->klen, e->size));
+    if(h->op==PACK_PUT){
+        e->seg=seg; e->off=off+(int64_t)sizeof(*h)+h->klen; e->size=h->size; e->mtime=h->mtime; e->live=1;
+    }else e->live=0;
+}
+
+// Replay complete records from the current position to the end of the log.
+static void pack_replay(void){
+    char p[2200];
+    for(;;){
+        seg_path(p,sizeof(p),pk.seg);
+        int fd=open(p,O_RDONLY);
+        if(fd>=0){
+            struct stat st; fstat(fd,&st);
+            struct pack_hdr h; char key[PACK_KEYMAX];
+            while(pk.pos+(int64_t)sizeof(h) <= st.st_size){
+                if(pread(fd,&h,sizeof(h),pk.pos)!=(ssize_t)sizeof(h) || h.magic!=PACK_MAGIC || h.klen>=sizeof(key)) break;
+                if(pk.pos+pack_reclen(h.klen,h.size) > st.st_size) break;   // torn or in-flight tail
+                if(pread(fd,key,h.klen,pk.pos+(off_t)sizeof(h))!=(ssize_t)h.klen) break;
+                key[h.klen]='\0';
+                pack_apply(pk.seg, pk.pos, &h, key);
+                pk.pos += pack_reclen(h.klen,h.size);
+            }
+            close(fd);
+        }
+        seg_path(p,sizeof(p),pk.seg+1);
+        if(access(p,F_OK)!=0 && pk.seg>=pk.last) return;   // compaction leaves holes below 'last'
+        pk.seg++; pk.pos=0;
+    }
+}
+static unsigned long long pack_read_gen(void){
+    char p[2200]; snprintf(p,sizeof(p),"%s/GEN",pk.dir);
+    char b[32]={0}; int fd=open(p,O_RDONLY); if(fd<0) return 0;
+    ssize_t r=read(fd,b,sizeof(b)-1); close(fd);
+    return r>0 ? strtoull(b,NULL,10) : 0;
+}
+static void pack_reload(void){
+    for(size_t i=0;i<pk.cap;i++) free(pk.tab[i].key);
+    free(pk.tab); pk.tab=NULL; pk.cap=pk.used=0;
+    if(pk.nstat){ memset(pk.total,0,pk.nstat*sizeof(long long)); memset(pk.live,0,pk.nstat*sizeof(long long)); }
+    pk.gen = pack_read_gen();
+
+    uint32_t lo=0, hi=0;
+    DIR *dp=opendir(pk.dir);
+    if(dp){
+        struct dirent *de;
+        while((de=readdir(dp))){
+            unsigned s; if(sscanf(de->d_name,"seg-%u",&s)!=1) continue;
+            if(lo==0 || s<lo) lo=s;
+            if(s>hi) hi=s;
+        }
+        closedir(dp);
+    }
+    pk.first = pk.seg = lo ? lo : 1; pk.last = hi; pk.pos = 0;
+    pack_replay();
+}
+static int pack_lock(int op){
+    if(pk.pid != getpid()){   // flock is per open file; each process needs its own
+        if(pk.lockfd>=0) close(pk.lockfd);
+        char p[2200]; snprintf(p,sizeof(p),"%s/LOCK",pk.dir);
+        pk.lockfd = open(p,O_RDWR|O_CREAT,0664);
+        pk.pid = getpid(); pk.held = 0;
+    }
+    if(pk.lockfd<0) return -1;
+    while(flock(pk.lockfd,op)<0) if(errno!=EINTR) return -1;
+    pk.held = op==LOCK_UN ? 0 : op;
+    return 0;
+}
+// Catch the index up with the log; takes LOCK_SH unless the caller holds the lock.
+static void pack_sync(void){
+    int own = pk.pid!=getpid() || !pk.held;
+    if(own && pack_lock(LOCK_SH)<0) return;
+    if(pack_read_gen()!=pk.gen) pack_reload();
+    else pack_replay();
+    if(own) pack_lock(LOCK_UN);
+}
+// fdatasync segments from..to, and the directory (new segments, unlinks).
+static int pack_flush(uint32_t from, uint32_t to){
+    char p[2200]; int rc=0;
+    for(uint32_t s=from; s<=to; s++){
+        seg_path(p,sizeof(p),s);
+        int fd=open(p,O_RDONLY); if(fd<0) continue;
+        if(fdatasync(fd)<0) rc=-1;
+        close(fd);
+    }
+    int dfd=open(pk.dir,O_RDONLY|O_DIRECTORY);
+    if(dfd>=0){ if(fsync(dfd)<0) rc=-1; close(dfd); }
+    return rc;
+}
+static int pack_init(const char *root){
+    join_path(pk.dir,sizeof(pk.dir),root,".pack");
+    if(ensure_dir(pk.dir)<0) return -1;
+    if(pack_lock(LOCK_SH)<0) return -1;
+    pack_reload();
+    pack_lock(LOCK_UN);
+    return 0;
+}
+
+// Append one record; caller holds LOCK_EX and has synced.
+// With 'durable' the record (and a new segment's name) is on disk on return.
+static int pack_append_locked(uint16_t op, const char *key, const char *data, uint32_t n, int64_t mtime, int durable){
+    char p[2200];
+    if(pk.pos >= PACK_SEGMAX){ pk.seg++; pk.pos=0; }
+    seg_path(p,sizeof(p),pk.seg);
+    int fd=open(p,O_RDWR|O_CREAT,0664); if(fd<0) return -1;
+    struct stat st;
+    if(fstat(fd,&st)==0 && st.st_size>pk.pos && ftruncate(fd,pk.pos)<0){ close(fd); return -1; } // crash leftovers
+    struct pack_hdr h = { PACK_MAGIC, op, (uint16_t)strlen(key), n, 0, mtime };
+    struct iovec iov[3] = { {&h,sizeof(h)}, {(void*)key,h.klen}, {(void*)data,n} };
+    ssize_t want = (ssize_t)pack_reclen(h.klen,n);
+    ssize_t w = pwritev(fd, iov, data ? 3 : 2, pk.pos);
+    if(w==want && durable && fdatasync(fd)<0) w = -1;
+    close(fd);
+    if(w!=want) return -1;
+    if(durable && pk.pos==0 && pack_flush(pk.seg+1, pk.seg)<0) return -1;   // directory only
+    pack_apply(pk.seg, pk.pos, &h, key);
+    pk.pos += want;
+    return 0;
+}
+static int pack_put(const char *key, const char *data, uint32_t n){
+    if(strlen(key)>=PACK_KEYMAX || pack_lock(LOCK_EX)<0) return -1;
+    pack_sync();
+    int rc = pack_append_locked(PACK_PUT, key, data, n, (int64_t)time(NULL), 1);
+    pack_lock(LOCK_UN);
+    return rc;
+}
+// Returns 0 if the key was live and is now deleted.
+static int pack_del(const char *key){
+    if(pack_lock(LOCK_EX)<0) return -1;
+    pack_sync();
+    struct pack_ent *e = pack_slot(key,0);
+    int rc = (e && e->live) ? pack_append_locked(PACK_DEL, key, NULL, 0, (int64_t)time(NULL), 1) : -1;
+    pack_lock(LOCK_UN);
+    return rc;
+}
+// Read a packed file into a malloc'd buffer; returns size or -1.
+// *ver (optional) identifies the record itself: every rewrite appends a new one.
+static long long pack_get(const char *key, char **out, int64_t *mtime, uint64_t *ver){
+    if(pack_lock(LOCK_SH)<0) return -1;
+    pack_sync();
+    long long rc=-1;
+    struct pack_ent *e = pack_slot(key,0);
+    if(e && e->live){
+        char p[2200]; seg_path(p,sizeof(p),e->seg);
+        int fd=open(p,O_RDONLY);
+        char *buf = malloc(e->size ? e->size : 1);
+        if(fd>=0 && buf && pread(fd,buf,e->size,e->off)==(ssize_t)e->size){
+            *out=buf; if(mtime) *mtime=e->mtime; if(ver) *ver=((uint64_t)e->seg<<40)^(uint64_t)e->off; rc=e->size; buf=NULL;
+        }
+        free(buf); if(fd>=0) close(fd);
+    }
+    pack_lock(LOCK_UN);
+    return rc;
+}
+// Add live packed names directly under 'dest' that end with 'ext' (up to max).
+static int pack_list(const char *dest, const char *ext, char **names, int n, int max){
+    char dir[PACK_KEYMAX]; pack_key(dir,sizeof(dir),dest,"");
+    size_t dl=strlen(dir);
+    pack_sync();
+    for(size_t i=0;i<pk.cap && n<max;i++){
+        struct pack_ent *e=&pk.tab[i];
+        if(!e->key || !e->live || strncmp(e->key,dir,dl)!=0) continue;
+        const char *nm=e->key+dl;
+        const char *dot=strrchr(nm,'.');
+        if(strchr(nm,'/') || !dot || strcasecmp(dot,ext)!=0) continue;
+        names[n++] = strdup(nm);
+    }
+    return n;
+}
+// A sealed segment that is mostly dead is rewritten: its live records are
+// re-appended at the tail, and so are its tombstones unless it is the
+// oldest segment (then nothing older can hold what they delete).
+static int pack_dead_seg(uint32_t s){
+    return s < pk.nstat && pk.total[s] > 0 && pk.live[s]*2 < pk.total[s];
+}
+static int pack_need_compact(void){
+    pack_sync();
+    for(uint32_t s=pk.first; s<pk.seg; s++) if(pack_dead_seg(s)) return 1;
+    return 0;
+}
+static int pack_compact_seg(uint32_t old){
+    char p[2200]; seg_path(p,sizeof(p),old);
+    int fd=open(p,O_RDONLY); if(fd<0) return -1;
+    struct stat st; fstat(fd,&st);
+    struct pack_hdr h; char key[PACK_KEYMAX];
+    int64_t pos=0; int ok=1; uint32_t s0=pk.seg;
+    while(ok && pos+(int64_t)sizeof(h) <= st.st_size){
+        if(pread(fd,&h,sizeof(h),pos)!=(ssize_t)sizeof(h) || h.magic!=PACK_MAGIC || h.klen>=sizeof(key)) break;
+        if(pread(fd,key,h.klen,pos+(off_t)sizeof(h))!=(ssize_t)h.klen) break;
+        key[h.klen]='\0';
+        struct pack_ent *e = pack_slot(key,0);
+        int64_t doff = pos+(int64_t)sizeof(h)+h.klen;
+        if(h.op==PACK_PUT && e && e->live && e->seg==old && e->off==doff){
+            char *buf=malloc(h.size ? h.size : 1);
+            ok = buf && pread(fd,buf,h.size,doff)==(ssize_t)h.size
+                 && pack_append_locked(PACK_PUT,key,buf,h.size,h.mtime,0)==0;
+            free(buf);
+        }else if(h.op==PACK_DEL && old!=pk.first && e && !e->live){
+            ok = pack_append_locked(PACK_DEL,key,NULL,0,h.mtime,0)==0;
+        }
+        pos += pack_reclen(h.klen,h.size);
+    }
+    close(fd);
+    if(!ok || pack_flush(s0, pk.seg)<0) return -1;   // the copies are on disk before the original goes
+    return unlink(p);
+}
+static void pack_compact(void){
+    if(pack_lock(LOCK_EX)<0) return;
+    pack_sync();
+    int changed=0;
+    uint32_t active=pk.seg;
+    for(uint32_t s=pk.first; s<active; s++)
+        if(pack_dead_seg(s) && pack_compact_seg(s)==0) changed=1;
+    if(changed){
+        char p[2200], tmp[2200]; snprintf(p,sizeof(p),"%s/GEN",pk.dir); snprintf(tmp,sizeof(tmp),"%s/GEN.tmp",pk.dir);
+        FILE *f=fopen(tmp,"w");
+        if(f){ fprintf(f,"%llu\n",pk.gen+1); fflush(f); fdatasync(fileno(f)); fclose(f); rename(tmp,p); }
+        pack_flush(1, 0);
+        pack_reload();
+    }
+    pack_lock(LOCK_UN);
+}
+
+
+/* ---------- directory listing cache (LIST) ----------
+   Sorted listings of recently used directories live in a MAP_SHARED region
+   set up before the accept loop, so every forked session sees them. Caching
+   a directory puts an inotify watch on it (sessions inherit the inotify fd,
+   so any of them can add watches); a thread in the listening process reads
+   the events and drops the slots of changed directories. This server's own
+   STORE/DELETE drop the slot synchronously via jnl_add(), which also covers
+   packed files that inotify cannot see. A fill is only kept if no
+   invalidation raced it (slot generation). */
+#ifndef DCACHE_SLOTS
+#define DCACHE_SLOTS 64          // 0 disables the cache
+#endif
+#define DCACHE_BYTES (64*1024)   // names of one listing, NUL-separated; larger ones are not cached
+#define DC_EVENTS (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR)
+
+struct dslot {
+    char key[1024], ext[8];          // directory relative to the root ("" or "a/b/")
+    int wd, valid, n, len;
+    unsigned gen; unsigned long long used;
+    char names[DCACHE_BYTES];
+};
+static struct dcache {
+    pthread_mutex_t mu; int ifd;
+    unsigned long long tick, hits, misses;
+    struct dslot s[DCACHE_SLOTS>0 ? DCACHE_SLOTS : 1];
+} *dc;
+static char dc_root[1024];
+
+static void dc_lock(void){
+    if(pthread_mutex_lock(&dc->mu)==EOWNERDEAD){      // a session died mid-update
+        for(int i=0;i<DCACHE_SLOTS;i++) dc->s[i].valid = 0;
+        pthread_mutex_consistent(&dc->mu);
+    }
+}
+// "x//y" and "/x/y" name the same slot as the pack key "x/y/"
+static void dc_key(char *out, size_t outsz, const char *dest){
+    pack_key(out, outsz, dest, "");
+    char *w = out;
+    for(char *r=out; *r; r++) if(!(*r=='/' && w>out && w[-1]=='/')) *w++ = *r;
+    *w = '\0';
+}
+static struct dslot *dc_find(const char *key, const char *ext){
+    for(int i=0;i<DCACHE_SLOTS;i++){
+        struct dslot *s = &dc->s[i];
+        if(s->used && !strcmp(s->key,key) && !strcmp(s->ext,ext)) return s;
+    }
+    return NULL;
+}
+static void *dc_watch(void *arg){
+    (void)arg;
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for(;;){
+        ssize_t r = read(dc->ifd, buf, sizeof(buf));
+        if(r<0 && errno==EINTR) continue;
+        if(r<=0) break;
+        dc_lock();
+        for(char *p=buf; p<buf+r; ){
+            struct inotify_event *ev = (struct inotify_event*)p;
+            for(int i=0;i<DCACHE_SLOTS;i++){
+                struct dslot *s = &dc->s[i];
+                if(ev->wd>=0 && s->wd!=ev->wd) continue;   // wd -1: queue overflow, drop all
+                s->valid = 0; s->gen++;
+                if(ev->mask & IN_IGNORED) s->wd = -1;
+            }
+            p += sizeof(*ev) + ev->len;
+        }
+        pthread_mutex_unlock(&dc->mu);
+    }
+    return NULL;
+}
+static void dc_init(const char *root){
+    if(DCACHE_SLOTS<=0) return;
+    struct dcache *m = mmap(NULL, sizeof(*dc), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if(m==MAP_FAILED) return;
+    pthread_mutexattr_t at; pthread_mutexattr_init(&at);
+    pthread_mutexattr_setpshared(&at, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&at, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&m->mu, &at);
+    pthread_mutexattr_destroy(&at);
+    for(int i=0;i<DCACHE_SLOTS;i++) m->s[i].wd = -1;
+    pthread_t th;
+    if((m->ifd = inotify_init1(IN_CLOEXEC))<0){ munmap(m, sizeof(*dc)); return; }
+    dc = m;
+    snprintf(dc_root, sizeof(dc_root), "%s", root);
+    if(pthread_create(&th, NULL, dc_watch, NULL)!=0){ close(m->ifd); munmap(m, sizeof(*dc)); dc = NULL; return; }
+    pthread_detach(th);
+}
+// Cached listing of 'dest': strdup'd names in *out and the count, or -1 on a
+// miss with *gen set for dc_put() (the directory is watched from here on).
+static int dc_get(const char *dest, const char *ext, char ***out, unsigned *gen){
+    *out = NULL;
+    if(!dc) return -1;
+    char key[1024]; dc_key(key, sizeof(key), dest);
+    int n = -1;
+    dc_lock();
+    struct dslot *s = dc_find(key, ext);
+    if(s && s->valid && (*out = malloc((size_t)(s->n ? s->n : 1)*sizeof(char*)))){
+        const char *p = s->names;
+        for(n=0; n<s->n; n++){ (*out)[n] = strdup(p); p += strlen(p)+1; }
+        s->used = ++dc->tick; dc->hits++;
+    }else{
+        dc->misses++;
+        if(!s){                                          // take the least recently used slot
+            s = &dc->s[0];
+            for(int i=1;i<DCACHE_SLOTS;i++) if(dc->s[i].used < s->used) s = &dc->s[i];
+            if(s->wd>=0){
+                int shared = 0;
+                for(int i=0;i<DCACHE_SLOTS;i++) if(&dc->s[i]!=s && dc->s[i].wd==s->wd) shared = 1;
+                if(!shared) inotify_rm_watch(dc->ifd, s->wd);
+            }
+            snprintf(s->key, sizeof(s->key), "%s", key);
+            snprintf(s->ext, sizeof(s->ext), "%s", ext);
+            s->wd = -1; s->valid = 0; s->gen++;
+        }
+        s->used = ++dc->tick;
+        if(s->wd<0){
+            char dir[2200]; snprintf(dir, sizeof(dir), "%s/%s", dc_root, key);
+            s->wd = inotify_add_watch(dc->ifd, dir, DC_EVENTS);
+        }
+        *gen = s->gen;
+    }
+    pthread_mutex_unlock(&dc->mu);
+    return n;
+}
+// Keep a freshly read listing unless the directory changed since dc_get().
+static void dc_put(const char *dest, const char *ext, unsigned gen, char **names, int n){
+    if(!dc) return;
+    size_t len = 0;
+    for(int i=0;i<n;i++) len += strlen(names[i])+1;
+    if(len>DCACHE_BYTES) return;
+    char key[1024]; dc_key(key, sizeof(key), dest);
+    dc_lock();
+    struct dslot *s = dc_find(key, ext);
+    if(s && s->gen==gen && s->wd>=0){
+        char *p = s->names;
+        for(int i=0;i<n;i++){ size_t l = strlen(names[i])+1; memcpy(p, names[i], l); p += l; }
+        s->n = n; s->len = (int)len; s->valid = 1;
+    }
+    pthread_mutex_unlock(&dc->mu);
+}
+// 'path' (relative to the root) was created or removed: drop its directory.
+static void dc_changed(const char *path){
+    if(!dc) return;
+    char key[1024]; const char *sl = strrchr(path, '/');
+    char dest[1024]; snprintf(dest, sizeof(dest), "%.*s", sl ? (int)(sl-path) : 0, path);
+    dc_key(key, sizeof(key), dest);
+    dc_lock();
+    for(int i=0;i<DCACHE_SLOTS;i++){
+        struct dslot *s = &dc->s[i];
+        if(s->used && !strcmp(s->key,key)){ s->valid = 0; s->gen++; }
+    }
+    pthread_mutex_unlock(&dc->mu);
+}
+
+/* ---------- change journal (incremental TARALL) ----------
+   Every STORE and DELETE appends "<usec> P|D <path>" to <root>/.journal;
+   the first line "# <usec>" is how far back the history goes. TARALL with
+   since=<usec> replays it instead of walking the tree. Past JOURNAL_MAX the
+   file is rewritten with only the newest line per path, which answers any
+   "since" the same way. */
+#ifndef JOURNAL_MAX
+#define JOURNAL_MAX (4<<20)
+#endif
+static char jnl_path[2200];
+
+static long long now_us(void){
+    struct timespec ts; clock_gettime(CLOCK_REALTIME,&ts);
+    return (long long)ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+static void jnl_init(const char *root){
+    ensure_dir(root);
+    snprintf(jnl_path,sizeof(jnl_path),"%s/.journal",root);
+    int fd=open(jnl_path,O_WRONLY|O_CREAT|O_EXCL,0664);
+    if(fd>=0){ dprintf(fd,"# %lld\n",now_us()); close(fd); }
+}
+// Open the journal locked with 'op', again if a compaction replaced it meanwhile.
+static int jnl_open(int op){
+    for(;;){
+        int fd=open(jnl_path,O_RDWR|O_APPEND);
+        if(fd<0) return -1;
+        while(flock(fd,op)<0) if(errno!=EINTR){ close(fd); return -1; }
+        struct stat a,b;
+        if(fstat(fd,&a)==0 && stat(jnl_path,&b)==0 && a.st_ino==b.st_ino) return fd;
+        close(fd);
+    }
+}
+
+struct jrec { char *path; long long us; char op; int seq; };
+static int jrec_cmp(const void *a, const void *b){
+    const struct jrec *x=a, *y=b;
+    int c=strcmp(x->path,y->path);
+    return c ? c : x->seq - y->seq;
+}
+// Newest record per path, sorted by path; *base = start of the history.
+static int jnl_load(int fd, struct jrec **out, long long *base){
+    FILE *f=fdopen(dup(fd),"r");
+    if(!f) return -1;
+    struct jrec *r=NULL; int n=0, cap=0;
+    char ln[PACK_KEYMAX+64];
+    *base=0;
+    while(fgets(ln,sizeof(ln),f)){
+        ln[strcspn(ln,"\n")]='\0';
+        if(ln[0]=='#'){ *base=atoll(ln+1); continue; }
+        long long us; char op; int off=0;
+        if(sscanf(ln,"%lld %c %n",&us,&op,&off)<2 || !off) continue;
+        if(n==cap){ cap=cap?cap*2:256; r=realloc(r,(size_t)cap*sizeof(*r)); if(!r){ fclose(f); return -1; } }
+        r[n].path=strdup(ln+off); r[n].us=us; r[n].op=op; r[n].seq=n; n++;
+    }
+    fclose(f);
+    if(n) qsort(r,(size_t)n,sizeof(*r),jrec_cmp);
+    int m=0;
+    for(int i=0;i<n;i++){
+        if(i+1<n && strcmp(r[i].path,r[i+1].path)==0){ free(r[i].path); continue; }
+        r[m++]=r[i];
+    }
+    *out=r;
+    return m;
+}
+static void jnl_free(struct jrec *r, int n){ for(int i=0;i<n;i++) free(r[i].path); free(r); }
+
+static void jnl_compact(int fd){   // caller holds LOCK_EX
+    struct jrec *r; long long base;
+    int n=jnl_load(fd,&r,&base);
+    if(n<0) return;
+    char tmp[2300]; snprintf(tmp,sizeof(tmp),"%s.tmp",jnl_path);
+    FILE *f=fopen(tmp,"w");
+    if(f){
+        fprintf(f,"# %lld\n",base);
+        for(int i=0;i<n;i++) fprintf(f,"%lld %c %s\n",r[i].us,r[i].op,r[i].path);
+        if(fclose(f)==0) rename(tmp,jnl_path); else unlink(tmp);
+    }
+    jnl_free(r,n);
+}
+static void jnl_add(char op, const char *path){
+    dc_changed(path);            // every journaled change also drops the cached listing
+    int fd=jnl_open(LOCK_SH);
+    if(fd<0) return;
+    char ln[PACK_KEYMAX+64];
+    int k=snprintf(ln,sizeof(ln),"%lld %c %s\n",now_us(),op,path);
+    if(k>0 && k<(int)sizeof(ln)) write_n(fd,ln,(size_t)k);
+    struct stat st;
+    int big = fstat(fd,&st)==0 && st.st_size>JOURNAL_MAX;
+    close(fd);
+    if(big && (fd=jnl_open(LOCK_EX))>=0){
+        if(fstat(fd,&st)==0 && st.st_size>JOURNAL_MAX) jnl_compact(fd);
+        close(fd);
+    }
+}
+
+/* ---------- request deadlines and cancellation ----------
+   S1 adds " dl=<usec>" (an absolute deadline) to the commands of a client
+   request that has one. While a command runs, a watchdog thread (started
+   with the session's first command) waits for that deadline and polls the
+   connection for a hang-up: S1 gave the request up, its client left, or it
+   was cancelled there. S1 never half-closes, so its end-of-input counts;
+   a direct client's (GET/PUT) doesn't, as it may shut down its sending
+   side and still wait for the answer. Either one cancels the command here too: the tar
+   helper and peer connections it started are killed / shut down, archive
+   building stops at the next entry, and the connection is shut down so the
+   session ends. Cancels and the bytes they spared are counted for the whole
+   server and logged. -DRQ_WATCHDOG=0 turns this off. */
+#include <sys/eventfd.h>
+#ifndef RQ_WATCHDOG
+#define RQ_WATCHDOG 1
+#endif
+#ifndef RQ_GRACE
+#define RQ_GRACE 20        // ms a hang-up or deadline waits for S1 (which may just have read the reply)
+#endif
+#define RQ_FDS     16
+#define RQ_PIDS    8
+#define RQ_GONE    1
+#define RQ_EXPIRED 2
+
+static struct {
+    int csd,efd,started,nfd,npid,cut,rdhup;
+    volatile int active,cancel; volatile unsigned gen;
+    long long dl,saved;
+    int fd[RQ_FDS]; pid_t pid[RQ_PIDS];
+    char cmd[16];
+} rq={ .csd=-1, .efd=-1 };
+static struct { unsigned long long gone,expired,saved; } *rqs;   // all sessions
+
+static void rq_init(void){
+    void *m=mmap(NULL,sizeof(*rqs),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+    if(m!=MAP_FAILED) rqs=m;
+}
+// A stale entry (closed, number reused) can only belong to the same command.
+static void rq_track(int fd){
+    int i=__atomic_fetch_add(&rq.nfd,1,__ATOMIC_RELAXED);
+    if(i<RQ_FDS) __atomic_store_n(&rq.fd[i],fd,__ATOMIC_RELEASE);
+}
+static void rq_child(pid_t pid){
+    int i=__atomic_fetch_add(&rq.npid,1,__ATOMIC_RELAXED);
+    if(i<RQ_PIDS) __atomic_store_n(&rq.pid[i],pid,__ATOMIC_RELEASE);
+}
+// " dl=<usec>" to pass the deadline on to a peer.
+static const char *rq_opt(void){
+    static __thread char o[32];
+    if(!rq.dl) return "";
+    snprintf(o,sizeof(o)," dl=%lld",rq.dl);
+    return o;
+}
+// A transfer stopped with 'left' bytes to go (counted if it was a cancel).
+static void rq_saved(long long left){
+    if(!left) return;
+    rq.cut=1;
+    if(left>0) rq.saved+=left;
+}
+static void rq_cancel(int why){
+    rq.cancel=why;
+    if(rqs) __atomic_add_fetch(why==RQ_GONE ? &rqs->gone : &rqs->expired,1,__ATOMIC_RELAXED);
+    shutdown(rq.csd,SHUT_RDWR);
+    int n=__atomic_load_n(&rq.nfd,__ATOMIC_ACQUIRE), np=__atomic_load_n(&rq.npid,__ATOMIC_ACQUIRE);
+    for(int i=0;i<n && i<RQ_FDS;i++){
+        int fd=__atomic_load_n(&rq.fd[i],__ATOMIC_ACQUIRE);
+        if(fd>=0) shutdown(fd,SHUT_RDWR);
+    }
+    for(int i=0;i<np && i<RQ_PIDS;i++){
+        pid_t p=__atomic_load_n(&rq.pid[i],__ATOMIC_ACQUIRE);
+        if(p>0) kill(p,SIGKILL);       // 0: slot taken, pid not stored yet
+    }
+}
+static void *rq_watch(void *arg){
+    (void)arg;
+    for(;;){
+        struct pollfd pf[2]={ { rq.efd,POLLIN,0 }, { rq.csd,(short)rq.rdhup,0 } };
+        int on=rq.active && !rq.cancel, ms=-1;
+        if(on && rq.dl){
+            long long left=rq.dl+RQ_GRACE*1000LL-now_us();   // S1 enforces it; this is the backstop
+            ms = left<=0 ? 0 : left>3600000000LL ? 3600000 : (int)((left+999)/1000);
+        }
+        int n=poll(pf,on ? 2 : 1,ms);
+        if(n<0){ if(errno==EINTR) continue; return NULL; }
+        if(pf[0].revents & POLLIN){ uint64_t v; (void)!read(rq.efd,&v,sizeof(v)); continue; }
+        if(!on || !rq.active) continue;
+        if(n>0 && (pf[1].revents & (rq.rdhup|POLLHUP|POLLERR))){
+            unsigned g=rq.gen;
+            struct pollfd e={ rq.efd,POLLIN,0 };
+            poll(&e,1,RQ_GRACE);
+            if(rq.active && rq.gen==g && !rq.cancel) rq_cancel(RQ_GONE);
+        }
+        else if(n==0 && rq.dl && now_us()>=rq.dl+RQ_GRACE*1000LL) rq_cancel(RQ_EXPIRED);
+    }
+}
+// A command line arrived: note its deadline and arm the watchdog.
+static void rq_begin(int csd, const char *line){
+    char v[24];
+    for(int i=0;i<rq.nfd && i<RQ_FDS;i++) rq.fd[i]=-1;
+    for(int i=0;i<rq.npid && i<RQ_PIDS;i++) rq.pid[i]=0;
+    rq.nfd=rq.npid=0; rq.cancel=0; rq.cut=0; rq.saved=0;
+    rq.dl = opt_get(line,"dl",v,sizeof(v)) ? atoll(v) : 0;
+    rq.rdhup = strncmp(line,"GET ",4) && strncmp(line,"PUT ",4) ? POLLRDHUP : 0;
+    if(!RQ_WATCHDOG) return;
+    if(!rq.started){
+        pthread_t t; pthread_attr_t at; pthread_attr_init(&at);
+        pthread_attr_setdetachstate(&at,PTHREAD_CREATE_DETACHED);
+        pthread_attr_setstacksize(&at,64<<10);
+        rq.csd=csd;
+        rq.efd=eventfd(0,EFD_CLOEXEC);
+        rq.started = rq.efd>=0 && pthread_create(&t,&at,rq_watch,NULL)==0 ? 1 : -1;
+        pthread_attr_destroy(&at);
+        if(rq.started>0) signal(SIGPIPE,SIG_IGN);   // unwind through EPIPE, counters included
+    }
+    if(rq.started<0) return;
+    snprintf(rq.cmd,sizeof(rq.cmd),"%.*s",(int)strcspn(line," \r\n"),line);
+    rq.gen++; rq.active=1;
+    uint64_t one=1; (void)!write(rq.efd,&one,sizeof(one));
+}
+static void rq_end(void){
+    rq.dl=0;
+    if(!rq.active) return;
+    rq.active=0;
+    struct pollfd pf={ rq.csd,(short)rq.rdhup,0 };    // the transfer hit the hang-up first
+    if(!rq.cancel && rq.cut && poll(&pf,1,0)>0 && (pf.revents & (rq.rdhup|POLLHUP|POLLERR))){
+        rq.cancel=RQ_GONE;
+        if(rqs) __atomic_add_fetch(&rqs->gone,1,__ATOMIC_RELAXED);
+    }
+    if(!rq.cancel) return;
+    if(rqs) __atomic_add_fetch(&rqs->saved,(unsigned long long)rq.saved,__ATOMIC_RELAXED);
+    fprintf(stderr,"S2: cancelled %s pid=%d (%s), %lld bytes not moved; totals gone=%llu deadline=%llu saved=%llu\n",
+            rq.cmd,(int)getpid(),rq.cancel==RQ_GONE ? "peer gone" : "deadline passed",rq.saved,
+            rqs ? rqs->gone : 0ULL,rqs ? rqs->expired : 0ULL,rqs ? rqs->saved : 0ULL);
+}
+
+/* ---------- parallel tree walker (tar file lists) ----------
+   walk_tree() lists the regular files under root/sub ending in 'ext'. Each
+   directory is a task read through a fd opened relative to its parent
+   (openat + fdopendir); d_type is trusted, so fstatat only runs for
+   DT_UNKNOWN and no absolute paths are built. Tasks sit in per-thread
+   deques: the owner works depth-first from the tail, idle threads steal from
+   the head, and a thread that finds nothing to steal sleeps until a task is
+   queued or the walk is over. The result is sorted, so the tar order does not depend on
+   scheduling. Dot entries (.pack, .journal, ...) are skipped. While a
+   metadata snapshot is current the answer comes from it instead. */
+#ifndef WALK_THREADS
+#define WALK_THREADS 0     // 0 = one per online CPU, at most 16
+#endif
+#define WALK_FDMAX 256     // queued directories kept open; beyond that reopened by path
+
+struct wtask { int fd; char *rel; };
+struct wdeque { pthread_mutex_t mu; struct wtask *t; int head, tail, cap; };
+struct wlist { char **v; int n, cap; };
+static struct {
+    int rootfd, nthreads; const char *ext;
+    struct wdeque *dq; struct wlist *out;
+    int pending, openfds;            // atomics: tasks queued or running / queued fds
+    int queued, sleepers;            // atomics: tasks in the deques / threads waiting on cv
+    pthread_mutex_t mu; pthread_cond_t cv;
+} wk;
+
+static void wlist_add(struct wlist *l, char *s){
+    if(l->n==l->cap){
+        int nc = l->cap ? l->cap*2 : 256;
+        char **nv = realloc(l->v, (size_t)nc*sizeof(*nv));
+        if(!nv){ free(s); return; }
+        l->v = nv; l->cap = nc;
+    }
+    l->v[l->n++] = s;
+}
+static int wq_push(int self, struct wtask t){
+    struct wdeque *q = &wk.dq[self];
+    pthread_mutex_lock(&q->mu);
+    if(q->tail==q->cap){
+        if(q->head>0){ memmove(q->t, q->t+q->head, (size_t)(q->tail-q->head)*sizeof(*q->t)); q->tail -= q->head; q->head = 0; }
+        if(q->tail==q->cap){
+            int nc = q->cap ? q->cap*2 : 64;
+            struct wtask *nt = realloc(q->t, (size_t)nc*sizeof(*nt));
+            if(!nt){ pthread_mutex_unlock(&q->mu); return -1; }
+            q->t = nt; q->cap = nc;
+        }
+    }
+    q->t[q->tail++] = t;
+    pthread_mutex_unlock(&q->mu);
+    __atomic_add_fetch(&wk.queued, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&wk.sleepers, __ATOMIC_SEQ_CST)){
+        pthread_mutex_lock(&wk.mu); pthread_cond_signal(&wk.cv); pthread_mutex_unlock(&wk.mu);
+    }
+    return 0;
+}
+static int wq_take(int who, int own, struct wtask *t){
+    struct wdeque *q = &wk.dq[who];
+    int got = 0;
+    pthread_mutex_lock(&q->mu);
+    if(q->tail>q->head){ *t = own ? q->t[--q->tail] : q->t[q->head++]; got = 1; }
+    pthread_mutex_unlock(&q->mu);
+    if(got) __atomic_sub_fetch(&wk.queued, 1, __ATOMIC_SEQ_CST);
+    return got;
+}
+static void walk_dir(int self, struct wtask t){
+    int fd = t.fd>=0 ? t.fd : openat(wk.rootfd, *t.rel ? t.rel : ".", O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if(t.fd>=0) __atomic_sub_fetch(&wk.openfds, 1, __ATOMIC_RELAXED);
+    DIR *dp = fd>=0 ? fdopendir(fd) : NULL;
+    if(!dp){ if(fd>=0) close(fd); free(t.rel); return; }
+    size_t rl = strlen(t.rel), el = strlen(wk.ext);
+    struct dirent *de;
+    while((de=readdir(dp))){
+        if(de->d_name[0]=='.') continue;
+        int type = de->d_type;
+        if(type==DT_UNKNOWN){
+            struct stat st;
+            if(fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)<0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+        }
+        if(type!=DT_DIR && type!=DT_REG) continue;
+        size_t nl = strlen(de->d_name);
+        if(type==DT_REG && (nl<el || strcasecmp(de->d_name+nl-el, wk.ext)!=0)) continue;
+        char *rel = malloc(rl+nl+2);
+        if(!rel) continue;
+        if(rl){ memcpy(rel, t.rel, rl); rel[rl] = '/'; memcpy(rel+rl+1, de->d_name, nl+1); }
+        else memcpy(rel, de->d_name, nl+1);
+        if(type==DT_REG){ wlist_add(&wk.out[self], rel); continue; }
+        struct wtask c = { -1, rel };
+        if(__atomic_add_fetch(&wk.openfds, 1, __ATOMIC_RELAXED) <= WALK_FDMAX)
+            c.fd = openat(fd, de->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        if(c.fd<0) __atomic_sub_fetch(&wk.openfds, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&wk.pending, 1, __ATOMIC_SEQ_CST);
+        if(wq_push(self, c)<0){
+            if(c.fd>=0){ close(c.fd); __atomic_sub_fetch(&wk.openfds, 1, __ATOMIC_RELAXED); }
+            free(rel);
+            __atomic_sub_fetch(&wk.pending, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+    closedir(dp);
+    free(t.rel);
+}
+static void *walk_worker(void *arg){
+    int self = (int)(intptr_t)arg;
+    for(;;){
+        struct wtask t; int got = wq_take(self, 1, &t);
+        for(int k=1; !got && k<wk.nthreads; k++) got = wq_take((self+k)%wk.nthreads, 0, &t);
+        if(got){
+            walk_dir(self, t);
+            if(__atomic_sub_fetch(&wk.pending, 1, __ATOMIC_SEQ_CST)==0){   // last task: release the sleepers
+                pthread_mutex_lock(&wk.mu); pthread_cond_broadcast(&wk.cv); pthread_mutex_unlock(&wk.mu);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&wk.mu);
+        __atomic_add_fetch(&wk.sleepers, 1, __ATOMIC_SEQ_CST);
+        while(!__atomic_load_n(&wk.queued, __ATOMIC_SEQ_CST) && __atomic_load_n(&wk.pending, __ATOMIC_SEQ_CST))
+            pthread_cond_wait(&wk.cv, &wk.mu);
+        __atomic_sub_fetch(&wk.sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&wk.mu);
+        if(!__atomic_load_n(&wk.pending, __ATOMIC_SEQ_CST)) break;
+    }
+    return NULL;
+}
+static int cmp_path(const void *a, const void *b){ return strcmp(*(char *const *)a, *(char *const *)b); }
+
+static int meta_walk(const char *root, const char *sub, const char *ext, char ***out);
+
+// Sorted malloc'd relative paths of the matching files; returns the count.
+static int walk_tree(const char *root, const char *sub, const char *ext, char ***out){
+    *out = NULL;
+    int mn = meta_walk(root, sub, ext, out);
+    if(mn >= 0) return mn;
+    memset(&wk, 0, sizeof(wk));
+    wk.rootfd = open(root, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(wk.rootfd<0) return 0;
+    wk.ext = ext;
+    wk.nthreads = WALK_THREADS>0 ? WALK_THREADS : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(wk.nthreads<1) wk.nthreads = 1;
+    if(wk.nthreads>16) wk.nthreads = 16;
+    wk.dq = calloc((size_t)wk.nthreads, sizeof(*wk.dq));
+    wk.out = calloc((size_t)wk.nthreads, sizeof(*wk.out));
+    char *top = strdup(sub);
+    if(!wk.dq || !wk.out || !top){ free(wk.dq); free(wk.out); free(top); close(wk.rootfd); return 0; }
+    for(int i=0;i<wk.nthreads;i++) pthread_mutex_init(&wk.dq[i].mu, NULL);
+    pthread_mutex_init(&wk.mu, NULL); pthread_cond_init(&wk.cv, NULL);
+    wk.pending = 1;
+    wq_push(0, (struct wtask){ -1, top });
+
+    pthread_t th[16]; int started = 1;
+    for(int i=1;i<wk.nthreads;i++) if(pthread_create(&th[i], NULL, walk_worker, (void*)(intptr_t)i)==0) started++; else break;
+    walk_worker((void*)0);
+    for(int i=1;i<started;i++) pthread_join(th[i], NULL);
+
+    int n = 0;
+    for(int i=0;i<wk.nthreads;i++) n += wk.out[i].n;
+    char **v = malloc((size_t)(n ? n : 1)*sizeof(*v));
+    int k = 0;
+    for(int i=0;i<wk.nthreads;i++){
+        for(int j=0;j<wk.out[i].n;j++){ if(v) v[k++] = wk.out[i].v[j]; else free(wk.out[i].v[j]); }
+        free(wk.out[i].v); free(wk.dq[i].t);
+        pthread_mutex_destroy(&wk.dq[i].mu);
+    }
+    free(wk.out); free(wk.dq);
+    pthread_mutex_destroy(&wk.mu); pthread_cond_destroy(&wk.cv);
+    close(wk.rootfd);
+    if(!v) return 0;
+    qsort(v, (size_t)k, sizeof(*v), cmp_path);
+    *out = v;
+    return k;
+}
+static void walk_free(char **v, int n){ for(int i=0;i<n;i++) free(v[i]); free(v); }
+
+/* ---------- metadata snapshot (warm restart) ----------
+   <root>/.meta lists every regular file under the root (dot entries skipped,
+   as walk_tree() does), sorted: a header, a table of offsets and the
+   NUL-terminated root-relative paths. Sessions map it read-only and bring it
+   current from the journal, which is the change log: every path journaled
+   since the snapshot was taken (from the recorded offset while the journal is
+   the same file, by time after a compaction) is looked at again with one
+   stat. walk_tree() and listings that miss the listing cache answer from
+   that view, so the first DOWNLTAR or listing after a restart walks nothing.
+   A keeper process rewrites the snapshot from a real walk at start-up, in
+   the background, and then every META_INTERVAL seconds when the journal has
+   moved (write to .meta.tmp, fsync, rename); that walk is also what picks up
+   files changed behind the server's back. META_INTERVAL 0 turns it off. */
+#include <sys/prctl.h>
+#ifndef META_INTERVAL
+#define META_INTERVAL 300
+#endif
+#define META_MAGIC 0x3141544du              // "MTA1"
+
+struct meta_hdr { uint32_t magic, count; uint64_t blob; int64_t base_us; uint64_t jnl_ino, jnl_off; };
+struct mchg { char *path; int seq; char live; };
+static struct {
+    char root[1024], path[2200]; int off;     // off: this process walks for real (the keeper)
+    const struct meta_hdr *h; size_t len; ino_t ino;
+    const uint32_t *idx; const char *blob;
+    struct mchg *chg; int nchg, cchg, seq;    // replayed journal tail, sorted by path
+    ino_t jino; long long joff;               // how far the journal has been replayed
+    unsigned long long hits;
+} meta;
+
+static const char *meta_at(uint32_t i){ return meta.blob + meta.idx[i]; }
+// First snapshot entry >= key.
+static uint32_t meta_lower(const char *key){
+    uint32_t lo = 0, hi = meta.h->count;
+    while(lo < hi){
+        uint32_t mid = lo + (hi-lo)/2;
+        if(strcmp(meta_at(mid), key) < 0) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+static int mchg_cmp(const void *a, const void *b){
+    const struct mchg *x = a, *y = b;
+    int c = strcmp(x->path, y->path);
+    return c ? c : x->seq - y->seq;
+}
+static int mchg_key(const void *k, const void *e){ return strcmp(k, ((const struct mchg*)e)->path); }
+// The replayed change for 'path', if the journal mentioned it since the snapshot.
+static struct mchg *meta_changed(const char *path){
+    return meta.nchg ? bsearch(path, meta.chg, (size_t)meta.nchg, sizeof(*meta.chg), mchg_key) : NULL;
+}
+static void meta_drop_chg(void){
+    for(int i=0;i<meta.nchg;i++) free(meta.chg[i].path);
+    meta.nchg = 0;
+}
+// Map the current snapshot (again, if the keeper replaced it).
+static void meta_map(void){
+    struct stat st;
+    if(stat(meta.path, &st)==0 && meta.h && st.st_ino==meta.ino) return;
+    if(meta.h){ munmap((void*)meta.h, meta.len); meta.h = NULL; meta.ino = 0; }
+    meta_drop_chg();
+    int fd = open(meta.path, O_RDONLY|O_CLOEXEC);
+    if(fd<0) return;
+    void *m = MAP_FAILED;
+    if(fstat(fd,&st)==0 && (size_t)st.st_size > sizeof(struct meta_hdr))
+        m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(m==MAP_FAILED) return;
+    const struct meta_hdr *h = m;
+    const uint32_t *idx = (const uint32_t*)(h+1);
+    const char *blob = (const char*)(idx + h->count);
+    int ok = h->magic==META_MAGIC && h->blob &&
+             sizeof(*h) + (uint64_t)h->count*sizeof(*idx) + h->blob == (uint64_t)st.st_size &&
+             blob[h->blob-1]=='\0';
+    for(uint32_t i=0; ok && i<h->count; i++) ok = idx[i] < h->blob;
+    if(!ok){ munmap(m, (size_t)st.st_size); return; }
+    meta.h = h; meta.len = (size_t)st.st_size; meta.ino = st.st_ino;
+    meta.idx = idx; meta.blob = blob;
+    meta.jino = (ino_t)h->jnl_ino; meta.joff = (long long)h->jnl_off;
+}
+// Paths under a dot directory are not part of the tree (.ec, .hot, ...).
+static int meta_hidden(const char *p){
+    for(const char *s = p; s; s = strchr(s, '/')){
+        if(*s=='/') s++;
+        if(*s=='.') return 1;
+    }
+    return 0;
+}
+// Replay what the journal gained since the last look.
+static void meta_replay(void){
+    int fd = jnl_open(LOCK_SH);
+    if(fd<0) return;
+    struct stat st;
+    if(fstat(fd,&st)<0){ close(fd); return; }
+    long long from = meta.joff, since = 0;
+    if(st.st_ino != meta.jino){                       // compacted since: go by time
+        meta_drop_chg();
+        from = 0; since = meta.h->base_us - 1000000;  // writers stamp before they append
+        meta.jino = st.st_ino; meta.joff = 0;
+    }
+    size_t n = st.st_size > from ? (size_t)(st.st_size-from) : 0;
+    char *buf = n ? malloc(n+1) : NULL;
+    ssize_t got = buf ? pread(fd, buf, n, from) : 0;
+    close(fd);
+    if(got<=0){ free(buf); return; }
+    buf[got] = '\0';
+    char *end = strrchr(buf, '\n');                   // whole lines only
+    if(!end){ free(buf); return; }
+    meta.joff = from + (end-buf) + 1;
+    end[1] = '\0';
+    int added = 0;
+    for(char *ln = buf, *nl; *ln; ln = nl+1){
+        nl = strchr(ln, '\n'); *nl = '\0';
+        long long us; char op; int off = 0;
+        if(ln[0]=='#' || sscanf(ln, "%lld %c %n", &us, &op, &off)!=2 || !off || us < since) continue;
+        const char *p = ln+off;
+        if(!*p || meta_hidden(p)) continue;
+        if(meta.nchg==meta.cchg){
+            int nc = meta.cchg ? meta.cchg*2 : 64;
+            struct mchg *v = realloc(meta.chg, (size_t)nc*sizeof(*v));
+            if(!v) break;
+            meta.chg = v; meta.cchg = nc;
+        }
+        char full[3300]; struct stat fs;
+        snprintf(full, sizeof(full), "%s/%s", meta.root, p);
+        char *dup = strdup(p);
+        if(!dup) break;
+        meta.chg[meta.nchg++] = (struct mchg){ dup, meta.seq++, lstat(full,&fs)==0 && S_ISREG(fs.st_mode) };
+        added++;
+    }
+    free(buf);
+    if(!added) return;
+    qsort(meta.chg, (size_t)meta.nchg, sizeof(*meta.chg), mchg_cmp);
+    int k = 0;                                        // newest look per path wins
+    for(int i=0;i<meta.nchg;i++){
+        if(i+1<meta.nchg && !strcmp(meta.chg[i].path, meta.chg[i+1].path)){ free(meta.chg[i].path); continue; }
+        meta.chg[k++] = meta.chg[i];
+    }
+    meta.nchg = k;
+}
+// Is there a current view of 'root'? Maps and replays as needed.
+static int meta_ready(const char *root){
+    if(META_INTERVAL<=0 || meta.off || !meta.root[0] || strcmp(root, meta.root)) return 0;
+    meta_map();
+    if(!meta.h) return 0;
+    meta_replay();
+    return 1;
+}
+static int meta_push(char ***v, int *n, int *cap, const char *s){
+    if(*n==*cap){
+        int nc = *cap ? *cap*2 : 64;
+        char **nv = realloc(*v, (size_t)nc*sizeof(char*));
+        if(!nv) return -1;
+        *v = nv; *cap = nc;
+    }
+    return ((*v)[*n] = strdup(s)) ? (++*n, 0) : -1;
+}
+static int meta_ext(const char *p, const char *ext){
+    size_t l = strlen(p), el = strlen(ext);
+    return l>=el && strcasecmp(p+l-el, ext)==0;
+}
+// walk_tree() from the view: -1 when there is none and the tree must be walked.
+static int meta_walk(const char *root, const char *sub, const char *ext, char ***out){
+    if(!meta_ready(root)) return -1;
+    while(*sub=='/') sub++;
+    size_t sl = strlen(sub);
+    while(sl && sub[sl-1]=='/') sl--;
+    char pre[1100];
+    if(sl >= sizeof(pre)-1) return -1;
+    size_t pl = (size_t)snprintf(pre, sizeof(pre), "%.*s%s", (int)sl, sub, sl ? "/" : "");
+    char **v = NULL; int n = 0, cap = 0, bad = 0;
+    for(uint32_t i = meta_lower(pre); i<meta.h->count && !bad; i++){
+        const char *p = meta_at(i);
+        if(strncmp(p, pre, pl)) break;
+        if(!meta_changed(p) && meta_ext(p, ext)) bad = meta_push(&v, &n, &cap, p);
+    }
+    for(int i=0;i<meta.nchg && !bad;i++){
+        const struct mchg *c = &meta.chg[i];
+        if(c->live && !strncmp(c->path, pre, pl) && meta_ext(c->path, ext)) bad = meta_push(&v, &n, &cap, c->path);
+    }
+    if(bad){ walk_free(v, n); return -1; }
+    if(n) qsort(v, (size_t)n, sizeof(*v), cmp_path);
+    meta.hits++;
+    *out = v;
+    return n;
+}
+// Names of the files directly in 'dest' whose extension is 'ext', from the view.
+static int meta_dir_each(const char *dest, const char *ext, int (*add)(const char *name, void *arg), void *arg){
+    if(!meta_ready(meta.root)) return -1;
+    while(*dest=='/') dest++;
+    size_t dl = strlen(dest);
+    while(dl && dest[dl-1]=='/') dl--;
+    char pre[1100];
+    if(dl >= sizeof(pre)-1) return -1;
+    size_t pl = (size_t)snprintf(pre, sizeof(pre), "%.*s%s", (int)dl, dest, dl ? "/" : "");
+    int n = 0;
+    for(uint32_t i = meta_lower(pre); i<meta.h->count; ){
+        const char *p = meta_at(i);
+        if(strncmp(p, pre, pl)) break;
+        const char *name = p+pl, *sl = strchr(name, '/');
+        if(sl){                                       // a subdirectory: jump past all of it
+            char skip[2200];
+            snprintf(skip, sizeof(skip), "%.*s0", (int)(sl-p), p);
+            i = meta_lower(skip);
+            continue;
+        }
+        i++;
+        const char *dot = strrchr(name, '.');
+        if(meta_changed(p) || !dot || strcasecmp(dot, ext)) continue;
+        if(add(name, arg)) return n;
+        n++;
+    }
+    for(int i=0;i<meta.nchg;i++){
+        const struct mchg *c = &meta.chg[i];
+        const char *name = c->path+pl, *dot;
+        if(!c->live || strncmp(c->path, pre, pl) || strchr(name, '/')) continue;
+        if(!(dot = strrchr(name, '.')) || strcasecmp(dot, ext)) continue;
+        if(add(name, arg)) return n;
+        n++;
+    }
+    meta.hits++;
+    return n;
+}
+// Keeper: walk the whole tree and replace the snapshot.
+static void meta_write(void){
+    struct stat js;
+    int fd = jnl_open(LOCK_SH);
+    if(fd<0) return;
+    int ok = fstat(fd,&js)==0;
+    close(fd);
+    if(!ok) return;
+    struct meta_hdr h = { META_MAGIC, 0, 0, now_us(), (uint64_t)js.st_ino, (uint64_t)js.st_size };
+    char **v; int n = walk_tree(meta.root, "", "", &v);
+    uint32_t *idx = malloc((size_t)(n ? n : 1)*sizeof(*idx));
+    for(int i=0;i<n && idx;i++){
+        size_t l = strlen(v[i])+1;
+        if(h.blob+l > UINT32_MAX){ n = i; break; }
+        idx[i] = (uint32_t)h.blob; h.blob += l;
+    }
+    h.count = (uint32_t)n;
+    char tmp[2300]; snprintf(tmp, sizeof(tmp), "%s.tmp", meta.path);
+    FILE *f = idx && h.blob ? fopen(tmp, "w") : NULL;
+    if(f){
+        int bad = fwrite(&h, sizeof(h), 1, f)!=1 || fwrite(idx, sizeof(*idx), (size_t)n, f)!=(size_t)n;
+        for(int i=0;i<n && !bad;i++) bad = fwrite(v[i], strlen(v[i])+1, 1, f)!=1;
+        bad |= fflush(f)!=0 || fsync(fileno(f))!=0;
+        bad |= fclose(f)!=0;
+        if(bad || rename(tmp, meta.path)<0) unlink(tmp);
+    }
+    else if(idx && !h.blob) unlink(meta.path);               // empty tree: nothing to map
+    free(idx);
+    walk_free(v, n);
+}
+static void meta_init(const char *root){
+    snprintf(meta.root, sizeof(meta.root), "%s", root);
+    snprintf(meta.path, sizeof(meta.path), "%s/.meta", root);
+    if(META_INTERVAL<=0) return;
+    meta_map();                                       // the sessions inherit the mapping
+    pid_t pid = fork();
+    if(pid<0){ perror("fork meta"); return; }
+    if(pid) return;
+    meta.off = 1;
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if(nice(19) < 0) perror("nice");                 // stays out of the sessions' way:
+    syscall(SYS_ioprio_set, 1, 0, 3<<13);             // lowest CPU priority, idle I/O class
+    struct stat last = {0}, js;
+    for(int first = 1;; first = 0){
+        int moved = stat(jnl_path,&js)==0 && (js.st_ino!=last.st_ino || js.st_size!=last.st_size);
+        if(first || moved){ meta_write(); last = js; }
+        sleep(META_INTERVAL);
+    }
+}
+
+struct mdir { char **v; int n, max; };
+static int meta_dir_add(const char *name, void *arg){
+    struct mdir *d = arg;
+    if(d->n>=d->max || !(d->v[d->n] = strdup(name))) return -1;
+    d->n++;
+    return 0;
+}
+
+/* ---------- change subscriptions (WATCH) ----------
+   A subscription follows the journal: it keeps its own offset into
+   <root>/.journal and wakes on inotify (IN_MODIFY on the file, IN_MOVED_TO
+   on the root for the rename a compaction does). Records for paths under
+   the watched directory (its direct entries, or the whole subtree with
+   r=1) become events. The paths seen put and not yet deleted tell a create
+   from a modify. Records up to 'since' (default: now) only fill that set, so
+   "since=<token>" resumes an earlier stream. A compacted journal is read
+   again from the start, skipping records not newer than the last one seen:
+   intermediate states of a path can be lost then, its final state is not. */
+#ifndef WATCH_BUCKETS
+#define WATCH_BUCKETS 4096
+#endif
+
+struct wpath { struct wpath *next; char p[]; };
+struct watch {
+    int fd, ino_fd, rec, refeed; ino_t ino; long long pos, since, last;
+    char sub[1024]; const char *ext;
+    struct wpath **live;
+};
+typedef void (*watch_fn)(void *arg, long long us, char kind, const char *path);
+
+static unsigned watch_hash(const char *s){
+    unsigned h = 2166136261u;
+    while(*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h % WATCH_BUCKETS;
+}
+// Record 'path' as existing or not; returns whether it existed before.
+static int watch_mark(struct watch *w, const char *path, int live){
+    struct wpath **pp = &w->live[watch_hash(path)];
+    while(*pp && strcmp((*pp)->p, path)) pp = &(*pp)->next;
+    int was = *pp != NULL;
+    if(was && !live){ struct wpath *d = *pp; *pp = d->next; free(d); }
+    else if(!was && live){
+        size_t n = strlen(path)+1;
+        struct wpath *e = malloc(sizeof(*e)+n);
+        if(e){ memcpy(e->p, path, n); e->next = NULL; *pp = e; }
+    }
+    return was;
+}
+static int watch_scope(const struct watch *w, const char *path){
+    size_t n = strlen(w->sub), l = strlen(path), el = strlen(w->ext);
+    if(n && (strncmp(path, w->sub, n) || path[n]!='/')) return 0;
+    if(!w->rec && strchr(path + (n ? n+1 : 0), '/')) return 0;
+    return !meta_hidden(path) && l>=el && strcasecmp(path+l-el, w->ext)==0;
+}
+static void watch_line(struct watch *w, char *ln, watch_fn fn, void *arg){
+    long long us; char op; int off = 0;
+    if(ln[0]=='#' || sscanf(ln, "%lld %c %n", &us, &op, &off)!=2 || !off) return;
+    if(w->refeed && us <= w->last) return;
+    if(us > w->last) w->last = us;
+    const char *p = ln+off;
+    if((op!='P' && op!='D') || !watch_scope(w, p)) return;
+    int was = watch_mark(w, p, op=='P');
+    if(us > w->since) fn(arg, us, op=='D' ? 'd' : was ? 'm' : 'c', p);
+}
+// Turn what the journal gained since the last call into events.
+static void watch_pump(struct watch *w, watch_fn fn, void *arg){
+    struct stat st;
+    if(stat(jnl_path, &st)==0 && st.st_ino != w->ino){   // first call, or compacted
+        int fd = open(jnl_path, O_RDONLY|O_CLOEXEC);
+        if(fd>=0 && fstat(fd, &st)==0){
+            if(w->fd>=0) close(w->fd);
+            w->fd = fd; w->ino = st.st_ino; w->pos = 0; w->refeed = w->last > 0;
+            inotify_add_watch(w->ino_fd, jnl_path, IN_MODIFY);
+        }
+        else if(fd>=0) close(fd);
+    }
+    if(w->fd<0) return;
+    char buf[64<<10];
+    for(;;){
+        ssize_t r = pread(w->fd, buf, sizeof(buf)-1, w->pos);
+        if(r<=0) break;
+        buf[r] = '\0';
+        char *ln = buf, *nl;
+        while((nl = strchr(ln, '\n'))){ *nl = '\0'; watch_line(w, ln, fn, arg); ln = nl+1; }
+        if(ln==buf) break;                            // half a line: the writer is not done
+        w->pos += ln-buf;
+    }
+    w->refeed = 0;
+}
+// Empty the inotify queue; the events only say "look again".
+static void watch_drain(struct watch *w){
+    char ev[4096];
+    while(read(w->ino_fd, ev, sizeof(ev)) > 0) ;
+}
+static void watch_close(struct watch *w){
+    for(int i=0; w->live && i<WATCH_BUCKETS; i++)
+        for(struct wpath *e = w->live[i], *nx; e; e = nx){ nx = e->next; free(e); }
+    free(w->live);
+    if(w->fd>=0) close(w->fd);
+    if(w->ino_fd>=0) close(w->ino_fd);
+}
+static int watch_open(struct watch *w, const char *root, const char *dest, int rec, const char *ext, long long since){
+    memset(w, 0, sizeof(*w));
+    w->fd = -1; w->rec = rec; w->ext = ext; w->since = since;
+    while(*dest=='/') dest++;
+    snprintf(w->sub, sizeof(w->sub), "%s", dest);
+    size_t n = strlen(w->sub);
+    while(n && w->sub[n-1]=='/') w->sub[--n] = '\0';
+    w->live = calloc(WATCH_BUCKETS, sizeof(*w->live));
+    w->ino_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if(!w->live || w->ino_fd<0 || inotify_add_watch(w->ino_fd, root, IN_MOVED_TO)<0){ watch_close(w); return -1; }
+    return 0;
+}
+
+static void watch_send(void *arg, long long us, char kind, const char *path){
+    dprintf(*(int*)arg, "EV %lld %c %s\n", us, kind, path);
+}
+// WATCH <dest> [r=1] [since=<usec>]: "EV <usec> c|m|d <path>" lines until S1 hangs up.
+static void watch_serve(int csd, const char *dest, int rec, long long since){
+    struct watch w;
+    if(watch_open(&w, ROOT, dest, rec, ".pdf", since) < 0){ dprintf(csd, "ERR watch\n"); return; }
+    dprintf(csd, "OK\n");
+    watch_pump(&w, watch_send, &csd);
+    for(;;){
+        struct pollfd pf[2] = { { csd, POLLIN, 0 }, { w.ino_fd, POLLIN, 0 } };
+        if(poll(pf, 2, 1000) < 0 && errno!=EINTR) break;
+        if(pf[0].revents) break;                      // the subscriber left
+        watch_drain(&w);
+        watch_pump(&w, watch_send, &csd);
+    }
+    watch_close(&w);
+}
+
+// Write the matching relative paths to 'f', one per line; returns the count.
+static int walk_list(const char *root, const char *sub, const char *ext, FILE *f){
+    char **v; int n = walk_tree(root, sub, ext, &v);
+    for(int i=0;i<n;i++) fprintf(f, "%s\n", v[i]);
+    walk_free(v, n);
+    return n;
+}
+
+/* ---------- minimal ustar writer ---------- */
+static int tar_header(int out, const char *name, long long size, long long mtime){
+    char h[512]; memset(h,0,sizeof(h));
+    size_t ln=strlen(name);
+    const char *base=name; size_t plen=0;
+    if(ln>99){   // split into prefix/name at a '/'
+        const char *s=name+ln-100;
+        while(*s && *s!='/') s++;
+        if(!*s || (size_t)(s-name)>155) return -1;
+        plen=(size_t)(s-name); base=s+1;
+    }
+    memcpy(h, base, strlen(base));
+    snprintf(h+100, 8,  "%07o", 0664);
+    snprintf(h+108, 8,  "%07o", 0);
+    snprintf(h+116, 8,  "%07o", 0);
+    snprintf(h+124, 12, "%011llo", size);
+    snprintf(h+136, 12, "%011llo", mtime);
+    memset(h+148, ' ', 8);
+    h[156]='0';
+    memcpy(h+257, "ustar", 6); memcpy(h+263, "00", 2);
+    if(plen) memcpy(h+345, name, plen);
+    unsigned sum=0; for(int i=0;i<512;i++) sum += (unsigned char)h[i];
+    snprintf(h+148, 8, "%06o", sum); h[155]=' ';
+    return write_n(out,h,512)==512 ? 0 : -1;
+}
+static int tar_pad(int out, long long size){
+    static const char z[1024];
+    size_t pad = (size_t)((512 - size%512) % 512);
+    return (pad==0 || write_n(out,z,pad)==(ssize_t)pad) ? 0 : -1;
+}
+static int tar_finish(int out){
+    static const char z[1024];
+    return write_n(out,z,sizeof(z))==(ssize_t)sizeof(z) ? 0 : -1;
+}
+// Copy exactly 'size' bytes of 'fd' as an entry body (zero-filled if the file shrank).
+static int tar_copy_fd(int out, int fd, long long size){
+    char buf[BUFSZ]; long long left=size;
+    while(left>0){
+        size_t want = left>BUFSZ ? BUFSZ : (size_t)left;
+        ssize_t r = read(fd,buf,want);
+        if(r<=0){ memset(buf,0,want); r=(ssize_t)want; }
+        if(write_n(out,buf,(size_t)r)!=r) return -1;
+        left -= r;
+    }
+    return tar_pad(out,size);
+}
+// 'sub' limits an archive to one subtree ("" = everything).
+static int in_subtree(const char *path, const char *sub){
+    size_t n=strlen(sub);
+    return n==0 || (strncmp(path,sub,n)==0 && path[n]=='/');
+}
+// Emit every live packed file under 'sub' ending with 'ext' as a tar entry.
+static int tar_pack_entries(int out, const char *ext, const char *sub){
+    if(!PACKSTORE) return 0;
+    if(pack_lock(LOCK_SH)<0) return -1;
+    pack_sync();
+    int rc=0; uint32_t openseg=0; int fd=-1;
+    for(size_t i=0;i<pk.cap && rc==0;i++){
+        struct pack_ent *e=&pk.tab[i];
+        const char *dot = e->key ? strrchr(e->key,'.') : NULL;
+        if(!e->live || !dot || strcasecmp(dot,ext)!=0 || !in_subtree(e->key,sub)) continue;
+        if(fd<0 || openseg!=e->seg){
+            if(fd>=0) close(fd);
+            char p[2200]; seg_path(p,sizeof(p),e->seg);
+            fd=open(p,O_RDONLY); openseg=e->seg;
+            if(fd<0) continue;
+        }
+        if(tar_header(out,e->key,e->size,e->mtime)<0) continue;
+        if(lseek(fd,e->off,SEEK_SET)<0 || tar_copy_fd(out,fd,e->size)<0) rc=-1;
+    }
+    if(fd>=0) close(fd);
+    pack_lock(LOCK_UN);
+    return rc;
+}
+// Native TARALL used with PACKSTORE: walked files plus packed files.
+static int write_native_tar(const char *root, const char *ext, const char *sub, int out){
+    char **v; int n = walk_tree(root, sub, ext, &v);
+    int rc = 0;
+    for(int i=0;i<n && rc==0;i++){
+        if(rq.cancel){ rc=-1; break; }
+        const char *name = v[i];
+        char abs[8192]; snprintf(abs,sizeof(abs),"%s/%s",root,name);
+        int fd = open(abs,O_RDONLY);
+        if(fd<0) continue;
+        struct stat st; fstat(fd,&st);
+        if(tar_header(out,name,(long long)st.st_size,(long long)st.st_mtime)==0)
+            rc = tar_copy_fd(out,fd,(long long)st.st_size);
+        close(fd);
+    }
+    walk_free(v, n);
+    if(rc==0) rc = tar_pack_entries(out,ext,sub);
+    if(rc==0) rc = tar_finish(out);
+    return rc;
+}
+// Add one file (packed or on disk) as an entry; gone files are skipped.
+static int tar_add_path(int out, const char *root, const char *key){
+    if(PACKSTORE){
+        char *data=NULL; int64_t mt=0;
+        long long sz=pack_get(key,&data,&mt,NULL);
+        if(sz>=0){
+            int rc=0;
+            if(tar_header(out,key,sz,(long long)mt)==0)
+                rc = (write_n(out,data,(size_t)sz)==sz && tar_pad(out,sz)==0) ? 0 : -1;
+            free(data);
+            return rc;
+        }
+    }
+    char abs[8192]; snprintf(abs,sizeof(abs),"%s/%s",root,key);
+    int fd=open(abs,O_RDONLY);
+    if(fd<0) return 0;
+    struct stat st; fstat(fd,&st);
+    int rc=0;
+    if(S_ISREG(st.st_mode) && tar_header(out,key,(long long)st.st_size,(long long)st.st_mtime)==0)
+        rc = tar_copy_fd(out,fd,(long long)st.st_size);
+    close(fd);
+    return rc;
+}
+// Incremental TARALL: a ".deleted/S2" entry listing paths deleted at or
+// after 'since', then the files changed since then. A journal younger than
+// 'since' gives a full archive, flagged "full" in the manifest.
+static int write_incr_tar(const char *root, const char *ext, const char *sub, long long since, int out){
+    struct jrec *r=NULL; long long base=0;
+    int fd=jnl_open(LOCK_SH);
+    int n = fd<0 ? -1 : jnl_load(fd,&r,&base);
+    if(fd>=0) close(fd);
+    if(n<0) return -1;
+    int full = since<base;
+    char *man=NULL; size_t msz=0;
+    FILE *m=open_memstream(&man,&msz);
+    if(!m){ jnl_free(r,n); return -1; }
+    fprintf(m,"# since %lld%s\n",since,full?" full":"");
+    for(int i=0;i<n && !full;i++){
+        const char *dot=strrchr(r[i].path,'.');
+        if(r[i].op=='D' && r[i].us>=since && dot && strcasecmp(dot,ext)==0 && in_subtree(r[i].path,sub))
+            fprintf(m,"%s\n",r[i].path);
+    }
+    fclose(m);
+    int rc = tar_header(out,".deleted/S2",(long long)msz,now_us()/1000000)==0 &&
+             write_n(out,man,msz)==(ssize_t)msz && tar_pad(out,(long long)msz)==0 ? 0 : -1;
+    free(man);
+    if(rc==0 && full) rc = write_native_tar(root,ext,sub,out);
+    else if(rc==0){
+        for(int i=0;i<n && rc==0;i++){
+            if(rq.cancel){ rc=-1; break; }
+            const char *dot=strrchr(r[i].path,'.');
+            if(r[i].op=='P' && r[i].us>=since && dot && strcasecmp(dot,ext)==0 && in_subtree(r[i].path,sub))
+                rc = tar_add_path(out,root,r[i].path);
+        }
+        if(rc==0) rc = tar_finish(out);
+    }
+    jnl_free(r,n);
+    return rc;
+}
 // --- tar helper ---
-static int make_tar_for_root(const char *root, const char *ext, char *outpath, size_t outsz){
-    char tmp[]="/tmp/s2tarXXXXXX"; int fd=mkstemp(tmp); if(fd<0) return -1; close(fd);
-    char pat[32]; snprintf(pat,sizeof(pat),"*%s",ext);
-    char cmd[4096];
-    snprintf(cmd,sizeof(cmd),
-        "set -e; cd '%s'; "
-        "FILES=$(find . -type f -name '%s' -print); "
-        "if [ -z \"$FILES\" ]; then tar -cf '%s' --files-from /dev/null; "
-        "else tar -cf '%s' $FILES; fi",
-        root, pat, tmp, tmp);
-    int rc=system(cmd);
-    if(rc!=0){ unlink(tmp); return -2; }
+// since >= 0: incremental archive (see write_incr_tar)
+static int make_tar_for_root(const char *root, const char *ext, const char *sub, long long since, char *outpath, size_t outsz){
+    char tmp[]="/tmp/s2tarXXXXXX"; int fd=mkstemp(tmp); if(fd<0) return -1;
+    if(since>=0 || PACKSTORE){
+        int rc = since>=0 ? write_incr_tar(root,ext,sub,since,fd) : write_native_tar(root,ext,sub,fd);
+        close(fd);
+        if(rc!=0){ unlink(tmp); return -2; }
+        snprintf(outpath,outsz,"%s",tmp);
+        return 0;
+    }
+    close(fd);
+    char list[]="/tmp/s2listXXXXXX"; int lfd=mkstemp(list);
+    FILE *lf = lfd<0 ? NULL : fdopen(lfd,"w");
+    if(!lf){ if(lfd>=0){ close(lfd); unlink(list); } unlink(tmp); return -1; }
+    int count = walk_list(root, sub, ext, lf);
+    fclose(lf);
+    pid_t pid=fork();
+    if(pid==0){
+        if(count==0) execlp("tar","tar","-cf",tmp,"--files-from","/dev/null",(char*)NULL);
+        else         execlp("tar","tar","-C",root,"-cf",tmp,"-T",list,(char*)NULL);
+        _exit(127);
+    }
+    if(pid>0) rq_child(pid);
+    int status=0;
+    int ok = pid>0 && waitpid(pid,&status,0)==pid && WIFEXITED(status) && WEXITSTATUS(status)==0;
+    unlink(list);
+    if(!ok){ unlink(tmp); return -2; }
     snprintf(outpath,outsz,"%s",tmp);
     return 0;
 }
 
+/* ---------- stores ----------
+   "STORE <dest> <fname> <size> [z=<codec>]" is followed by the file's bytes
+   (framed when compressed). PULL (below) feeds the same path from a FETCH
+   on another aux server. A file is written under a dot name next to the
+   target, fsynced and renamed over it, so a stream that breaks leaves the
+   old version in place and OK is only answered once the new one is on disk. */
+static int tmp_commit(int fd, const char *tmp, const char *full, const char *dpath){
+    int rc = fsync(fd)==0 ? 0 : -1;
+    if(close(fd)!=0) rc=-1;
+    if(rc==0 && rename(tmp,full)!=0) rc=-1;
+    if(rc!=0){ unlink(tmp); return -1; }
+    int dd=open(dpath,O_RDONLY|O_DIRECTORY);
+    if(dd>=0){ fsync(dd); close(dd); }
+    return 0;
+}
+// Read size bytes of dest/fname from in and keep them, packed or as a file.
+// NULL when stored, else the error line to answer.
+static const char *store_stream(int in, int zc, const char *dest, const char *fname, long long size){
+    char dpath[2048]; join_path(dpath,sizeof(dpath),ROOT,dest);
+    if(ensure_dir(dpath)<0) return "ERR makedir";
+    char full[3072]; snprintf(full,sizeof(full),"%s/%s",dpath,fname);
+    char key[PACK_KEYMAX]; pack_key(key,sizeof(key),dest,fname);
+    struct zr zr; zr_init(&zr,in,zc);
+    if(PACKSTORE && size<=PACK_MAX){
+        char *data=malloc(size ? (size_t)size : 1); long long got=0;
+        while(data && got<size){
+            ssize_t r=zr_read(&zr,data+got,(size_t)(size-got));
+            if(r<=0){ free(data); rq_saved(size-got); return "ERR stream"; }
+            got+=r;
+        }
+        zr_finish(&zr);
+        if(!data || pack_put(key,data,(uint32_t)size)!=0){ free(data); return "ERR disk"; }
+        free(data); unlink(full);
+        jnl_add('P',key);
+        return NULL;
+    }
+    char tmp[3200]; snprintf(tmp,sizeof(tmp),"%s/.%s.st%d",dpath,fname,(int)getpid());
+    int fd=open(tmp,O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC,0664); if(fd<0) return "ERR open";
+    if(zc==Z_NONE){
+        long long b0=iostat.bytes;
+        if(xfer_copy(in,fd,size,-1,0)!=size){ close(fd); unlink(tmp); rq_saved(size-(iostat.bytes-b0)); return "ERR stream"; }
+    }
+    char buf[BUFSZ]; long long left = zc==Z_NONE ? 0 : size;
+    while(left>0){
+        ssize_t r=zr_read(&zr,buf,(left>BUFSZ?BUFSZ:(size_t)left));
+        if(r<=0){ close(fd); unlink(tmp); rq_saved(left); return "ERR stream"; }
+        if(write_n(fd,buf,(size_t)r)!=r){ close(fd); unlink(tmp); return "ERR disk"; }
+        left-=r;
+    }
+    zr_finish(&zr);
+    if(tmp_commit(fd,tmp,full,dpath)<0) return "ERR disk";
+    if(PACKSTORE) pack_del(key);
+    jnl_add('P',key);
+    return NULL;
+}
+
+/* ---------- deletes ----------
+   "DELETE <dest> <fname>" removes one file. "DELBATCH <n> <bytes>" is
+   followed by <bytes> of n (at most DEL_BATCH) "<dest> <fname>" lines and
+   answers "OK <n>" plus n bytes, '+' (removed) or '-' per line, in order.
+   "DELTREE /<sub>" removes every .pdf file under sub, packed ones too, and
+   answers "OK <count> <bytes>" plus <bytes> of "<path>" lines, one per
+   removed file. Both replies are one header and one block. */
+#define DEL_BATCH 4096
+
+// Unlink dest/fname and drop its packed copy; 0 if either existed.
+static int del_file(const char *dest, const char *fname){
+    char dpath[2048]; join_path(dpath,sizeof(dpath),ROOT,dest);
+    char full[3072]; snprintf(full,sizeof(full),"%s/%s",dpath,fname);
+    int rc=unlink(full);
+    char key[PACK_KEYMAX]; pack_key(key,sizeof(key),dest,fname);
+    if(PACKSTORE && pack_del(key)==0) rc=0;
+    if(rc==0) jnl_add('D',key);
+    return rc;
+}
+static int del_batch(int csd, int n, size_t bytes){
+    char *req=malloc(bytes+1), *flags=malloc((size_t)n);
+    if(!req || !flags || read_full(csd,req,bytes)<0){ free(req); free(flags); return -1; }
+    req[bytes]='\0';
+    char *p=req;
+    for(int i=0;i<n;i++){
+        char dest[1024], fname[256], *e=strchr(p,'\n');
+        if(e) *e='\0';
+        flags[i] = sscanf(p,"%1023s %255s",dest,fname)==2 && !strstr(dest,"..") && !strchr(fname,'/') &&
+                   del_file(dest,fname)==0 ? '+' : '-';
+        p = e ? e+1 : p+strlen(p);
+    }
+    head_printf(csd,1,"OK %d\n",n);
+    write_n(csd,flags,(size_t)n);
+    free(req); free(flags);
+    return 0;
+}
+// "/a/b/" -> "a/b" in sub; -1 for a path that climbs out of the root.
+static int tree_arg(char *sub, size_t n, const char *arg){
+    while(*arg=='/') arg++;
+    snprintf(sub,n,"%s",arg);
+    size_t sl=strlen(sub); while(sl>0 && sub[sl-1]=='/') sub[--sl]='\0';
+    return strstr(sub,"..") ? -1 : 0;
+}
+// Every .pdf file under sub, on disk or packed, as root-relative paths.
+static int tree_files(const char *sub, char ***out){
+    char **v; int n=walk_tree(ROOT,sub,".pdf",&v), cap=n;
+    if(PACKSTORE && pack_lock(LOCK_SH)==0){   // packed files have no inode for the walk to find
+        pack_sync();
+        for(size_t i=0;i<pk.cap;i++){
+            struct pack_ent *e=&pk.tab[i];
+            const char *dot = e->key ? strrchr(e->key,'.') : NULL;
+            if(!e->live || !dot || strcasecmp(dot,".pdf")!=0 || !in_subtree(e->key,sub)) continue;
+            if(n==cap){ char **nv=realloc(v,(size_t)(cap=cap*2+64)*sizeof(*v)); if(!nv) break; v=nv; }
+            v[n++]=strdup(e->key);
+        }
+        pack_lock(LOCK_UN);
+    }
+    *out=v;
+    return n;
+}
+static void del_tree(int csd, const char *arg){
+    char sub[1024];
+    if(tree_arg(sub,sizeof(sub),arg)<0){ dprintf(csd,"ERR badpath\n"); return; }
+    char **v; int n=tree_files(sub,&v);
+    char *out=NULL; size_t osz=0; int done=0;
+    FILE *m=open_memstream(&out,&osz);
+    for(int i=0;i<n && m;i++){
+        if(!v[i]) continue;
+        char *slash=strrchr(v[i],'/'), dest[1100];
+        snprintf(dest,sizeof(dest),"/%.*s",slash ? (int)(slash-v[i]) : 0,v[i]);
+        if(del_file(dest,slash ? slash+1 : v[i])==0){ fprintf(m,"%s\n",v[i]); done++; }
+    }
+    if(m) fclose(m);
+    head_printf(csd,osz>0,"OK %d %zu\n",done,osz);
+    if(osz) write_n(csd,out,osz);
+    free(out);
+    walk_free(v,n);
+}
+
+/* ---------- server-side copy / move ----------
+   "COPY <sdest> <sfname> <ddest> <dfname>" and "MOVE ..." work inside this
+   server: a move is a rename (a packed file is re-keyed), a copy clones the
+   file into a temporary name (FICLONE where the filesystem can share the
+   extents, else copy_file_range) and renames it over the target.
+   "PULL <port> <sdest> <sfname> <ddest> <dfname>" FETCHes the file from the
+   aux server on <port> and stores it here, so a copy across servers goes
+   from one backend to the other. "COPYTREE /<sub> /<to>" and "MOVETREE ..."
+   do COPY/MOVE for every .pdf file under sub and answer like DELTREE, with
+   the source paths that were done. */
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+static int clone_file(const char *src, const char *dst){
+    int in=open(src,O_RDONLY); if(in<0) return -1;
+    char tmp[3200]; snprintf(tmp,sizeof(tmp),"%s.cp%d",dst,(int)getpid());
+    int out=open(tmp,O_CREAT|O_TRUNC|O_WRONLY,0664);
+    struct stat st; int rc = out<0 || fstat(in,&st)<0 ? -1 : 0;
+    if(rc==0 && ioctl(out,FICLONE,in)!=0){
+        long long left=st.st_size;
+        while(left>0){
+            ssize_t r=copy_file_range(in,NULL,out,NULL,(size_t)left,0);
+            if(r<=0) break;
+            left-=r;
+        }
+        char *buf = left>0 ? malloc(IO_BUF) : NULL;   // no copy_file_range here: go on from where it stopped
+        while(left>0 && buf){
+            ssize_t r=read(in,buf,IO_BUF);
+            if(r<=0 || write_n(out,buf,(size_t)r)!=r) break;
+            left-=r;
+        }
+        free(buf);
+        if(left>0) rc=-1;
+    }
+    close(in);
+    if(out>=0) close(out);
+    if(rc==0 && rename(tmp,dst)!=0) rc=-1;
+    if(rc!=0) unlink(tmp);
+    return rc;
+}
+// 0 done, -1 no such source, -2 the copy failed.
+static int copy_one(const char *sdest, const char *sf, const char *ddest, const char *df, int move){
+    char sdir[2048], ddir[2048], src[3072], dst[3072];
+    join_path(sdir,sizeof(sdir),ROOT,sdest); join_path(ddir,sizeof(ddir),ROOT,ddest);
+    snprintf(src,sizeof(src),"%s/%s",sdir,sf); snprintf(dst,sizeof(dst),"%s/%s",ddir,df);
+    if(!strcmp(src,dst)) return -2;
+    char skey[PACK_KEYMAX], dkey[PACK_KEYMAX]; pack_key(skey,sizeof(skey),sdest,sf); pack_key(dkey,sizeof(dkey),ddest,df);
+    if(ensure_dir(ddir)<0) return -2;
+    if(PACKSTORE){
+        char *data=NULL; long long n=pack_get(skey,&data,NULL,NULL);
+        if(n>=0){
+            int rc=pack_put(dkey,data,(uint32_t)n);
+            free(data);
+            if(rc!=0) return -2;
+            unlink(dst);
+            if(move) del_file(sdest,sf);
+            jnl_add('P',dkey);
+            return 0;
+        }
+    }
+    if(move ? rename(src,dst)!=0 : clone_file(src,dst)!=0) return errno==ENOENT ? -1 : -2;
+    if(PACKSTORE) pack_del(dkey);
+    if(move) jnl_add('D',skey);
+    jnl_add('P',dkey);
+    return 0;
+}
+static int connect_peer(int port){
+    if(AUX_UNIX){
+        struct sockaddr_un u={0}; u.sun_family=AF_UNIX;
+        snprintf(u.sun_path,sizeof(u.sun_path),AUX_SOCK,port);
+        int sd=socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+        if(sd>=0 && connect(sd,(struct sockaddr*)&u,sizeof(u))==0){ rq_track(sd); return sd; }
+        if(sd>=0) close(sd);
+    }
+    int sd=socket(AF_INET,SOCK_STREAM|SOCK_CLOEXEC,0); if(sd<0) return -1;
+    struct sockaddr_in a={0}; a.sin_family=AF_INET; a.sin_port=htons(port); a.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    if(connect(sd,(struct sockaddr*)&a,sizeof(a))<0){ close(sd); return -1; }
+    rq_track(sd);
+    return sd;
+}
+static const char *pull_file(int port, const char *sdest, const char *sf, const char *ddest, const char *df){
+    int sd=connect_peer(port); if(sd<0) return "ERR peer";
+    dprintf(sd,"FETCH %s %s%s\n",sdest,sf,rq_opt());
+    char hdr[256]; long long size=-1;
+    if(read_line(sd,hdr,sizeof(hdr))<=0 || sscanf(hdr,"OK %lld",&size)!=1 || size<0){ close(sd); return "ERR nofile"; }
+    const char *err=store_stream(sd,Z_NONE,ddest,df,size);
+    dprintf(sd,"QUIT\n");
+    close(sd);
+    return err;
+}
+static void copy_tree(int csd, const char *from, const char *to, int move){
+    char sub[1024], nsub[1024];
+    if(tree_arg(sub,sizeof(sub),from)<0 || tree_arg(nsub,sizeof(nsub),to)<0){ dprintf(csd,"ERR badpath\n"); return; }
+    char **v; int n=tree_files(sub,&v);
+    char *out=NULL; size_t osz=0; int done=0;
+    FILE *m=open_memstream(&out,&osz);
+    for(int i=0;i<n && m;i++){
+        if(!v[i]) continue;
+        const char *rest=v[i]+strlen(sub); while(*rest=='/') rest++;
+        char np[2200]; snprintf(np,sizeof(np),"%s%s%s",nsub,*nsub ? "/" : "",rest);
+        char *s1=strrchr(v[i],'/'), *s2=strrchr(np,'/'), sd[1100], dd[1100];
+        snprintf(sd,sizeof(sd),"/%.*s",s1 ? (int)(s1-v[i]) : 0,v[i]);
+        snprintf(dd,sizeof(dd),"/%.*s",s2 ? (int)(s2-np) : 0,np);
+        if(copy_one(sd,s1 ? s1+1 : v[i],dd,s2 ? s2+1 : np,move)==0){ fprintf(m,"%s\n",v[i]); done++; }
+    }
+    if(m) fclose(m);
+    head_printf(csd,osz>0,"OK %d %zu\n",done,osz);
+    if(osz) write_n(csd,out,osz);
+    free(out);
+    walk_free(v,n);
+}
+
+/* ---------- direct clients: signed GET / PUT ----------
+   S1 may send a client straight here with a grant signed by the key we
+   share ($DFS_KEY at start-up). "GET <dest> <fname> exp=<t> sig=<hex>
+   [if-none=<tag>]" is then answered as FETCH, and "PUT <dest> <fname>
+   <size> exp=<t> sig=<hex>" as STORE, if the HMAC-SHA256 of the request
+   matches and the grant hasn't expired. Without $DFS_KEY both are refused.
+   With it, a peer that isn't S1's side (the unix socket or loopback) may
+   only send those two. */
+
+/* SHA-256 (FIPS 180-4) and HMAC-SHA256 (RFC 2104) */
+static const uint32_t sha_k[64] = {
+    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+    0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+    0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+    0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+    0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+    0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+    0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+    0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2 };
+struct sha256 { uint32_t h[8]; uint64_t len; unsigned char b[64]; size_t n; };
+
+#define SHA_ROR(x,r) (((x)>>(r))|((x)<<(32-(r))))
+static void sha256_block(uint32_t *h, const unsigned char *p){
+    uint32_t w[64], s[8];
+    for(int i=0;i<16;i++) w[i] = be32get(p+4*i);
+    for(int i=16;i<64;i++){
+        uint32_t s0 = SHA_ROR(w[i-15],7)^SHA_ROR(w[i-15],18)^(w[i-15]>>3), s1 = SHA_ROR(w[i-2],17)^SHA_ROR(w[i-2],19)^(w[i-2]>>10);
+        w[i] = w[i-16]+s0+w[i-7]+s1;
+    }
+    memcpy(s, h, sizeof(s));
+    for(int i=0;i<64;i++){
+        uint32_t t1 = s[7]+(SHA_ROR(s[4],6)^SHA_ROR(s[4],11)^SHA_ROR(s[4],25))+((s[4]&s[5])^(~s[4]&s[6]))+sha_k[i]+w[i];
+        uint32_t t2 = (SHA_ROR(s[0],2)^SHA_ROR(s[0],13)^SHA_ROR(s[0],22))+((s[0]&s[1])^(s[0]&s[2])^(s[1]&s[2]));
+        memmove(s+1, s, 7*sizeof(uint32_t));
+        s[4] += t1; s[0] = t1+t2;
+    }
+    for(int i=0;i<8;i++) h[i] += s[i];
+}
+static void sha256_init(struct sha256 *c){
+    static const uint32_t iv[8] = { 0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19 };
+    memcpy(c->h, iv, sizeof(iv)); c->len = 0; c->n = 0;
+}
+static void sha256_update(struct sha256 *c, const void *data, size_t n){
+    const unsigned char *p = data;
+    c->len += n;
+    while(n > 0){
+        size_t k = 64-c->n < n ? 64-c->n : n;
+        memcpy(c->b+c->n, p, k); c->n += k; p += k; n -= k;
+        if(c->n == 64){ sha256_block(c->h, c->b); c->n = 0; }
+    }
+}
+static void sha256_final(struct sha256 *c, unsigned char out[32]){
+    uint64_t bits = c->len*8;
+    unsigned char pad = 0x80, z = 0, lb[8];
+    sha256_update(c, &pad, 1);
+    while(c->n != 56) sha256_update(c, &z, 1);
+    for(int i=0;i<8;i++) lb[i] = (unsigned char)(bits>>(56-8*i));
+    sha256_update(c, lb, 8);
+    for(int i=0;i<8;i++) be32put(out+4*i, c->h[i]);
+}
+static void hmac_sha256(const char *key, const char *msg, unsigned char out[32]){
+    unsigned char k[64] = {0}, ip[64], op[64], ih[32];
+    size_t kl = strlen(key);
+    if(kl > 64){ struct sha256 c; sha256_init(&c); sha256_update(&c, key, kl); sha256_final(&c, k); }
+    else memcpy(k, key, kl);
+    for(int i=0;i<64;i++){ ip[i] = k[i]^0x36; op[i] = k[i]^0x5c; }
+    struct sha256 c;
+    sha256_init(&c); sha256_update(&c, ip, 64); sha256_update(&c, msg, strlen(msg)); sha256_final(&c, ih);
+    sha256_init(&c); sha256_update(&c, op, 64); sha256_update(&c, ih, 32); sha256_final(&c, out);
+}
+
+static const char *redir_key;   // NULL: no direct clients
+
+static void redir_init(void){
+    const char *k=getenv("DFS_KEY");
+    if(k && *k) redir_key=k;
+}
+static int peer_local(int sd){
+    struct sockaddr_storage a; socklen_t l=sizeof(a);
+    if(getpeername(sd,(struct sockaddr*)&a,&l)<0) return 0;
+    if(a.ss_family==AF_UNIX) return 1;
+    if(a.ss_family==AF_INET) return (ntohl(((struct sockaddr_in*)&a)->sin_addr.s_addr)>>24)==127;
+    if(a.ss_family==AF_INET6){
+        const struct in6_addr *x=&((struct sockaddr_in6*)&a)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(x) || (IN6_IS_ADDR_V4MAPPED(x) && x->s6_addr[12]==127);
+    }
+    return 0;
+}
+static int redir_check(const char *line){
+    char dest[1024], fname[256], ev[24], sig[80], msg[1500], want[65]; long long size=0;
+    int put = line[0]=='P';
+    if(!opt_get(line,"exp",ev,sizeof(ev)) || !opt_get(line,"sig",sig,sizeof(sig)) || strlen(sig)!=64) return -1;
+    if(put ? sscanf(line+4,"%1023s %255s %lld",dest,fname,&size)!=3 : sscanf(line+4,"%1023s %255s",dest,fname)!=2) return -1;
+    long long exp=atoll(ev);
+    if(exp < (long long)time(NULL)) return -1;
+    if(put) snprintf(msg,sizeof(msg),"PUT %s %s %lld %lld",dest,fname,size,exp);
+    else    snprintf(msg,sizeof(msg),"GET %s %s %lld",dest,fname,exp);
+    unsigned char mac[32], d=0; hmac_sha256(redir_key,msg,mac);
+    for(int i=0;i<32;i++) snprintf(want+2*i,3,"%02x",mac[i]);
+    for(int i=0;i<64;i++) d |= (unsigned char)(want[i]^sig[i]);   // no early exit
+    return d ? -1 : 0;
+}
+
 static void handle_client(int csd){
-    char line[2048];
+    char line[4096];   // COPY/MOVE/PULL carry two paths of up to 1023 characters
+    int local = !redir_key || peer_local(csd);
     while(1){
+        rq_end();
+        tr_finish();
         ssize_t n=read_line(csd,line,sizeof(line)); if(n<=0) break;
+        tr_request(line);
+        rq_begin(csd,line);
+        if(strncmp(line,"GET ",4)==0 || strncmp(line,"PUT ",4)==0){   // a redirected client: same as FETCH / STORE
+            if(!redir_key || redir_check(line)!=0){ dprintf(csd,"ERR denied\n"); break; }
+            char cmd[sizeof(line)]; snprintf(cmd,sizeof(cmd),"%s %.4000s",line[0]=='G' ? "FETCH" : "STORE",line+4);
+            snprintf(line,sizeof(line),"%s",cmd);
+        }
+        else if(!local && strncmp(line,"QUIT",4)!=0){ dprintf(csd,"ERR denied\n"); break; }   // unsigned: S1 only
 
         if(strncmp(line,"STORE ",6)==0){
             char dest[1024], fname[256]; long long size=0;
             if(sscanf(line+6,"%1023s %255s %lld",dest,fname,&size)!=3 || size<0){ dprintf(csd,"ERR bad STORE\n"); break; }
             if(strstr(dest,"..")){ dprintf(csd,"ERR badpath\n"); break; }
-            char dpath[2048]; join_path(dpath,sizeof(dpath),ROOT,dest);
-            if(ensure_dir(dpath)<0){ dprintf(csd,"ERR makedir\n"); break; }
-            char full[3072]; snprintf(full,sizeof(full),"%s/%s",dpath,fname);
-            int fd=open(full,O_CREAT|O_TRUNC|O_WRONLY,0664); if(fd<0){ dprintf(csd,"ERR open\n"); break; }
-            char buf[BUFSZ]; long long left=size;
-            while(left>0){
-                ssize_t r=read(csd,buf,(left>BUFSZ?BUFSZ:(size_t)left));
-                if(r<=0){ close(fd); unlink(full); dprintf(csd,"ERR stream\n"); return; }
-                if(write_n(fd,buf,(size_t)r)!=r){ close(fd); unlink(full); dprintf(csd,"ERR disk\n"); return; }
-                left-=r;
-            }
-            close(fd); dprintf(csd,"OK\n");
+            char zv[16]; int zc=opt_get(line,"z",zv,sizeof(zv)) ? z_parse(zv) : Z_NONE;
+            if(zc<0 || !z_supported(zc)){ dprintf(csd,"ERR bad STORE\n"); break; }
+            int th=tr_begin("recv");
+            const char *err=store_stream(csd,zc,dest,fname,size);
+            tr_end(th);
+            if(err){ dprintf(csd,"%s\n",err); break; }
+            dprintf(csd,"OK\n");
         }
         else if(strncmp(line,"FETCH ",6)==0){
             char dest[1024], fname[256];
@@ -109,33 +2632,123 @@ static void handle_client(int csd){
             if(strstr(dest,"..")){ dprintf(csd,"ERR badpath\n"); break; }
             char dpath[2048]; join_path(dpath,sizeof(dpath),ROOT,dest);
             char full[3072]; snprintf(full,sizeof(full),"%s/%s",dpath,fname);
+            int zc = z_skip_ext(fname) ? Z_NONE : sess_codec;
+            char inm[48]; int has_inm=opt_get(line,"if-none",inm,sizeof(inm));
+            char tag[48];   // version tag: size and mtime (ns) or pack record, hex
+            struct zw zw; zw_init(&zw,csd,zc);
+            int th=tr_begin("send");
+            if(PACKSTORE){
+                char key[PACK_KEYMAX]; pack_key(key,sizeof(key),dest,fname);
+                char *data=NULL; uint64_t ver=0; long long psize=pack_get(key,&data,NULL,&ver);
+                if(psize>=0){
+                    snprintf(tag,sizeof(tag),"%llx-p%llx",(unsigned long long)psize,(unsigned long long)ver);
+                    if(has_inm && !strcmp(inm,tag)){ free(data); dprintf(csd,"SAME tag=%s\n",tag); tr_end(th); continue; }
+                    zw_head(&zw,"OK %lld%s tag=%s\n",psize,z_opt(zc),tag);
+                    zw_write(&zw,data,(size_t)psize); zw_end(&zw); free(data);
+                    tr_end(th);
+                    continue;
+                }
+            }
             int fd=open(full,O_RDONLY); if(fd<0){ dprintf(csd,"ERR nofile\n"); break; }
             struct stat st; fstat(fd,&st); long long size=st.st_size;
-            dprintf(csd,"OK %lld\n",size);
+            snprintf(tag,sizeof(tag),"%llx-%llx",(unsigned long long)size,
+                     (unsigned long long)((long long)st.st_mtim.tv_sec*1000000000LL+st.st_mtim.tv_nsec));
+            if(has_inm && !strcmp(inm,tag)){ close(fd); dprintf(csd,"SAME tag=%s\n",tag); tr_end(th); continue; }
+            char fv[8];
+            if(AUX_UNIX && size>=FD_PASS_MIN && opt_get(line,"fd",fv,sizeof(fv)) && sock_is_unix(csd)){
+                char ok[128]; snprintf(ok,sizeof(ok),"OK %lld fd=1 tag=%s\n",size,tag);
+                int rc=send_fd(csd,ok,fd);
+                close(fd); tr_end(th);
+                if(rc==0) continue;
+                break;
+            }
+            if(zc==Z_NONE){
+                head_printf(csd,size>0,"OK %lld tag=%s\n",size,tag);
+                long long b0=iostat.bytes;
+                if(xfer_copy(fd,csd,size,0,-1)!=size) rq_saved(size-(iostat.bytes-b0));
+                close(fd); tr_end(th); continue;
+            }
+            zw_head(&zw,"OK %lld%s tag=%s\n",size,z_opt(zc),tag);
             char buf[BUFSZ]; long long left=size;
             while(left>0){ ssize_t r=read(fd,buf,(left>BUFSZ?BUFSZ:(size_t)left)); if(r<=0) break;
-                if(write_n(csd,buf,(size_t)r)!=r) break; left-=r; }
+                if(zw_write(&zw,buf,(size_t)r)!=0) break; left-=r; }
+            rq_saved(left);
+            zw_end(&zw);
             close(fd);
+            tr_end(th);
         }
         else if(strncmp(line,"DELETE ",7)==0){
             char dest[1024], fname[256];
             if(sscanf(line+7,"%1023s %255s",dest,fname)!=2){ dprintf(csd,"ERR bad DELETE\n"); break; }
             if(strstr(dest,"..")){ dprintf(csd,"ERR badpath\n"); break; }
-            char dpath[2048]; join_path(dpath,sizeof(dpath),ROOT,dest);
-            char full[3072]; snprintf(full,sizeof(full),"%s/%s",dpath,fname);
-            int rc=unlink(full); dprintf(csd, (rc==0)?"OK\n":"ERR\n");
+            int th=tr_begin("unlink");
+            int rc=del_file(dest,fname);
+            tr_end(th);
+            dprintf(csd, (rc==0)?"OK\n":"ERR\n");
+        }
+        else if(strncmp(line,"DELBATCH ",9)==0){
+            int n=0; long long bytes=0;
+            if(sscanf(line+9,"%d %lld",&n,&bytes)!=2 || n<1 || n>DEL_BATCH || bytes<0 || bytes>(long long)n*1400){ dprintf(csd,"ERR bad DELBATCH\n"); break; }
+            int th=tr_begin("unlink");
+            int rc=del_batch(csd,n,(size_t)bytes);
+            tr_end(th);
+            if(rc<0) break;
+        }
+        else if(strncmp(line,"DELTREE ",8)==0){
+            char sub[1024];
+            if(sscanf(line+8,"%1023s",sub)!=1 || strchr(sub,'=')){ dprintf(csd,"ERR bad DELTREE\n"); break; }
+            int th=tr_begin("unlink");
+            del_tree(csd,sub);
+            tr_end(th);
+        }
+        else if(strncmp(line,"COPY ",5)==0 || strncmp(line,"MOVE ",5)==0){
+            char sdest[1024], sf[256], ddest[1024], df[256]; int move = line[0]=='M';
+            if(sscanf(line+5,"%1023s %255s %1023s %255s",sdest,sf,ddest,df)!=4){ dprintf(csd,"ERR bad %s\n",move ? "MOVE" : "COPY"); break; }
+            if(strstr(sdest,"..") || strstr(ddest,"..") || strchr(sf,'/') || strchr(df,'/')){ dprintf(csd,"ERR badpath\n"); break; }
+            int th=tr_begin(move ? "rename" : "clone");
+            int rc=copy_one(sdest,sf,ddest,df,move);
+            tr_end(th);
+            dprintf(csd, rc==0 ? "OK\n" : rc==-1 ? "ERR nofile\n" : "ERR copy\n");
+        }
+        else if(strncmp(line,"PULL ",5)==0){
+            char sdest[1024], sf[256], ddest[1024], df[256]; int port=0;
+            if(sscanf(line+5,"%d %1023s %255s %1023s %255s",&port,sdest,sf,ddest,df)!=5 || port<1 || port>65535 || port==S2_PORT){ dprintf(csd,"ERR bad PULL\n"); break; }
+            if(strstr(sdest,"..") || strstr(ddest,"..") || strchr(sf,'/') || strchr(df,'/')){ dprintf(csd,"ERR badpath\n"); break; }
+            int th=tr_begin("pull");
+            const char *err=pull_file(port,sdest,sf,ddest,df);
+            tr_end(th);
+            dprintf(csd,"%s\n",err ? err : "OK");
+        }
+        else if(strncmp(line,"COPYTREE ",9)==0 || strncmp(line,"MOVETREE ",9)==0){
+            char from[1024], to[1024];
+            if(sscanf(line+9,"%1023s %1023s",from,to)!=2 || strchr(from,'=') || strchr(to,'=')){ dprintf(csd,"ERR bad %.8s\n",line); break; }
+            int th=tr_begin(line[0]=='M' ? "rename" : "clone");
+            copy_tree(csd,from,to,line[0]=='M');
+            tr_end(th);
         }
         else if(strncmp(line,"TARALL ",7)==0){
-            char ext[16];
-            if(sscanf(line+7,"%15s",ext)!=1){ dprintf(csd,"ERR bad TARALL\n"); break; }
+            char ext[16], sub[1024]="";   // TARALL <ext> [<subtree>] [since=<usec>]
+            if(sscanf(line+7,"%15s %1023s",ext,sub)<1){ dprintf(csd,"ERR bad TARALL\n"); break; }
+            char sv[32]; long long since = opt_get(line,"since",sv,sizeof(sv)) ? atoll(sv) : -1;
+            if(strchr(sub,'=')) sub[0]='\0';   // no subtree, just options (since=, rid=)
             if(strcmp(ext,".pdf")!=0){ dprintf(csd,"ERR ext\n"); break; }
+            if(strstr(sub,"..") || strchr(sub,'\'')){ dprintf(csd,"ERR badpath\n"); break; }
             char tarpath[256];
-            if(make_tar_for_root(ROOT, ".pdf", tarpath, sizeof(tarpath))!=0){ dprintf(csd,"ERR tar\n"); break; }
+            int th=tr_begin("build");
+            int trc=make_tar_for_root(ROOT, ".pdf", sub, since, tarpath, sizeof(tarpath));
+            tr_end(th);
+            if(trc!=0){ dprintf(csd,"ERR tar\n"); break; }
             int fd=open(tarpath,O_RDONLY); if(fd<0){ unlink(tarpath); dprintf(csd,"ERR taropen\n"); break; }
             struct stat st; fstat(fd,&st);
-            dprintf(csd,"OK %lld\n",(long long)st.st_size);
-            char buf[BUFSZ]; ssize_t r;
-            while((r=read(fd,buf,sizeof(buf)))>0) if(write_n(csd,buf,(size_t)r)!=r) break;
+            int zc = z_skip_ext(ext) ? Z_NONE : sess_codec;
+            struct zw zw; zw_init(&zw,csd,zc);
+            zw_head(&zw,"OK %lld%s\n",(long long)st.st_size,z_opt(zc));
+            th=tr_begin("send");
+            char buf[BUFSZ]; ssize_t r; long long left=st.st_size;
+            while((r=read(fd,buf,sizeof(buf)))>0){ if(zw_write(&zw,buf,(size_t)r)!=0) break; left-=r; }
+            rq_saved(left);
+            zw_end(&zw);
+            tr_end(th);
             close(fd); unlink(tarpath);
         }
           /* ---- LIST <dest> : return sorted names with this server's extension ---- */
@@ -148,38 +2761,155 @@ else if (strncmp(line, "LIST ", 5) == 0) {
     if (dest[0]=='/') snprintf(dir, sizeof(dir), "%s%s", ROOT, dest);
     else              snprintf(dir, sizeof(dir), "%s/%s", ROOT, dest);
 
-    DIR *dp = opendir(dir);
-    if (!dp) { dprintf(csd,"OK 0\n"); continue; }
-
-    char *names[4096]; int n=0;
-    struct dirent *de;
-    while ((de=readdir(dp))) {
-        if (de->d_name[0]=='.') continue;
-        const char *dot = strrchr(de->d_name, '.');
-        if (dot && strcasecmp(dot, ".pdf")==0) names[n++] = strdup(de->d_name);
-        if (n>=4096) break;
+    char **names; unsigned gen = 0;
+    int th = tr_begin("list");
+    int n = dc_get(dest, ".pdf", &names, &gen);
+    if (n < 0) {
+        if (!(names = malloc(4096*sizeof(char*)))) { dprintf(csd,"ERR nomem\n"); continue; }
+        struct mdir md = { names, 0, 4096 };
+        n = meta_dir_each(dest, ".pdf", meta_dir_add, &md) < 0 ? -1 : md.n;
+        if (n < 0) {
+            DIR *dp = opendir(dir);
+            if (!dp && !PACKSTORE) { free(names); dprintf(csd,"OK 0\n"); continue; }
+            n = 0;
+            struct dirent *de;
+            while (dp && (de=readdir(dp))) {
+                if (de->d_name[0]=='.') continue;
+                const char *dot = strrchr(de->d_name, '.');
+                if (dot && strcasecmp(dot, ".pdf")==0) names[n++] = strdup(de->d_name);
+                if (n>=4096) break;
+            }
+            if (dp) closedir(dp);
+        }
+        if (PACKSTORE) n = pack_list(dest, ".pdf", names, n, 4096);
+        qsort(names, n, sizeof(char*), cmp_cstr);
+        dc_put(dest, ".pdf", gen, names, n);
     }
-    closedir(dp);
-    qsort(names, n, sizeof(char*), cmp_cstr);
-    dprintf(csd, "OK %d\n", n);
-    for (int i=0;i<n;i++){ dprintf(csd,"NAME %s\n", names[i]); free(names[i]); }
+    tr_end(th);
+    int zc = n ? sess_codec : Z_NONE;
+    struct zw zw; zw_init(&zw, csd, zc);
+    zw_head(&zw, "OK %d%s\n", n, z_opt(zc));
+    char nl[320];
+    for (int i=0;i<n;i++){ zw_write(&zw, nl, (size_t)snprintf(nl,sizeof(nl),"NAME %s\n", names[i])); free(names[i]); }
+    free(names);
+    zw_end(&zw);
 }
+        else if(strncmp(line,"COMP ",5)==0){
+            char offer[128]; if(sscanf(line+5,"%127s",offer)!=1){ dprintf(csd,"ERR bad COMP\n"); break; }
+            sess_codec=z_choose(offer);
+            dprintf(csd,"OK %s\n",z_names[sess_codec]);
+        }
+        else if(strncmp(line,"WATCH ",6)==0){
+            char dest[1024], v[32];
+            int rec=opt_get(line,"r",v,sizeof(v)) && atoi(v);
+            long long since=opt_get(line,"since",v,sizeof(v)) ? atoll(v) : now_us();
+            if(sscanf(line+6,"%1023s",dest)!=1 || strchr(dest,'=') || strstr(dest,"..")){ dprintf(csd,"ERR bad WATCH\n"); break; }
+            rq_end();   // a subscription ends when S1 drops it: not a cancel
+            watch_serve(csd,dest,rec,since);
+            break;
+        }
         else if(strncmp(line,"QUIT",4)==0) break;
         else dprintf(csd,"ERR unknown\n");
     }
+    rq_end();
+    tr_finish();
     close(csd);
 }
 
-int main(void){
-    int sd=socket(AF_INET,SOCK_STREAM,0); if(sd<0){ perror("socket"); return 1; }
+/* ---------- acceptors ----------
+   With -DACCEPTORS=n (0 = one per online CPU) the server listens through n
+   SO_REUSEPORT sockets on the same port, each drained by its own acceptor
+   process, so the kernel spreads incoming connections over them instead of
+   queueing everything behind one accept(). -DACCEPT_PIN=1 pins acceptor i
+   (and the sessions it forks) to CPU i. The first acceptor is the original
+   process and keeps the listing-cache watcher thread.
+   With AUX_UNIX (default on) one more acceptor serves the AF_UNIX socket
+   AUX_SOCK, which S1 prefers when it runs on the same host. On it FETCH may
+   ask for "fd=1": files of FD_PASS_MIN bytes and up are then answered with
+   "OK <size> fd=1" and the open descriptor itself (SCM_RIGHTS), and S1
+   sends the data to its client straight from our file. */
+#ifndef ACCEPTORS
+#define ACCEPTORS 1
+#endif
+#ifndef ACCEPT_PIN
+#define ACCEPT_PIN 0
+#endif
+#define ACCEPT_MAX 64
+
+static int listen_on(int port, int reuseport){
+    int sd=socket(AF_INET,SOCK_STREAM,0); if(sd<0){ perror("socket"); return -1; }
     int opt=1; setsockopt(sd,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof(opt));
-    struct sockaddr_in a={0}; a.sin_family=AF_INET; a.sin_addr.s_addr=htonl(INADDR_ANY); a.sin_port=htons(S2_PORT);
-    if(bind(sd,(struct sockaddr*)&a,sizeof(a))<0){ perror("bind"); return 1; }
-    if(listen(sd,BACKLOG)<0){ perror("listen"); return 1; }
-    fprintf(stderr,"S2 listening on %d, root=%s\n", S2_PORT, ROOT);
+    if(reuseport && setsockopt(sd,SOL_SOCKET,SO_REUSEPORT,&opt,sizeof(opt))<0){ perror("SO_REUSEPORT"); close(sd); return -1; }
+    struct sockaddr_in a={0}; a.sin_family=AF_INET; a.sin_addr.s_addr=htonl(INADDR_ANY); a.sin_port=htons(port);
+    if(bind(sd,(struct sockaddr*)&a,sizeof(a))<0){ perror("bind"); close(sd); return -1; }
+    if(listen(sd,BACKLOG)<0){ perror("listen"); close(sd); return -1; }
+    return sd;
+}
+static int listen_unix(int port){
+    struct sockaddr_un a={0}; a.sun_family=AF_UNIX;
+    snprintf(a.sun_path,sizeof(a.sun_path),AUX_SOCK,port);
+    int sd=socket(AF_UNIX,SOCK_STREAM,0); if(sd<0){ perror("socket unix"); return -1; }
+    unlink(a.sun_path);                                  // left over from a previous run
+    if(bind(sd,(struct sockaddr*)&a,sizeof(a))<0 || chmod(a.sun_path,0600)<0 || listen(sd,BACKLOG)<0){
+        perror(a.sun_path); close(sd); return -1;
+    }
+    return sd;
+}
+// Open the listening sockets; returns how many (all on 'port').
+static int listen_all(int port, int *sds){
+    int n = ACCEPTORS>0 ? ACCEPTORS : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(n<1) n=1;
+    if(n>ACCEPT_MAX) n=ACCEPT_MAX;
+    for(int i=0;i<n;i++){
+        if((sds[i]=listen_on(port, n>1))<0){ while(i-->0) close(sds[i]); return -1; }
+    }
+    return n;
+}
+// Fork acceptors 1..n-1, each keeping only its own socket; returns the
+// index of the calling acceptor (0 in the original process).
+static int spawn_acceptors(int *sds, int n){
+    int me=0;
+    for(int i=1;i<n && me==0;i++){
+        pid_t pid=fork();
+        if(pid==0) me=i;
+        else if(pid<0) perror("fork acceptor");
+    }
+    for(int i=0;i<n;i++) if(i!=me) close(sds[i]);
+    if(ACCEPT_PIN){
+        long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set; CPU_ZERO(&set); CPU_SET(me % (ncpu>0 ? ncpu : 1), &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    return me;
+}
+
+int main(void){
+    int sds[ACCEPT_MAX];
+    int nacc=listen_all(S2_PORT,sds); if(nacc<0) return 1;
+    fprintf(stderr,"S2 listening on %d (%d acceptor%s), root=%s\n", S2_PORT, nacc, nacc>1?"s":"", ROOT);
+    if(PACKSTORE && pack_init(ROOT)<0){ perror("pack"); return 1; }
+    jnl_init(ROOT);
+    meta_init(ROOT);
+    dc_init(ROOT);
+    redir_init();
+    if(TRACE) tr_open_file();   // sessions inherit it; names this server's track
+    rq_init();
+    int me=spawn_acceptors(sds,nacc), sd=sds[me];
+    int usd = (AUX_UNIX && me==0) ? listen_unix(S2_PORT) : -1;
+    if(usd>=0){                                          // its own acceptor process
+        pid_t pid=fork();
+        if(pid==0){ close(sd); sd=usd; }
+        else{ if(pid<0) perror("fork acceptor"); close(usd); }
+    }
+    time_t last_compact=0;
     while(1){
         int csd=accept(sd,NULL,NULL);
         if(csd<0){ if(errno==EINTR) continue; perror("accept"); break; }
+        int one=1; setsockopt(csd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));   // replies are batched already
+        if(PACKSTORE && time(NULL)-last_compact>=60 && pack_need_compact()){
+            last_compact=time(NULL);
+            if(fork()==0){ close(sd); close(csd); pack_compact(); _exit(0); }
+        }
         pid_t pid=fork();
         if(pid==0){ close(sd); handle_client(csd); _exit(0); }
         close(csd);
@@ -0,0 +1,411 @@
+// s25bench.c — micro-benchmarks against a running S1 (and S2/S3/S4).
+// Build: gcc s25bench.c -o s25bench
+// Usage:
+//   s25bench comp <reps> downlf <~S1/path/file>
+//   s25bench comp <reps> dispfnames <~S1/path>
+//   s25bench comp <reps> downltar .c|.pdf|.txt
+//   s25bench io <reps> downlf <~S1/path/file>
+//   s25bench io <reps> uploadf <localfile>
+//   s25bench conn <seconds> <parallel> [port]
+//   s25bench alloc <reps> downlf|dispfnames|downltar|uploadf <arg>
+//   s25bench ec <MB> [k m]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define S1_PORT 6201
+#define BUFSZ   65536
+
+static void usage(void){
+    fprintf(stderr,
+        "Usage:\n"
+        "  s25bench comp <reps> downlf <~S1/path/file>\n"
+        "  s25bench comp <reps> dispfnames <~S1/path>\n"
+        "  s25bench comp <reps> downltar .c|.pdf|.txt\n"
+        "  s25bench io <reps> downlf <~S1/path/file>\n"
+        "  s25bench io <reps> uploadf <localfile>\n"
+        "  s25bench conn <seconds> <parallel> [port]\n"
+        "  s25bench alloc <reps> downlf|dispfnames|downltar|uploadf <arg>\n"
+        "  s25bench ec <MB> [k m]\n");
+}
+static double now_ms(void){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec*1e3 + (double)ts.tv_nsec/1e6;
+}
+static int connect_port(int port){
+    int sd=socket(AF_INET,SOCK_STREAM,0); if(sd<0) return -1;
+    struct sockaddr_in a={0}; a.sin_family=AF_INET; a.sin_port=htons(port); a.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    if(connect(sd,(struct sockaddr*)&a,sizeof(a))<0){ close(sd); return -1; }
+    return sd;
+}
+static int connect_s1(void){ return connect_port(S1_PORT); }
+static ssize_t read_line(int fd, char *buf, size_t len){
+    size_t i=0;
+    while(i+1<len){
+        char c; ssize_t r=read(fd,&c,1);
+        if(r<0){ if(errno==EINTR) continue; return -1; }
+        if(r==0) break;
+        buf[i++]=c;
+        if(c=='\n') break;
+    }
+    buf[i]='\0';
+    return (ssize_t)i;
+}
+static int skip_n(int fd, long long n){
+    static char buf[BUFSZ];
+    while(n>0){
+        ssize_t r=read(fd,buf,(size_t)(n>BUFSZ?BUFSZ:n));
+        if(r<0 && errno==EINTR) continue;
+        if(r<=0) return -1;
+        n-=r;
+    }
+    return 0;
+}
+
+/* ---------- wire accounting ---------- */
+static long long g_raw, g_wire;
+
+// Payload after a header line: framed when the header has " z=", else 'size' raw bytes.
+static int drain(int sd, const char *hdr, long long size){
+    g_wire += (long long)strlen(hdr);
+    if(!strstr(hdr," z=")){
+        if(skip_n(sd,size)<0) return -1;
+        g_raw += size; g_wire += size;
+        return 0;
+    }
+    for(;;){
+        unsigned char h[8];
+        size_t got=0;
+        while(got<8){ ssize_t r=read(sd,h+got,8-got); if(r<=0) return -1; got+=(size_t)r; }
+        uint32_t raw=((uint32_t)h[0]<<24)|((uint32_t)h[1]<<16)|((uint32_t)h[2]<<8)|h[3];
+        uint32_t wire=((uint32_t)h[4]<<24)|((uint32_t)h[5]<<16)|((uint32_t)h[6]<<8)|h[7];
+        g_wire += 8;
+        if(raw==0) return wire ? -1 : 0;   // wire!=0: the sender's error frame
+        if(skip_n(sd,wire)<0) return -1;
+        g_raw += raw; g_wire += wire;
+    }
+}
+static int run_op(int sd, const char *op, const char *arg){
+    char hdr[512];
+    if(!strcmp(op,"downlf")){
+        dprintf(sd,"DOWNLF 1\nPATH %s\n",arg);
+        if(read_line(sd,hdr,sizeof(hdr))<=0 || strncmp(hdr,"FILE ",5)) return -1;
+        char name[256]; long long size=0;
+        if(sscanf(hdr+5,"%255s %lld",name,&size)!=2) return -1;
+        return drain(sd,hdr,size);
+    }
+    if(!strcmp(op,"downltar")){
+        dprintf(sd,"DOWNLTAR %s\n",arg);
+        if(read_line(sd,hdr,sizeof(hdr))<=0 || strncmp(hdr,"TAR ",4)) return -1;
+        char name[256]; long long size=0;
+        if(sscanf(hdr+4,"%255s %lld",name,&size)!=2) return -1;
+        return drain(sd,hdr,size);
+    }
+    if(!strcmp(op,"dispfnames")){
+        dprintf(sd,"DISPFNAMES %s\n",arg);
+        if(read_line(sd,hdr,sizeof(hdr))<=0 || strncmp(hdr,"NAMES ",6)) return -1;
+        int count=0; sscanf(hdr+6,"%d",&count);
+        if(strstr(hdr," z=")) return drain(sd,hdr,0);
+        g_wire += (long long)strlen(hdr);
+        for(int i=0;i<count;i++){
+            char ln[512]; ssize_t n=read_line(sd,ln,sizeof(ln));
+            if(n<=0) return -1;
+            g_raw += n; g_wire += n;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/* ---------- comp: bytes saved vs codec CPU per codec ---------- */
+static int bench_comp(int reps, const char *op, const char *arg){
+    static const char *codecs[] = { "none", "lz4", "zstd" };
+    printf("%-6s %6s %12s %12s %7s %9s %14s\n","codec","ops","raw_bytes","wire_bytes","saved","wall_ms","s1_codec_cpu_ms");
+    for(int c=0;c<3;c++){
+        int sd=connect_s1(); if(sd<0){ perror("connect"); return 1; }
+        char resp[256];
+        if(c>0){
+            dprintf(sd,"COMP %s\n",codecs[c]);
+            if(read_line(sd,resp,sizeof(resp))<=0) return 1;
+            resp[strcspn(resp,"\r\n")]=0;
+            if(strcmp(resp+3,codecs[c])!=0){ printf("%-6s (not supported by S1)\n",codecs[c]); close(sd); continue; }
+        }
+        g_raw=g_wire=0;
+        double t0=now_ms();
+        int ok=0;
+        for(int i=0;i<reps;i++) if(run_op(sd,op,arg)==0) ok++; else break;
+        double t1=now_ms();
+        long long cpu_us=0;
+        dprintf(sd,"STATS\n");
+        if(read_line(sd,resp,sizeof(resp))>0){ char *p=strstr(resp,"cpu_us="); if(p) cpu_us=atoll(p+7); }
+        dprintf(sd,"QUIT\n"); close(sd);
+        printf("%-6s %6d %12lld %12lld %6.1f%% %9.1f %14.2f\n", codecs[c], ok, g_raw, g_wire,
+               g_raw ? 100.0*(double)(g_raw-g_wire)/(double)g_raw : 0.0, t1-t0, (double)cpu_us/1000.0);
+    }
+    return 0;
+}
+
+/* ---------- io: S1 copy engine, read/write loop vs io_uring vs sendfile ---------- */
+static int upload_one(int sd, const char *path){
+    int fd=open(path,O_RDONLY); if(fd<0) return -1;
+    struct stat st; fstat(fd,&st);
+    const char *base=strrchr(path,'/'); base = base ? base+1 : path;
+    dprintf(sd,"UPLOAD 1 ~S1/s25bench\nNAME %s\nSIZE %lld\n",base,(long long)st.st_size);
+    static char buf[BUFSZ]; ssize_t r;
+    while((r=read(fd,buf,sizeof(buf)))>0){
+        for(ssize_t w=0;w<r;){ ssize_t k=write(sd,buf+w,(size_t)(r-w)); if(k<=0){ close(fd); return -1; } w+=k; }
+        g_raw += r; g_wire += r;
+    }
+    close(fd);
+    char resp[256];
+    return (read_line(sd,resp,sizeof(resp))>0 && !strncmp(resp,"OK",2)) ? 0 : -1;
+}
+static int bench_io(int reps, const char *op, const char *arg){
+    static const char *modes[] = { "rw", "uring", "sendfile" };
+    printf("%-6s %6s %12s %9s %9s %12s %12s\n","engine","ops","bytes","wall_ms","MB/s","calls/GB","s1_cpu_ms/GB");
+    for(int m=0;m<3;m++){
+        int sd=connect_s1(); if(sd<0){ perror("connect"); return 1; }
+        char resp[512];
+        dprintf(sd,"IO %s\n",modes[m]);
+        if(read_line(sd,resp,sizeof(resp))<=0 || strncmp(resp,"OK",2)){ printf("%-6s (not available)\n",modes[m]); close(sd); continue; }
+        g_raw=g_wire=0;
+        double t0=now_ms();
+        int ok=0;
+        for(int i=0;i<reps;i++){
+            int rc = !strcmp(op,"uploadf") ? upload_one(sd,arg) : run_op(sd,op,arg);
+            if(rc==0) ok++; else break;
+        }
+        double t1=now_ms();
+        long long calls=0, iob=0, cpu=0;
+        dprintf(sd,"STATS\n");
+        if(read_line(sd,resp,sizeof(resp))>0){
+            char *p;
+            if((p=strstr(resp,"io_calls="))) calls=atoll(p+9);
+            if((p=strstr(resp,"io_bytes="))) iob=atoll(p+9);
+            if((p=strstr(resp,"proc_cpu_us="))) cpu=atoll(p+12);
+        }
+        dprintf(sd,"QUIT\n"); close(sd);
+        double gb = iob ? (double)iob/1e9 : 1.0;
+        printf("%-6s %6d %12lld %9.1f %9.1f %12.0f %12.1f\n", modes[m], ok, g_raw, t1-t0,
+               t1>t0 ? (double)g_raw/1e6/((t1-t0)/1e3) : 0.0, (double)calls/gb, (double)cpu/1000.0/gb);
+    }
+    return 0;
+}
+
+/* ---------- alloc: what one request allocates in S1 (heap, arena, I/O buffers) and how many writes it takes ---------- */
+#define NALLOC 6
+static const char *alloc_keys[NALLOC] = { "heap_allocs=", "arena_allocs=", "arena_bytes=", "iob_gets=", "iob_new=", "write_calls=" };
+static int alloc_stats(int sd, long long *v){
+    char resp[1024];
+    dprintf(sd,"STATS\n");
+    if(read_line(sd,resp,sizeof(resp))<=0 || strncmp(resp,"STATS ",6)) return -1;
+    for(int i=0;i<NALLOC;i++){ char *p=strstr(resp,alloc_keys[i]); v[i] = p ? atoll(p+strlen(alloc_keys[i])) : 0; }
+    return strstr(resp,alloc_keys[0]) ? 0 : -1;
+}
+static int bench_alloc(int reps, const char *op, const char *arg){
+    int sd=connect_s1(); if(sd<0){ perror("connect"); return 1; }
+    long long a[NALLOC], b[NALLOC], c[NALLOC];
+    int rc = !strcmp(op,"uploadf") ? upload_one(sd,arg) : run_op(sd,op,arg);     // warm-up: pools, cache
+    if(rc!=0 || alloc_stats(sd,a)!=0 || alloc_stats(sd,b)!=0){ fprintf(stderr,"S1 does not report allocations\n"); close(sd); return 1; }
+    double t0=now_ms();
+    int ok=0;
+    for(int i=0;i<reps;i++){
+        rc = !strcmp(op,"uploadf") ? upload_one(sd,arg) : run_op(sd,op,arg);
+        if(rc==0) ok++; else break;
+    }
+    double t1=now_ms();
+    if(alloc_stats(sd,c)!=0){ close(sd); return 1; }
+    dprintf(sd,"QUIT\n"); close(sd);
+    // b-a is what one STATS costs itself
+    printf("%-10s %6s %10s %10s %12s %10s %8s %9s %9s\n","op","ops","heap/op","arena/op","arena_B/op","iob/op","iob_new","writes/op","us/op");
+    double n = ok ? ok : 1;
+    printf("%-10s %6d %10.2f %10.2f %12.0f %10.2f %8lld %9.2f %9.1f\n", op, ok,
+           (double)(c[0]-b[0]-(b[0]-a[0]))/n, (double)(c[1]-b[1]-(b[1]-a[1]))/n, (double)(c[2]-b[2]-(b[2]-a[2]))/n,
+           (double)(c[3]-b[3]-(b[3]-a[3]))/n, c[4]-b[4], (double)(c[5]-b[5]-(b[5]-a[5]))/n, (t1-t0)*1e3/n);
+    return 0;
+}
+
+/* ---------- conn: connection setup rate (connect, QUIT, wait for close) ---------- */
+struct conn_res { long long ok, fail; double sum_ms, max_ms; };
+static int bench_conn(double secs, int par, int port){
+    if(par<1) par=1;
+    int p[2]; if(pipe(p)<0){ perror("pipe"); return 1; }
+    double t0=now_ms(), end=t0+secs*1e3;
+    for(int w=0;w<par;w++){
+        if(fork()!=0) continue;
+        close(p[0]);
+        struct conn_res r={0};
+        while(now_ms()<end){
+            double a=now_ms();
+            int sd=connect_port(port);
+            if(sd<0){ r.fail++; continue; }
+            char c;
+            if(write(sd,"QUIT\n",5)!=5 || read(sd,&c,1)!=0){ r.fail++; close(sd); continue; }
+            close(sd);
+            double d=now_ms()-a;
+            r.ok++; r.sum_ms+=d; if(d>r.max_ms) r.max_ms=d;
+        }
+        if(write(p[1],&r,sizeof(r))!=(ssize_t)sizeof(r)) _exit(1);
+        _exit(0);
+    }
+    close(p[1]);
+    struct conn_res t={0}, r;
+    while(read(p[0],&r,sizeof(r))==(ssize_t)sizeof(r)){
+        t.ok+=r.ok; t.fail+=r.fail; t.sum_ms+=r.sum_ms; if(r.max_ms>t.max_ms) t.max_ms=r.max_ms;
+    }
+    close(p[0]);
+    while(wait(NULL)>0);
+    double el=(now_ms()-t0)/1e3;
+    printf("%-6s %8s %8s %10s %9s %9s\n","port","conns","fail","conns/s","avg_ms","max_ms");
+    printf("%-6d %8lld %8lld %10.0f %9.3f %9.3f\n", port, t.ok, t.fail, el>0 ? (double)t.ok/el : 0.0,
+           t.ok ? t.sum_ms/(double)t.ok : 0.0, t.max_ms);
+    return 0;
+}
+
+/* ---------- ec: GF(2^8) Reed-Solomon kernels (S1's erasure coding, run in-process) ---------- */
+#define EC_MAXK 32
+static uint8_t gf_exp[512], gf_log[256], gf_tab[256][256];
+
+static uint8_t gf_inv(uint8_t a){ return gf_exp[255-gf_log[a]]; }
+static void gf_madd_table(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n){
+    const uint8_t *t = gf_tab[c];
+    for(size_t i=0;i<n;i++) dst[i] ^= t[src[i]];
+}
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+static void gf_madd_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n){
+    uint8_t lo[16], hi[16];
+    for(int i=0;i<16;i++){ lo[i] = gf_tab[c][i]; hi[i] = gf_tab[c][i<<4]; }
+    __m128i tl = _mm_loadu_si128((const __m128i*)lo), th = _mm_loadu_si128((const __m128i*)hi), mk = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for(; i+16<=n; i+=16){
+        __m128i s = _mm_loadu_si128((const __m128i*)(src+i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tl, _mm_and_si128(s, mk)),
+                                  _mm_shuffle_epi8(th, _mm_and_si128(_mm_srli_epi64(s, 4), mk)));
+        _mm_storeu_si128((__m128i*)(dst+i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(dst+i)), p));
+    }
+    gf_madd_table(dst+i, src+i, c, n-i);
+}
+__attribute__((target("avx2")))
+static void gf_madd_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n){
+    uint8_t lo[16], hi[16];
+    for(int i=0;i<16;i++){ lo[i] = gf_tab[c][i]; hi[i] = gf_tab[c][i<<4]; }
+    __m256i tl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lo));
+    __m256i th = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)hi));
+    __m256i mk = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for(; i+32<=n; i+=32){
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src+i));
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(tl, _mm256_and_si256(s, mk)),
+                                     _mm256_shuffle_epi8(th, _mm256_and_si256(_mm256_srli_epi64(s, 4), mk)));
+        _mm256_storeu_si256((__m256i*)(dst+i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(dst+i)), p));
+    }
+    gf_madd_table(dst+i, src+i, c, n-i);
+}
+#endif
+static void gf_init(void){
+    int x = 1;
+    for(int i=0;i<255;i++){
+        gf_exp[i] = gf_exp[i+255] = (uint8_t)x; gf_log[x] = (uint8_t)i;
+        x <<= 1; if(x & 0x100) x ^= 0x11d;
+    }
+    for(int a=1;a<256;a++) for(int b=1;b<256;b++) gf_tab[a][b] = gf_exp[gf_log[a]+gf_log[b]];
+}
+static uint8_t ec_coef(int k, int row, int col){ return row < k ? row == col : gf_inv((uint8_t)(row ^ col)); }
+static int gf_invert(int k, uint8_t a[EC_MAXK][EC_MAXK], uint8_t inv[EC_MAXK][EC_MAXK]){
+    for(int r=0;r<k;r++) for(int c=0;c<k;c++) inv[r][c] = r==c;
+    for(int c=0;c<k;c++){
+        int p = c; while(p<k && !a[p][c]) p++;
+        if(p==k) return -1;
+        for(int j=0;j<k;j++){
+            uint8_t t = a[c][j]; a[c][j] = a[p][j]; a[p][j] = t;
+            t = inv[c][j]; inv[c][j] = inv[p][j]; inv[p][j] = t;
+        }
+        uint8_t s = gf_inv(a[c][c]);
+        for(int j=0;j<k;j++){ a[c][j] = gf_tab[s][a[c][j]]; inv[c][j] = gf_tab[s][inv[c][j]]; }
+        for(int r=0;r<k;r++){
+            uint8_t f = a[r][c];
+            if(r==c || !f) continue;
+            for(int j=0;j<k;j++){ a[r][j] ^= gf_tab[f][a[c][j]]; inv[r][j] ^= gf_tab[f][inv[c][j]]; }
+        }
+    }
+    return 0;
+}
+// Encode k data chunks of len bytes into m parity chunks, then lose the first
+// m data chunks and rebuild them from the rest; per kernel, MB/s of data.
+static int bench_ec(int mb, int k, int m){
+    if(mb<1 || k<1 || m<1 || k+m>EC_MAXK || m>k || k+m>255){ usage(); return 2; }
+    gf_init();
+    struct { const char *name; void (*f)(uint8_t *, const uint8_t *, uint8_t, size_t); int ok; } kern[] = {
+        { "table", gf_madd_table, 1 },
+#if defined(__x86_64__) || defined(__i386__)
+        { "ssse3", gf_madd_ssse3, __builtin_cpu_supports("ssse3") },
+        { "avx2",  gf_madd_avx2,  __builtin_cpu_supports("avx2") },
+#endif
+    };
+    size_t len = (((size_t)mb<<20) / (size_t)k + 63) & ~(size_t)63;
+    uint8_t *ch[EC_MAXK], *rb[EC_MAXK];
+    for(int i=0;i<k+m;i++) if(posix_memalign((void**)&ch[i], 64, len)){ perror("alloc"); return 1; }
+    for(int i=0;i<m;i++) if(posix_memalign((void**)&rb[i], 64, len)){ perror("alloc"); return 1; }
+    unsigned s = 12345;
+    for(int i=0;i<k;i++) for(size_t j=0;j<len;j++){ s = s*1103515245u + 12345u; ch[i][j] = (uint8_t)(s>>16); }
+    for(int i=k;i<k+m;i++) memset(ch[i], 0, len);   // fault the pages in before timing
+    for(int i=0;i<m;i++) memset(rb[i], 0, len);
+
+    // decode matrix: chunks m..k+m-1 survive
+    uint8_t a[EC_MAXK][EC_MAXK], inv[EC_MAXK][EC_MAXK];
+    for(int r=0;r<k;r++) for(int c=0;c<k;c++) a[r][c] = ec_coef(k, m+r, c);
+    if(gf_invert(k, a, inv)!=0){ fprintf(stderr,"singular decode matrix\n"); return 1; }
+
+    printf("%-6s %4s %4s %10s %12s %12s %7s\n","kernel","k","m","MB","encode_MB/s","decode_MB/s","check");
+    for(size_t x=0;x<sizeof(kern)/sizeof(kern[0]);x++){
+        if(!kern[x].ok) continue;
+        double t0 = now_ms();
+        for(int i=k;i<k+m;i++){
+            memset(ch[i], 0, len);
+            for(int j=0;j<k;j++) kern[x].f(ch[i], ch[j], ec_coef(k, i, j), len);
+        }
+        double t1 = now_ms();
+        for(int j=0;j<m;j++){
+            memset(rb[j], 0, len);
+            for(int r=0;r<k;r++) kern[x].f(rb[j], ch[m+r], inv[j][r], len);
+        }
+        double t2 = now_ms();
+        int same = 1;
+        for(int j=0;j<m;j++) same &= !memcmp(rb[j], ch[j], len);
+        double mbytes = (double)k*len/1e6;
+        printf("%-6s %4d %4d %10.1f %12.0f %12.0f %7s\n", kern[x].name, k, m, mbytes,
+               t1>t0 ? mbytes/((t1-t0)/1e3) : 0.0, t2>t1 ? mbytes/((t2-t1)/1e3) : 0.0, same ? "ok" : "BAD");
+        if(!same) return 1;
+    }
+    for(int i=0;i<k+m;i++) free(ch[i]);
+    for(int i=0;i<m;i++) free(rb[i]);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    if(argc==5 && !strcmp(argv[1],"comp")) return bench_comp(atoi(argv[2]),argv[3],argv[4]);
+    if(argc==5 && !strcmp(argv[1],"io")) return bench_io(atoi(argv[2]),argv[3],argv[4]);
+    if(argc==5 && !strcmp(argv[1],"alloc")) return bench_alloc(atoi(argv[2]),argv[3],argv[4]);
+    if((argc==4 || argc==5) && !strcmp(argv[1],"conn"))
+        return bench_conn(atof(argv[2]), atoi(argv[3]), argc==5 ? atoi(argv[4]) : S1_PORT);
+    if((argc==3 || argc==5) && !strcmp(argv[1],"ec"))
+        return bench_ec(atoi(argv[2]), argc==5 ? atoi(argv[3]) : 2, argc==5 ? atoi(argv[4]) : 1);
+    usage();
+    return 2;
+}
@@ -2,10 +2,15 @@
 // s25client.c — matches your S1 protocol exactly.
 // Commands:
 //   uploadf <f1> [f2] [f3] <dest>
-//   downlf  <~S1/path/file1> [~S1/path/file2]
-//   removef <~S1/path/file1> [~S1/path/file2]
-//   downltar .c|.pdf|.txt
+//   downlf  <~S1/path/file1> [~S1/path/file2]   (revalidated against the local cache)
+//   removef <~S1/path/file>... | @<listfile> | <~S1/dir/>|all [.c,.pdf,...|all]
+//   copyf|movef <~S1/path/file> <~S1/path/[file]> | <~S1/dir/> <~S1/dir/>
+//   downltar <.c|.pdf|.txt|.zip>[,...]|all [gz|zst] [~S1/dir] [since=<token>]
+//   watch <~S1/dir> [-r] [.c,.pdf,...|all] [since=<token>] [max=<n>]
 //   quit
+// S25_DIRECT=1 asks S1 to send .pdf/.txt/.zip transfers straight to S2-S4.
+// S25_DEADLINE=<ms> gives every command a deadline (downltar also takes
+// deadline=<ms> as typed); S1 drops the connection when one passes.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,17 +23,24 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <stdint.h>
+#include <time.h>
 
 #define S1_PORT 6201
 #define BUFSZ   4096
+#ifndef CLIENT_COMP
+#define CLIENT_COMP 1   // 0 = never ask S1 for wire compression
+#endif
 
 static void usage(){
     fprintf(stderr,
         "Commands:\n"
         "  uploadf <f1> [f2] [f3] <dest>\n"
         "  downlf  <~S1/path/file1> [~S1/path/file2]\n"
-        "  removef <~S1/path/file1> [~S1/path/file2]\n"
-        "  downltar .c|.pdf|.txt\n"
+        "  removef <~S1/path/file>... | @<listfile> | <~S1/dir/>|all [.c,.pdf,...|all]\n"
+        "  copyf|movef <~S1/path/file> <~S1/path/[file]> | <~S1/dir/> <~S1/dir/>\n"
+        "  downltar <.c|.pdf|.txt|.zip>[,...]|all [gz|zst] [~S1/dir] [since=<token>]\n"
+        "  watch <~S1/dir> [-r] [.c,.pdf,...|all] [since=<token>] [max=<n>]\n"
         "  quit\n");
 }
 static off_t file_size(const char *p){ struct stat st; if(stat(p,&st)==0) return st.st_size; return -1; }
@@ -57,11 +69,341 @@ static ssize_t read_line(int fd, char *buf, size_t len){
     return (ssize_t)i;
 }
 
+/* ---------- wire compression ----------
+   COMP <codec,...> picks the first codec both ends support for the session.
+   A transfer whose header line carries "z=<codec>" is then sent as frames:
+   raw length and wire length (4 bytes each, big-endian) followed by the
+   payload; wire==raw means stored, raw==0 ends the stream. raw==0 with
+   wire==0xffffffff ends it with an error: the sender gave up and what came
+   before is incomplete. "lz4" is the
+   LZ4 block format (built-in coder, or liblz4 with -DHAVE_LZ4 -llz4);
+   "zstd" needs -DHAVE_ZSTD -lzstd. */
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#define ZCHUNK  (64*1024)
+#define ZBOUND  (ZCHUNK + ZCHUNK/255 + 64)
+enum { Z_NONE=0, Z_LZ4=1, Z_ZSTD=2, Z_RAW=3 };   // raw: framed, never compressed
+static const char *z_names[] = { "none", "lz4", "zstd", "raw" };
+static struct { long long raw, wire, cpu_ns; } zstat;   // this process
+
+static int z_parse(const char *name){
+    for(int i=0;i<4;i++) if(strcmp(name,z_names[i])==0) return i;
+    return -1;
+}
+static int z_supported(int c){
+#ifdef HAVE_ZSTD
+    if(c==Z_ZSTD) return 1;
+#endif
+    return c==Z_NONE || c==Z_LZ4 || c==Z_RAW;
+}
+// Already-compressed formats are sent as-is.
+static int z_skip_ext(const char *name){
+    static const char *exts[] = { ".zip",".pdf",".gz",".tgz",".zst",".xz",".bz2",".7z",".png",".jpg",".jpeg",NULL };
+    const char *dot=strrchr(name,'.');
+    if(!dot) return 0;
+    for(int i=0;exts[i];i++) if(strcasecmp(dot,exts[i])==0) return 1;
+    return 0;
+}
+// Value of a " key=value" token in a header line; returns 1 if present.
+static int opt_get(const char *line, const char *key, char *val, size_t vsz){
+    size_t kl=strlen(key);
+    for(const char *p=line; (p=strchr(p,' '))!=NULL; ){
+        p++;
+        if(strncmp(p,key,kl)==0 && p[kl]=='='){
+            p+=kl+1; size_t n=strcspn(p," \r\n");
+            if(n>=vsz) n=vsz-1;
+            memcpy(val,p,n); val[n]='\0';
+            return 1;
+        }
+    }
+    return 0;
+}
+static const char *z_opt(int c){ static const char *o[]={""," z=lz4"," z=zstd"," z=raw"}; return o[c]; }
+static long long z_now_ns(void){
+    struct timespec ts; clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&ts);
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+#ifndef HAVE_LZ4
+static uint32_t lz_read32(const unsigned char *p){ uint32_t v; memcpy(&v,p,4); return v; }
+static int lz_putlen(unsigned char *dst, int op, int cap, int len){
+    for(; len>=255; len-=255){ if(op>=cap) return -1; dst[op++]=255; }
+    if(op>=cap) return -1;
+    dst[op++]=(unsigned char)len;
+    return op;
+}
+static int lz_emit(unsigned char *dst, int op, int cap, const unsigned char *lit, int nlit, int off, int mlen){
+    if(op>=cap) return -1;
+    int tok=op++;
+    dst[tok] = (unsigned char)((nlit>=15 ? 15 : nlit) << 4);
+    if(nlit>=15 && (op=lz_putlen(dst,op,cap,nlit-15))<0) return -1;
+    if(op+nlit>cap) return -1;
+    memcpy(dst+op,lit,(size_t)nlit); op+=nlit;
+    if(!off) return op;                          // final literals-only sequence
+    if(op+2>cap) return -1;
+    dst[op++]=(unsigned char)(off&255); dst[op++]=(unsigned char)(off>>8);
+    int m=mlen-4;
+    dst[tok] |= (unsigned char)(m>=15 ? 15 : m);
+    if(m>=15 && (op=lz_putlen(dst,op,cap,m-15))<0) return -1;
+    return op;
+}
+#endif
+// Returns compressed length, or -1 if it does not fit in 'cap'.
+static int lz4_compress(const unsigned char *src, int n, unsigned char *dst, int cap){
+#ifdef HAVE_LZ4
+    int r=LZ4_compress_default((const char*)src,(char*)dst,n,cap);
+    return r>0 ? r : -1;
+#else
+    enum { HLOG=12 };
+    int tab[1<<HLOG]; memset(tab,-1,sizeof(tab));
+    int ip=0, anchor=0, op=0;
+    const int mflimit=n-12, matchlimit=n-5;     // LZ4 end-of-block rules
+    while(ip<mflimit){
+        uint32_t seq=lz_read32(src+ip);
+        uint32_t h=(seq*2654435761u)>>(32-HLOG);
+        int ref=tab[h]; tab[h]=ip;
+        if(ref<0 || ip-ref>65535 || lz_read32(src+ref)!=seq){ ip += 1 + ((ip-anchor)>>6); continue; }
+        while(ip>anchor && ref>0 && src[ip-1]==src[ref-1]){ ip--; ref--; }
+        int len=4; while(ip+len<matchlimit && src[ip+len]==src[ref+len]) len++;
+        if((op=lz_emit(dst,op,cap,src+anchor,ip-anchor,ip-ref,len))<0) return -1;
+        ip+=len; anchor=ip;
+    }
+    return lz_emit(dst,op,cap,src+anchor,n-anchor,0,0);
+#endif
+}
+// Returns decompressed length, or -1 on corrupt input.
+static int lz4_decompress(const unsigned char *src, int n, unsigned char *dst, int cap){
+#ifdef HAVE_LZ4
+    int r=LZ4_decompress_safe((const char*)src,(char*)dst,n,cap);
+    return r>=0 ? r : -1;
+#else
+    int ip=0, op=0;
+    while(ip<n){
+        int tok=src[ip++], lit=tok>>4, b;
+        if(lit==15) do{ if(ip>=n) return -1; b=src[ip++]; lit+=b; }while(b==255);
+        if(ip+lit>n || op+lit>cap) return -1;
+        memcpy(dst+op,src+ip,(size_t)lit); ip+=lit; op+=lit;
+        if(ip>=n) break;
+        if(ip+2>n) return -1;
+        int off=src[ip] | (src[ip+1]<<8); ip+=2;
+        if(off==0 || off>op) return -1;
+        int ml=(tok&15)+4;
+        if((tok&15)==15) do{ if(ip>=n) return -1; b=src[ip++]; ml+=b; }while(b==255);
+        if(op+ml>cap) return -1;
+        for(int i=0;i<ml;i++,op++) dst[op]=dst[op-off];   // may overlap
+    }
+    return op;
+#endif
+}
+static int z_compress(int codec, const char *src, int n, char *dst, int cap){
+    int r=-1; long long t0=z_now_ns();
+    if(codec==Z_LZ4) r=lz4_compress((const unsigned char*)src,n,(unsigned char*)dst,cap);
+#ifdef HAVE_ZSTD
+    else if(codec==Z_ZSTD){ size_t z=ZSTD_compress(dst,(size_t)cap,src,(size_t)n,1); r=ZSTD_isError(z)?-1:(int)z; }
+#endif
+    zstat.cpu_ns += z_now_ns()-t0;
+    return r;
+}
+static int z_decompress(int codec, const char *src, int n, char *dst, int cap){
+    int r=-1; long long t0=z_now_ns();
+    if(codec==Z_LZ4) r=lz4_decompress((const unsigned char*)src,n,(unsigned char*)dst,cap);
+#ifdef HAVE_ZSTD
+    else if(codec==Z_ZSTD){ size_t z=ZSTD_decompress(dst,(size_t)cap,src,(size_t)n); r=ZSTD_isError(z)?-1:(int)z; }
+#endif
+    zstat.cpu_ns += z_now_ns()-t0;
+    return r;
+}
+
+static void be32put(unsigned char *p, uint32_t v){ p[0]=(unsigned char)(v>>24); p[1]=(unsigned char)(v>>16); p[2]=(unsigned char)(v>>8); p[3]=(unsigned char)v; }
+static uint32_t be32get(const unsigned char *p){ return ((uint32_t)p[0]<<24)|((uint32_t)p[1]<<16)|((uint32_t)p[2]<<8)|p[3]; }
+
+// Frame writer; with Z_NONE it writes straight through.
+struct zw { int fd, codec; size_t n; char buf[ZCHUNK]; char out[8+ZBOUND]; };
+static void zw_init(struct zw *z, int fd, int codec){ z->fd=fd; z->codec=codec; z->n=0; }
+static int zw_frame(struct zw *z){
+    if(z->n==0) return 0;
+    int c = z_compress(z->codec, z->buf, (int)z->n, z->out+8, ZBOUND);
+    uint32_t wire = (c>0 && (size_t)c<z->n) ? (uint32_t)c : (uint32_t)z->n;
+    if(wire==z->n) memcpy(z->out+8, z->buf, z->n);
+    be32put((unsigned char*)z->out, (uint32_t)z->n); be32put((unsigned char*)z->out+4, wire);
+    zstat.raw += (long long)z->n; zstat.wire += 8+(long long)wire;
+    z->n=0;
+    return write_n(z->fd, z->out, 8+wire)==(ssize_t)(8+wire) ? 0 : -1;
+}
+static int zw_write(struct zw *z, const void *p, size_t n){
+    if(z->codec==Z_NONE) return write_n(z->fd,p,n)==(ssize_t)n ? 0 : -1;
+    const char *s=(const char*)p;
+    while(n>0){
+        size_t k = ZCHUNK - z->n; if(k>n) k=n;
+        memcpy(z->buf+z->n, s, k); z->n+=k; s+=k; n-=k;
+        if(z->n==ZCHUNK && zw_frame(z)<0) return -1;
+    }
+    return 0;
+}
+static int zw_end(struct zw *z){
+    if(z->codec==Z_NONE) return 0;
+    if(zw_frame(z)<0) return -1;
+    static const char endf[8];
+    zstat.wire += 8;
+    return write_n(z->fd, endf, 8)==8 ? 0 : -1;
+}
+
+// Frame reader; with Z_NONE it reads straight through (no read-ahead).
+struct zr { int fd, codec, eof; size_t off, len; char buf[ZCHUNK]; char in[ZBOUND]; };
+static void zr_init(struct zr *z, int fd, int codec){ z->fd=fd; z->codec=codec; z->eof=0; z->off=z->len=0; }
+static int read_full(int fd, void *buf, size_t n){
+    size_t off=0;
+    while(off<n){
+        ssize_t r=read(fd,(char*)buf+off,n-off);
+        if(r<0){ if(errno==EINTR) continue; return -1; }
+        if(r==0) return -1;
+        off+=(size_t)r;
+    }
+    return 0;
+}
+static int zr_fill(struct zr *z){
+    unsigned char h[8];
+    if(read_full(z->fd,h,8)<0) return -1;
+    uint32_t raw=be32get(h), wire=be32get(h+4);
+    if(raw==0){ if(wire) return -1; z->eof=1; zstat.wire+=8; return 0; }   // wire!=0: error frame
+    if(raw>ZCHUNK || wire>raw || read_full(z->fd,z->in,wire)<0) return -1;
+    if(wire==raw) memcpy(z->buf,z->in,raw);
+    else if(z_decompress(z->codec,z->in,(int)wire,z->buf,ZCHUNK)!=(int)raw) return -1;
+    zstat.raw += raw; zstat.wire += 8+(long long)wire;
+    z->off=0; z->len=raw;
+    return 0;
+}
+static ssize_t zr_read(struct zr *z, void *p, size_t n){
+    if(z->codec==Z_NONE){
+        for(;;){ ssize_t r=read(z->fd,p,n); if(r<0 && errno==EINTR) continue; return r; }
+    }
+    if(z->off==z->len){
+        if(z->eof) return 0;
+        if(zr_fill(z)<0) return -1;
+        if(z->eof) return 0;
+    }
+    size_t k = z->len - z->off; if(k>n) k=n;
+    memcpy(p, z->buf+z->off, k); z->off+=k;
+    return (ssize_t)k;
+}
+static ssize_t zr_line(struct zr *z, char *buf, size_t len){
+    if(z->codec==Z_NONE) return read_line(z->fd,buf,len);
+    size_t i=0;
+    while(i+1<len){
+        char c; ssize_t r=zr_read(z,&c,1);
+        if(r<0) return -1;
+        if(r==0) break;
+        buf[i++]=c;
+        if(c=='\n') break;
+    }
+    buf[i]='\0';
+    return (ssize_t)i;
+}
+// Consume the rest of a framed stream up to its end marker.
+static int zr_finish(struct zr *z){
+    char tmp[512];
+    if(z->codec==Z_NONE) return 0;
+    while(!z->eof){ ssize_t r=zr_read(z,tmp,sizeof(tmp)); if(r<0) return -1; if(r==0) break; }
+    return 0;
+}
+
+/* ---------- download cache ----------
+   Files fetched with downlf are kept in CLIENT_CACHE (the S25_CACHE
+   environment variable overrides it, empty turns the cache off) together
+   with the version tag S1 sent. Fetching the same path again sends
+   "if-none=<tag>"; when S1 answers "SAME" the cached copy is used and no
+   file data crosses the network. One flat entry per path ('/' -> '#'). */
+#ifndef CLIENT_CACHE
+#define CLIENT_CACHE ".s25cache"
+#endif
+static const char *cache_dir(void){ const char *d=getenv("S25_CACHE"); return d ? d : CLIENT_CACHE; }
+static int cache_path(char *out, size_t n, const char *path, const char *suffix){
+    const char *d=cache_dir();
+    if(!*d) return -1;
+    if(!strncmp(path,"~S1/",4)) path+=4;
+    size_t k=(size_t)snprintf(out,n,"%s/",d);
+    for(const char *p=path; *p && k+1<n; p++) out[k++] = *p=='/' ? '#' : *p;
+    out[k]='\0';
+    if(k+strlen(suffix)+1>n) return -1;
+    strcat(out,suffix);
+    return 0;
+}
+// Tag of the cached copy of 'path' (only if the copy itself is there).
+static int cache_tag(const char *path, char *tag, size_t n){
+    char tp[1200], dp[1200];
+    if(cache_path(tp,sizeof(tp),path,".tag")<0 || cache_path(dp,sizeof(dp),path,"")<0 || access(dp,R_OK)!=0) return -1;
+    int fd=open(tp,O_RDONLY); if(fd<0) return -1;
+    ssize_t r=read(fd,tag,n-1); close(fd);
+    if(r<=0) return -1;
+    tag[r]='\0'; tag[strcspn(tag,"\r\n")]='\0';
+    return *tag ? 0 : -1;
+}
+// Data first, then the tag, each renamed into place: a tag never describes
+// data that isn't there yet.
+static void cache_commit(const char *path, const char *part, const char *tag){
+    char dp[1200], tp[1200], tmp[1210];
+    if(cache_path(dp,sizeof(dp),path,"")<0 || cache_path(tp,sizeof(tp),path,".tag")<0) return;
+    snprintf(tmp,sizeof(tmp),"%s.tmp",tp);
+    int fd=open(tmp,O_CREAT|O_TRUNC|O_WRONLY,0644);
+    if(fd<0) return;
+    int ok = rename(part,dp)==0 && write_n(fd,tag,strlen(tag))==(ssize_t)strlen(tag);
+    close(fd);
+    if(ok) rename(tmp,tp); else unlink(tmp);
+}
+// Direct data path: S1 answered "REDIRECT <host> <port> <dest> <fname> exp=.. sig=..".
+static int direct = 0;
+static int dial(const char *host, int port){
+    int sd=socket(AF_INET,SOCK_STREAM,0); if(sd<0) return -1;
+    struct sockaddr_in a={0}; a.sin_family=AF_INET; a.sin_port=htons(port);
+    if(inet_pton(AF_INET,host,&a.sin_addr)!=1 || connect(sd,(struct sockaddr*)&a,sizeof(a))<0){ close(sd); return -1; }
+    return sd;
+}
+// Connect to the aux server a REDIRECT names and send it the granted request.
+static int redirect_open(const char *redir, const char *verb, long long size, const char *extra){
+    char host[64], dest[1024], fname[256], ev[24], sig[80]; int port=0;
+    if(sscanf(redir+9,"%63s %d %1023s %255s",host,&port,dest,fname)!=4 ||
+       !opt_get(redir,"exp",ev,sizeof(ev)) || !opt_get(redir,"sig",sig,sizeof(sig))) return -1;
+    int sd=dial(host,port); if(sd<0) return -1;
+    if(size>=0) dprintf(sd,"%s %s %s %lld exp=%s sig=%s%s\n",verb,dest,fname,size,ev,sig,extra);
+    else        dprintf(sd,"%s %s %s exp=%s sig=%s%s\n",verb,dest,fname,ev,sig,extra);
+    return sd;
+}
+
+static int copy_file(const char *from, const char *to){
+    int in=open(from,O_RDONLY); if(in<0) return -1;
+    int out=open(to,O_CREAT|O_TRUNC|O_WRONLY,0664); if(out<0){ close(in); return -1; }
+    char buf[BUFSZ]; ssize_t r; long long n=0;
+    while((r=read(in,buf,sizeof(buf)))>0){ if(write_n(out,buf,(size_t)r)!=r){ n=-1; break; } n+=r; }
+    close(in); close(out);
+    return (r<0 || n<0) ? -1 : 0;
+}
+
 int main(){
     int sd=socket(AF_INET,SOCK_STREAM,0); if(sd<0){ perror("socket"); return 1; }
     struct sockaddr_in a={0}; a.sin_family=AF_INET; a.sin_port=htons(S1_PORT); a.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
     if(connect(sd,(struct sockaddr*)&a,sizeof(a))<0){ perror("connect"); return 1; }
     fprintf(stderr,"Connected to S1:%d\n",S1_PORT);
+    { const char *d=getenv("S25_DIRECT"); direct = d && *d && strcmp(d,"0"); }
+    char dl[32]="";   // " deadline=<ms>" on each command line
+    { const char *d=getenv("S25_DEADLINE"); if(d && atol(d)>0) snprintf(dl,sizeof(dl)," deadline=%ld",atol(d)); }
+
+    int codec=Z_NONE;
+    if(CLIENT_COMP){
+#ifdef HAVE_ZSTD
+        dprintf(sd,"COMP zstd,lz4\n");
+#else
+        dprintf(sd,"COMP lz4\n");
+#endif
+        char resp[64];
+        if(read_line(sd,resp,sizeof(resp))>0 && !strncmp(resp,"OK ",3)){
+            resp[strcspn(resp,"\r\n")]=0;
+            int c=z_parse(resp+3); if(c>0 && z_supported(c)) codec=c;
+        }
+    }
 
     char line[2048];
     while(1){
@@ -85,92 +427,232 @@ int main(){
                 names[i]=base_name(paths[i]);
             }
 
-            dprintf(sd,"UPLOAD %d %s\n",nfiles,dest);
+            dprintf(sd,"UPLOAD %d %s%s\n",nfiles,dest,dl);
+            int direct_err=0;
             for(int i=0;i<nfiles;i++){
                 dprintf(sd,"NAME %s\n",names[i]);
-                dprintf(sd,"SIZE %lld\n",(long long)sizes[i]);
-                int fd=open(paths[i],O_RDONLY); if(fd<0){ perror("open"); goto next; }
+                int zc = z_skip_ext(names[i]) ? Z_NONE : codec;
+                dprintf(sd,"SIZE %lld%s%s\n",(long long)sizes[i],z_opt(zc),direct ? " direct=1" : "");
+                int out=sd;
+                if(direct){                          // S1 says SEND, or where to PUT it
+                    char r[1400]; if(read_line(sd,r,sizeof(r))<=0){ fprintf(stderr,"Disconnected\n"); goto next; }
+                    if(!strncmp(r,"REDIRECT ",9)){
+                        if((out=redirect_open(r,"PUT",(long long)sizes[i],""))<0){ fprintf(stderr,"Direct upload of %s failed\n",names[i]); goto next; }
+                        zc=Z_NONE;
+                    }else if(strncmp(r,"SEND",4)){ fprintf(stderr,"S1: %s",r); goto next; }
+                }
+                int fd=open(paths[i],O_RDONLY); if(fd<0){ perror("open"); if(out!=sd) close(out); goto next; }
+                struct zw zw; zw_init(&zw,out,zc);
                 char buf[BUFSZ]; off_t left=sizes[i];
                 while(left>0){
                     ssize_t r=read(fd,buf,(left>BUFSZ?BUFSZ:(size_t)left));
                     if(r<=0){ perror("read"); close(fd); goto next; }
-                    if(write_n(sd,buf,(size_t)r)!=r){ perror("write"); close(fd); goto next; }
+                    if(zw_write(&zw,buf,(size_t)r)!=0){ perror("write"); close(fd); if(out!=sd) close(out); goto next; }
                     left-=r;
                 }
                 close(fd);
+                if(zw_end(&zw)!=0){ perror("write"); if(out!=sd) close(out); goto next; }
+                if(out!=sd){
+                    char r[256]; if(read_line(out,r,sizeof(r))<=0 || strncmp(r,"OK",2)){ fprintf(stderr,"%s: %s",names[i],r); direct_err=1; }
+                    close(out);
+                }
             }
-            { char resp[256]; if(read_line(sd,resp,sizeof(resp))>0) fprintf(stderr,"S1: %s",resp); }
+            { char resp[256]; if(read_line(sd,resp,sizeof(resp))>0) fprintf(stderr,"S1: %s",direct_err && !strncmp(resp,"OK",2) ? "ERR direct\n" : resp); }
         }
 
         else if(!strncmp(line,"downlf ",7)){
             char *p1=strtok(line+7," "); char *p2=strtok(NULL," ");
             if(!p1){ usage(); continue; }
             int n=p2?2:1;
-            dprintf(sd,"DOWNLF %d\n",n);
-            dprintf(sd,"PATH %s\n",p1);
-            if(p2) dprintf(sd,"PATH %s\n",p2);
+            const char *paths[2]={p1,p2};
+            dprintf(sd,"DOWNLF %d%s\n",n,dl);
+            for(int i=0;i<n;i++){
+                char tag[64];
+                if(cache_tag(paths[i],tag,sizeof(tag))==0) dprintf(sd,"PATH %s if-none=%s%s\n",paths[i],tag,direct ? " direct=1" : "");
+                else dprintf(sd,"PATH %s%s\n",paths[i],direct ? " direct=1" : "");
+            }
 
             for(int i=0;i<n;i++){
-                char hdr[256]; if(read_line(sd,hdr,sizeof(hdr))<=0){ fprintf(stderr,"Disconnected\n"); break; }
-                if(strncmp(hdr,"FILE ",5)!=0){ fprintf(stderr,"%s",hdr); break; }
+                char hdr[1400]; if(read_line(sd,hdr,sizeof(hdr))<=0){ fprintf(stderr,"Disconnected\n"); break; }
+                int in=sd;
+                if(strncmp(hdr,"REDIRECT ",9)==0){    // fetch it from the aux server; its OK/SAME become FILE/SAME
+                    char name[256], tag[64], extra[80]="", ah[256];
+                    if(sscanf(hdr+9,"%*s %*d %*s %255s",name)!=1){ fprintf(stderr,"Bad redirect\n"); continue; }
+                    if(cache_tag(paths[i],tag,sizeof(tag))==0) snprintf(extra,sizeof(extra)," if-none=%s",tag);
+                    if((in=redirect_open(hdr,"GET",-1,extra))<0 || read_line(in,ah,sizeof(ah))<=0){ fprintf(stderr,"Direct download of %s failed\n",name); if(in>=0) close(in); continue; }
+                    if(!strncmp(ah,"OK ",3)) snprintf(hdr,sizeof(hdr),"FILE %s %s",name,ah+3);
+                    else if(!strncmp(ah,"SAME ",5)) snprintf(hdr,sizeof(hdr),"SAME %s %s",name,ah+5);
+                    else snprintf(hdr,sizeof(hdr),"%s",ah);
+                }
+                if(strncmp(hdr,"SAME ",5)==0){
+                    if(in!=sd) close(in);
+                    char name[256], dp[1200];
+                    if(sscanf(hdr+5,"%255s",name)!=1 || cache_path(dp,sizeof(dp),paths[i],"")<0 || copy_file(dp,name)!=0){ fprintf(stderr,"Cache copy failed\n"); break; }
+                    fprintf(stderr,"Up to date %s (from cache)\n",name);
+                    continue;
+                }
+                if(strncmp(hdr,"FILE ",5)!=0){ fprintf(stderr,"%s",hdr); if(in!=sd){ close(in); continue; } break; }
                 char name[256]; long long size=0; if(sscanf(hdr+5,"%255s %lld",name,&size)!=2 || size<0){ fprintf(stderr,"Bad header\n"); break; }
-                int fd=open(name,O_CREAT|O_TRUNC|O_WRONLY,0664); if(fd<0){ perror("open"); break; }
+                char zv[16]; int zc=opt_get(hdr,"z",zv,sizeof(zv)) ? z_parse(zv) : Z_NONE;
+                if(zc<0 || !z_supported(zc)){ fprintf(stderr,"Bad header\n"); break; }
+                int fd=open(name,O_CREAT|O_TRUNC|O_WRONLY,0664); if(fd<0){ perror("open"); if(in!=sd) close(in); break; }
+                // tee into the cache when S1 tagged the file
+                char tag[64], part[1210]="", dp[1200]; int cfd=-1;
+                if(opt_get(hdr,"tag",tag,sizeof(tag)) && cache_path(dp,sizeof(dp),paths[i],"")==0){
+                    mkdir(cache_dir(),0755);
+                    snprintf(part,sizeof(part),"%s.part",dp);
+                    cfd=open(part,O_CREAT|O_TRUNC|O_WRONLY,0644);
+                }
+                struct zr zr; zr_init(&zr,in,zc);
                 char buf[BUFSZ]; long long left=size;
                 while(left>0){
-                    ssize_t r=read(sd,buf,(left>BUFSZ?BUFSZ:(size_t)left)); if(r<=0){ fprintf(stderr,"Stream ended early\n"); break; }
+                    ssize_t r=zr_read(&zr,buf,(left>BUFSZ?BUFSZ:(size_t)left)); if(r<=0){ fprintf(stderr,"Stream ended early\n"); break; }
                     if(write_n(fd,buf,(size_t)r)!=r){ perror("write"); break; }
+                    if(cfd>=0 && write_n(cfd,buf,(size_t)r)!=r){ close(cfd); cfd=-1; unlink(part); }
                     left-=r;
                 }
+                zr_finish(&zr);
                 close(fd);
+                if(in!=sd) close(in);
+                if(cfd>=0){ close(cfd); if(left==0) cache_commit(paths[i],part,tag); else unlink(part); }
                 fprintf(stderr,"Downloaded %s (%lld bytes)\n",name,size);
             }
         }
 
         else if(!strncmp(line,"removef ",8)){
-            char *p1=strtok(line+8," "); char *p2=strtok(NULL," "); if(!p1){ usage(); continue; }
-            int n=p2?2:1;
-            dprintf(sd,"REMOVEF %d\n",n);
-            dprintf(sd,"PATH %s\n",p1);
-            if(p2) dprintf(sd,"PATH %s\n",p2);
-            for(int i=0;i<n;i++){ char resp[256]; if(read_line(sd,resp,sizeof(resp))>0) fprintf(stderr,"%s",resp); }
+            char *a1=strtok(line+8," "), *a2=strtok(NULL," "); if(!a1){ usage(); continue; }
+            size_t l1=strlen(a1);
+            if(a1[l1-1]=='/' || !strcmp(a1,"all")){   // a directory ("all": the whole tree): everything (of those types) under it
+                dprintf(sd,"REMOVEF %s%s%s%s\n",a1,a2?" ":"",a2?a2:"",dl);
+                char resp[1400];
+                while(read_line(sd,resp,sizeof(resp))>0){
+                    if(!strncmp(resp,"DONE ",5)){ int d=0,e=0; sscanf(resp+5,"%d %d",&d,&e); fprintf(stderr,"Removed %d file(s), %d error(s)\n",d,e); break; }
+                    if(!strncmp(resp,"OK ",3)){ fputs(resp+3,stdout); continue; }
+                    fprintf(stderr,"%s",resp);
+                    if(strncmp(resp,"ERR .",5)) break;   // "ERR .<ext>": one server failed, the rest goes on
+                }
+                continue;
+            }
+            // paths as arguments, or one per line in @listfile; sent in a single request
+            char *body=NULL; size_t bsz=0; int n=0;
+            FILE *m=open_memstream(&body,&bsz); if(!m){ perror("memstream"); continue; }
+            if(a1[0]=='@'){
+                FILE *lf=fopen(a1+1,"r"); if(!lf){ perror(a1+1); fclose(m); free(body); continue; }
+                char pl[1200];
+                while(fgets(pl,sizeof(pl),lf)){ pl[strcspn(pl,"\r\n")]=0; if(*pl){ fprintf(m,"PATH %s\n",pl); n++; } }
+                fclose(lf);
+            }else{
+                for(char *a=a1; a; a=(a==a1 ? a2 : strtok(NULL," "))){ fprintf(m,"PATH %s\n",a); n++; }
+            }
+            fclose(m);
+            if(n>0){
+                dprintf(sd,"REMOVEF %d%s\n",n,dl);
+                write_n(sd,body,bsz);
+                for(int i=0;i<n;i++){ char resp[320]; if(read_line(sd,resp,sizeof(resp))<=0) break; fprintf(stderr,"%s",resp); }
+            }
+            free(body);
+        }
+
+        else if(!strncmp(line,"copyf ",6) || !strncmp(line,"movef ",6)){
+            // done by the servers: no file data comes through here
+            char *a1=strtok(line+6," "), *a2=strtok(NULL," "); if(!a1 || !a2){ usage(); continue; }
+            const char *cmd = line[0]=='m' ? "MOVE" : "COPY";
+            dprintf(sd,"%s %s %s%s\n",cmd,a1,a2,dl);
+            char resp[1400];
+            if(a1[strlen(a1)-1]!='/'){ if(read_line(sd,resp,sizeof(resp))>0) fprintf(stderr,"S1: %s",resp); continue; }
+            while(read_line(sd,resp,sizeof(resp))>0){
+                if(!strncmp(resp,"DONE ",5)){ int d=0,e=0; sscanf(resp+5,"%d %d",&d,&e); fprintf(stderr,"%s %d file(s), %d error(s)\n",line[0]=='m' ? "Moved" : "Copied",d,e); break; }
+                if(!strncmp(resp,"OK ",3)){ fputs(resp+3,stdout); continue; }
+                fprintf(stderr,"%s",resp);
+                if(strncmp(resp,"ERR .",5)) break;
+            }
+        }
+
+        else if(!strncmp(line,"watch ",6)){
+            // change events instead of polling dispfnames; max=<n> stops after n of them
+            char req[1200]="", *dir=NULL; long max=-1; int bad=0;
+            for(char *t=strtok(line+6," "); t; t=strtok(NULL," ")){
+                size_t rl=strlen(req);
+                if(!strcmp(t,"-r")) snprintf(req+rl,sizeof(req)-rl," r=1");
+                else if(!strncmp(t,"max=",4)) max=atol(t+4);
+                else if(!strncmp(t,"since=",6)) snprintf(req+rl,sizeof(req)-rl," %s",t);
+                else if(t[0]=='.' || !strcmp(t,"all")) snprintf(req+rl,sizeof(req)-rl," types=%s",t);
+                else if(!dir) dir=t;
+                else bad=1;
+            }
+            if(!dir || bad){ usage(); continue; }
+            dprintf(sd,"WATCH %s%s\n",dir,req);
+            char ev[2200];
+            if(read_line(sd,ev,sizeof(ev))<=0){ fprintf(stderr,"Disconnected\n"); break; }
+            if(strncmp(ev,"OK ",3)){ fprintf(stderr,"%s",ev); continue; }
+            ev[strcspn(ev,"\r\n")]=0;
+            fprintf(stderr,"Watching %s (%s)\n",dir,ev+3);
+            long seen=0; int ended=0;
+            while(read_line(sd,ev,sizeof(ev))>0){
+                if(!strncmp(ev,"END",3)){ ended=1; break; }
+                if(!strncmp(ev,"EV ",3)){
+                    char kind[16], path[2100];
+                    if(sscanf(ev+3,"%*s %15s %2099s",kind,path)==2) printf("%s ~S1%s\n",kind,path);
+                }
+                else if(!strncmp(ev,"RESYNC ",7)) printf("resync %s",ev+7);   // events were dropped: list again
+                else fprintf(stderr,"%s",ev);
+                fflush(stdout);
+                if(++seen==max) dprintf(sd,"UNWATCH\n");
+            }
+            if(!ended){ fprintf(stderr,"Disconnected\n"); break; }
         }
 
         else if(!strncmp(line,"downltar ",9)){
-            char ext[16]; if(sscanf(line+9,"%15s",ext)!=1){ usage(); continue; }
-            dprintf(sd,"DOWNLTAR %s\n",ext);
+            char ext[64]; if(sscanf(line+9,"%63s",ext)!=1){ usage(); continue; }
+            // optional gz|zst (compressed archive), ~S1/dir (subtree) and since=<token>
+            // (changes only) go through as typed; S1 validates them
+            dprintf(sd,"DOWNLTAR %s%s\n",line+9,dl);
 
             char hdr[256]; if(read_line(sd,hdr,sizeof(hdr))<=0){ fprintf(stderr,"Disconnected\n"); break; }
             if(strncmp(hdr,"TAR ",4)!=0){ fprintf(stderr,"%s",hdr); continue; }
-            char tname[64]; long long size=0; if(sscanf(hdr+4,"%63s %lld",tname,&size)!=2 || size<0){ fprintf(stderr,"Bad TAR header\n"); continue; }
+            char tname[64]; long long size=0; if(sscanf(hdr+4,"%63s %lld",tname,&size)!=2 || size<-1){ fprintf(stderr,"Bad TAR header\n"); continue; }
 
+            char zv[16]; int zc=opt_get(hdr,"z",zv,sizeof(zv)) ? z_parse(zv) : Z_NONE;
+            if(zc<0 || !z_supported(zc) || (size<0 && zc==Z_NONE)){ fprintf(stderr,"Bad TAR header\n"); continue; }
             int fd=open(tname,O_CREAT|O_TRUNC|O_WRONLY,0664); if(fd<0){ perror("open"); continue; }
-            char buf[BUFSZ]; long long left=size;
-            while(left>0){
-                ssize_t r=read(sd,buf,(left>BUFSZ?BUFSZ:(size_t)left)); if(r<=0) break;
-                if(write_n(fd,buf,(size_t)r)!=r){ perror("write"); break; }
-                left-=r;
+            struct zr zr; zr_init(&zr,sd,zc);
+            char buf[BUFSZ]; long long left=size, got=0;   // size -1: framed, runs to the end frame
+            int bad=0;
+            while(size<0 || left>0){
+                ssize_t r=zr_read(&zr,buf,(size<0||left>BUFSZ?BUFSZ:(size_t)left));
+                if(r<=0){ bad = size<0 ? !zr.eof : 1; break; }   // error frame, cut stream or short
+                if(write_n(fd,buf,(size_t)r)!=r){ perror("write"); bad=1; break; }
+                left-=r; got+=r;
             }
+            if(!bad) zr_finish(&zr);
             close(fd);
-            fprintf(stderr,"Downloaded %s (%lld bytes)\n",tname,size);
+            if(bad){ unlink(tname); fprintf(stderr,"Download of %s failed: archive incomplete\n",tname); continue; }
+            char tok[32];
+            if(opt_get(hdr,"since",tok,sizeof(tok))) fprintf(stderr,"Downloaded %s (%lld bytes), next since=%s\n",tname,got,tok);
+            else fprintf(stderr,"Downloaded %s (%lld bytes)\n",tname,got);
         }
         /* ---- dispfnames ---- */
 else if (!strncmp(line, "dispfnames ", 11)) {
     char pth[1024];
     if (sscanf(line+11, "%1023s", pth) != 1) { usage(); continue; }
 
-    dprintf(sd, "DISPFNAMES %s\n", pth);
+    dprintf(sd, "DISPFNAMES %s%s\n", pth, dl);
 
     char hdr[256];
     if (read_line(sd, hdr, sizeof(hdr)) <= 0) { fprintf(stderr,"Disconnected\n"); break; }
     if (strncmp(hdr, "NAMES ", 6) != 0) { fprintf(stderr, "%s", hdr); continue; }
 
     int count=0; sscanf(hdr+6, "%d", &count);
+    char zv[16]; int zc = opt_get(hdr, "z", zv, sizeof(zv)) ? z_parse(zv) : Z_NONE;
+    if (zc < 0 || !z_supported(zc)) { fprintf(stderr, "Bad NAMES header\n"); continue; }
+    struct zr zr; zr_init(&zr, sd, zc);
     for (int i=0;i<count;i++){
         char ln[256];
-        if (read_line(sd, ln, sizeof(ln)) <= 0) break;
+        if (zr_line(&zr, ln, sizeof(ln)) <= 0) break;
         if (!strncmp(ln,"NAME ",5)) fprintf(stdout, "%s\n", ln+5); // print name only
         else                          fprintf(stdout, "%s", ln);    // any ERR line
     }
+    zr_finish(&zr);
 }
 
         else usage();